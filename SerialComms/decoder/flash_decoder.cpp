@@ -0,0 +1,1134 @@
+/**
+ * Ground-side decoder for raw W25N01GV and W25M02GV flash images
+ *
+ * Turns a dump of the flash chip into a table of telemetry, using the same
+ * telem/calibration CSV that the generated Python parsers come from. It does
+ * what the firmware's readback does, straight from the image:
+ *   - Bad blocks and blocks retired at runtime are skipped.
+ *   - A circular log starts at its oldest block.
+ *   - A W25M02GV's dies are put back in the order they were written.
+ *   - Sectors that fail their CRC are dropped, along with every frame they cut
+ *     through. That covers torn writes and pages that ECC couldn't correct.
+ *   - Test delimiters split the output into numbered tests.
+ *   - Events from write_flash_event() are listed with their page and time.
+ *
+ * The log is then split into COBS frames, and the frames are decoded on every
+ * core. The output is CSV with one column per item, or a columnar binary file
+ * (see the SerialComms README for both formats).
+ *
+ * Build: g++ -std=c++17 -O2 -pthread flash_decoder.cpp -o flash_decoder
+ * Usage: flash_decoder [options] <telem_data.csv> <flash.img>
+ *
+ * Michigan Aeronautical Science Association
+ */
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Flash geometry and on-flash records, see W25N01GV/src/W25N01GV.c
+#define FLASH_BYTES_PER_PAGE              (uint32_t) 2048
+#define FLASH_SPARE_AREA_SIZE             (uint32_t) 64
+#define FLASH_RAW_PAGE_SIZE               (uint32_t) (FLASH_BYTES_PER_PAGE + FLASH_SPARE_AREA_SIZE)
+#define FLASH_PAGES_PER_BLOCK             (uint32_t) 64
+#define FLASH_NUM_BLOCKS                  (uint32_t) 1024
+#define FLASH_PAGES_PER_DIE               (uint32_t) (FLASH_PAGES_PER_BLOCK * FLASH_NUM_BLOCKS)
+#define FLASH_NUM_DATA_BLOCKS             (uint32_t) 1021
+#define FLASH_CHECKPOINT_BLOCK            (uint32_t) 1022
+#define FLASH_RESERVED_BLOCK              (uint32_t) 1023
+#define FLASH_SECTOR_SIZE                 (uint32_t) 512
+#define FLASH_SECTORS_PER_PAGE            (uint32_t) 4
+#define FLASH_ERASED_BYTE                 (uint8_t)  0xFF
+
+// Sector metadata: CRC, tag and valid byte count, sequence number (big-endian)
+#define FLASH_SPARE_BYTES_PER_SECTOR      (uint32_t) 16
+#define FLASH_METADATA_OFFSET             (uint32_t) 2
+#define FLASH_METADATA_VALID_BYTES_MASK   (uint16_t) 0x03FF
+#define FLASH_METADATA_SECTION_END        (uint16_t) 0x0800
+#define FLASH_TAG_DATA                    (uint8_t)  0x0
+#define FLASH_TAG_DELIMITER               (uint8_t)  0x1
+#define FLASH_TAG_EVENT                   (uint8_t)  0x2
+#define FLASH_TAG_PADDING                 (uint8_t)  0x3
+#define FLASH_TAG_NONE                    (uint8_t)  0xF
+
+// Page time: high half, low half and their CRC, each in its own sector's spare bytes
+#define FLASH_PAGE_TIME_OFFSET            (uint32_t) 0
+#define FLASH_PAGE_TIME_HIGH_SECTOR       (uint32_t) 1
+#define FLASH_PAGE_TIME_LOW_SECTOR        (uint32_t) 2
+#define FLASH_PAGE_TIME_CHECK_SECTOR      (uint32_t) 3
+
+// Checkpoint block slots: 2 marker bytes, a value and the value inverted
+#define FLASH_RETIRED_BLOCK_FIRST_SLOT    (uint32_t) 128
+#define FLASH_RETIRED_BLOCK_SLOTS         (uint32_t) 126
+#define FLASH_RETIRED_BLOCK_MARKER        "RB"
+#define FLASH_ERASE_AHEAD_SLOT            (uint32_t) 255
+#define FLASH_ERASE_AHEAD_MARKER          "EA"
+#define FLASH_ERASE_AHEAD_CIRCULAR        (uint16_t) 1
+
+// W25M02GV layout record in die 1's reserved block, see W25N01GV/src/W25M02GV.c
+#define W25M02GV_LAYOUT_PAGE              (uint32_t) 63
+#define W25M02GV_LAYOUT_MARKER            "LYOT"
+#define W25M02GV_LAYOUT_STRIPED           (uint8_t)  1
+
+// Packet framing, see SerialComms/src/comms.c
+#define PING_MAX_PACKET_SIZE              (uint16_t) 253  // A CLB_Flash frame is stuffed this many bytes at a time
+#define CLB_FLASH_KEYFRAME                (uint8_t)  1
+#define CLB_FLASH_DELTA_FRAME             (uint8_t)  2
+#define CLB_FLASH_UNCHANGED_RUN           (uint8_t)  0x80
+
+// Rows formatted per thread before the CSV is written out
+#define CSV_ROWS_PER_BATCH                (size_t)   16384
+
+// Columnar output, see the SerialComms README
+#define COLUMNS_MAGIC                     "MASACOL1"
+
+typedef enum Field_Type {
+	FIELD_UINT8, FIELD_INT8, FIELD_UINT16, FIELD_INT16, FIELD_UINT32,
+	FIELD_INT32, FIELD_UINT64, FIELD_INT64, FIELD_FLOAT, FIELD_DOUBLE
+} Field_Type;
+
+static const uint8_t field_type_size[] = { 1, 1, 2, 2, 4, 4, 8, 8, 4, 8 };
+
+typedef struct Field {
+	std::string name;      // Name the Python parser gives the item
+	Field_Type type;       // type_cast it's packed as
+	uint16_t offset;       // Position in the packet, after the header
+	double xmit_scale;     // Value on flash is the real value times this
+	bool python_int;       // python_type is int, so the value is truncated
+} Field;
+
+typedef struct Schema {
+	std::vector<Field> fields;
+	uint16_t packet_size;  // Header and data
+} Schema;
+
+typedef struct Event_Record {
+	uint32_t test;
+	uint8_t die;
+	uint32_t page_adr;
+	uint8_t sector;
+	bool has_time;                    // The page's time passed its CRC
+	uint32_t time;
+	std::vector<uint8_t> data;        // The event's valid bytes
+} Event_Record;
+
+typedef struct Log_Stream {
+	std::vector<uint8_t> bytes;
+	std::vector<uint64_t> breaks;     // Offsets where data is missing, no frame can cross one
+	std::vector<uint64_t> test_ends;  // Offsets where a test ended
+	std::vector<Event_Record> events; // Kept out of bytes, they aren't telemetry frames
+} Log_Stream;
+
+typedef struct Decode_Stats {
+	uint64_t pages;
+	uint64_t sectors;
+	uint64_t bad_blocks;
+	uint64_t crc_failures;       // Torn writes and uncorrectable pages
+	uint64_t unfinished_sectors; // Data with no metadata, from a write cut off before the spare area
+	uint64_t sequence_gaps;
+	uint64_t events;
+	uint64_t other_records;      // Tags that aren't telemetry or events
+	uint64_t frames;
+	uint64_t damaged_frames;     // Crossed a gap in the log
+	uint64_t bad_frames;         // Didn't decode to a packet of the right size
+	uint64_t rows;
+} Decode_Stats;
+
+typedef struct Options {
+	const char *schema_path;
+	const char *image_path;
+	const char *output_path;
+	const char *events_path;
+	bool columns;
+	bool delta;
+	unsigned num_threads;
+} Options;
+
+/**
+ * CRC-16/CCITT, the same as update_flash_crc16() in W25N01GV.c.
+ *
+ * @param crc        <uint16_t>           CRC so far, 0xFFFF to start
+ * @param data       <const uint8_t*>     Bytes to add
+ * @param num_bytes  <size_t>             Number of bytes
+ * @retval The updated CRC
+ */
+static uint16_t update_crc16(uint16_t crc, const uint8_t *data, size_t num_bytes) {
+	static uint16_t table[256];
+	static bool table_ready = false;
+	if (!table_ready) {
+		for (uint16_t i = 0; i < 256; i++) {
+			uint16_t entry = i << 8;
+			for (uint8_t bit = 0; bit < 8; bit++)
+				entry = (entry & 0x8000) ? (entry << 1) ^ 0x1021 : entry << 1;
+			table[i] = entry;
+		}
+		table_ready = true;
+	}
+
+	for (size_t i = 0; i < num_bytes; i++)
+		crc = (crc << 8) ^ table[(crc >> 8) ^ data[i]];
+	return crc;
+}
+
+static uint16_t read_uint16_be(const uint8_t *bytes) {
+	return ((uint16_t) bytes[0] << 8) | bytes[1];
+}
+
+static bool all_bytes_are(const uint8_t *bytes, size_t num_bytes, uint8_t value) {
+	for (size_t i = 0; i < num_bytes; i++)
+		if (bytes[i] != value)
+			return false;
+	return true;
+}
+
+/**
+ * Runs fn(thread, first, last) over [0, count) split evenly between threads.
+ */
+template <typename Fn>
+static void parallel_for(size_t count, unsigned num_threads, Fn fn) {
+	if (num_threads <= 1 || count < num_threads) {
+		fn(0, (size_t) 0, count);
+		return;
+	}
+
+	std::vector<std::thread> threads;
+	for (unsigned t = 0; t < num_threads; t++) {
+		size_t first = count * t / num_threads;
+		size_t last = count * (t+1) / num_threads;
+		threads.emplace_back(fn, t, first, last);
+	}
+	for (std::thread &thread : threads)
+		thread.join();
+}
+
+/********************************** Schema ***********************************/
+
+/**
+ * Splits a CSV line into columns. Quoted columns can hold commas, which the
+ * calibration CSVs use in their descriptions.
+ */
+static std::vector<std::string> split_csv_line(const std::string &line) {
+	std::vector<std::string> columns(1);
+	bool quoted = false;
+
+	for (size_t i = 0; i < line.size(); i++) {
+		char c = line[i];
+		if (c == '"') {
+			if (quoted && i+1 < line.size() && line[i+1] == '"')
+				columns.back() += line[++i];
+			else
+				quoted = !quoted;
+		}
+		else if (c == ',' && !quoted)
+			columns.emplace_back();
+		else if (c != '\r' && c != '\n')
+			columns.back() += c;
+	}
+	return columns;
+}
+
+static bool parse_field_type(const std::string &type_cast, Field_Type *type) {
+	static const char *names[] = { "uint8_t", "int8_t", "uint16_t", "int16_t", "uint32_t",
+			"int32_t", "uint64_t", "int64_t", "float", "double" };
+
+	if (type_cast == "char") {
+		*type = FIELD_UINT8;
+		return true;
+	}
+	for (uint8_t t = 0; t <= FIELD_DOUBLE; t++) {
+		if (type_cast == names[t]) {
+			*type = (Field_Type) t;
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Reads the items of a telem or calibration CSV that have should_generate set,
+ * in the order telem_file_generator.py packs them. The packet header comes first.
+ *
+ * @param path       <const char*>        CSV file
+ * @param schema     <Schema*>            Struct to fill in
+ * @retval true on success, false with a message printed if the CSV can't be used
+ */
+static bool load_schema(const char *path, Schema *schema) {
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) {
+		fprintf(stderr, "Can't open %s\n", path);
+		return false;
+	}
+
+	static const struct { const char *name; Field_Type type; } header[] = {
+		{"packet_type", FIELD_UINT8}, {"origin_addr", FIELD_UINT8}, {"target_addr", FIELD_UINT8},
+		{"priority", FIELD_UINT8}, {"num_packets", FIELD_UINT8}, {"do_cobbs", FIELD_UINT8},
+		{"checksum", FIELD_UINT16}, {"timestamp", FIELD_UINT32}
+	};
+	uint16_t offset = 0;
+	for (const auto &item : header) {
+		schema->fields.push_back({item.name, item.type, offset, 1.0, true});
+		offset += field_type_size[item.type];
+	}
+
+	std::vector<std::string> column_names;
+	int firmware_variable = -1, override_variable = -1, type_cast = -1;
+	int xmit_scale = -1, python_type = -1, should_generate = -1;
+
+	std::string line;
+	uint32_t row_num = 0;
+	bool ok = true;
+	for (int c = fgetc(file); ok && c != EOF; c = fgetc(file)) {
+		if (c != '\n') {
+			line += (char) c;
+			continue;
+		}
+		row_num++;
+		std::vector<std::string> columns = split_csv_line(line);
+		line.clear();
+
+		if (column_names.empty()) {
+			column_names = columns;
+			for (int i = 0; i < (int) columns.size(); i++) {
+				if (columns[i] == "firmware_variable")         firmware_variable = i;
+				if (columns[i] == "python_variable_override")  override_variable = i;
+				if (columns[i] == "type_cast")                 type_cast = i;
+				if (columns[i] == "xmit_scale")                xmit_scale = i;
+				if (columns[i] == "python_type")               python_type = i;
+				if (columns[i] == "should_generate")           should_generate = i;
+			}
+			if (firmware_variable < 0 || type_cast < 0 || xmit_scale < 0
+					|| python_type < 0 || should_generate < 0) {
+				fprintf(stderr, "%s is missing a column the parser generators use\n", path);
+				ok = false;
+			}
+			continue;
+		}
+
+		columns.resize(column_names.size());
+		if (columns[should_generate] != "y")
+			continue;
+
+		Field field;
+		field.name = columns[firmware_variable];
+		if (override_variable >= 0 && !columns[override_variable].empty())
+			field.name = columns[override_variable];
+		field.offset = offset;
+		field.xmit_scale = strtod(columns[xmit_scale].c_str(), NULL);
+		field.python_int = columns[python_type] == "int";
+
+		if (!parse_field_type(columns[type_cast], &field.type) || field.xmit_scale == 0) {
+			fprintf(stderr, "[row %u] Error: bad type_cast or xmit_scale\n", row_num);
+			ok = false;
+		}
+		offset += field_type_size[field.type];
+		schema->fields.push_back(field);
+	}
+
+	fclose(file);
+	schema->packet_size = offset;
+	return ok;
+}
+
+/********************************* Flash image ********************************/
+
+typedef struct Die_Image {
+	const uint8_t *mem;           // Start of the die in the image
+	bool bad_blocks[FLASH_NUM_BLOCKS];
+	std::vector<uint32_t> pages;  // Pages of the log, in the order they were written
+	bool wrapped;                 // Circular log that has overwritten its start, so it begins mid-frame
+} Die_Image;
+
+static const uint8_t *die_page(const Die_Image *die, uint32_t page_adr) {
+	return die->mem + (size_t) page_adr * FLASH_RAW_PAGE_SIZE;
+}
+
+/**
+ * Reads a record from a slot of the checkpoint block, see write_slot_record().
+ *
+ * @param die        <const Die_Image*>   Die to read
+ * @param slot       <uint32_t>           Slot number
+ * @param marker     <const char*>        The 2 marker bytes
+ * @param value      <uint16_t*>          The record's value, if it has one
+ * @retval true if the slot holds a valid record with that marker
+ */
+static bool read_slot_record(const Die_Image *die, uint32_t slot, const char *marker, uint16_t *value) {
+	const uint8_t *record = die_page(die, FLASH_CHECKPOINT_BLOCK * FLASH_PAGES_PER_BLOCK
+			+ slot / FLASH_SECTORS_PER_PAGE) + (slot % FLASH_SECTORS_PER_PAGE) * FLASH_SECTOR_SIZE;
+
+	if (record[0] != (uint8_t) marker[0] || record[1] != (uint8_t) marker[1])
+		return false;
+	*value = read_uint16_be(record + 2);
+	return (uint16_t) ~*value == read_uint16_be(record + 4);
+}
+
+static uint8_t sector_tag(const uint8_t *page, uint32_t sector) {
+	const uint8_t *metadata = page + FLASH_BYTES_PER_PAGE + sector * FLASH_SPARE_BYTES_PER_SECTOR + FLASH_METADATA_OFFSET;
+	return metadata[2] >> 4;
+}
+
+/**
+ * Lists the pages of a die's log in the order they were written. Every good
+ * data block is included, erased pages and all, so a partly written block
+ * still gives all of its pages.
+ *
+ * @param die        <Die_Image*>         Die to read, with mem set
+ * @param use_metadata <bool>             false for an image written without sector metadata
+ * @param stats      <Decode_Stats*>      Counts bad blocks
+ */
+static void find_log_pages(Die_Image *die, bool use_metadata, Decode_Stats *stats) {
+	for (uint32_t block = 0; block < FLASH_NUM_BLOCKS; block++)
+		die->bad_blocks[block] = die_page(die, block * FLASH_PAGES_PER_BLOCK)[FLASH_BYTES_PER_PAGE] != FLASH_ERASED_BYTE;
+
+	uint16_t value;
+	for (uint32_t slot = 0; slot < FLASH_RETIRED_BLOCK_SLOTS; slot++) {
+		if (read_slot_record(die, FLASH_RETIRED_BLOCK_FIRST_SLOT + slot, FLASH_RETIRED_BLOCK_MARKER, &value)
+				&& value < FLASH_NUM_BLOCKS)
+			die->bad_blocks[value] = true;
+	}
+
+	std::vector<uint32_t> good_blocks;
+	for (uint32_t block = 0; block < FLASH_NUM_DATA_BLOCKS; block++) {
+		if (die->bad_blocks[block])
+			stats->bad_blocks++;
+		else
+			good_blocks.push_back(block);
+	}
+
+	// A circular log starts at the first written block after the ones erased
+	// ahead of the write pointer, see find_oldest_log_page()
+	size_t first = 0;
+	bool circular = read_slot_record(die, FLASH_ERASE_AHEAD_SLOT, FLASH_ERASE_AHEAD_MARKER, &value)
+			&& value == FLASH_ERASE_AHEAD_CIRCULAR;
+	if (circular && !good_blocks.empty()) {
+		std::vector<bool> written(good_blocks.size());
+		for (size_t i = 0; i < good_blocks.size(); i++) {
+			const uint8_t *page = die_page(die, good_blocks[i] * FLASH_PAGES_PER_BLOCK);
+			written[i] = use_metadata ? sector_tag(page, 0) != FLASH_TAG_NONE
+					: !all_bytes_are(page, FLASH_BYTES_PER_PAGE, FLASH_ERASED_BYTE);
+		}
+		for (size_t i = 0; i < good_blocks.size(); i++) {
+			if (written[i] && !written[(i + good_blocks.size() - 1) % good_blocks.size()]) {
+				first = i;
+				break;
+			}
+		}
+	}
+	die->wrapped = first != 0;
+
+	for (size_t i = 0; i < good_blocks.size(); i++) {
+		uint32_t block = good_blocks[(first + i) % good_blocks.size()];
+		for (uint32_t page = 0; page < FLASH_PAGES_PER_BLOCK; page++)
+			die->pages.push_back(block * FLASH_PAGES_PER_BLOCK + page);
+	}
+}
+
+/**
+ * Checks if any page of the image was written with sector metadata. Images
+ * from before it was added are read a whole page at a time.
+ */
+static bool image_has_metadata(const std::vector<Die_Image> &dies) {
+	for (const Die_Image &die : dies)
+		for (uint32_t page_adr = 0; page_adr < FLASH_NUM_DATA_BLOCKS * FLASH_PAGES_PER_BLOCK; page_adr++)
+			if (sector_tag(die_page(&die, page_adr), 0) != FLASH_TAG_NONE)
+				return true;
+	return false;
+}
+
+typedef struct Die_Read_State {
+	bool started;
+	bool have_sequence;
+	uint16_t last_sequence;
+} Die_Read_State;
+
+static void add_break(Log_Stream *stream) {
+	if (stream->breaks.empty() || stream->breaks.back() != stream->bytes.size())
+		stream->breaks.push_back(stream->bytes.size());
+}
+
+static void add_test_end(Log_Stream *stream) {
+	if (!stream->bytes.empty() && (stream->test_ends.empty() || stream->test_ends.back() != stream->bytes.size()))
+		stream->test_ends.push_back(stream->bytes.size());
+}
+
+/**
+ * Reads a page's time, see read_flash_page_time().
+ *
+ * @retval true if the time passed its CRC
+ */
+static bool read_page_time(const uint8_t *page, uint32_t *time) {
+	const uint8_t *spare = page + FLASH_BYTES_PER_PAGE + FLASH_PAGE_TIME_OFFSET;
+	const uint8_t *high = spare + FLASH_PAGE_TIME_HIGH_SECTOR * FLASH_SPARE_BYTES_PER_SECTOR;
+	const uint8_t *low = spare + FLASH_PAGE_TIME_LOW_SECTOR * FLASH_SPARE_BYTES_PER_SECTOR;
+	const uint8_t *check = spare + FLASH_PAGE_TIME_CHECK_SECTOR * FLASH_SPARE_BYTES_PER_SECTOR;
+	uint8_t time_bytes[4] = {high[0], high[1], low[0], low[1]};
+
+	*time = ((uint32_t) read_uint16_be(high) << 16) | read_uint16_be(low);
+	return update_crc16(0xFFFF, time_bytes, 4) == read_uint16_be(check);
+}
+
+/**
+ * Appends the data sectors of a page to the log stream, and adds its event
+ * sectors to the stream's events. A sector that fails its CRC, or whose
+ * sequence number doesn't follow the last one, leaves a break in the stream.
+ *
+ * @param page       <const uint8_t*>     Page with its spare area
+ * @param die        <uint8_t>            Die the page is on
+ * @param page_adr   <uint32_t>           Page address on the die
+ * @param state      <Die_Read_State*>    Sequence number tracking for the page's die
+ * @param stream     <Log_Stream*>        Stream to append to
+ * @param stats      <Decode_Stats*>      Counters to update
+ */
+static void read_page_sectors(const uint8_t *page, uint8_t die, uint32_t page_adr, Die_Read_State *state,
+		Log_Stream *stream, Decode_Stats *stats) {
+	for (uint32_t sector = 0; sector < FLASH_SECTORS_PER_PAGE; sector++) {
+		const uint8_t *data = page + sector * FLASH_SECTOR_SIZE;
+		const uint8_t *metadata = page + FLASH_BYTES_PER_PAGE + sector * FLASH_SPARE_BYTES_PER_SECTOR + FLASH_METADATA_OFFSET;
+		uint16_t tag_and_size = read_uint16_be(metadata + 2);
+
+		if ((tag_and_size >> 12) == FLASH_TAG_NONE) {
+			if (!all_bytes_are(data, FLASH_SECTOR_SIZE, FLASH_ERASED_BYTE)) {
+				stats->unfinished_sectors++;
+				add_break(stream);
+			}
+			continue;
+		}
+		stats->sectors++;
+
+		uint16_t crc = update_crc16(0xFFFF, data, FLASH_SECTOR_SIZE);
+		crc = update_crc16(crc, metadata + 2, 4);
+		if (crc != read_uint16_be(metadata)) {
+			stats->crc_failures++;
+			state->have_sequence = false;
+			add_break(stream);
+			continue;
+		}
+
+		uint16_t sequence = read_uint16_be(metadata + 4);
+		if (state->have_sequence && sequence != (uint16_t) (state->last_sequence + 1)) {
+			stats->sequence_gaps++;
+			add_break(stream);
+		}
+		state->have_sequence = true;
+		state->last_sequence = sequence;
+
+		uint8_t tag = tag_and_size >> 12;
+		uint16_t valid_bytes = tag_and_size & FLASH_METADATA_VALID_BYTES_MASK;
+		if (tag == FLASH_TAG_DATA && valid_bytes <= FLASH_SECTOR_SIZE)
+			stream->bytes.insert(stream->bytes.end(), data, data + valid_bytes);
+		else if (tag == FLASH_TAG_EVENT && valid_bytes <= FLASH_SECTOR_SIZE) {
+			Event_Record event = {(uint32_t) stream->test_ends.size(), die, page_adr, (uint8_t) sector,
+					false, 0, std::vector<uint8_t>(data, data + valid_bytes)};
+			event.has_time = read_page_time(page, &event.time);
+			stream->events.push_back(event);
+			stats->events++;
+		}
+		else if (tag != FLASH_TAG_DATA && tag != FLASH_TAG_DELIMITER && tag != FLASH_TAG_PADDING)
+			stats->other_records++;
+
+		if (tag == FLASH_TAG_DELIMITER || (tag_and_size & FLASH_METADATA_SECTION_END))
+			add_test_end(stream);
+	}
+}
+
+/**
+ * Appends a page written without metadata. An empty page is skipped, and a
+ * page of 0x00 is the old test delimiter.
+ *
+ * finish_flash_write() and add_test_delimiter() leave the rest of a partly
+ * filled sector erased. Without the valid byte count, a run of 0xFF from
+ * just after a frame's terminating 0 to the end of the sector is taken to be
+ * that padding and dropped, so it doesn't end up in front of the next frame.
+ */
+static void read_page_without_metadata(const uint8_t *page, Log_Stream *stream) {
+	if (all_bytes_are(page, FLASH_BYTES_PER_PAGE, FLASH_ERASED_BYTE))
+		return;
+	if (all_bytes_are(page, FLASH_BYTES_PER_PAGE, 0x00)) {
+		add_test_end(stream);
+		return;
+	}
+
+	for (uint32_t sector = 0; sector < FLASH_SECTORS_PER_PAGE; sector++) {
+		const uint8_t *data = page + sector * FLASH_SECTOR_SIZE;
+		uint32_t size = FLASH_SECTOR_SIZE;
+		while (size > 0 && data[size-1] == FLASH_ERASED_BYTE)
+			size--;
+
+		// Keep 0xFF bytes that belong to a frame
+		bool after_frame = (size > 0) ? data[size-1] == 0x00
+				: stream->bytes.empty() || stream->bytes.back() == 0x00;
+		if (!after_frame)
+			size = FLASH_SECTOR_SIZE;
+		stream->bytes.insert(stream->bytes.end(), data, data + size);
+	}
+}
+
+/**
+ * Reads the log out of a flash image into one stream of bytes.
+ *
+ * The image is either a dump with spare areas (2112 byte pages, like the
+ * simulator's image) of a W25N01GV or both dies of a W25M02GV, or a dump of
+ * just the 2048 byte main arrays, read in file order.
+ *
+ * @param image      <const uint8_t*>     Memory-mapped image
+ * @param image_size <size_t>             Size of the image
+ * @param stream     <Log_Stream*>        Stream to fill in
+ * @param stats      <Decode_Stats*>      Counters to update
+ * @retval true on success, false if the image size isn't recognised
+ */
+static bool read_flash_log(const uint8_t *image, size_t image_size, Log_Stream *stream, Decode_Stats *stats) {
+	size_t die_size = (size_t) FLASH_PAGES_PER_DIE * FLASH_RAW_PAGE_SIZE;
+
+	if (image_size != die_size && image_size != 2 * die_size) {
+		if (image_size == 0 || image_size % FLASH_BYTES_PER_PAGE != 0) {
+			fprintf(stderr, "Image size %zu isn't a whole number of pages or dies\n", image_size);
+			return false;
+		}
+		for (size_t offset = 0; offset < image_size; offset += FLASH_BYTES_PER_PAGE) {
+			read_page_without_metadata(image + offset, stream);
+			stats->pages++;
+		}
+		return true;
+	}
+
+	std::vector<Die_Image> dies(image_size / die_size);
+	for (size_t d = 0; d < dies.size(); d++)
+		dies[d].mem = image + d * die_size;
+
+	bool use_metadata = image_has_metadata(dies);
+	for (Die_Image &die : dies)
+		find_log_pages(&die, use_metadata, stats);
+
+	// Logical page n of a striped W25M02GV is page n/2 of die n%2
+	bool striped = false;
+	if (dies.size() == 2) {
+		const uint8_t *layout = die_page(&dies[1], FLASH_RESERVED_BLOCK * FLASH_PAGES_PER_BLOCK + W25M02GV_LAYOUT_PAGE);
+		striped = memcmp(layout, W25M02GV_LAYOUT_MARKER, 4) == 0 && layout[4] == W25M02GV_LAYOUT_STRIPED;
+	}
+
+	std::vector<std::pair<uint8_t, uint32_t>> order;
+	if (striped) {
+		size_t num_pages = std::max(dies[0].pages.size(), dies[1].pages.size());
+		for (size_t i = 0; i < num_pages; i++)
+			for (uint8_t d = 0; d < 2; d++)
+				if (i < dies[d].pages.size())
+					order.emplace_back(d, dies[d].pages[i]);
+	}
+	else {
+		for (uint8_t d = 0; d < dies.size(); d++)
+			for (uint32_t page_adr : dies[d].pages)
+				order.emplace_back(d, page_adr);
+	}
+
+	std::vector<Die_Read_State> states(dies.size(), Die_Read_State{false, false, 0});
+	for (const auto &entry : order) {
+		const uint8_t *page = die_page(&dies[entry.first], entry.second);
+		Die_Read_State *state = &states[entry.first];
+
+		// The first frame of a wrapped log lost its start when its block was erased
+		if (!state->started && dies[entry.first].wrapped)
+			add_break(stream);
+		state->started = true;
+
+		if (use_metadata)
+			read_page_sectors(page, entry.first, entry.second, state, stream, stats);
+		else
+			read_page_without_metadata(page, stream);
+		stats->pages++;
+	}
+	return true;
+}
+
+/********************************** Frames ***********************************/
+
+/**
+ * Decodes one COBS frame (without its terminating 0).
+ *
+ * @param stuffed    <const uint8_t*>     Frame
+ * @param length     <size_t>             Length of the frame
+ * @param out        <uint8_t*>           Where to decode to
+ * @param max_length <size_t>             Size of out
+ * @retval Decoded length, or SIZE_MAX if it doesn't fit or the frame is malformed
+ */
+static size_t unstuff_frame(const uint8_t *stuffed, size_t length, uint8_t *out, size_t max_length) {
+	size_t out_length = 0;
+	size_t i = 0;
+
+	while (i < length) {
+		uint8_t code = stuffed[i++];
+		if (code == 0 || i + code - 1 > length || out_length + code - 1 > max_length)
+			return SIZE_MAX;
+		memcpy(out + out_length, stuffed + i, code - 1);
+		out_length += code - 1;
+		i += code - 1;
+
+		if (code != 0xFF && i < length) {
+			if (out_length >= max_length)
+				return SIZE_MAX;
+			out[out_length++] = 0;
+		}
+	}
+	return out_length;
+}
+
+/**
+ * send_data() stuffs a CLB_Flash frame PING_MAX_PACKET_SIZE bytes at a time,
+ * so unstuffing the whole frame adds a 0 after each of those chunks. Removes
+ * them in place.
+ *
+ * @retval The packet length
+ */
+static size_t remove_chunk_zeros(uint8_t *packet, size_t length) {
+	size_t out = PING_MAX_PACKET_SIZE;
+	for (size_t in = PING_MAX_PACKET_SIZE; in < length; in++) {
+		if ((in + 1) % (PING_MAX_PACKET_SIZE + 1) == 0)
+			continue;
+		packet[out++] = packet[in];
+	}
+	return (length > PING_MAX_PACKET_SIZE) ? out : length;
+}
+
+/**
+ * Applies a CLB_Flash_Delta frame to the last packet, like decode_flash_frame().
+ *
+ * @param coded      <const uint8_t*>     Unstuffed frame, starting with the frame type
+ * @param coded_sz   <size_t>             Its length
+ * @param packet     <uint8_t*>           Last packet, updated in place
+ * @param packet_sz  <size_t>             Packet size
+ * @param have_prev  <bool>               Whether packet holds the last packet
+ * @retval true if packet now holds this frame's packet
+ */
+static bool apply_flash_frame(const uint8_t *coded, size_t coded_sz, uint8_t *packet, size_t packet_sz, bool have_prev) {
+	if (coded_sz < 2)
+		return false;
+	if (coded[0] == CLB_FLASH_KEYFRAME) {
+		if (coded_sz - 1 != packet_sz)
+			return false;
+		memcpy(packet, coded + 1, packet_sz);
+		return true;
+	}
+	if (coded[0] != CLB_FLASH_DELTA_FRAME || !have_prev)
+		return false;
+
+	size_t frame_pos = 0;
+	size_t i = 1;
+	while (i < coded_sz) {
+		uint8_t token = coded[i++];
+		size_t run_sz = (token & ~CLB_FLASH_UNCHANGED_RUN) + 1;
+		if (frame_pos + run_sz > packet_sz)
+			return false;
+		if (token & CLB_FLASH_UNCHANGED_RUN) {
+			frame_pos += run_sz;
+			continue;
+		}
+		if (i + run_sz > coded_sz)
+			return false;
+		for (size_t j = 0; j < run_sz; j++)
+			packet[frame_pos++] ^= coded[i++];
+	}
+	return frame_pos == packet_sz;
+}
+
+typedef struct Frame_Table {
+	std::vector<uint64_t> ends;      // Offset of each frame's terminating 0
+	std::vector<uint8_t> packets;    // slot_size bytes per frame
+	std::vector<uint16_t> lengths;   // Decoded length of each frame, 0 if it's unusable
+	size_t slot_size;
+} Frame_Table;
+
+/**
+ * Finds every frame in the stream and unstuffs it into its slot, in parallel.
+ * Frames that cross a break are dropped: their start or end is missing.
+ */
+static void split_frames(const Log_Stream &stream, const Options &options, size_t packet_size,
+		Frame_Table *table, Decode_Stats *stats) {
+	const uint8_t *bytes = stream.bytes.data();
+	std::vector<std::vector<uint64_t>> zeros(options.num_threads);
+
+	parallel_for(stream.bytes.size(), options.num_threads, [&](unsigned t, size_t first, size_t last) {
+		for (const uint8_t *p = bytes + first; p < bytes + last; p++) {
+			p = (const uint8_t *) memchr(p, 0, bytes + last - p);
+			if (p == NULL)
+				break;
+			zeros[t].push_back(p - bytes);
+		}
+	});
+	for (const std::vector<uint64_t> &thread_zeros : zeros)
+		table->ends.insert(table->ends.end(), thread_zeros.begin(), thread_zeros.end());
+
+	size_t num_frames = table->ends.size();
+	table->slot_size = packet_size + packet_size / PING_MAX_PACKET_SIZE + 1;
+	table->packets.resize(num_frames * table->slot_size);
+	table->lengths.assign(num_frames, 0);
+
+	std::vector<Decode_Stats> thread_stats(options.num_threads, Decode_Stats{});
+	parallel_for(num_frames, options.num_threads, [&](unsigned t, size_t first, size_t last) {
+		for (size_t f = first; f < last; f++) {
+			uint64_t start = (f == 0) ? 0 : table->ends[f-1] + 1;
+			uint64_t end = table->ends[f];
+			if (start == end)  // Padding, or the 0x00 page of an old test delimiter
+				continue;
+			thread_stats[t].frames++;
+
+			auto next_break = std::lower_bound(stream.breaks.begin(), stream.breaks.end(), start);
+			if (next_break != stream.breaks.end() && *next_break <= end) {
+				thread_stats[t].damaged_frames++;
+				continue;
+			}
+
+			uint8_t *packet = &table->packets[f * table->slot_size];
+			size_t length = unstuff_frame(bytes + start, end - start, packet, table->slot_size);
+			if (length != SIZE_MAX && !options.delta)
+				length = remove_chunk_zeros(packet, length);
+
+			if (length == SIZE_MAX || (!options.delta && length != packet_size)) {
+				thread_stats[t].bad_frames++;
+				continue;
+			}
+			table->lengths[f] = (uint16_t) length;
+		}
+	});
+	for (const Decode_Stats &s : thread_stats) {
+		stats->frames += s.frames;
+		stats->damaged_frames += s.damaged_frames;
+		stats->bad_frames += s.bad_frames;
+	}
+}
+
+/**
+ * Turns delta frames back into packets, in order since each one builds on
+ * the last. After a lost frame, nothing decodes until the next keyframe.
+ */
+static void undo_flash_deltas(Frame_Table *table, size_t packet_size, Decode_Stats *stats) {
+	std::vector<uint8_t> packet(packet_size);
+	bool have_prev = false;
+
+	for (size_t f = 0; f < table->lengths.size(); f++) {
+		uint64_t start = (f == 0) ? 0 : table->ends[f-1] + 1;
+		if (start == table->ends[f])
+			continue;
+
+		uint8_t *slot = &table->packets[f * table->slot_size];
+		if (table->lengths[f] == 0) {
+			have_prev = false;
+			continue;
+		}
+
+		have_prev = apply_flash_frame(slot, table->lengths[f], packet.data(), packet_size, have_prev);
+		if (!have_prev) {
+			stats->bad_frames++;
+			table->lengths[f] = 0;
+			continue;
+		}
+		memcpy(slot, packet.data(), packet_size);
+		table->lengths[f] = (uint16_t) packet_size;
+	}
+}
+
+/********************************** Output ***********************************/
+
+typedef struct Row {
+	const uint8_t *packet;
+	uint32_t test;
+} Row;
+
+static double read_field(const uint8_t *packet, const Field &field) {
+	uint64_t raw = 0;
+	for (uint8_t b = 0; b < field_type_size[field.type]; b++)
+		raw |= (uint64_t) packet[field.offset + b] << (8*b);  // Packed little-endian
+
+	switch (field.type) {
+	case FIELD_INT8:   return (int8_t) raw;
+	case FIELD_INT16:  return (int16_t) raw;
+	case FIELD_INT32:  return (int32_t) raw;
+	case FIELD_INT64:  return (double) (int64_t) raw;
+	case FIELD_FLOAT:  { float value; uint32_t bits = (uint32_t) raw; memcpy(&value, &bits, 4); return value; }
+	case FIELD_DOUBLE: { double value; memcpy(&value, &raw, 8); return value; }
+	default:           return (double) raw;
+	}
+}
+
+/**
+ * Formats a value the way Python prints it, so the CSV matches the dicts the
+ * generated parsers fill in.
+ */
+static void append_python_value(std::string *out, double value, bool python_int) {
+	char buffer[64];
+	char *end;
+
+	if (python_int && value >= 0)
+		end = std::to_chars(buffer, buffer + sizeof(buffer), (uint64_t) value).ptr;
+	else if (python_int)
+		end = std::to_chars(buffer, buffer + sizeof(buffer), (int64_t) value).ptr;
+	// Python's repr() is the shortest round trip, in scientific notation outside of 1e-4 to 1e16
+	else if (value != 0 && (std::fabs(value) < 1e-4 || std::fabs(value) >= 1e16))
+		end = std::to_chars(buffer, buffer + sizeof(buffer), value, std::chars_format::scientific).ptr;
+	else {
+		end = std::to_chars(buffer, buffer + sizeof(buffer), value, std::chars_format::fixed).ptr;
+		if (std::isfinite(value) && std::find(buffer, end, '.') == end) {
+			*end++ = '.';
+			*end++ = '0';
+		}
+	}
+	out->append(buffer, end);
+}
+
+static bool write_csv(FILE *out, const Schema &schema, const std::vector<Row> &rows, unsigned num_threads) {
+	std::string header = "test";
+	for (const Field &field : schema.fields)
+		header += "," + field.name;
+	header += "\n";
+	fwrite(header.data(), 1, header.size(), out);
+
+	std::vector<std::string> text(num_threads);
+	size_t batch_rows = CSV_ROWS_PER_BATCH * num_threads;
+	for (size_t batch = 0; batch < rows.size(); batch += batch_rows) {
+		size_t count = std::min(batch_rows, rows.size() - batch);
+
+		parallel_for(count, num_threads, [&](unsigned t, size_t first, size_t last) {
+			std::string &s = text[t];
+			s.clear();
+			for (size_t r = batch + first; r < batch + last; r++) {
+				s.append(std::to_string(rows[r].test));
+				for (const Field &field : schema.fields) {
+					s.push_back(',');
+					append_python_value(&s, read_field(rows[r].packet, field) / field.xmit_scale, field.python_int);
+				}
+				s.push_back('\n');
+			}
+		});
+		for (const std::string &s : text)
+			if (fwrite(s.data(), 1, s.size(), out) != s.size())
+				return false;
+	}
+	return true;
+}
+
+template <typename T>
+static void write_le(FILE *out, T value) {
+	uint8_t bytes[sizeof(T)];
+	uint64_t bits = 0;
+	memcpy(&bits, &value, sizeof(T));
+	for (size_t b = 0; b < sizeof(T); b++)
+		bytes[b] = (uint8_t) (bits >> (8*b));
+	fwrite(bytes, 1, sizeof(T), out);
+}
+
+static bool write_columns(FILE *out, const Schema &schema, const std::vector<Row> &rows, unsigned num_threads) {
+	fwrite(COLUMNS_MAGIC, 1, 8, out);
+	write_le<uint32_t>(out, (uint32_t) schema.fields.size() + 1);
+	write_le<uint64_t>(out, rows.size());
+
+	// The test number is the first column
+	std::vector<Field> columns = schema.fields;
+	columns.insert(columns.begin(), Field{"test", FIELD_UINT32, 0, 1.0, true});
+	for (const Field &column : columns) {
+		write_le<uint16_t>(out, (uint16_t) column.name.size());
+		fwrite(column.name.data(), 1, column.name.size(), out);
+		write_le<uint8_t>(out, (uint8_t) column.type);
+		write_le<uint8_t>(out, column.python_int);
+		write_le<double>(out, column.xmit_scale);
+	}
+
+	// Values are already little-endian in the packets, so each column is a gather
+	std::vector<uint8_t> data;
+	for (size_t c = 0; c < columns.size(); c++) {
+		size_t size = field_type_size[columns[c].type];
+		data.resize(rows.size() * size);
+
+		parallel_for(rows.size(), num_threads, [&](unsigned, size_t first, size_t last) {
+			for (size_t r = first; r < last; r++) {
+				if (c == 0)
+					for (size_t b = 0; b < size; b++)
+						data[r*size + b] = (uint8_t) (rows[r].test >> (8*b));
+				else
+					memcpy(&data[r*size], rows[r].packet + columns[c].offset, size);
+			}
+		});
+		if (fwrite(data.data(), 1, data.size(), out) != data.size())
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Writes the events as CSV: test, die, page, sector, the page's time (empty
+ * if it failed its CRC) and the event's bytes in hex.
+ *
+ * @retval true if it was all written
+ */
+static bool write_events(FILE *out, const std::vector<Event_Record> &events) {
+	static const char hex_digits[] = "0123456789abcdef";
+	bool ok = fputs("test,die,page,sector,time,data\n", out) >= 0;
+
+	for (const Event_Record &event : events) {
+		std::string line = std::to_string(event.test) + ',' + std::to_string(event.die) + ','
+				+ std::to_string(event.page_adr) + ',' + std::to_string(event.sector) + ','
+				+ (event.has_time ? std::to_string(event.time) : std::string()) + ',';
+		for (uint8_t byte : event.data) {
+			line += hex_digits[byte >> 4];
+			line += hex_digits[byte & 0xF];
+		}
+		line += '\n';
+		ok = fwrite(line.data(), 1, line.size(), out) == line.size() && ok;
+	}
+	return ok;
+}
+
+/*********************************** Main ************************************/
+
+static void print_usage(const char *program) {
+	fprintf(stderr,
+		"Usage: %s [options] <telem_data.csv> <flash.img>\n"
+		"  -o <file>          Write to file instead of stdout\n"
+		"  --format <fmt>     csv (default) or columns\n"
+		"  --delta            Frames were written with CLB_Flash_Delta\n"
+		"  --events <file>    Write the events, with their bytes, to file as CSV\n"
+		"  --threads <n>      Threads to decode with (default: all cores)\n", program);
+}
+
+static bool parse_options(int argc, char **argv, Options *options) {
+	*options = Options{NULL, NULL, NULL, NULL, false, false, std::thread::hardware_concurrency()};
+	std::vector<const char *> paths;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool has_value = i+1 < argc;
+		if (arg == "-o" && has_value)
+			options->output_path = argv[++i];
+		else if (arg == "--format" && has_value) {
+			std::string format = argv[++i];
+			if (format != "csv" && format != "columns")
+				return false;
+			options->columns = format == "columns";
+		}
+		else if (arg == "--events" && has_value)
+			options->events_path = argv[++i];
+		else if (arg == "--delta")
+			options->delta = true;
+		else if (arg == "--threads" && has_value)
+			options->num_threads = (unsigned) atoi(argv[++i]);
+		else if (arg[0] == '-')
+			return false;
+		else
+			paths.push_back(argv[i]);
+	}
+
+	if (options->num_threads == 0)
+		options->num_threads = 1;
+	if (paths.size() != 2)
+		return false;
+	options->schema_path = paths[0];
+	options->image_path = paths[1];
+	return true;
+}
+
+int main(int argc, char **argv) {
+	Options options;
+	if (!parse_options(argc, argv, &options)) {
+		print_usage(argv[0]);
+		return 2;
+	}
+
+	Schema schema;
+	if (!load_schema(options.schema_path, &schema))
+		return 1;
+
+	int fd = open(options.image_path, O_RDONLY);
+	struct stat image_stat;
+	if (fd < 0 || fstat(fd, &image_stat) != 0) {
+		fprintf(stderr, "Can't open %s\n", options.image_path);
+		return 1;
+	}
+	size_t image_size = (size_t) image_stat.st_size;
+	void *image = (image_size > 0) ? mmap(NULL, image_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	if (image == MAP_FAILED) {
+		fprintf(stderr, "Can't map %s\n", options.image_path);
+		return 1;
+	}
+	madvise(image, image_size, MADV_SEQUENTIAL);
+
+	Decode_Stats stats = {};
+	Log_Stream stream;
+	if (!read_flash_log((const uint8_t *) image, image_size, &stream, &stats))
+		return 1;
+
+	Frame_Table table;
+	split_frames(stream, options, schema.packet_size, &table, &stats);
+	if (options.delta)
+		undo_flash_deltas(&table, schema.packet_size, &stats);
+
+	std::vector<Row> rows;
+	for (size_t f = 0; f < table.lengths.size(); f++) {
+		if (table.lengths[f] != schema.packet_size)
+			continue;
+		uint64_t start = (f == 0) ? 0 : table.ends[f-1] + 1;
+		uint32_t test = std::upper_bound(stream.test_ends.begin(), stream.test_ends.end(), start) - stream.test_ends.begin();
+		rows.push_back(Row{&table.packets[f * table.slot_size], test});
+	}
+	stats.rows = rows.size();
+
+	FILE *out = stdout;
+	if (options.output_path != NULL && (out = fopen(options.output_path, "wb")) == NULL) {
+		fprintf(stderr, "Can't open %s\n", options.output_path);
+		return 1;
+	}
+	bool written = options.columns ? write_columns(out, schema, rows, options.num_threads)
+			: write_csv(out, schema, rows, options.num_threads);
+	written = (fflush(out) == 0) && written;
+	if (out != stdout)
+		written = (fclose(out) == 0) && written;
+	munmap(image, image_size);
+
+	// Without a file for them, events are at least listed where they are
+	if (options.events_path != NULL) {
+		FILE *events_out = fopen(options.events_path, "wb");
+		if (events_out == NULL) {
+			fprintf(stderr, "Can't open %s\n", options.events_path);
+			return 1;
+		}
+		written = write_events(events_out, stream.events) && written;
+		written = (fclose(events_out) == 0) && written;
+	}
+	else {
+		for (const Event_Record &event : stream.events) {
+			fprintf(stderr, "Event in test %u: die %u, page %u, sector %u, ", event.test, event.die,
+					event.page_adr, event.sector);
+			if (event.has_time)
+				fprintf(stderr, "time %u, %zu bytes\n", event.time, event.data.size());
+			else
+				fprintf(stderr, "no time, %zu bytes\n", event.data.size());
+		}
+	}
+
+	fprintf(stderr,
+		"%llu pages, %llu sectors, %llu bad blocks\n"
+		"%llu sectors failed their CRC, %llu were cut off, %llu sequence gaps\n"
+		"%llu events, %llu other records\n"
+		"%llu frames: %llu crossed a gap, %llu didn't decode\n"
+		"%llu rows in %zu tests\n",
+		(unsigned long long) stats.pages, (unsigned long long) stats.sectors, (unsigned long long) stats.bad_blocks,
+		(unsigned long long) stats.crc_failures, (unsigned long long) stats.unfinished_sectors,
+		(unsigned long long) stats.sequence_gaps,
+		(unsigned long long) stats.events, (unsigned long long) stats.other_records,
+		(unsigned long long) stats.frames, (unsigned long long) stats.damaged_frames,
+		(unsigned long long) stats.bad_frames, (unsigned long long) stats.rows,
+		rows.empty() ? (size_t) 0 : (size_t) rows.back().test + 1);
+
+	if (!written) {
+		fprintf(stderr, "Couldn't write the output\n");
+		return 1;
+	}
+	return 0;
+}
@@ -27,6 +27,16 @@
 #define PONG_MAX_PACKET_SIZE        255
 #define CLB_HEADER_SZ               12       // packet header struct size (bytes)
 
+/* Flash Delta Compression Defines */
+#define CLB_FLASH_FRAME_MAX_SZ      512      // largest header + data frame that can be delta compressed
+#define CLB_FLASH_KEYFRAME_INTERVAL 64       // every 64th frame is stored whole
+#define CLB_FLASH_MAX_RUN           128      // longest run a single run length token can hold
+#define CLB_FLASH_UNCHANGED_RUN     0x80     // token bit for a run of unchanged bytes
+// a frame type byte + the frame (deltas that code larger are sent as keyframes)
+#define CLB_FLASH_CODED_MAX_SZ      (1 + CLB_FLASH_FRAME_MAX_SZ)
+// a coded frame after COBS encoding, not counting the 0 terminator
+#define CLB_FLASH_STUFFED_MAX_SZ    (CLB_FLASH_CODED_MAX_SZ + CLB_FLASH_CODED_MAX_SZ/254 + 1)
+
 /* Public Function Prototypes */
 
 // Packet Header 
@@ -50,12 +60,19 @@ typedef struct CLB_send_data_info {
 
 enum CLB_send_data_errors {
 	CLB_nominal					= 0,
-	CLB_flash_buffer_overflow 	= 1
+	CLB_flash_buffer_overflow 	= 1,
+	CLB_flash_frame_too_large	= 2
 };
 
 enum CLB_send_data_type {
 	CLB_Telem = 0,
-	CLB_Flash = 1
+	CLB_Flash = 1,
+	CLB_Flash_Delta = 2
+};
+
+enum CLB_flash_frame_type {
+	CLB_FLASH_KEYFRAME		= 1,	// whole header + data frame follows
+	CLB_FLASH_DELTA_FRAME	= 2		// run length coded XOR against the previous frame follows
 };
 
 enum CLB_receive_data_status {
@@ -77,6 +94,13 @@ uint8_t CLB_last_cmd_received;
 
 CLB_Packet_Header CLB_receive_header;       // private header for receive packets
 
+/* Flash Delta Compression Data */
+uint8_t CLB_flash_frame[CLB_FLASH_FRAME_MAX_SZ];        // frame being compressed
+uint8_t CLB_flash_prev_frame[CLB_FLASH_FRAME_MAX_SZ];   // last frame written, deltas are against it
+uint16_t CLB_flash_prev_frame_sz;                       // 0 forces a keyframe
+uint16_t CLB_flash_frames_since_key;
+uint8_t CLB_flash_coded_frame[CLB_FLASH_CODED_MAX_SZ];  // frame type byte + keyframe or coded delta
+
 #ifdef PACK_CALIBRATION_DEFINES_H
 uint8_t CLB_calibration_data[CLB_NUM_CALIBRATION_ITEMS];
 #endif
@@ -103,6 +127,31 @@ uint8_t* return_telem_buffer(uint8_t*buffer_sz);
 */
 uint8_t send_data(CLB_send_data_info* info, uint8_t type);
 
+/**
+    Makes the next frame sent with CLB_Flash_Delta a keyframe. Call this when
+    starting a new log (after erasing flash) or after a flash write fails, so
+    the frames that follow can be decoded without the ones before them.
+*/
+void restart_flash_delta();
+
+/**
+    Decodes one frame written with send_data(info, CLB_Flash_Delta). Frames
+    are separated by a 0 byte, which should not be passed in.
+
+    @param  stuffed         <uint8_t*> COBS encoded frame, without the 0 terminator
+    @param  length          <uint16_t> number of bytes in stuffed
+    @param  frame           <uint8_t*> CLB_FLASH_FRAME_MAX_SZ byte buffer that holds
+                            the previously decoded frame, which is replaced with
+                            the header + data of this one
+    @param  prev_frame_sz   <uint16_t> size of the frame already in frame, 0 if none
+
+    @returns                <uint16_t> size of the decoded frame, 0 if it is a delta
+                            frame that can't be decoded because the frame before it
+                            is missing or doesn't match. Skip frames until the next
+                            keyframe in that case, frame may be partly overwritten.
+*/
+uint16_t decode_flash_frame(uint8_t *stuffed, uint16_t length, uint8_t *frame, uint16_t prev_frame_sz);
+
 // TODO:
 uint8_t receive_data(UART_HandleTypeDef* uartx, uint8_t* buffer, uint16_t buffer_sz);
 
@@ -9,6 +9,9 @@
 
 // Prviate function prototypes here
 static inline uint8_t validate_command(int16_t cmd_index, uint16_t data_sz);
+static uint8_t send_flash_delta(CLB_send_data_info* info);
+static uint16_t code_flash_delta(uint8_t *frame, uint8_t *prev_frame, uint16_t frame_sz,
+									uint8_t *coded, uint16_t max_coded_sz);
 
 // Private function prototypes end
 
@@ -38,6 +41,10 @@ uint8_t send_data(CLB_send_data_info* info, uint8_t type) {
 		4. Repeats steps 2-3 until buffer is fully transmitted
 		5. Return status/errors in transmission if they exist
 	*/
+	if (type == CLB_Flash_Delta) {
+		return send_flash_delta(info);
+	}
+
 	uint8_t status		= CLB_nominal;			// to be used for error codes
 	uint32_t flash_pos 	= 0;
 	uint16_t clb_pos 	= 0;					// position in clb buffer
@@ -160,6 +167,164 @@ static inline uint8_t validate_command(int16_t cmd_index, uint16_t data_sz) {
     return CLB_RECEIVE_SZ_ERROR;
 }
 
+static uint8_t send_flash_delta(CLB_send_data_info* info) {
+	/* Procedure for sending a compressed frame to flash:
+		1. Pack the header and data into one frame, same as CLB_Flash
+		2. Code it as a delta against the previous frame, or whole as a
+		   keyframe if it's time for one or the delta doesn't come out smaller
+		3. COBS encode the coded frame into flash_arr, followed by a 0
+	*/
+	uint16_t frame_sz = CLB_HEADER_SZ + CLB_buffer_sz;
+	if (frame_sz > CLB_FLASH_FRAME_MAX_SZ) {
+		return CLB_flash_frame_too_large;
+	}
+
+	CLB_header->checksum = compute_checksum();
+	CLB_header->num_packets = compute_packet_sz();
+	pack_header(CLB_header, CLB_flash_frame);
+	pack_packet(CLB_buffer, CLB_flash_frame+CLB_HEADER_SZ, CLB_buffer_sz);
+
+	uint16_t coded_sz = 0;
+	if (frame_sz == CLB_flash_prev_frame_sz
+			&& CLB_flash_frames_since_key < CLB_FLASH_KEYFRAME_INTERVAL - 1) {
+		// must come out at least a byte smaller than the frame to be worth it
+		coded_sz = code_flash_delta(CLB_flash_frame, CLB_flash_prev_frame,
+						frame_sz, CLB_flash_coded_frame+1, frame_sz-1);
+	}
+
+	if (coded_sz > 0) {
+		CLB_flash_coded_frame[0] = CLB_FLASH_DELTA_FRAME;
+	} else {
+		CLB_flash_coded_frame[0] = CLB_FLASH_KEYFRAME;
+		pack_packet(CLB_flash_frame, CLB_flash_coded_frame+1, frame_sz);
+		coded_sz = frame_sz;
+	}
+	coded_sz++;		// frame type byte
+
+	// worst case COBS size + the 0 terminator
+	uint16_t max_stuffed_sz = coded_sz + coded_sz/254 + 2;
+	if (info->flash_arr_used + max_stuffed_sz > info->flash_arr_sz) {
+		// the frame is dropped, so the next one can't be a delta against it
+		restart_flash_delta();
+		return CLB_flash_buffer_overflow;
+	}
+
+	uint16_t stuffed_packet_sz = stuff_packet(CLB_flash_coded_frame,
+								info->flash_arr+info->flash_arr_used, coded_sz);
+	info->flash_arr_used += stuffed_packet_sz;
+	info->flash_arr[info->flash_arr_used++] = 0;
+
+	if (CLB_flash_coded_frame[0] == CLB_FLASH_KEYFRAME) {
+		CLB_flash_frames_since_key = 0;
+	} else {
+		CLB_flash_frames_since_key++;
+	}
+	pack_packet(CLB_flash_frame, CLB_flash_prev_frame, frame_sz);
+	CLB_flash_prev_frame_sz = frame_sz;
+
+	return CLB_nominal;
+}
+
+/*
+ * Codes the XOR of frame and prev_frame as runs of up to CLB_FLASH_MAX_RUN
+ * bytes. A run of unchanged bytes is a single token byte with the
+ * CLB_FLASH_UNCHANGED_RUN bit set, a run of changed bytes is a token byte
+ * followed by the XORed bytes. The low 7 bits of a token are the run length - 1.
+ *
+ * Returns the coded size, or 0 if it would be more than max_coded_sz.
+ */
+static uint16_t code_flash_delta(uint8_t *frame, uint8_t *prev_frame, uint16_t frame_sz,
+									uint8_t *coded, uint16_t max_coded_sz) {
+	uint16_t coded_sz = 0;
+	uint16_t i = 0;
+	while (i < frame_sz) {
+		uint16_t run_start = i;
+		if (frame[i] == prev_frame[i]) {
+			while (i < frame_sz && i - run_start < CLB_FLASH_MAX_RUN
+									&& frame[i] == prev_frame[i]) {
+				i++;
+			}
+			if (coded_sz + 1 > max_coded_sz) {
+				return 0;
+			}
+			coded[coded_sz++] = CLB_FLASH_UNCHANGED_RUN | (i - run_start - 1);
+		} else {
+			while (i < frame_sz && i - run_start < CLB_FLASH_MAX_RUN
+									&& frame[i] != prev_frame[i]) {
+				i++;
+			}
+			if (coded_sz + 1 + (i - run_start) > max_coded_sz) {
+				return 0;
+			}
+			coded[coded_sz++] = i - run_start - 1;
+			for (uint16_t j = run_start; j < i; ++j) {
+				coded[coded_sz++] = frame[j] ^ prev_frame[j];
+			}
+		}
+	}
+	return coded_sz;
+}
+
+void restart_flash_delta() {
+	CLB_flash_prev_frame_sz = 0;
+	CLB_flash_frames_since_key = 0;
+}
+
+uint16_t decode_flash_frame(uint8_t *stuffed, uint16_t length, uint8_t *frame, uint16_t prev_frame_sz) {
+	// not CLB_flash_coded_frame, so this can't clobber a frame send_flash_delta() is coding
+	uint8_t coded_frame[CLB_FLASH_STUFFED_MAX_SZ];
+
+	if (length == 0 || length > CLB_FLASH_STUFFED_MAX_SZ) {
+		return 0;
+	}
+
+	uint16_t coded_sz = unstuff_packet(stuffed, coded_frame, length);
+	if (coded_sz < 2) {
+		return 0;
+	}
+
+	uint8_t *coded = coded_frame + 1;
+	coded_sz--;		// frame type byte
+
+	if (coded_frame[0] == CLB_FLASH_KEYFRAME) {
+		if (coded_sz > CLB_FLASH_FRAME_MAX_SZ) {
+			return 0;
+		}
+		pack_packet(coded, frame, coded_sz);
+		return coded_sz;
+	}
+
+	if (coded_frame[0] != CLB_FLASH_DELTA_FRAME || prev_frame_sz == 0) {
+		return 0;
+	}
+
+	// undo the XOR in place, see code_flash_delta()
+	uint16_t frame_pos = 0;
+	uint16_t i = 0;
+	while (i < coded_sz) {
+		uint8_t token = coded[i++];
+		uint16_t run_sz = (token & ~CLB_FLASH_UNCHANGED_RUN) + 1;
+		if (frame_pos + run_sz > prev_frame_sz) {
+			return 0;
+		}
+		if (token & CLB_FLASH_UNCHANGED_RUN) {
+			frame_pos += run_sz;
+		} else {
+			if (i + run_sz > coded_sz) {
+				return 0;
+			}
+			for (uint16_t j = 0; j < run_sz; ++j) {
+				frame[frame_pos++] ^= coded[i++];
+			}
+		}
+	}
+
+	if (frame_pos != prev_frame_sz) {
+		return 0;
+	}
+	return prev_frame_sz;
+}
+
 uint8_t* return_telem_buffer(uint8_t*buffer_sz) {
     *buffer_sz = CLB_buffer_sz;
     return CLB_buffer;
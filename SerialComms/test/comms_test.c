@@ -0,0 +1,314 @@
+/**
+ * Tests for the delta-compressed flash frames in comms.c, run on the host.
+ *
+ * Build from the SerialComms directory, with the W25N01GV simulator's
+ * stand-in for the HAL:
+ * gcc -fcommon -Itest -I../W25N01GV/sim test/comms_test.c src/comms.c -lm -o comms_tests
+ *
+ * Usage: ./comms_tests [name of one test]
+ *
+ * Prints each failed check and exits with 1 if any failed.
+ *
+ * Michigan Aeronautical Science Association
+ */
+
+#include "../inc/comms.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_DATA_SZ            200
+#define TEST_FRAME_SZ           (CLB_HEADER_SZ + TEST_DATA_SZ)
+#define TEST_NUM_FRAMES         2000
+#define TEST_NUM_PRESSURES      40
+#define TEST_LOG_SZ             (TEST_NUM_FRAMES * (TEST_FRAME_SZ + 4))
+
+#define CHECK(condition)        check((condition) != 0, #condition, __LINE__)
+
+// Left empty by the generated files in a board's firmware
+int16_t command_map[1];
+uint8_t command_sz[1];
+void (*cmds_ptr[1])(uint8_t*, uint8_t*);
+
+static uint32_t num_checks = 0;
+static uint32_t num_failed_checks = 0;
+
+static CLB_Packet_Header header;
+static uint8_t frames[TEST_NUM_FRAMES][TEST_FRAME_SZ];
+static uint8_t flash_log[TEST_LOG_SZ];
+static uint32_t random_state;
+
+
+/* Stand-ins for the generated and HAL functions comms.c links against */
+
+void pack_telem_data(uint8_t *dst) {
+	(void) dst;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size, uint32_t Timeout) {
+	(void) huart; (void) pData; (void) Size; (void) Timeout;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Receive(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size, uint32_t Timeout) {
+	(void) huart; (void) pData; (void) Size; (void) Timeout;
+	return HAL_OK;
+}
+
+
+/* Private functions */
+
+static void check(int passed, const char *condition, int line) {
+	num_checks++;
+	if (!passed) {
+		num_failed_checks++;
+		printf("    line %d: CHECK(%s) failed\n", line, condition);
+	}
+}
+
+static uint32_t next_random(void) {
+	random_state = random_state * 1103515245u + 12345u;
+	return random_state >> 16;
+}
+
+/**
+ * Points comms.c at the data of frame n, with a header for it.
+ */
+static void load_frame(uint32_t n, uint8_t *data) {
+	memset(&header, 0, sizeof(header));
+	header.do_cobbs = 1;  // Frames on flash are split at their 0 terminators
+	header.timestamp = n * 1000;
+	init_data(data, TEST_DATA_SZ, &header);
+}
+
+/**
+ * Makes frame n from its data, with the header send_data() will give it.
+ */
+static void pack_frame(uint32_t n, uint8_t *data) {
+	load_frame(n, data);
+	header.checksum = compute_checksum();
+	header.num_packets = compute_packet_sz();
+	pack_header(&header, frames[n]);
+	memcpy(frames[n] + CLB_HEADER_SZ, data, TEST_DATA_SZ);
+}
+
+/**
+ * Fills in TEST_NUM_FRAMES frames of telemetry, header and all: 40 pressures
+ * that drift a little in a quarter of the frames, then valve states and
+ * setpoints that change every 500 frames.
+ */
+static void make_telemetry_frames(void) {
+	uint16_t pressures[TEST_NUM_PRESSURES];
+	uint8_t data[TEST_DATA_SZ];
+
+	random_state = 1;
+	for (uint8_t i = 0; i < TEST_NUM_PRESSURES; i++)
+		pressures[i] = 1000 + i * 37;
+
+	for (uint32_t n = 0; n < TEST_NUM_FRAMES; n++) {
+		for (uint8_t i = 0; i < TEST_NUM_PRESSURES; i++) {
+			if (next_random() % 4 == 0)
+				pressures[i] += (next_random() % 5) - 2;
+			data[2*i] = (uint8_t) pressures[i];
+			data[2*i+1] = (uint8_t) (pressures[i] >> 8);
+		}
+		for (uint16_t i = 2 * TEST_NUM_PRESSURES; i < TEST_DATA_SZ; i++)
+			data[i] = (i < 100) ? (uint8_t) (n / 500) : 0x5A;
+		pack_frame(n, data);
+	}
+}
+
+/**
+ * Sends frames first to last with send_data() into flash_log.
+ *
+ * @retval The number of bytes written to flash_log
+ */
+static uint32_t send_frames(uint32_t first, uint32_t last, uint8_t type) {
+	CLB_send_data_info info = { NULL, 0, 0, NULL };
+	uint8_t buffer[2 * TEST_FRAME_SZ];
+	uint32_t log_sz = 0;
+
+	for (uint32_t n = first; n <= last; n++) {
+		load_frame(n, frames[n] + CLB_HEADER_SZ);
+		info.flash_arr = buffer;
+		info.flash_arr_sz = sizeof(buffer);
+		info.flash_arr_used = 0;
+		send_data(&info, type);
+		memcpy(flash_log + log_sz, buffer, info.flash_arr_used);
+		log_sz += info.flash_arr_used;
+	}
+	return log_sz;
+}
+
+/**
+ * Decodes the frames in flash_log with decode_flash_frame() and compares
+ * them to frames first onwards.
+ *
+ * @retval The number of frames that decoded to the right frame. A frame that
+ *         can't be decoded counts as wrong, so does one that decodes wrongly.
+ */
+static uint32_t frames_decoded(uint32_t log_sz, uint32_t first) {
+	uint8_t frame[CLB_FLASH_FRAME_MAX_SZ];
+	uint16_t frame_sz = 0;
+	uint32_t start = 0;
+	uint32_t n = first;
+	uint32_t num_right = 0;
+
+	for (uint32_t i = 0; i < log_sz; i++) {
+		if (flash_log[i] != 0)
+			continue;
+		frame_sz = decode_flash_frame(flash_log + start, i - start, frame, frame_sz);
+		if (frame_sz == TEST_FRAME_SZ && memcmp(frame, frames[n], TEST_FRAME_SZ) == 0)
+			num_right++;
+		start = i + 1;
+		n++;
+	}
+	return num_right;
+}
+
+
+/* Tests */
+
+/**
+ * Telemetry where little changes from frame to frame is stored several
+ * times smaller than with CLB_Flash, and every frame decodes back exactly.
+ */
+static void test_delta_round_trip(void) {
+	uint32_t plain_sz = send_frames(0, TEST_NUM_FRAMES - 1, CLB_Flash);
+
+	restart_flash_delta();
+	uint32_t delta_sz = send_frames(0, TEST_NUM_FRAMES - 1, CLB_Flash_Delta);
+	CHECK(delta_sz * 5 < plain_sz);
+	CHECK(frames_decoded(delta_sz, 0) == TEST_NUM_FRAMES);
+}
+
+/**
+ * A reader that starts partway through the log can't decode anything until
+ * the next keyframe, and decodes every frame after it.
+ */
+static void test_delta_keyframe_interval(void) {
+	restart_flash_delta();
+	send_frames(0, 2, CLB_Flash_Delta);
+	uint32_t log_sz = send_frames(3, 2 * CLB_FLASH_KEYFRAME_INTERVAL - 1, CLB_Flash_Delta);
+
+	CHECK(frames_decoded(log_sz, 3) == CLB_FLASH_KEYFRAME_INTERVAL);
+}
+
+/**
+ * A frame that changes completely is never stored more than a byte bigger
+ * than with CLB_Flash. A frame of a new size is stored whole, so it can be
+ * decoded without the frame before it.
+ */
+static void test_delta_changed_frames(void) {
+	uint8_t data[TEST_DATA_SZ];
+	for (uint16_t i = 0; i < TEST_DATA_SZ; i++)
+		data[i] = (uint8_t) next_random();
+	pack_frame(10, data);
+	uint32_t plain_sz = send_frames(10, 10, CLB_Flash);
+
+	restart_flash_delta();
+	uint32_t log_sz = send_frames(0, 20, CLB_Flash_Delta);
+	uint8_t *frame_10 = flash_log;
+	for (uint8_t n = 0; n < 10; n++)
+		frame_10 = (uint8_t *) memchr(frame_10, 0, log_sz) + 1;
+	uint32_t changed_sz = (uint32_t) ((uint8_t *) memchr(frame_10, 0, log_sz) - frame_10) + 1;
+	CHECK(changed_sz <= plain_sz + 1);
+	CHECK(frames_decoded(log_sz, 0) == 21);
+
+	// The first 150 bytes of frame 21, with its header
+	CLB_send_data_info info = { NULL, 0, 0, NULL };
+	uint8_t buffer[2 * TEST_FRAME_SZ];
+	uint8_t frame[CLB_FLASH_FRAME_MAX_SZ];
+	load_frame(21, frames[21] + CLB_HEADER_SZ);
+	init_data(frames[21] + CLB_HEADER_SZ, 150, &header);
+	info.flash_arr = buffer;
+	info.flash_arr_sz = sizeof(buffer);
+	CHECK(send_data(&info, CLB_Flash_Delta) == CLB_nominal);
+	CHECK(decode_flash_frame(buffer, info.flash_arr_used - 1, frame, 0) == CLB_HEADER_SZ + 150);
+	CHECK(memcmp(frame + CLB_HEADER_SZ, frames[21] + CLB_HEADER_SZ, 150) == 0);
+}
+
+/**
+ * A frame that doesn't fit in flash_arr is dropped, and the next one is a
+ * keyframe so it can be decoded without it.
+ */
+static void test_delta_overflow_restarts(void) {
+	CLB_send_data_info info = { NULL, 0, 0, NULL };
+	uint8_t buffer[2 * TEST_FRAME_SZ];
+
+	restart_flash_delta();
+	send_frames(0, 4, CLB_Flash_Delta);
+
+	load_frame(5, frames[5] + CLB_HEADER_SZ);
+	info.flash_arr = buffer;
+	info.flash_arr_sz = 4;
+	CHECK(send_data(&info, CLB_Flash_Delta) == CLB_flash_buffer_overflow);
+	CHECK(info.flash_arr_used == 0);
+
+	uint32_t log_sz = send_frames(6, 10, CLB_Flash_Delta);
+	CHECK(frames_decoded(log_sz, 6) == 5);
+
+	// Frames too big to code are refused
+	uint8_t big_data[CLB_FLASH_FRAME_MAX_SZ];
+	memset(big_data, 0, sizeof(big_data));
+	init_data(big_data, CLB_FLASH_FRAME_MAX_SZ, &header);
+	info.flash_arr_sz = sizeof(buffer);
+	CHECK(send_data(&info, CLB_Flash_Delta) == CLB_flash_frame_too_large);
+}
+
+
+/**
+ * Decoding doesn't touch the encoder's buffers, so a frame can be decoded
+ * on the board while send_data() is coding another one.
+ */
+static void test_decode_leaves_encoder_alone(void) {
+	uint8_t coded_frame[sizeof(CLB_flash_coded_frame)];
+
+	restart_flash_delta();
+	uint32_t log_sz = send_frames(0, 9, CLB_Flash_Delta);
+	memset(CLB_flash_coded_frame, 0xA5, sizeof(CLB_flash_coded_frame));
+	memcpy(coded_frame, CLB_flash_coded_frame, sizeof(coded_frame));
+
+	CHECK(frames_decoded(log_sz, 0) == 10);
+	CHECK(memcmp(coded_frame, CLB_flash_coded_frame, sizeof(coded_frame)) == 0);
+}
+
+
+/* Main */
+
+typedef struct {
+	const char *name;
+	void (*run)(void);
+} Test;
+
+static const Test tests[] = {
+	{ "delta_round_trip",                test_delta_round_trip                },
+	{ "delta_keyframe_interval",         test_delta_keyframe_interval         },
+	{ "delta_changed_frames",            test_delta_changed_frames            },
+	{ "delta_overflow_restarts",         test_delta_overflow_restarts         },
+	{ "decode_leaves_encoder_alone",     test_decode_leaves_encoder_alone     },
+};
+
+int main(int argc, char **argv) {
+	uint32_t num_failed_tests = 0;
+	uint32_t num_run = 0;
+
+	for (uint32_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+		if (argc > 1 && strcmp(argv[1], tests[i].name) != 0)
+			continue;
+
+		uint32_t failures_before = num_failed_checks;
+		printf("%s\n", tests[i].name);
+		make_telemetry_frames();
+		tests[i].run();
+		num_run++;
+		if (num_failed_checks != failures_before)
+			num_failed_tests++;
+	}
+
+	printf("%u of %u tests passed (%u checks)\n", (unsigned) (num_run - num_failed_tests),
+			(unsigned) num_run, (unsigned) num_checks);
+
+	return (num_failed_tests == 0 && num_run > 0) ? 0 : 1;
+}
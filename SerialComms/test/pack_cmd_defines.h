@@ -0,0 +1,20 @@
+/**
+ * Host-side stand-in for the pack_cmd_defines.h the Python generators write
+ * into a board's firmware. comms_test.c doesn't receive commands, so the
+ * command map is empty.
+ *
+ * Michigan Aeronautical Science Association
+ */
+
+#ifndef PACK_CMD_DEFINES_H
+#define PACK_CMD_DEFINES_H
+
+#include <stdint.h>
+
+#define COMMAND_MAP_SZ 0
+
+extern int16_t command_map[];
+extern uint8_t command_sz[];
+extern void (*cmds_ptr[])(uint8_t*, uint8_t*);
+
+#endif
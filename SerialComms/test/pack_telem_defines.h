@@ -0,0 +1,14 @@
+/**
+ * Host-side stand-in for the pack_telem_defines.h the Python generators write
+ * into a board's firmware. comms_test.c passes its own frames to init_data(),
+ * so only the size of the generated telem buffer is needed.
+ *
+ * Michigan Aeronautical Science Association
+ */
+
+#ifndef PACK_TELEM_DEFINES_H
+#define PACK_TELEM_DEFINES_H
+
+#define CLB_NUM_TELEM_ITEMS 200
+
+#endif
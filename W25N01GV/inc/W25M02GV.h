@@ -24,13 +24,30 @@
 
 #include "W25N01GV.h"
 
+/**
+ * How logical pages are spread across the two dies. The layout is stored on
+ * the chip, so fc_init_flash() reads it back. See fc_set_flash_layout().
+ */
+typedef enum {
+	W25M02GV_LAYOUT_LINEAR,   // All of die 0 is written before die 1 (default)
+	W25M02GV_LAYOUT_STRIPED   // Consecutive 2KB pages alternate dies, even pages on die 0
+} W25M02GV_Layout;
+
 typedef struct {
 	W25N01GV_Flash flash0;
 	W25N01GV_Flash flash1;
 
+	W25M02GV_Layout layout;
+
+	// Striped layout only. Data is collected into a full page before it's
+	// written, so one die can program while the other is loaded.
+	uint8_t stripe_buffer[W25N01GV_BYTES_PER_PAGE];
+	uint16_t stripe_buffer_size;  // Column the buffer is filled up to
+
 	SPI_HandleTypeDef *SPI_bus;   // SPI struct, specified by user
 	GPIO_TypeDef *cs_base;        // Chip select GPIO base, specified by user
 	uint16_t cs_pin;              // Chip select GPIO pin, specified by user
+	W25N01GV_Transport transport; // Used instead of SPI_bus if not NULL, see fc_init_flash_with_transport()
 
 	uint8_t current_write_die;    // Track the die that has the last written address
 	uint8_t current_read_die;     // Track the die that has the next page to read
@@ -54,6 +71,49 @@ typedef struct {
 void fc_init_flash(W25M02GV_Flash *fc_flash, SPI_HandleTypeDef *SPI_bus_in,
 		GPIO_TypeDef *cs_base_in, uint16_t cs_pin_in);
 
+/**
+ * Same as fc_init_flash(), but every command goes through transport instead
+ * of a SPI bus and chip select pin, see init_flash_with_transport(). That
+ * includes die select and fc_ping_flash(), which pass the transport
+ * fc_flash->flash0 since they're for the whole chip.
+ *
+ * @param fc_flash   <W25M02GV_Flash*>     Struct used to store flash pins and addresses
+ * @param transport  <W25N01GV_Transport>  Function that runs a transaction on the peripheral
+ * @param data_lines <uint8_t>             1, 2 or 4 lines for page data
+ */
+void fc_init_flash_with_transport(W25M02GV_Flash *fc_flash, W25N01GV_Transport transport, uint8_t data_lines);
+
+/**
+ * Switches between the linear and striped layouts. In the striped layout,
+ * consecutive 2KB pages alternate dies, and each page is programmed while the
+ * next one is being loaded into the other die, so writing isn't limited by
+ * a single die's program time.
+ *
+ * The layout is saved in the last page of die 1's reserved block, and is
+ * read back by fc_init_flash(). Flash must be empty, so call fc_erase_flash()
+ * first. Replacing a layout that was saved before means erasing die 1's
+ * reserved block, so that's refused while any other reserved page on die 1
+ * holds data. To change the layout anyway, call
+ * fc_erase_reserved_flash_pages(fc_flash, 1) first.
+ *
+ * @param fc_flash   <W25M02GV_Flash*>    Struct used to store flash pins and addresses
+ * @param layout     <W25M02GV_Layout>    Layout to use for all data written from now on
+ * @retval 0 if the layout was changed, 1 if flash isn't empty, die 1's reserved pages
+ *         are in use or saving the layout failed
+ */
+uint8_t fc_set_flash_layout(W25M02GV_Flash *fc_flash, W25M02GV_Layout layout);
+
+/**
+ * Erases the 64 reserved pages of one die, see erase_reserved_flash_pages().
+ * Die 1's reserved block also holds the layout, so erasing it goes back to
+ * the linear layout, and is refused while striped data is on flash.
+ *
+ * @param fc_flash   <W25M02GV_Flash*>    Struct used to store flash pins and addresses
+ * @param die_id     <uint8_t>            Die to erase the reserved pages of, 0 or 1
+ * @retval 1 if it fails to erase or striped data is on flash, 0 otherwise
+ */
+uint8_t fc_erase_reserved_flash_pages(W25M02GV_Flash *fc_flash, uint8_t die_id);
+
 /**
  * Check that the device's JEDEC ID matches the one listed in the datasheet.
  * Use this function to check if the flash and the SPI bus is functioning.
@@ -88,6 +148,10 @@ uint8_t fc_reset_flash(W25M02GV_Flash *fc_flash);
  * This function also resets the address counters in the two W25N01GV_Flash structs
  * contained in the W25M02GV_Flash struct.
  *
+ * The dies are erased at the same time: a block erase is started on one die,
+ * then on the other, and each die gets its next block as soon as it's done
+ * (see start_flash_erase()). It takes about as long as erasing one die.
+ *
  * WARNING: This function will erase all data, and causes a substantial delay
  * on the order of 2-10 seconds. Only use it if you're absolutely sure.
  *
@@ -96,6 +160,20 @@ uint8_t fc_reset_flash(W25M02GV_Flash *fc_flash);
  */
 uint16_t fc_erase_flash(W25M02GV_Flash *fc_flash);
 
+/**
+ * Scans both dies for bad memory blocks, see scan_bad_blocks(). Like
+ * fc_erase_flash(), one die loads a page while the other one is read.
+ *
+ * Die 0's bad blocks come first in the array, followed by die 1's, which are
+ * numbered from 1024 (block 3 on die 1 is 1027).
+ *
+ * @param fc_flash   <W25M02GV_Flash*>    Struct used to store flash pins and addresses
+ * @param bad_blocks <uint16_t*>          An array of size 2048 containing the address of each bad block.
+ * 	The return value tells how many of the first N indices of this array are used.
+ * @retval The total number of bad blocks found on both dies
+ */
+uint16_t fc_scan_bad_blocks(W25M02GV_Flash *fc_flash, uint16_t *bad_blocks);
+
 /**
  * Writes data from an array to the W25N01GV flash memory chip.
  * It automatically tracks the address of data it writes; no address
@@ -126,6 +204,7 @@ uint16_t fc_write_to_flash(W25M02GV_Flash *fc_flash, uint8_t *data, uint32_t num
  * up to the last 512 bytes of data.
  *
  * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @retval The number of writes that failed and couldn't be moved to a good block
  */
 uint16_t fc_finish_flash_write(W25M02GV_Flash *fc_flash);
 
@@ -143,6 +222,7 @@ void fc_reset_flash_read_pointer(W25M02GV_Flash *fc_flash);
 /**
  * Reads a 2KB page into the supplied buffer, then increments a counter so it
  * will output the next page the next time this function is called.
+ * In the striped layout, it alternates between the two dies.
  *
  * To read out the entire memory array, call reset_read_pointer(), then call
  * this function up to W25N01GV_NUM_PAGES times. See README for sample code.
@@ -158,6 +238,9 @@ void fc_read_next_2KB_from_flash(W25M02GV_Flash *fc_flash, uint8_t *buffer);
  * page of die0. If die0 is full, it returns the number of pages in die0 plus
  * the current page of die1.
  *
+ * In the striped layout, it returns the index of the current logical page,
+ * counting pages on both dies.
+ *
  * Use the output of this function as the upper limit (inclusive) for loop counters when reading from flash.
  */
 uint32_t fc_flash_current_page(W25M02GV_Flash *fc_flash);
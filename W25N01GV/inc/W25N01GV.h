@@ -77,6 +77,19 @@
  *
  * ============================================================================
  *
+ * // Writing without blocking on the SPI transfer or the program time.
+ * // One sector buffer is filled while the other is sent over DMA.
+ *
+ * enable_async_flash_write(&flash, NULL);
+ * while (logging) {
+ *   write_to_flash(&flash, data, num_bytes);
+ *   poll_async_flash_write(&flash);
+ * }
+ * finish_flash_write(&flash);
+ * disable_async_flash_write(&flash);
+ *
+ * ============================================================================
+ *
  * // Miscellaneous functions
  * TODO reorganize these functions
  *
@@ -101,9 +114,12 @@
 
 // Number of pages that can be read from. See README and
 // the above documentation for use when reading from flash.
-// Note: there are actually 65536 pages, but the last block (64 pages)
-// is reserved by this firmware.
-#define W25N01GV_NUM_PAGES (uint32_t) 65472
+// Note: there are actually 65536 pages, but the last 3 blocks (192 pages)
+// are reserved by this firmware: the last block for the user (pseudo-eeprom),
+// the block before it for write pointer checkpoints, and the one before that
+// for compacting the key/value store. This was 65472 before the checkpoint
+// block and 65408 before the key/value store's second block.
+#define W25N01GV_NUM_PAGES (uint32_t) 65344
 
 // Each page has a 2048-byte main data array to read/write
 #define W25N01GV_BYTES_PER_PAGE (uint16_t) 2048
@@ -114,6 +130,35 @@
 // See application note linked in README for why.
 #define W25N01GV_SECTOR_SIZE (uint16_t) 512
 
+// Largest record that can be reserved with reserve_flash_write()
+#define W25N01GV_MAX_RESERVE_SIZE (uint16_t) 256
+
+// Each sector has 16 bytes in the page's spare area. This firmware stores
+// 6 bytes of metadata for each sector there, see W25N01GV_Sector_Metadata.
+#define W25N01GV_SECTOR_METADATA_SIZE (uint16_t) 6
+
+// Sectors 1-3 of a page also store part of the page's timestamp in the 2 spare
+// bytes before their metadata, see seek_flash_to_time(). This is the size of
+// both together, as they're written to the spare area.
+#define W25N01GV_SECTOR_SPARE_RECORD_SIZE (uint16_t) 8
+
+// Record tags stored in the sector metadata, see set_flash_record_tag().
+// Tags are 4 bits, so the user can pick any value up to 14 for their own records.
+#define W25N01GV_TAG_DATA      (uint8_t) 0x00  // Default for write_to_flash()
+#define W25N01GV_TAG_DELIMITER (uint8_t) 0x01  // Empty sector written by add_test_delimiter()
+#define W25N01GV_TAG_EVENT     (uint8_t) 0x02  // Sector written by write_flash_event()
+#define W25N01GV_TAG_PADDING   (uint8_t) 0x03  // Empty sector written by write_flash_padding()
+#define W25N01GV_TAG_NONE      (uint8_t) 0x0F  // Sector has no metadata (erased, or written by older firmware)
+
+// Key/value store on the reserved block and its second block, see init_flash_kv_store().
+// Keys are 0 to W25N01GV_KV_MAX_KEYS-1. Every value takes 6 more bytes on
+// flash, and all of the current values together have to fit in one 2048 byte page.
+#define W25N01GV_KV_MAX_KEYS       (uint8_t)  64
+#define W25N01GV_KV_MAX_VALUE_SIZE (uint16_t) 256
+
+// Size of the telemetry snapshot written by pack_flash_stats()
+#define W25N01GV_STATS_PACKED_SIZE (uint16_t) 27
+
 /**
  * Value representing the status of the last read command. Error correction
  * algorithms are run internally on the flash chip, and the ECC1 and ECC0 bits
@@ -130,25 +175,163 @@ typedef enum {
 	READ_ERROR_NO_ECC_STATUS   // Failed to read ECC bits
 } W25N01GV_ECC_Status;
 
+/**
+ * Metadata stored in the spare area of every sector written to the data area.
+ * It's written in the same program operation as the sector, so it doesn't
+ * break the 512 byte framing. The tag, valid byte count and sequence number
+ * are covered by the chip's ECC, and the CRC covers all of the sector's data
+ * and the other fields. See read_flash_page_metadata().
+ */
+typedef struct {
+	uint8_t tag;              // Record tag, W25N01GV_TAG_NONE if the sector has no metadata
+	uint16_t valid_bytes;     // Bytes of user data in the sector, the rest is padding
+	uint8_t section_end;      // 1 if a test ends with this sector, see add_test_delimiter()
+	uint16_t sequence;        // Counts up by one for every sector written since erase_flash(), wraps around
+	uint16_t crc;             // CRC-16/CCITT of the sector's 512 bytes and the fields above
+} W25N01GV_Sector_Metadata;
+
+/**
+ * State of the asynchronous write pipeline. See enable_async_flash_write().
+ */
+typedef enum {
+	ASYNC_WRITE_IDLE,         // No sector in flight, both sector buffers are free to fill
+	ASYNC_WRITE_LOADING,      // A sector is being clocked into the chip's buffer over SPI DMA
+	ASYNC_WRITE_PROGRAMMING,  // Program execute was issued, waiting for the chip to finish
+	ASYNC_WRITE_ERASING       // A block ahead of the write pointer is being erased, see quick_erase_flash()
+} W25N01GV_Async_State;
+
+/**
+ * Operation on the whole chip that's done a block at a time between calls to
+ * poll_flash_block_op(). See start_flash_erase().
+ */
+typedef enum {
+	BLOCK_OP_NONE,
+	BLOCK_OP_ERASE,           // Started by start_flash_erase()
+	BLOCK_OP_BAD_BLOCK_SCAN   // Started by start_flash_bad_block_scan()
+} W25N01GV_Block_Op;
+
+/**
+ * Result of a key/value store operation. See init_flash_kv_store().
+ */
+typedef enum {
+	KV_OK,
+	KV_NOT_FOUND,      // The key has no value
+	KV_INVALID,        // Key or size out of range, or the buffer is too small
+	KV_FULL,           // The current values wouldn't fit in one page anymore
+	KV_CORRUPTED,      // The value on flash doesn't match its CRC
+	KV_WRITE_FAILED    // Programming or erasing the store's block failed
+} W25N01GV_KV_Status;
+
+/**
+ * Latency of one kind of chip operation, in CPU cycles (DWT cycle counter),
+ * from sending the command until the chip is seen to be ready.
+ */
+typedef struct {
+	uint32_t count;
+	uint32_t min_cycles;
+	uint32_t max_cycles;
+	uint64_t total_cycles;
+} W25N01GV_Latency;
+
+/**
+ * Optional statistics, kept by the library once enable_flash_stats() is
+ * called. Per-block counters stop at 255.
+ */
+typedef struct {
+	W25N01GV_Latency page_load;       // Page data read, until the page is in the chip's buffer
+	W25N01GV_Latency program;         // Program execute
+	W25N01GV_Latency erase;           // Block erase
+
+	uint32_t busy_polls;              // Status register reads to check if the chip is busy
+	uint32_t max_polls_per_wait;      // Most busy polls in one blocking wait
+
+	uint32_t ECC_corrections;         // Page reads the chip had to correct
+	uint32_t ECC_failures;            // Page reads with uncorrectable errors
+	uint32_t program_failures;
+	uint32_t erase_failures;
+
+	uint8_t block_ECC_corrections[1024];
+	uint8_t block_failures[1024];     // Uncorrectable reads, program and erase failures
+} W25N01GV_Stats;
+
+struct W25N01GV_Flash;
+
+/**
+ * Called when an asynchronous sector write finishes programming.
+ * write_failure_status is 0 if the sector was written successfully.
+ */
+typedef void (*W25N01GV_Write_Callback)(struct W25N01GV_Flash *flash, uint8_t write_failure_status);
+
+/**
+ * Called repeatedly while the library waits for the chip to finish a page
+ * load, program or erase, see set_flash_busy_wait(). It shouldn't use the
+ * flash's SPI bus, and it should return quickly.
+ */
+typedef void (*W25N01GV_Yield_Callback)(struct W25N01GV_Flash *flash);
+
+/**
+ * Returns the time stamped on each page written, see set_flash_time_source().
+ * Any unit works, as long as it counts up.
+ */
+typedef uint32_t (*W25N01GV_Time_Callback)(struct W25N01GV_Flash *flash);
+
+/**
+ * Runs one whole transaction (chip select included) on a peripheral that can
+ * do dual or quad transfers, see init_flash_with_transport(). The header_size
+ * header bytes (command, address and dummy bytes) are sent on 1 line, then
+ * data_size bytes of data are sent, or received if is_read is 1, on data_lines
+ * lines. data_size is 0 for commands without data.
+ * Returns the HAL status of the transfer.
+ */
+typedef HAL_StatusTypeDef (*W25N01GV_Transport)(struct W25N01GV_Flash *flash, uint8_t *header,
+		uint16_t header_size, uint8_t *data, uint16_t data_size, uint8_t data_lines, uint8_t is_read);
+
 /*
  * Struct to store data related to flash, including pins
  * and address counters. A pointer to a struct of this type
  * is passed to each flash function.
  */
-typedef struct {
-	// Data buffer to store data before writing
-	uint8_t write_buffer[W25N01GV_SECTOR_SIZE];
+typedef struct W25N01GV_Flash {
+	// Two sector-sized buffers. Normally only the first one is used, but in
+	// async write mode one is filled while the other is written to flash.
+	// Each has room after the sector for a reserved record that crosses into
+	// the next sector, see reserve_flash_write().
+	uint8_t sector_buffers[2][W25N01GV_SECTOR_SIZE + W25N01GV_MAX_RESERVE_SIZE];
+
+	// Data buffer to store data before writing, points at the sector buffer being filled
+	uint8_t *write_buffer;
 
 	uint32_t next_page_to_read;   // Tracking pages while reading
+	uint8_t next_sector_to_read;  // First sector of next_page_to_read left for read_next_valid_data_from_flash()
+	uint8_t test_end_read;        // 1 if the data read_next_valid_data_from_flash() just returned ends a test
+	uint32_t invalid_sectors_skipped; // Sectors read_next_valid_data_from_flash() dropped because of a bad CRC
+	uint8_t torn_page_skipped;    // 1 if init_flash() found a partly programmed page at the write pointer
 
 	SPI_HandleTypeDef *SPI_bus;   // SPI struct, specified by user
 	GPIO_TypeDef *cs_base;        // Chip select GPIO base, specified by user
 	uint16_t cs_pin;              // Chip select GPIO pin, specified by user
+	W25N01GV_Transport transport; // Used instead of SPI_bus if not NULL, see init_flash_with_transport()
+	uint8_t data_lines;           // Lines used for page data with a transport: 1, 2 or 4
 
 	uint16_t write_buffer_size;   // Tracking the bytes stored in the buffer while writing
 
+	// Sector for write_flash_event(), which bypasses write_buffer.
+	// In async mode it's in flight until the pipeline is idle.
+	uint8_t event_buffer[W25N01GV_SECTOR_SIZE];
+	uint16_t reserved_bytes;      // Bytes reserved with reserve_flash_write() and not committed yet
+
 	uint16_t current_page;        // Tracking pages while writing
 	uint16_t next_free_column;    // Tracking columns while writing
+	uint16_t last_checkpoint_page; // Write pointer page saved in the checkpoint block, 0 if none
+
+	uint8_t record_tag;           // Tag written in the metadata of each sector, see set_flash_record_tag()
+	uint16_t next_sequence;       // Sequence number for the metadata of the next sector written
+	uint8_t section_end_pending;  // Set while add_test_delimiter() writes the last sector of a test
+
+	// Page timestamps, see seek_flash_to_time()
+	W25N01GV_Time_Callback time_source;  // NULL to use HAL_GetTick()
+	uint32_t page_time;           // Timestamp of the page being written
+	uint16_t page_time_page;      // Page that page_time was taken for
 
 	// The firmware checks various status codes, all of
 	// which can be accessed at any time.
@@ -159,14 +342,127 @@ typedef struct {
 	uint8_t last_write_failure_status;
 	uint8_t last_erase_failure_status;
 
+	// Asynchronous write pipeline, see enable_async_flash_write()
+	uint8_t async_write_enabled;
+	volatile W25N01GV_Async_State async_state;
+	uint8_t *async_data;                     // Sector buffer currently in flight
+	uint16_t async_num_bytes;
+	uint16_t async_page;                     // Address the sector in flight is written to
+	uint16_t async_column;
+	uint8_t async_metadata[W25N01GV_BYTES_PER_PAGE / W25N01GV_SECTOR_SIZE][W25N01GV_SECTOR_SPARE_RECORD_SIZE];
+	uint16_t async_write_failures;           // Running count of failed asynchronous sector writes
+	W25N01GV_Write_Callback async_callback;  // Optional, can be NULL
+
+	// Continuous read streaming, see begin_continuous_flash_read()
+	uint8_t continuous_read_active;
+	uint16_t continuous_read_column;         // Position in flash->next_page_to_read
+	uint8_t continuous_read_dma_active;      // A chunk from start_continuous_flash_chunk_read() may still be arriving
+	uint16_t last_ECC_failure_page;          // Last page with an uncorrectable ECC error in a stream
+	W25N01GV_ECC_Status continuous_read_ECC_status;  // Combined ECC status of the stream so far
+
+	// Bad block management, see init_flash()
+	uint8_t bad_blocks[1024 / 8];            // 1 bit per block, set if the block is bad or retired
+	uint16_t num_bad_blocks;                 // Bad blocks in the data area (not counting the last 2 blocks)
+	uint16_t bad_blocks_ahead;               // Bad blocks in the data area after the write pointer's block
+	uint16_t retired_blocks;                 // Blocks that failed to program or erase since init_flash()
+	uint8_t num_retired_block_records;       // Retired blocks recorded in the checkpoint block
+
+	// Erase-ahead mode, see quick_erase_flash()
+	uint8_t erase_ahead_enabled;
+	uint16_t erase_ahead_block;              // First block after the write pointer that isn't erased yet
+	uint8_t circular_log_enabled;            // See start_circular_flash_log()
+
+	uint8_t kv_store_active;                 // 1 once init_flash_kv_store() owns the reserved block
+
+	// Whole-chip operation in progress, see start_flash_erase()
+	W25N01GV_Block_Op block_op;
+	uint16_t block_op_block;                 // Block being erased or read
+	uint16_t block_op_result;                // Blocks that failed to erase, or bad blocks found so far
+	uint16_t *block_op_bad_blocks;           // Where start_flash_bad_block_scan() puts the bad blocks
+	uint32_t block_op_start;                 // Cycle count when the block's command was sent
+
+	// Optional statistics, see enable_flash_stats()
+	W25N01GV_Stats *stats;                   // NULL if disabled
+	uint8_t timed_op;                        // Operation being timed, if any
+	uint32_t timed_op_start;                 // Cycle count when it was started
+	uint16_t last_op_page;                   // Page of the last load, program or erase
+
+	// Waiting for the chip, see set_flash_busy_wait()
+	uint32_t poll_interval_us;               // Time between status register reads, 0 to poll back to back
+	W25N01GV_Yield_Callback yield_callback;  // Optional, can be NULL
+	uint8_t last_wait_timed_out;             // 1 if the chip was still busy at the end of the last wait
+	uint32_t wait_timeouts;                  // Running count of waits that timed out
+
 } W25N01GV_Flash;
 
+/**
+ * Where the current value of a key is in the reserved block.
+ */
+typedef struct {
+	uint8_t present;          // 0 if the key has no value
+	uint8_t page;             // Page of the store's block, 0 to 63
+	uint16_t column;          // Column the record starts at
+	uint16_t size;            // Size of the value in bytes
+} W25N01GV_KV_Entry;
+
+/**
+ * Key/value store on the reserved block. See init_flash_kv_store().
+ */
+typedef struct {
+	W25N01GV_Flash *flash;
+	W25N01GV_KV_Entry index[W25N01GV_KV_MAX_KEYS];  // RAM index, built by init_flash_kv_store()
+	uint16_t block;                                 // Block the store is in, the reserved block or the one 2 before it
+	uint16_t generation;                            // Number of the last compaction, saved on flash
+	uint16_t next_free_sector;                      // Next sector of the block to append to, 256 when it's full
+	uint16_t live_bytes;                            // Bytes the current values take up on flash
+	uint16_t num_compactions;                       // Compactions since init_flash_kv_store()
+} W25N01GV_KV_Store;
+
+/**
+ * Background ECC check of the log, a few pages at a time. See start_flash_scrub().
+ * Per-block counters stop at 255.
+ */
+typedef struct {
+	W25N01GV_Flash *flash;
+	uint8_t active;
+	uint8_t relocate;                 // 1 to move blocks that needed corrections to a spare block
+	uint32_t next_page;               // Next page to check
+
+	uint32_t pages_checked;
+	uint32_t pages_corrected;         // Pages the chip had to correct
+	uint32_t pages_failed;            // Pages with uncorrectable errors, or no ECC status
+	uint16_t blocks_relocated;
+	uint16_t relocations_skipped;     // Blocks that needed it, but had no spare block or look up table entry
+
+	uint8_t block_corrections[1024];
+	uint8_t block_failures[1024];
+
+	// Block being moved to a spare block, see poll_flash_scrub()
+	uint16_t relocate_src;            // 1024 if none
+	uint16_t relocate_dst;            // 1024 until a spare block is erased
+	uint8_t relocate_pages_copied;
+} W25N01GV_Scrub;
+
 /**
  * Initializes the flash memory chip with SPI and pin information,
  * sets parameters to an initial state, enables the onboard
  * ECC and buffer read mode, and finds the address of the first
  * location in memory available to be written to.
  *
+ * The write pointer is saved to a checkpoint block every 512 pages, so this
+ * only has to search the pages written since the latest checkpoint. If there
+ * is no checkpoint, or it doesn't match what's on flash, it falls back to
+ * searching all of flash. If the data on flash has sector metadata, the search
+ * only reads a byte of each page's spare area instead of the whole page.
+ *
+ * It also builds a table of bad blocks in RAM, from the table saved in the
+ * checkpoint block, the retired block records and the BBM look up table (~3 ms).
+ * The first time, and whenever the saved table is missing, it reads the bad
+ * block marker of every block instead (~70 ms) and saves the table.
+ * Bad blocks are skipped when writing and reading.
+ * If programming or erasing a block fails, the block is retired: it's marked bad,
+ * and anything already written to it is moved to the next good block.
+ *
  * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
  * @param SPI_bus_in <SPI_HandleTypeDef*> Struct used for SPI communication
  * @param cs_base    <GPIO_TypeDef*>      GPIO pin array the chip select pin is on
@@ -175,6 +471,51 @@ typedef struct {
 void init_flash(W25N01GV_Flash *flash, SPI_HandleTypeDef *SPI_bus_in,
 		GPIO_TypeDef *cs_base_in, uint16_t cs_pin_in);
 
+/**
+ * Same as init_flash(), but every command goes through transport instead of
+ * a SPI bus and chip select pin, e.g. for a QUADSPI peripheral.
+ *
+ * With 4 data lines, pages are read with Fast Read Quad Output (6Bh) and
+ * loaded with Quad Load Program Data (32h/34h), so moving page data takes a
+ * quarter of the clocks. With 2 lines, reads use Fast Read Dual Output (3Bh),
+ * and loads stay on 1 line because the chip has no dual load command.
+ * Commands, addresses and status registers are always sent on 1 line.
+ *
+ * The quad commands use the WP and HLD pins as IO2 and IO3, which works as
+ * long as the WP-E bit in the protection register is 0 (the default).
+ * datasheet pg 15
+ *
+ * A transport can't keep chip select active between calls, so in async mode
+ * the sector is loaded with a blocking transfer (programming still runs in
+ * the background), and continuous reads are done one page at a time in
+ * buffer read mode.
+ *
+ * @param flash      <W25N01GV_Flash*>     Struct used to store flash pins and addresses
+ * @param transport  <W25N01GV_Transport>  Function that runs a transaction on the peripheral
+ * @param data_lines <uint8_t>             1, 2 or 4 lines for page data
+ */
+void init_flash_with_transport(W25N01GV_Flash *flash, W25N01GV_Transport transport, uint8_t data_lines);
+
+/**
+ * Sets how the library waits for the chip to finish page loads (up to 60 us),
+ * programs (up to 700 us) and erases (up to 10 ms). By default it reads the
+ * status register back to back until the chip is ready, which keeps the SPI
+ * bus busy the whole time. With a poll interval, it waits that long between
+ * reads, and yield_callback is called while it waits so other work (like
+ * starting ADC conversions) can run.
+ *
+ * Waits are timed with the DWT cycle counter, which init_flash() turns on. If
+ * the chip is still busy after the datasheet's maximum time, the wait gives up:
+ * flash->last_wait_timed_out is set, flash->wait_timeouts goes up, and the
+ * operation is reported as failed (a program or erase failure, or
+ * READ_ERROR_NO_ECC_STATUS for a read).
+ *
+ * @param flash            <W25N01GV_Flash*>          Struct used to store flash pins and addresses
+ * @param poll_interval_us <uint32_t>                 Time between status register reads, 0 for back to back
+ * @param yield_callback   <W25N01GV_Yield_Callback>  Called while waiting, can be NULL
+ */
+void set_flash_busy_wait(W25N01GV_Flash *flash, uint32_t poll_interval_us, W25N01GV_Yield_Callback yield_callback);
+
 /**
  * Check that the device's JEDEC ID matches the one listed in the datasheet.
  * Use this function to check if the flash and the SPI bus is functioning.
@@ -207,7 +548,9 @@ uint8_t reset_flash(W25N01GV_Flash *flash);
  *
  * This function will not erase the last 64 pages / last block, which is reserved
  * for pseudo-eeprom functionality, and those pages must be erased separately
- * by calling erase_reserved_pages().
+ * by calling erase_reserved_pages(). The key/value store's second block isn't
+ * erased either. It does erase the write pointer checkpoints.
+ * Bad blocks aren't erased, so they stay marked, and blocks that fail to erase are retired.
  *
  * WARNING: This function will erase all data, and causes a substantial delay
  * on the order of 2-10 seconds. Only use it if you're absolutely sure.
@@ -217,6 +560,101 @@ uint8_t reset_flash(W25N01GV_Flash *flash);
  */
 uint16_t erase_flash(W25N01GV_Flash *flash);
 
+/**
+ * Starts erase_flash() without waiting for it. The first block erase is
+ * sent, then each call to poll_flash_block_op() checks if the chip is done
+ * and sends the next one. erase_flash() is the same thing with a loop.
+ *
+ * The chip is busy the whole time, so no other flash functions can be called
+ * until poll_flash_block_op() returns 0. In the meantime the SPI bus is free,
+ * which is what lets fc_erase_flash() erase both dies of a W25M02GV at once.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+void start_flash_erase(W25N01GV_Flash *flash);
+
+/**
+ * Starts scan_bad_blocks() without waiting for it, in the same way as
+ * start_flash_erase(): each call to poll_flash_block_op() reads the page
+ * that finished loading and starts loading the next block's first page.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param bad_blocks <uint16_t*>          Array of size 1024 for the address of each bad block,
+ * 	which has to stay valid until the scan is done
+ */
+void start_flash_bad_block_scan(W25N01GV_Flash *flash, uint16_t *bad_blocks);
+
+/**
+ * Advances the operation started by start_flash_erase() or
+ * start_flash_bad_block_scan() without blocking. If the chip is done with
+ * the current block, the result is checked and the next block is started.
+ * A block that takes longer than the datasheet maximum counts as a wait timeout.
+ *
+ * When it's done, flash->block_op_result has the number of blocks that failed
+ * to erase, or the number of bad blocks found.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @retval 1 while the operation is still running, 0 when it's done
+ */
+uint8_t poll_flash_block_op(W25N01GV_Flash *flash);
+
+/**
+ * Starts a new log without erasing all of flash first. Only the checkpoint
+ * block and the first 2 good blocks are erased (~10 ms), the write pointer
+ * goes back to the start, and erase-ahead mode is turned on until the next
+ * erase_flash(). It stays on after a reset.
+ *
+ * In erase-ahead mode, old data after the write pointer is erased a block at
+ * a time: poll_async_flash_write() erases the next block whenever the
+ * pipeline is idle, keeping up to W25N01GV_ERASE_AHEAD_BLOCKS blocks (1 MB)
+ * erased ahead. Any block that still isn't erased when the write pointer
+ * gets to it is erased by the write function, which then takes 2-10 ms longer.
+ * Use get_erased_bytes_remaining() to check how much can be written without that.
+ *
+ * WARNING: The old data is lost, even though most of it is still on flash
+ * until it's erased. Reading stops at the write pointer.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @retval The number of memory blocks that failed to erase
+ */
+uint16_t quick_erase_flash(W25N01GV_Flash *flash);
+
+/**
+ * Erases all of flash like erase_flash(), then starts a circular log: when the
+ * write pointer reaches the end of the data area it wraps around to the first
+ * good block, and the oldest data is erased a block at a time ahead of it like
+ * in erase-ahead mode (see quick_erase_flash()). Flash never fills up, so
+ * write_to_flash() can be called forever and the last ~127 MB are always kept.
+ * The mode stays on after a reset, until the next erase_flash() or quick_erase_flash().
+ *
+ * After a reset, the write pointer is found from the erased gap in front of
+ * it, so init_flash() takes about as long as it does in the normal mode.
+ *
+ * To read the log oldest to newest, call reset_flash_read_pointer(), then read
+ * pages with read_next_2KB_from_flash() or a continuous read until
+ * end_of_flash_log() returns 1.
+ *
+ * WARNING: This function will erase all data, and causes a substantial delay
+ * on the order of 2-10 seconds.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @retval The number of memory blocks that failed to erase
+ */
+uint16_t start_circular_flash_log(W25N01GV_Flash *flash);
+
+/**
+ * Returns 1 once the read pointer has reached the write pointer, i.e. all of
+ * the data written so far has been read. This is the way to tell where a
+ * circular log ends, since the pages after it wrap around to the oldest data
+ * instead of reading as empty. It works the same in the normal mode.
+ *
+ * The last page read may be partly written; the rest of it is 0xFF.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @retval 1 if there's nothing left to read, 0 otherwise
+ */
+uint8_t end_of_flash_log(W25N01GV_Flash *flash);
+
 /**
  * Writes data from an array to the W25N01GV flash memory chip.
  * It automatically tracks the address of data it writes; no address
@@ -226,6 +664,10 @@ uint16_t erase_flash(W25N01GV_Flash *flash);
  * Note: It can only write data to memory locations that were previously
  * erased, so make sure to call erase_flash() once before you start writing.
  *
+ * If a page fails to program, its block is retired and the data is written
+ * to the next good block instead, so a write failure only loses data once
+ * flash runs out of good blocks.
+ *
  * Stores data in the struct's buffer and only transmits periodically,
  * to prevent the ECC from getting corrupted.
  *
@@ -236,20 +678,77 @@ uint16_t erase_flash(W25N01GV_Flash *flash);
  * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
  * @param data       <uint8_t*>           Array of data to write to flash
  * @param num_bytes  <uint32_t>           Number of bytes to write to flash
- * @retval The number of memory blocks that failed to write
+ * @retval The number of writes that failed and couldn't be moved to a good block
  */
 uint16_t write_to_flash(W25N01GV_Flash *flash, uint8_t *data, uint32_t num_bytes);
 
+/**
+ * Reserves space for a record in the write buffer, so it can be serialized
+ * directly into it instead of being built in a separate array and copied
+ * by write_to_flash(). Call commit_flash_write() when it's filled in.
+ *
+ * The space is always contiguous: a record that crosses into the next sector
+ * is stored past the end of the sector buffer, and only that part is moved
+ * when it's committed. The data ends up on flash exactly as if it had been
+ * passed to write_to_flash(), so the 512 byte framing is the same.
+ *
+ * Don't call any other write function between reserving and committing.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param num_bytes  <uint16_t>           Bytes to reserve, up to W25N01GV_MAX_RESERVE_SIZE
+ * @retval Pointer to the reserved space, or NULL if it's too large or doesn't fit on flash
+ */
+uint8_t *reserve_flash_write(W25N01GV_Flash *flash, uint16_t num_bytes);
+
+/**
+ * Adds the record filled in after reserve_flash_write() to the data being
+ * written, and writes the sector to flash if it's full, like write_to_flash().
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param num_bytes  <uint16_t>           Bytes actually used, up to the number reserved
+ * @retval The number of writes that failed and couldn't be moved to a good block
+ */
+uint16_t commit_flash_write(W25N01GV_Flash *flash, uint16_t num_bytes);
+
 /**
  * Writes whatever is contained in the write buffer to flash.
  * You MUST call this function at the end of your program, before the
  * W25N10GV_Flash struct goes out of scope, or else you will lose
  * up to the last 512 bytes of data.
  *
+ * A sector can only be programmed once, so the rest of a partly filled
+ * sector is padded with 0xFF (left erased) and the next write starts in the
+ * next sector. The sector metadata records how many bytes are valid.
+ *
  * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
  */
 uint16_t finish_flash_write(W25N01GV_Flash *flash);
 
+/**
+ * Writes a small, urgent record (an abort, a valve state change) to flash
+ * right away, in a sector of its own tagged W25N01GV_TAG_EVENT. The data
+ * in the write buffer isn't touched, so the bulk data keeps being written in
+ * full sectors, and the event doesn't wait behind up to 511 bytes of it.
+ *
+ * In normal mode, the event is on flash when this function returns. In async
+ * mode, it waits for the sector in flight (if any), then starts loading the
+ * event and returns, so it's programmed within about 2 sector write times
+ * (under 2 ms at 20 MHz SPI).
+ *
+ * Every call uses a whole 512 byte sector and a program, however small the
+ * event is: the chip works out a sector's ECC when it's programmed, so a
+ * programmed sector can't be appended to. The rest of the sector is left
+ * erased. Combine events that happen together into one call. Events can end up on
+ * flash before bulk data that was written just before them, since that's
+ * still in the write buffer. Read the events back with read_next_tagged_data_from_flash().
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param data       <uint8_t*>           Event to write
+ * @param num_bytes  <uint16_t>           Size of the event, up to W25N01GV_SECTOR_SIZE (anything over is cut off)
+ * @retval The number of writes that failed and couldn't be moved to a good block
+ */
+uint16_t write_flash_event(W25N01GV_Flash *flash, uint8_t *data, uint16_t num_bytes);
+
 /**
  * To be used before calling read_next_2KB_from_flash().
  *
@@ -257,6 +756,12 @@ uint16_t finish_flash_write(W25N01GV_Flash *flash);
  * for reading. Use this first, then call read_next_2KB_from_flash().
  * See README for sample code.
  *
+ * In circular mode (see start_circular_flash_log()), the first page is the
+ * oldest data that hasn't been erased yet, so any buffered writes are
+ * finished first. It's in the first block after the ones erased ahead of the
+ * write pointer, which init_flash() finds again after a reset, so finding it
+ * takes one page read.
+ *
  * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
  */
 void reset_flash_read_pointer(W25N01GV_Flash *flash);
@@ -267,29 +772,161 @@ void reset_flash_read_pointer(W25N01GV_Flash *flash);
  *
  * To read out the entire memory array, call reset_read_pointer(), then call
  * this function up to W25N01GV_NUM_PAGES times. See README for sample code.
+ * Bad blocks are skipped, so once the last good page has been read, the
+ * buffer is filled with 0xFF like an empty page. In circular mode it wraps
+ * around to the first good page instead; use end_of_flash_log() to stop.
  *
  * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
  * @param buffer     <uint8_t*>           Buffer to hold 2048 bytes of data
  */
 void read_next_2KB_from_flash(W25N01GV_Flash *flash, uint8_t *buffer);
 
+/**
+ * Like read_next_2KB_from_flash(), but only returns the data that is known to
+ * be good: the valid bytes of each sector whose CRC matches its metadata,
+ * back to back. Padding and unwritten sectors are left out, and sectors torn
+ * by a power loss (or with uncorrectable ECC errors) are skipped and counted
+ * in flash->invalid_sectors_skipped, so a decoder never sees them. That
+ * includes sectors with data but no metadata, which are torn too.
+ *
+ * Sectors written by older firmware without metadata are left out too, so
+ * use read_next_2KB_from_flash() to read those.
+ *
+ * Tests are split on the section end flag add_test_delimiter() puts in the
+ * metadata: the data returned stops after a test's last sector, even in the
+ * middle of a page, and flash->test_end_read is set. The next call goes on
+ * from the sector after it.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param buffer     <uint8_t*>           Buffer to hold up to 2048 bytes of data
+ * @retval The number of bytes put in buffer, 0 to 2048
+ */
+uint16_t read_next_valid_data_from_flash(W25N01GV_Flash *flash, uint8_t *buffer);
+
+/**
+ * Same as read_next_valid_data_from_flash(), but only returns the sectors
+ * with the given tag. Use W25N01GV_TAG_EVENT to read back what was written
+ * with write_flash_event(), and W25N01GV_TAG_DATA to read the bulk data without the events.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param buffer     <uint8_t*>           Buffer to hold up to 2048 bytes of data
+ * @param tag        <uint8_t>            Tag of the sectors to keep, 0 to 14
+ * @retval The number of bytes put in buffer, 0 to 2048
+ */
+uint16_t read_next_tagged_data_from_flash(W25N01GV_Flash *flash, uint8_t *buffer, uint8_t tag);
+
+/**
+ * Starts streaming flash out in continuous read mode (BUF=0), beginning at
+ * flash->next_page_to_read. Pages are sent back to back without a separate
+ * page data read for each one, so a full dump is limited only by the SPI clock.
+ *
+ * Chip select stays active until end_continuous_flash_read(), so the SPI bus
+ * can't be used for anything else in between. Don't call any other flash
+ * functions until the stream is ended.
+ *
+ * datasheet pg 18, 40
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+void begin_continuous_flash_read(W25N01GV_Flash *flash);
+
+/**
+ * Reads the next num_bytes of the stream into buffer. Chunks can be any size
+ * and don't have to line up with pages. The stream stops at the end of the
+ * writable area (W25N01GV_NUM_PAGES), and flash->next_page_to_read is kept
+ * up to date so the read pointer can be checked between chunks. Bad blocks
+ * are skipped by starting a new stream after them.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param buffer     <uint8_t*>           Buffer to hold num_bytes of data
+ * @param num_bytes  <uint32_t>           Number of bytes to read
+ * @retval The number of bytes read, which is less than num_bytes at the end of flash
+ */
+uint32_t read_continuous_flash_chunk(W25N01GV_Flash *flash, uint8_t *buffer, uint32_t num_bytes);
+
+/**
+ * Starts reading the next chunk of the stream into buffer over DMA and
+ * returns right away, so the CPU or another peripheral (e.g. a UART sending
+ * the previous chunk) can work while the SPI bus is busy. A chunk stops at
+ * the end of the page, so the number of bytes started can be less than
+ * num_bytes. Poll continuous_flash_chunk_read_busy() until it returns 0
+ * before using the data. Any other stream function waits for it first.
+ *
+ * With a transport (see init_flash_with_transport()), the chunk is read
+ * before this function returns.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param buffer     <uint8_t*>           Buffer to hold num_bytes of data, must stay valid until the read is done
+ * @param num_bytes  <uint32_t>           Maximum number of bytes to read
+ * @retval The number of bytes being read, 0 at the end of flash
+ */
+uint32_t start_continuous_flash_chunk_read(W25N01GV_Flash *flash, uint8_t *buffer, uint32_t num_bytes);
+
+/**
+ * Checks on a chunk started by start_continuous_flash_chunk_read().
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @retval 1 if the DMA transfer is still running, 0 once the data is in the buffer
+ */
+uint8_t continuous_flash_chunk_read_busy(W25N01GV_Flash *flash);
+
+/**
+ * Ends the stream and returns flash to buffer read mode.
+ *
+ * The chip checks ECC on every page it streams, and this function reports the
+ * combined result for the whole stream: SUCCESS_WITH_CORRECTIONS if any page
+ * needed corrections, ERROR_ONE_PAGE or ERROR_MULTIPLE_PAGES if any pages
+ * were uncorrectable. In the error case, the address of the last bad page is
+ * stored in flash->last_ECC_failure_page. The result is also stored in
+ * flash->last_read_ECC_status.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @retval ECC status for all pages read since begin_continuous_flash_read()
+ */
+W25N01GV_ECC_Status end_continuous_flash_read(W25N01GV_Flash *flash);
+
 /**
  * Returns the number of bytes remaining in the flash memory array that are
  * available to write to.
  *
  * Uses the address counters in the flash struct to calcluate how much space
  * is currently taken up, then subtracts that from the total available space.
+ * Bad blocks after the write pointer aren't counted. In circular mode flash
+ * never fills up, and this is the capacity minus the data still being buffered.
  *
  * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
  * @retval Number of free bytes remaining in the flash chip to write to
  */
 uint32_t get_bytes_remaining(W25N01GV_Flash *flash);
 
+/**
+ * Returns the number of bytes that can be written to the data area when it's
+ * empty, which is less than W25N01GV_NUM_PAGES * W25N01GV_BYTES_PER_PAGE if
+ * the chip has bad blocks. get_bytes_remaining() is equal to this after erase_flash().
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @retval Number of bytes in all of the good blocks in the data area
+ */
+uint32_t get_flash_capacity(W25N01GV_Flash *flash);
+
+/**
+ * Returns the number of bytes that can be written without waiting for a block
+ * to be erased, i.e. the erased space ahead of the write pointer. In erase-ahead
+ * mode (see quick_erase_flash()), this is how ready flash is to log; otherwise
+ * all of the remaining space is erased and it's the same as get_bytes_remaining().
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @retval Number of erased bytes remaining after the write pointer
+ */
+uint32_t get_erased_bytes_remaining(W25N01GV_Flash *flash);
+
 /**
  * Allows the user to manually write data to specific pages in the last memory block.
  * User specifies the page to write with a number from 0 to 63 inclusive.
  * Note: remember to call erase_reserved_flash_pages() before updating the values.
  * Note: calling erase_reserved_flash_pages() will erase all 64 reserved pages.
+ * Note: once init_flash_kv_store() has been called, the block belongs to the
+ * key/value store, and this returns 1 without writing anything.
  *
  * @param flash       <W25N01GV_Flash*>     Struct used to store flash pins and addresses
  * @param page_num    <uint8_t>             Address of page in block to write to (0-63 inclusive)
@@ -312,17 +949,106 @@ void read_reserved_flash_page(W25N01GV_Flash *flash, uint8_t page_num, uint8_t*
 /**
  * Erases all 64 of the reserved pages.
  *
+ * Once init_flash_kv_store() has been called, the block belongs to the
+ * key/value store, and this returns 1 without erasing anything.
+ *
  * @param flash       <W25N01GV_Flash*>     Struct used to store flash pins and addresses
  * @retval 1 if it fails to erase, 0 otherwise
  */
 uint8_t erase_reserved_flash_pages(W25N01GV_Flash *flash);
 
+/**
+ * Sets up a key/value store on the reserved block, and builds its RAM index by
+ * reading the records already on it (reads every written sector once).
+ *
+ * The store is append-only: updating a key programs a new record into the
+ * next erased 512 byte sector of the block, without erasing anything, and the
+ * index points to the newest one. Only when all 251 sectors after the first
+ * page are used is the store compacted into a second block (the one 2 before
+ * the reserved block): the current values are read into RAM and written
+ * packed into its first page, and the old block is erased after that. The
+ * store moves back and forth between the two blocks, and init_flash_kv_store()
+ * finds the newest one, so a power loss during a compaction (~10 ms) keeps
+ * either the old or the new values.
+ *
+ * The store takes over the reserved block: from here until the next
+ * init_flash(), write_reserved_flash_page() and erase_reserved_flash_pages()
+ * fail without touching it. read_reserved_flash_page() still works.
+ *
+ * @param store      <W25N01GV_KV_Store*> Struct to keep the store's index in
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+void init_flash_kv_store(W25N01GV_KV_Store *store, W25N01GV_Flash *flash);
+
+/**
+ * Sets the value of a key by appending a record to the store. Compacts the
+ * store first if the block is full.
+ *
+ * Every update uses a whole 512 byte sector of the block, however small the
+ * value is, since a sector can only be programmed once. 251 updates fit
+ * between compactions.
+ *
+ * @param store      <W25N01GV_KV_Store*> Store from init_flash_kv_store()
+ * @param key        <uint8_t>            Key, 0 to W25N01GV_KV_MAX_KEYS-1
+ * @param value      <uint8_t*>           Value to save
+ * @param size       <uint16_t>           Size of the value, 1 to W25N01GV_KV_MAX_VALUE_SIZE
+ * @retval KV_OK, or the reason the value wasn't saved
+ */
+W25N01GV_KV_Status write_flash_kv(W25N01GV_KV_Store *store, uint8_t key, uint8_t *value, uint16_t size);
+
+/**
+ * Reads the current value of a key. The index gives its location, so this
+ * is a single read from flash.
+ *
+ * @param store      <W25N01GV_KV_Store*> Store from init_flash_kv_store()
+ * @param key        <uint8_t>            Key, 0 to W25N01GV_KV_MAX_KEYS-1
+ * @param buffer     <uint8_t*>           Array to read the value into
+ * @param buffer_sz  <uint16_t>           Size of buffer, at least get_flash_kv_size()
+ * @retval KV_OK, KV_NOT_FOUND, KV_INVALID or KV_CORRUPTED
+ */
+W25N01GV_KV_Status read_flash_kv(W25N01GV_KV_Store *store, uint8_t key, uint8_t *buffer, uint16_t buffer_sz);
+
+/**
+ * Returns the size of the current value of a key, from the RAM index.
+ *
+ * @param store      <W25N01GV_KV_Store*> Store from init_flash_kv_store()
+ * @param key        <uint8_t>            Key, 0 to W25N01GV_KV_MAX_KEYS-1
+ * @retval Size of the value in bytes, 0 if the key has no value
+ */
+uint16_t get_flash_kv_size(W25N01GV_KV_Store *store, uint8_t key);
+
+/**
+ * Removes the value of a key by appending a record with no value.
+ *
+ * @param store      <W25N01GV_KV_Store*> Store from init_flash_kv_store()
+ * @param key        <uint8_t>            Key, 0 to W25N01GV_KV_MAX_KEYS-1
+ * @retval KV_OK, or the reason the value wasn't removed
+ */
+W25N01GV_KV_Status delete_flash_kv(W25N01GV_KV_Store *store, uint8_t key);
+
+/**
+ * Compacts the store now instead of waiting for the block to fill up: reads
+ * the current values into RAM, erases the store's other block, writes them
+ * there and reads them back, commits to the new block with a record after
+ * the first page, and only then erases the old block. write_flash_kv() does
+ * this automatically. Values that fail their CRC are dropped.
+ *
+ * If the other block is bad, the store's own block is erased and rewritten,
+ * and the values are lost if power is lost in between.
+ *
+ * @param store      <W25N01GV_KV_Store*> Store from init_flash_kv_store()
+ * @retval KV_OK, or KV_WRITE_FAILED if the new copy couldn't be written, in
+ *         which case the store stays in the old block
+ */
+W25N01GV_KV_Status compact_flash_kv_store(W25N01GV_KV_Store *store);
+
 /**
  * Scan flash for bad memory blocks before writing to it for the first time.
  *
- * Reads the first byte of each block and checks for a bad block marking.
- * Out of the factory, all bytes are set to 0xFF except for the first byte
- * of each bad block. This function looks for those bytes, records the address
+ * Reads the bad block marker of each block, the first byte of the spare area
+ * of its first page. Out of the factory, all bytes are set to 0xFF except for
+ * the markers of bad blocks, and blocks retired later get one too, so data in
+ * the main array doesn't matter. This function looks for those bytes, records the address
  * of any bad blocks found into the bad_blocks array, and returns the number of
  * bad blocks it found.
  *
@@ -336,14 +1062,297 @@ uint8_t erase_reserved_flash_pages(W25N01GV_Flash *flash);
 uint16_t scan_bad_blocks(W25N01GV_Flash *flash, uint16_t *bad_blocks);
 
 /**
- * Adds at least an entire page of 0s (2048B) so that a flash parser can
- * differentiate between sections.
+ * Switches write_to_flash() to a non-blocking, double-buffered mode.
+ *
+ * While one 512 byte sector buffer is filled by write_to_flash(), the other
+ * is clocked into the chip over SPI DMA and programmed. write_to_flash() only
+ * blocks if it fills a sector before the previous one has finished, which
+ * takes up to 700 microseconds. Interrupts stay enabled during the transfer.
+ *
+ * Progress is made by calling poll_async_flash_write() from the main loop,
+ * and optionally async_flash_write_dma_complete() from the SPI transmit
+ * complete interrupt. Completion of each sector is reported through the
+ * callback, and failures are counted in flash->async_write_failures.
+ *
+ * Flash stays unlocked while async mode is on. Call wait_for_async_flash_write()
+ * before using the SPI bus for anything else, and disable_async_flash_write()
+ * (after finish_flash_write()) when you're done logging.
+ *
+ * The SPI peripheral must have a TX DMA stream configured. If starting the DMA
+ * transfer fails, the sector is sent with a blocking transfer instead.
+ *
+ * @param flash      <W25N01GV_Flash*>          Struct used to store flash pins and addresses
+ * @param callback   <W25N01GV_Write_Callback>  Called after each sector is programmed, can be NULL
+ */
+void enable_async_flash_write(W25N01GV_Flash *flash, W25N01GV_Write_Callback callback);
+
+/**
+ * Waits for the sector in flight, locks flash and returns write_to_flash()
+ * to its normal blocking behavior.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @retval The number of sectors that failed to write while async mode was on
+ */
+uint16_t disable_async_flash_write(W25N01GV_Flash *flash);
+
+/**
+ * Advances the asynchronous write pipeline without blocking. Call this
+ * regularly from the main loop while async mode is on, and in erase-ahead
+ * mode (see quick_erase_flash()) whenever there's idle time.
+ *
+ * When the DMA transfer has finished, it issues the program execute command.
+ * When programming has finished, it checks for a write failure and calls
+ * the completion callback. When the pipeline is idle in erase-ahead mode,
+ * it starts erasing the next block ahead of the write pointer.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @retval The state of the pipeline after polling
+ */
+W25N01GV_Async_State poll_async_flash_write(W25N01GV_Flash *flash);
+
+/**
+ * Optional. Call this from HAL_SPI_TxCpltCallback() for the flash's SPI bus
+ * so programming starts as soon as the DMA transfer ends, instead of
+ * at the next poll_async_flash_write().
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+void async_flash_write_dma_complete(W25N01GV_Flash *flash);
+
+/**
+ * Blocks until the sector in flight (if any) has been programmed, or the
+ * block being erased ahead of the write pointer (if any) has been erased.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+void wait_for_async_flash_write(W25N01GV_Flash *flash);
+
+/**
+ * Loads data at the write pointer and issues program execute, but returns
+ * without waiting the 250-700 microseconds it takes to program. Writes at most
+ * up to the end of the current page, and bypasses the write buffer.
+ *
+ * This is the building block for the W25M02GV striped layout, which programs
+ * one die while loading the other. num_bytes should be a multiple of
+ * W25N01GV_SECTOR_SIZE (except for the last write) to keep the 512 byte framing.
+ *
+ * The page is tracked like an asynchronous write, so poll_async_flash_write()
+ * and wait_for_async_flash_write() report when it's done, and failures are
+ * counted in flash->async_write_failures. If a previous page is still being
+ * programmed, this function waits for it first.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param data       <uint8_t*>           Data to write, can be reused as soon as this returns
+ * @param num_bytes  <uint16_t>           Number of bytes to write, up to the end of the current page
+ * @retval The number of bytes written, 0 if flash is full
+ */
+uint16_t start_flash_page_write(W25N01GV_Flash *flash, uint8_t *data, uint16_t num_bytes);
+
+/**
+ * Sets the tag stored in the metadata of every sector written from now on,
+ * so a parser can tell what kind of records a sector holds without reading it.
+ * The tag is applied to whole sectors when they're written to flash, so call
+ * finish_flash_write() first if a sector shouldn't mix records with different tags.
+ * init_flash() sets it to W25N01GV_TAG_DATA.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param tag        <uint8_t>            Tag from 0 to 14. W25N01GV_TAG_DELIMITER is used by add_test_delimiter().
+ */
+void set_flash_record_tag(W25N01GV_Flash *flash, uint8_t tag);
+
+/**
+ * Reads the metadata of all 4 sectors in a page from its spare area. This only
+ * transfers 64 bytes instead of the 2048 byte page, so it's a much faster way
+ * to scan through flash, e.g. to find the test delimiters or the valid bytes
+ * in each sector.
+ *
+ * @param flash      <W25N01GV_Flash*>            Struct used to store flash pins and addresses
+ * @param page_adr   <uint16_t>                   Page to read, 0 to W25N01GV_NUM_PAGES-1
+ * @param metadata   <W25N01GV_Sector_Metadata*>  Array of 4 structs, one for each sector in the page
+ * @retval The number of sectors in the page that have metadata
+ */
+uint8_t read_flash_page_metadata(W25N01GV_Flash *flash, uint16_t page_adr, W25N01GV_Sector_Metadata *metadata);
+
+/**
+ * Checks a sector read from flash against the CRC in its metadata.
+ *
+ * @param metadata   <W25N01GV_Sector_Metadata*>  Metadata of the sector from read_flash_page_metadata()
+ * @param data       <uint8_t*>                   The sector's 512 bytes
+ * @retval 1 if the CRC matches, 0 if it doesn't or the sector has no metadata
+ */
+uint8_t check_flash_sector_crc(W25N01GV_Sector_Metadata *metadata, uint8_t *data);
+
+/**
+ * Updates a CRC-16/CCITT (polynomial 0x1021, no reflection) with num_bytes of
+ * data. This is the CRC used for sector metadata and key/value records, for
+ * checking data sent on from flash the same way.
+ *
+ * @param crc        <uint16_t>           CRC so far, start with 0xFFFF
+ * @param data       <uint8_t*>           Data to add to the CRC
+ * @param num_bytes  <uint16_t>           Number of bytes in data
+ * @retval The updated CRC
+ */
+uint16_t update_flash_crc16(uint16_t crc, const uint8_t *data, uint16_t num_bytes);
+
+/**
+ * Sets the clock used to timestamp pages. Every page written to the data area
+ * is stamped with the time its first sector was written, in the spare bytes
+ * of sectors 1-3, so seek_flash_to_time() can find a point in the log without
+ * reading it all. The default is HAL_GetTick(), i.e. ms since boot; use a
+ * callback to stamp pages with the same clock as the records in them.
+ *
+ * @param flash       <W25N01GV_Flash*>         Struct used to store flash pins and addresses
+ * @param time_source <W25N01GV_Time_Callback>  Returns the current time, NULL for HAL_GetTick()
+ */
+void set_flash_time_source(W25N01GV_Flash *flash, W25N01GV_Time_Callback time_source);
+
+/**
+ * Reads the timestamp of a page from its spare area (64 bytes).
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param page_adr   <uint16_t>           Page to read, 0 to W25N01GV_NUM_PAGES-1
+ * @param time       <uint32_t*>          Set to the page's timestamp
+ * @retval 1 if the page has a timestamp, 0 if it's erased, only partly written or corrupted
+ */
+uint8_t read_flash_page_time(W25N01GV_Flash *flash, uint16_t page_adr, uint32_t *time);
+
+/**
+ * Moves the read pointer to the page holding the data that was written at
+ * the given time, so read_next_2KB_from_flash() or a continuous read starts
+ * there instead of at the beginning of the log. It's set to the last page
+ * stamped at or before time, so the first page read starts a little before it.
+ *
+ * The pages are binary searched by their timestamps, first by block and then
+ * within the block, which takes about 16 spare area reads for a full chip.
+ * Times are compared relative to the oldest page, so they can wrap around
+ * once (HAL_GetTick() does after 49 days). Works in circular mode too.
+ *
+ * Pages with fewer than 4 sectors written don't have a timestamp, like the
+ * last page before finish_flash_write() and the page being written at a
+ * reset. The search skips them and only lands on stamped pages.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param time       <uint32_t>           Time to seek to, from the same clock as the timestamps
+ * @retval 1 if the read pointer was moved, 0 if time is before the log (or the
+ *         log has no timestamps) and it was left at the start of the log
+ */
+uint8_t seek_flash_to_time(W25N01GV_Flash *flash, uint32_t time);
+
+/**
+ * Marks the end of a test, so that a flash parser can differentiate between
+ * sections. Writes the data left in the write buffer like finish_flash_write(),
+ * with the section end flag set in the sector's metadata, so the boundary
+ * costs nothing more than the padding finish_flash_write() would add anyway.
+ * If the buffer is empty, the flag goes on an empty sector tagged
+ * W25N01GV_TAG_DELIMITER instead (512 bytes).
+ *
+ * The data read back doesn't contain a marker. read_next_valid_data_from_flash()
+ * stops at the end of each test, and parsers can also find the boundaries
+ * with read_flash_page_metadata(). Older firmware wrote a 2048 byte page of
+ * 0s instead.
  *
- * Use case: call this function after you stop logging a test.
+ * Use case: call this function instead of finish_flash_write() after you stop
+ * logging a test.
  *
  * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
  */
 void add_test_delimiter(W25N01GV_Flash *flash);
 
+/**
+ * Writes an empty sector tagged W25N01GV_TAG_PADDING, after writing the data
+ * left in the write buffer like finish_flash_write(). The sector has no valid
+ * bytes, so read_next_valid_data_from_flash() and the flash decoder skip it.
+ * Used to fill sector slots that have to be taken up without adding data,
+ * e.g. to line up the chips of a W25N01GV_Array.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @retval The number of writes that failed and couldn't be moved to a good block
+ */
+uint16_t write_flash_padding(W25N01GV_Flash *flash);
+
+/**
+ * Starts keeping statistics in stats, which is cleared first: the latency of
+ * page loads, programs and erases, how many status register polls waiting
+ * takes, and ECC corrections and failures, overall and for each block.
+ *
+ * Latencies are measured with the DWT cycle counter, which this enables.
+ * stats has to stay in scope until disable_flash_stats() is called.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param stats      <W25N01GV_Stats*>    Struct to keep the statistics in
+ */
+void enable_flash_stats(W25N01GV_Flash *flash, W25N01GV_Stats *stats);
+
+/**
+ * Stops keeping statistics. The stats struct keeps its values.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+void disable_flash_stats(W25N01GV_Flash *flash);
+
+/**
+ * Packs a summary of the statistics into W25N01GV_STATS_PACKED_SIZE bytes for
+ * telemetry, all big-endian:
+ * - average and max page load, program and erase times, 2+2 bytes each, in us
+ * - busy polls, 4 bytes
+ * - ECC corrections, ECC failures, program failures and erase failures, 2 bytes each
+ * - the block with the most failures (or corrections, if none failed), 2 bytes
+ * - that block's failure count, 1 byte
+ *
+ * Counts over 65535 are reported as 65535.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param buffer     <uint8_t*>           Buffer with room for W25N01GV_STATS_PACKED_SIZE bytes
+ * @retval The number of bytes packed, 0 if statistics aren't enabled
+ */
+uint16_t pack_flash_stats(W25N01GV_Flash *flash, uint8_t *buffer);
+
+/**
+ * Starts checking the ECC of every page written to the log, from the oldest
+ * page up to the write pointer, without blocking. The chip's ECC status is
+ * otherwise only seen when flash is read back after a test. The counters in
+ * scrub are cleared first. Nothing is read until poll_flash_scrub() is called.
+ *
+ * With relocate set, a fully written block that needed corrections is copied
+ * to a spare block, which then takes its place through the BBM look up table,
+ * before its errors get past what ECC can correct. Pages are copied inside
+ * the chip, so an uncorrectable page is copied as it was read and its sector
+ * CRCs still show it. Spare blocks come from the erased blocks ahead of the
+ * write pointer (the end of flash in a linear log), and the look up table has
+ * room for 20 blocks over the life of the chip.
+ *
+ * scrub is about 2 KB, so keep it static.
+ *
+ * @param scrub      <W25N01GV_Scrub*>    Struct used to store the scrub state and results
+ * @param flash      <W25N01GV_Flash*>    Flash to check
+ * @param relocate   <uint8_t>            1 to relocate blocks that needed corrections, 0 to only count them
+ */
+void start_flash_scrub(W25N01GV_Scrub *scrub, W25N01GV_Flash *flash, uint8_t relocate);
+
+/**
+ * Checks up to max_pages pages, so it fits in the main loop's idle time: each
+ * page is a ~60 us page load. Returns right away while an asynchronous write,
+ * erase or continuous read is using the chip, so in async mode call
+ * poll_async_flash_write() too. A relocation goes on in the same budget, one
+ * page copy (up to ~1 ms) at a time, but erasing the spare block blocks for
+ * up to 10 ms in one call.
+ *
+ * Results are in scrub->pages_corrected, scrub->pages_failed and the per-block
+ * counters. The reads also count towards the statistics, if they're enabled.
+ *
+ * @param scrub      <W25N01GV_Scrub*>    Struct used to store the scrub state and results
+ * @param max_pages  <uint16_t>           Most pages to load or copy in this call
+ * @retval 1 while the scrub is running, 0 once it has reached the write pointer
+ */
+uint8_t poll_flash_scrub(W25N01GV_Scrub *scrub, uint16_t max_pages);
+
+/**
+ * Stops the scrub. A relocation in progress is dropped and its spare block is
+ * erased again. Call this before erasing flash while a scrub is running.
+ *
+ * @param scrub      <W25N01GV_Scrub*>    Struct used to store the scrub state and results
+ */
+void stop_flash_scrub(W25N01GV_Scrub *scrub);
+
 #endif	// end SPI include protection
 #endif	// end header include protection
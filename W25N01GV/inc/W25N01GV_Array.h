@@ -0,0 +1,178 @@
+/**
+ * Header file for striping data across several W25N01GV Flash Memory chips
+ * Datasheet: https://www.winbond.com/resource-files/w25n01gv%20revl%20050918%20unsecured.pdf
+ *
+ * NOTE: This is a wrapper around the W25N01GV functions, like the W25M02GV
+ * library, except each chip has its own SPI bus and chip select, so transfers
+ * to different chips can run at the same time.
+ *
+ * Consecutive 512 byte sectors go to the chips in turn (RAID-0). Striping
+ * is by sector rather than by page because the asynchronous write pipeline
+ * works a sector at a time, so a chip gets its next sector as soon as its
+ * last one is programmed, and no more than a sector per chip waits in RAM.
+ *
+ * Every chip always runs the W25N01GV asynchronous write pipeline, so while
+ * one chip's sector is clocked in over DMA and programmed, the next sectors
+ * are already going out on the other buses. There's no blocking mode: the
+ * chips would be programmed one after another, and striping would gain
+ * nothing. Don't call disable_async_flash_write() on the chips. Write
+ * throughput scales with the number of chips.
+ *
+ * Nathaniel Kalantar (nkalan@umich.edu)
+ * Michigan Aeronautical Science Association
+ */
+
+#ifndef W25N01GV_ARRAY_H	// Begin header include protection
+#define W25N01GV_ARRAY_H
+
+#include "stm32f4xx_hal.h"
+
+#ifdef HAL_SPI_MODULE_ENABLED	// Begin SPI include protection
+
+#include "W25N01GV.h"
+
+#define W25N01GV_ARRAY_MAX_CHIPS (uint8_t) 4
+
+typedef struct {
+	W25N01GV_Flash chips[W25N01GV_ARRAY_MAX_CHIPS];
+	uint8_t num_chips;
+
+	uint8_t current_write_chip;   // Chip that the next sector is written to
+	uint8_t current_read_chip;    // Chip that has the next sector to read
+	uint8_t read_active;          // Chips are streaming in continuous read mode
+} W25N01GV_Array;
+
+/**
+ * Initializes every chip in the array with init_flash() and turns on
+ * async mode for each of them (see enable_async_flash_write()).
+ *
+ * The chips must be passed in the same order every time, because the order
+ * decides where each sector is. The chip that gets the next sector is found
+ * from the number of sectors already written on all chips, so writing picks
+ * up where it left off after a reset. If a power loss left one chip ahead of
+ * the others (a lost sector, or a torn page it skips), the others are padded
+ * with empty sectors (see write_flash_padding()) to line the chips back up,
+ * so data written after the reset reads back in order.
+ *
+ * Every chip needs its own SPI bus with a TX DMA stream. Chips on one bus would
+ * have their transfers serialized, and reading holds each chip select active.
+ *
+ * @param array      <W25N01GV_Array*>     Struct used to store the chips
+ * @param num_chips  <uint8_t>             Number of chips, 1 to W25N01GV_ARRAY_MAX_CHIPS
+ * @param SPI_buses  <SPI_HandleTypeDef**> SPI bus of each chip
+ * @param cs_bases   <GPIO_TypeDef**>      GPIO pin array each chip select pin is on
+ * @param cs_pins    <uint16_t*>           GPIO pin connected to each chip select
+ */
+void array_init_flash(W25N01GV_Array *array, uint8_t num_chips, SPI_HandleTypeDef **SPI_buses,
+		GPIO_TypeDef **cs_bases, uint16_t *cs_pins);
+
+/**
+ * Checks the JEDEC ID of every chip, see ping_flash().
+ *
+ * @param array      <W25N01GV_Array*>     Struct used to store the chips
+ * @retval 1 if every chip read its ID back correctly, 0 if any didn't
+ */
+uint8_t array_ping_flash(W25N01GV_Array *array);
+
+/**
+ * Erases every chip like erase_flash() and starts writing at the first chip.
+ * The chips erase at the same time (see start_flash_erase()).
+ *
+ * WARNING: This function will erase all data, and causes a substantial delay
+ * on the order of 2-10 seconds. Only use it if you're absolutely sure.
+ *
+ * @param array      <W25N01GV_Array*>     Struct used to store the chips
+ * @retval The number of memory blocks that failed to erase
+ */
+uint16_t array_erase_flash(W25N01GV_Array *array);
+
+/**
+ * Writes data across the array, 512 bytes to each chip in turn. Like
+ * write_to_flash() in async mode, it only blocks if a chip is still busy
+ * with its previous sector when its turn comes around again. If the array
+ * runs out of space, anything over capacity is cut off.
+ *
+ * Call array_poll_flash_write() regularly to move the chips' pipelines along.
+ *
+ * @param array      <W25N01GV_Array*>     Struct used to store the chips
+ * @param data       <uint8_t*>            Array of data to write to flash
+ * @param num_bytes  <uint32_t>            Number of bytes to write to flash
+ * @retval The number of sectors that failed to write while this function was running
+ */
+uint16_t array_write_to_flash(W25N01GV_Array *array, uint8_t *data, uint32_t num_bytes);
+
+/**
+ * Advances the asynchronous write pipeline of every chip without blocking,
+ * see poll_async_flash_write().
+ *
+ * @param array      <W25N01GV_Array*>     Struct used to store the chips
+ */
+void array_poll_flash_write(W25N01GV_Array *array);
+
+/**
+ * Optional. Call this from HAL_SPI_TxCpltCallback() so the chip on that bus
+ * starts programming as soon as its DMA transfer ends.
+ *
+ * @param array      <W25N01GV_Array*>     Struct used to store the chips
+ * @param hspi       <SPI_HandleTypeDef*>  SPI bus whose transfer finished
+ */
+void array_flash_dma_complete(W25N01GV_Array *array, SPI_HandleTypeDef *hspi);
+
+/**
+ * Writes the partly filled sector to flash and waits for every chip to
+ * finish programming. You MUST call this function at the end of your program,
+ * or else you will lose up to the last 512 bytes of data.
+ *
+ * @param array      <W25N01GV_Array*>     Struct used to store the chips
+ * @retval The number of sectors that failed to write
+ */
+uint16_t array_finish_flash_write(W25N01GV_Array *array);
+
+/**
+ * To be used before calling array_read_next_2KB_from_flash().
+ *
+ * Sets the read pointer of every chip to its first page, and ends any read
+ * in progress. Writing in the middle of a read also ends it, so call this
+ * again before reading after a write.
+ *
+ * @param array      <W25N01GV_Array*>     Struct used to store the chips
+ */
+void array_reset_flash_read_pointer(W25N01GV_Array *array);
+
+/**
+ * Reads the next 2KB of data into the supplied buffer, in the order it was
+ * written, taking each 512 byte sector from the chip it was striped to.
+ * The chips are streamed in continuous read mode (see begin_continuous_flash_read()),
+ * so each one keeps its chip select active until the read ends.
+ * Past the end of a chip's data, its sectors read back as 0xFF.
+ *
+ * To read out the entire array, call array_reset_flash_read_pointer(), then
+ * call this function array_flash_current_page() + 1 times.
+ *
+ * @param array      <W25N01GV_Array*>     Struct used to store the chips
+ * @param buffer     <uint8_t*>            Buffer to hold 2048 bytes of data
+ */
+void array_read_next_2KB_from_flash(W25N01GV_Array *array, uint8_t *buffer);
+
+/**
+ * Returns the index of the current 2KB page of data, counting the sectors
+ * written to every chip. Use it as the upper limit (inclusive) for loop
+ * counters when reading from the array.
+ *
+ * @param array      <W25N01GV_Array*>     Struct used to store the chips
+ * @retval Index of the page that the next sector is written to
+ */
+uint32_t array_flash_current_page(W25N01GV_Array *array);
+
+/**
+ * Returns the number of bytes that can still be written to the array.
+ * Sectors go to the chips in turn, so writing stops when the first chip
+ * fills up, and chips with more bad blocks limit the whole array.
+ *
+ * @param array      <W25N01GV_Array*>     Struct used to store the chips
+ * @retval Number of free bytes remaining in the array to write to
+ */
+uint32_t array_get_bytes_remaining(W25N01GV_Array *array);
+
+#endif	// end SPI include protection
+#endif	// end header include protection
@@ -0,0 +1,117 @@
+/**
+ * Header file for downloading a W25N01GV flash log over UART
+ * Datasheet: https://www.winbond.com/resource-files/w25n01gv%20revl%20050918%20unsecured.pdf
+ *
+ * NOTE: This is built on the W25N01GV continuous read functions. Two page
+ * buffers are used, so while one page is sent over UART DMA, the next one is
+ * read over SPI DMA, and a download runs at the UART's speed instead of the
+ * UART's and the flash's added together.
+ *
+ * Each page is sent as a frame:
+ *   2 bytes   W25N01GV_DOWNLOAD_MAGIC
+ *   4 bytes   Page address, most significant byte first
+ *   2 bytes   Frame number, counting from 0 at start_flash_download()
+ *   2048 bytes of page data
+ *   2 bytes   CRC-16 of everything before it (see update_flash_crc16())
+ *
+ * Nathaniel Kalantar (nkalan@umich.edu)
+ * Michigan Aeronautical Science Association
+ */
+
+#ifndef W25N01GV_DOWNLOAD_H	// Begin header include protection
+#define W25N01GV_DOWNLOAD_H
+
+#include "stm32f4xx_hal.h"
+
+#if defined(HAL_SPI_MODULE_ENABLED) && defined(HAL_UART_MODULE_ENABLED)	// Begin SPI/UART include protection
+
+#include "W25N01GV.h"
+
+#define W25N01GV_DOWNLOAD_MAGIC           (uint16_t) 0x574E  // "WN"
+#define W25N01GV_DOWNLOAD_HEADER_SIZE     (uint8_t) 8
+#define W25N01GV_DOWNLOAD_FRAME_SIZE      (uint16_t) (W25N01GV_DOWNLOAD_HEADER_SIZE + W25N01GV_BYTES_PER_PAGE + 2)
+
+typedef enum W25N01GV_Download_Frame_State {
+	DOWNLOAD_FRAME_EMPTY,
+	DOWNLOAD_FRAME_READING,   // Page is coming in over SPI DMA
+	DOWNLOAD_FRAME_READY,     // Page is ready to send
+	DOWNLOAD_FRAME_SENDING    // Frame is going out over UART DMA
+} W25N01GV_Download_Frame_State;
+
+typedef struct {
+	W25N01GV_Flash *flash;
+	UART_HandleTypeDef *uart;
+
+	uint8_t frames[2][W25N01GV_DOWNLOAD_FRAME_SIZE];
+	W25N01GV_Download_Frame_State frame_state[2];
+	uint32_t frame_page[2];       // Page address of the page in each frame
+	uint8_t read_frame;           // Frame the next page is read into
+	uint8_t send_frame;           // Frame that's sent next
+
+	uint32_t num_pages;           // Pages to send in this download
+	uint32_t pages_read;          // Pages read from flash so far, including one in flight
+	uint32_t pages_sent;          // Frames handed to the UART so far
+	uint32_t pages_acked;         // Frames the receiver said it got, see ack_flash_download()
+	uint32_t window;              // Frames that can be sent ahead of pages_acked, 0 for no flow control
+
+	uint8_t active;
+	W25N01GV_ECC_Status ECC_status;  // ECC result of the pages read, once the download ends
+} W25N01GV_Download;
+
+/**
+ * Starts downloading up to num_pages pages of the flash log, beginning at
+ * start_page. The download ends early once it reaches the write pointer
+ * (see end_of_flash_log()). Bad blocks are skipped like in a continuous read,
+ * and a circular log wraps around. Nothing is sent until poll_flash_download()
+ * is called.
+ *
+ * To download the whole log, call reset_flash_read_pointer() and start at
+ * flash->next_page_to_read. To resume a download that was cut off, start at
+ * the page after the last one the receiver got, which is in each frame header.
+ *
+ * Don't call any other flash functions until the download has ended.
+ *
+ * @param download   <W25N01GV_Download*>  Struct used to store the download state
+ * @param flash      <W25N01GV_Flash*>     Flash to download from
+ * @param uart       <UART_HandleTypeDef*> UART to send over, with a TX DMA stream
+ * @param start_page <uint32_t>            Page address to start at
+ * @param num_pages  <uint32_t>            Maximum number of pages to send, UINT32_MAX for the whole log
+ * @param window     <uint32_t>            Frames that can be sent before the receiver
+ *                                         acknowledges them, 0 to not wait for it
+ */
+void start_flash_download(W25N01GV_Download *download, W25N01GV_Flash *flash, UART_HandleTypeDef *uart,
+		uint32_t start_page, uint32_t num_pages, uint32_t window);
+
+/**
+ * Moves the download along without blocking. Finished SPI and UART transfers
+ * are handed on, the next page is read while the current one is sent, and
+ * sending stops while the flow control window is full.
+ *
+ * Call this regularly, e.g. from the main loop, until it returns 0.
+ *
+ * @param download   <W25N01GV_Download*>  Struct used to store the download state
+ * @retval 1 while the download is running, 0 once every page has been sent
+ */
+uint8_t poll_flash_download(W25N01GV_Download *download);
+
+/**
+ * Records that the receiver has got the first num_frames frames, which opens
+ * the flow control window for more. Call it from the command handler for the
+ * receiver's acknowledgements. Older acknowledgements are ignored.
+ *
+ * @param download   <W25N01GV_Download*>  Struct used to store the download state
+ * @param num_frames <uint32_t>            Number of frames received, counting from frame 0
+ */
+void ack_flash_download(W25N01GV_Download *download, uint32_t num_frames);
+
+/**
+ * Stops the download, waiting for transfers in progress to finish, and ends
+ * the continuous read. It can be resumed later with start_flash_download().
+ *
+ * @param download   <W25N01GV_Download*>  Struct used to store the download state
+ * @retval ECC status of the pages read, see end_continuous_flash_read()
+ */
+W25N01GV_ECC_Status stop_flash_download(W25N01GV_Download *download);
+
+#endif	// end SPI/UART include protection
+#endif	// end header include protection
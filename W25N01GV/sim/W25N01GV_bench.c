@@ -0,0 +1,240 @@
+/**
+ * Throughput and latency benchmarks for the W25N01GV library, run against
+ * the host-side simulator with its SPI clock and chip timing.
+ *
+ * Build from the W25N01GV directory:
+ * gcc -O2 -Isim -Iinc sim/W25N01GV_bench.c src/W25N01GV.c sim/W25N01GV_sim.c -o bench
+ *
+ * Usage: ./bench [SPI clock in MHz, default 20]
+ *
+ * All times are simulated time: SPI transfers and chip busy time. The CPU time
+ * spent in the library itself isn't counted, so on hardware the numbers for
+ * small writes (where the library's bookkeeping dominates) will be worse.
+ *
+ * Nathaniel Kalantar (nkalan@umich.edu)
+ * Michigan Aeronautical Science Association
+ */
+
+#include "W25N01GV_sim.h"
+#include "W25N01GV.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_WRITE_PAYLOAD      (uint32_t) (4 * 1024 * 1024)  // Bytes written by each write scenario
+#define BENCH_READ_PAGES         (uint32_t) 2048
+#define BENCH_CS_PIN             GPIO_PIN_5
+
+static SPI_HandleTypeDef hspi;
+static GPIO_TypeDef gpio;
+static uint32_t spi_clock_hz = 20000000;
+static W25N01GV_Sim *sim = NULL;
+
+static uint32_t *latencies = NULL;
+static uint32_t num_latencies = 0;
+
+
+/* Private functions */
+
+/**
+ * Replaces the simulated chip with a fresh, erased one.
+ */
+static void new_chip(void) {
+	if (sim != NULL)
+		w25n01gv_sim_destroy(sim);
+
+	memset(&hspi, 0, sizeof(hspi));
+	memset(&gpio, 0, sizeof(gpio));
+	hspi.clock_hz = spi_clock_hz;
+
+	sim = w25n01gv_sim_create(NULL, 1);
+	if (sim == NULL) {
+		fprintf(stderr, "Couldn't create the simulated chip\n");
+		exit(1);
+	}
+	w25n01gv_sim_attach(sim, &hspi, &gpio, BENCH_CS_PIN);
+}
+
+static int compare_uint32(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *) a;
+	uint32_t y = *(const uint32_t *) b;
+	return (x > y) - (x < y);
+}
+
+static void record_latency(uint64_t ns) {
+	latencies[num_latencies++] = (ns > UINT32_MAX) ? UINT32_MAX : (uint32_t) ns;
+}
+
+/**
+ * Sorts the recorded latencies and returns the given percentile of them.
+ */
+static uint32_t latency_percentile(uint32_t percentile) {
+	if (num_latencies == 0)
+		return 0;
+	qsort(latencies, num_latencies, sizeof(uint32_t), compare_uint32);
+	uint32_t index = (uint32_t) (((uint64_t) num_latencies * percentile) / 100);
+	return latencies[(index < num_latencies) ? index : num_latencies - 1];
+}
+
+static void print_header(const char *title) {
+	printf("\n%s\n", title);
+	printf("%-28s %10s %10s %10s %10s %12s\n", "scenario", "MB/s", "p50 us", "p99 us", "max us", "SPI B/byte");
+}
+
+static void print_result(const char *name, uint64_t payload_bytes, uint64_t elapsed_ns) {
+	double mb_per_s = (elapsed_ns > 0) ? (double) payload_bytes * 1000.0 / (double) elapsed_ns : 0;
+	uint32_t p50 = latency_percentile(50);
+	uint32_t p99 = latency_percentile(99);
+	uint32_t max = latency_percentile(100);
+	printf("%-28s %10.2f %10.1f %10.1f %10.1f %12.3f\n", name, mb_per_s,
+			p50 / 1000.0, p99 / 1000.0, max / 1000.0,
+			(double) sim->stats.spi_bytes / (double) payload_bytes);
+}
+
+/**
+ * Writes BENCH_WRITE_PAYLOAD bytes with write_to_flash() calls of call_size
+ * bytes, timing each call. In async mode the pipeline is polled after each
+ * call, like a logging loop would, and the poll counts towards the call.
+ */
+static void bench_write(uint32_t call_size, uint8_t async) {
+	static uint8_t data[4096];
+	char name[40];
+
+	new_chip();
+	W25N01GV_Flash flash;
+	init_flash(&flash, &hspi, &gpio, BENCH_CS_PIN);
+	if (async)
+		enable_async_flash_write(&flash, NULL);
+
+	for (uint32_t i = 0; i < call_size; i++)
+		data[i] = (uint8_t) i;
+
+	w25n01gv_sim_clear_stats(sim);
+	num_latencies = 0;
+	uint64_t start = w25n01gv_sim_time_ns();
+
+	for (uint32_t written = 0; written < BENCH_WRITE_PAYLOAD; written += call_size) {
+		uint64_t call_start = w25n01gv_sim_time_ns();
+		write_to_flash(&flash, data, call_size);
+		if (async)
+			poll_async_flash_write(&flash);
+		record_latency(w25n01gv_sim_time_ns() - call_start);
+	}
+	finish_flash_write(&flash);
+	if (async)
+		disable_async_flash_write(&flash);
+
+	uint64_t elapsed = w25n01gv_sim_time_ns() - start;
+	snprintf(name, sizeof(name), "write %4u B%s", (unsigned) call_size, async ? " async" : "");
+	print_result(name, BENCH_WRITE_PAYLOAD, elapsed);
+}
+
+/**
+ * Fills BENCH_READ_PAGES pages, then reads them back one page at a time
+ * and with a continuous read.
+ */
+static void bench_read(void) {
+	static uint8_t data[W25N01GV_BYTES_PER_PAGE];
+
+	new_chip();
+	W25N01GV_Flash flash;
+	init_flash(&flash, &hspi, &gpio, BENCH_CS_PIN);
+	for (uint32_t page = 0; page < BENCH_READ_PAGES; page++)
+		write_to_flash(&flash, data, W25N01GV_BYTES_PER_PAGE);
+	finish_flash_write(&flash);
+
+	uint64_t payload = (uint64_t) BENCH_READ_PAGES * W25N01GV_BYTES_PER_PAGE;
+
+	w25n01gv_sim_clear_stats(sim);
+	num_latencies = 0;
+	reset_flash_read_pointer(&flash);
+	uint64_t start = w25n01gv_sim_time_ns();
+	for (uint32_t page = 0; page < BENCH_READ_PAGES; page++) {
+		uint64_t call_start = w25n01gv_sim_time_ns();
+		read_next_2KB_from_flash(&flash, data);
+		record_latency(w25n01gv_sim_time_ns() - call_start);
+	}
+	print_result("read_next_2KB", payload, w25n01gv_sim_time_ns() - start);
+
+	w25n01gv_sim_clear_stats(sim);
+	num_latencies = 0;
+	reset_flash_read_pointer(&flash);
+	start = w25n01gv_sim_time_ns();
+	begin_continuous_flash_read(&flash);
+	for (uint32_t page = 0; page < BENCH_READ_PAGES; page++) {
+		uint64_t call_start = w25n01gv_sim_time_ns();
+		read_continuous_flash_chunk(&flash, data, W25N01GV_BYTES_PER_PAGE);
+		record_latency(w25n01gv_sim_time_ns() - call_start);
+	}
+	end_continuous_flash_read(&flash);
+	print_result("continuous read 2KB chunks", payload, w25n01gv_sim_time_ns() - start);
+}
+
+/**
+ * Fills flash in steps and times init_flash() after a power cycle at each
+ * fill level.
+ */
+static void bench_init(void) {
+	static const uint8_t fill_percent[] = { 0, 1, 10, 25, 50 };
+	static uint8_t data[W25N01GV_BYTES_PER_PAGE];
+
+	printf("\n%-28s %10s %10s %12s\n", "init_flash() at fill level", "pages", "ms", "page reads");
+
+	new_chip();
+	W25N01GV_Flash flash;
+	init_flash(&flash, &hspi, &gpio, BENCH_CS_PIN);
+	uint32_t capacity_pages = get_flash_capacity(&flash) / W25N01GV_BYTES_PER_PAGE;
+
+	for (uint8_t i = 0; i < sizeof(fill_percent); i++) {
+		uint32_t target_pages = capacity_pages * fill_percent[i] / 100;
+
+		// A partly filled last page is the worst case for the search
+		while (flash.current_page < target_pages)
+			write_to_flash(&flash, data, W25N01GV_BYTES_PER_PAGE);
+		write_to_flash(&flash, data, W25N01GV_SECTOR_SIZE);
+		finish_flash_write(&flash);
+
+		w25n01gv_sim_power_cycle(sim);
+		w25n01gv_sim_clear_stats(sim);
+		uint64_t start = w25n01gv_sim_time_ns();
+		init_flash(&flash, &hspi, &gpio, BENCH_CS_PIN);
+		uint64_t elapsed = w25n01gv_sim_time_ns() - start;
+
+		char name[40];
+		snprintf(name, sizeof(name), "%3u%% full", fill_percent[i]);
+		printf("%-28s %10u %10.2f %12llu\n", name, (unsigned) flash.current_page, elapsed / 1e6,
+				(unsigned long long) sim->stats.page_reads);
+	}
+}
+
+
+/* Main */
+
+int main(int argc, char **argv) {
+	static const uint32_t call_sizes[] = { 1, 16, 64, 300, 512, 4096 };
+
+	if (argc > 1)
+		spi_clock_hz = (uint32_t) (atof(argv[1]) * 1e6);
+
+	latencies = malloc(BENCH_WRITE_PAYLOAD * sizeof(uint32_t));
+	if (latencies == NULL)
+		return 1;
+
+	printf("W25N01GV benchmarks, SPI clock %.1f MHz\n", spi_clock_hz / 1e6);
+
+	print_header("write_to_flash() + finish_flash_write()");
+	for (uint8_t async = 0; async < 2; async++) {
+		for (uint8_t i = 0; i < sizeof(call_sizes) / sizeof(call_sizes[0]); i++)
+			bench_write(call_sizes[i], async);
+	}
+
+	print_header("Reading");
+	bench_read();
+
+	bench_init();
+
+	w25n01gv_sim_destroy(sim);
+	free(latencies);
+	return 0;
+}
@@ -0,0 +1,770 @@
+/**
+ * Implementation of the host-side W25N01GV / W25M02GV simulator and the
+ * HAL stand-in functions that route SPI traffic to it.
+ * See W25N01GV_sim.h for what is modeled.
+ *
+ * Datasheet: https://www.winbond.com/resource-files/w25n01gv%20revl%20050918%20unsecured.pdf
+ *
+ * Nathaniel Kalantar (nkalan@umich.edu)
+ * Michigan Aeronautical Science Association
+ */
+
+#include "W25N01GV_sim.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Status register bits, datasheet pg 15-20
+#define SIM_SR1_BLOCK_PROTECT_BITS    (uint8_t) 0x78  // BP3-BP0
+#define SIM_SR1_POWER_ON              (uint8_t) 0x7C  // Whole array protected, TB=1
+#define SIM_SR2_WRITABLE_BITS         (uint8_t) 0xF8
+#define SIM_SR2_ECC_ENABLE            (uint8_t) 0x10
+#define SIM_SR2_BUFFER_READ_MODE      (uint8_t) 0x08
+#define SIM_SR2_POWER_ON              (uint8_t) 0x18  // -IG models: ECC on, buffer mode
+#define SIM_SR3_BBM_LUT_FULL          (uint8_t) 0x40
+#define SIM_SR3_ECC_BITS              (uint8_t) 0x30
+#define SIM_SR3_PROGRAM_FAILURE       (uint8_t) 0x08
+#define SIM_SR3_ERASE_FAILURE         (uint8_t) 0x04
+#define SIM_SR3_WRITE_ENABLE_LATCH    (uint8_t) 0x02
+#define SIM_SR3_BUSY                  (uint8_t) 0x01
+
+#define SIM_ECC_CORRECTED             (uint8_t) 0x01
+#define SIM_ECC_UNCORRECTABLE         (uint8_t) 0x02
+#define SIM_ECC_MULTIPLE_PAGES        (uint8_t) 0x03
+
+#define SIM_MAIN_SIZE                 2048
+#define SIM_SECTOR_SIZE               512
+#define SIM_SPARE_BYTES_PER_SECTOR    16
+#define SIM_SECTORS_PER_PAGE          4
+
+#define SIM_DEFAULT_SPI_CLOCK_HZ      20000000U
+#define SIM_DMA_POLL_COST_NS          100U
+#define SIM_CYCCNT_READ_COST_NS       20U   // A busy loop reading the cycle counter
+
+static uint64_t sim_now_ns = 0;
+static W25N01GV_Sim *transport_sim = NULL;  // Chip behind w25n01gv_sim_transport()
+
+uint32_t SystemCoreClock = 180000000;  // STM32F446 at full speed
+CoreDebug_Type sim_core_debug;
+static DWT_Type sim_dwt_registers;
+
+
+/* Private functions */
+
+static int bit_is_set(const uint8_t *bitmap, uint32_t bit) {
+	return (bitmap[bit >> 3] >> (bit & 7)) & 1;
+}
+
+static void set_bit(uint8_t *bitmap, uint32_t bit) {
+	bitmap[bit >> 3] |= (uint8_t) (1 << (bit & 7));
+}
+
+static void clear_bit(uint8_t *bitmap, uint32_t bit) {
+	bitmap[bit >> 3] &= (uint8_t) ~(1 << (bit & 7));
+}
+
+static uint8_t *die_page(W25N01GV_Sim_Die *die, uint16_t page) {
+	return die->mem + (size_t) page * W25N01GV_SIM_PAGE_SIZE;
+}
+
+static int die_is_busy(W25N01GV_Sim_Die *die) {
+	return sim_now_ns < die->busy_until_ns;
+}
+
+static void start_busy(W25N01GV_Sim *sim, W25N01GV_Sim_Die *die, uint32_t ns) {
+	die->busy_until_ns = sim_now_ns + ns;
+	sim->stats.busy_ns += ns;
+}
+
+static uint8_t read_register(W25N01GV_Sim_Die *die, uint8_t register_adr) {
+	switch (register_adr & 0xF0) {
+	case 0xA0:
+		return die->sr1;
+	case 0xB0:
+		return die->sr2;
+	case 0xC0:
+		return (uint8_t) ((die->sr3 & ~SIM_SR3_BUSY) | (die_is_busy(die) ? SIM_SR3_BUSY : 0));
+	default:
+		return 0xFF;
+	}
+}
+
+/**
+ * Applies the BBM look up table to a page address, like the chip does
+ * for every array access.
+ */
+static uint16_t remap_page(W25N01GV_Sim_Die *die, uint16_t page) {
+	uint16_t block = page / W25N01GV_SIM_PAGES_PER_BLOCK;
+	for (uint8_t i = 0; i < die->lut_count; i++) {
+		if ((die->lut_lba[i] & 0x3FF) == block)
+			return (uint16_t) ((die->lut_pba[i] & 0x3FF) * W25N01GV_SIM_PAGES_PER_BLOCK
+					+ page % W25N01GV_SIM_PAGES_PER_BLOCK);
+	}
+	return page;
+}
+
+/**
+ * Returns the ECC bits for a page that was just loaded into the buffer,
+ * consuming any injected result for it.
+ */
+static uint8_t page_ecc_bits(W25N01GV_Sim_Die *die, uint16_t page) {
+	uint8_t ecc = 0;
+	for (uint8_t s = 0; s < SIM_SECTORS_PER_PAGE; s++) {
+		if (bit_is_set(die->corrupt, (uint32_t) page * SIM_SECTORS_PER_PAGE + s))
+			ecc = SIM_ECC_UNCORRECTABLE;
+	}
+	for (uint8_t i = 0; i < die->num_injected; i++) {
+		if (die->injected[i].page == page) {
+			if (die->injected[i].ecc_bits > ecc)
+				ecc = die->injected[i].ecc_bits;
+			die->injected[i] = die->injected[--die->num_injected];
+			break;
+		}
+	}
+	if (ecc == SIM_ECC_UNCORRECTABLE)
+		die->last_ecc_fail_page = page;
+	return ecc;
+}
+
+static void load_page_into_buffer(W25N01GV_Sim *sim, W25N01GV_Sim_Die *die, uint16_t page) {
+	uint16_t physical_page = remap_page(die, page);
+	memcpy(die->buffer, die_page(die, physical_page), W25N01GV_SIM_PAGE_SIZE);
+	uint8_t ecc = page_ecc_bits(die, physical_page);
+	die->sr3 = (uint8_t) ((die->sr3 & ~SIM_SR3_ECC_BITS) | (ecc << 4));
+	sim->stats.page_reads++;
+}
+
+/**
+ * Continuous read mode streams the main array of consecutive pages.
+ * ECC results are accumulated across pages, datasheet pg 20.
+ */
+static void continuous_read_next_page(W25N01GV_Sim *sim, W25N01GV_Sim_Die *die) {
+	die->cont_page++;
+	die->cont_column = 0;
+	uint16_t physical_page = remap_page(die, die->cont_page);
+	memcpy(die->buffer, die_page(die, physical_page), W25N01GV_SIM_PAGE_SIZE);
+
+	uint8_t ecc = page_ecc_bits(die, physical_page);
+	uint8_t old_ecc = (die->sr3 & SIM_SR3_ECC_BITS) >> 4;
+	if (ecc == SIM_ECC_UNCORRECTABLE)
+		ecc = (old_ecc >= SIM_ECC_UNCORRECTABLE) ? SIM_ECC_MULTIPLE_PAGES : SIM_ECC_UNCORRECTABLE;
+	if (ecc < old_ecc)
+		ecc = old_ecc;
+	die->sr3 = (uint8_t) ((die->sr3 & ~SIM_SR3_ECC_BITS) | (ecc << 4));
+	sim->stats.continuous_pages++;
+}
+
+static int sector_has_data(const uint8_t *page, uint8_t sector) {
+	const uint8_t *main = page + sector * SIM_SECTOR_SIZE;
+	for (uint16_t i = 0; i < SIM_SECTOR_SIZE; i++) {
+		if (main[i] != 0xFF)
+			return 1;
+	}
+	// User bytes of the spare area, not counting the bad block marker and ECC bytes
+	const uint8_t *spare = page + SIM_MAIN_SIZE + sector * SIM_SPARE_BYTES_PER_SECTOR;
+	for (uint8_t i = 2; i < 8; i++) {
+		if (spare[i] != 0xFF)
+			return 1;
+	}
+	return 0;
+}
+
+static void program_execute(W25N01GV_Sim *sim, W25N01GV_Sim_Die *die, uint16_t page) {
+	uint16_t physical_page = remap_page(die, page);
+	uint16_t block = physical_page / W25N01GV_SIM_PAGES_PER_BLOCK;
+	uint8_t *mem = die_page(die, physical_page);
+
+	die->sr3 &= ~SIM_SR3_WRITE_ENABLE_LATCH;
+
+	if ((die->sr1 & SIM_SR1_BLOCK_PROTECT_BITS) || bit_is_set(die->failing_blocks, block)) {
+		die->sr3 |= SIM_SR3_PROGRAM_FAILURE;
+		start_busy(sim, die, sim->timing.page_program_ns);
+		return;
+	}
+	die->sr3 &= ~SIM_SR3_PROGRAM_FAILURE;
+
+	// Programming the same ECC sector twice corrupts its ECC bytes.
+	// That is what the 512-byte framing in the driver avoids.
+	for (uint8_t s = 0; s < SIM_SECTORS_PER_PAGE; s++) {
+		if (sector_has_data(die->buffer, s) && sector_has_data(mem, s)) {
+			set_bit(die->corrupt, (uint32_t) physical_page * SIM_SECTORS_PER_PAGE + s);
+			sim->stats.nop_violations++;
+		}
+	}
+
+	uint32_t num_bytes = W25N01GV_SIM_PAGE_SIZE;
+	if (sim->tear_after_bytes != UINT32_MAX) {
+		num_bytes = sim->tear_after_bytes < num_bytes ? sim->tear_after_bytes : num_bytes;
+		sim->tear_after_bytes = UINT32_MAX;
+	}
+	// NAND programming can only clear bits
+	for (uint32_t i = 0; i < num_bytes; i++)
+		mem[i] &= die->buffer[i];
+
+	sim->stats.page_programs++;
+	start_busy(sim, die, sim->timing.page_program_ns);
+}
+
+static void block_erase(W25N01GV_Sim *sim, W25N01GV_Sim_Die *die, uint16_t page) {
+	uint16_t physical_page = remap_page(die, page);
+	uint16_t block = physical_page / W25N01GV_SIM_PAGES_PER_BLOCK;
+
+	die->sr3 &= ~SIM_SR3_WRITE_ENABLE_LATCH;
+
+	if ((die->sr1 & SIM_SR1_BLOCK_PROTECT_BITS) || bit_is_set(die->failing_blocks, block)) {
+		die->sr3 |= SIM_SR3_ERASE_FAILURE;
+		start_busy(sim, die, sim->timing.block_erase_ns);
+		return;
+	}
+	die->sr3 &= ~SIM_SR3_ERASE_FAILURE;
+
+	memset(die_page(die, block * W25N01GV_SIM_PAGES_PER_BLOCK), 0xFF,
+			(size_t) W25N01GV_SIM_PAGES_PER_BLOCK * W25N01GV_SIM_PAGE_SIZE);
+	for (uint32_t s = 0; s < W25N01GV_SIM_PAGES_PER_BLOCK * SIM_SECTORS_PER_PAGE; s++)
+		clear_bit(die->corrupt, (uint32_t) block * W25N01GV_SIM_PAGES_PER_BLOCK * SIM_SECTORS_PER_PAGE + s);
+
+	die->erase_count[block]++;
+	sim->stats.block_erases++;
+	start_busy(sim, die, sim->timing.block_erase_ns);
+}
+
+static void reset_die(W25N01GV_Sim_Die *die) {
+	die->sr1 = SIM_SR1_POWER_ON;
+	die->sr2 = SIM_SR2_POWER_ON;
+	die->sr3 = 0;
+	die->busy_until_ns = 0;
+	die->cont_page = 0;
+	die->cont_column = 0;
+	memset(die->buffer, 0xFF, sizeof(die->buffer));
+}
+
+static int allowed_while_busy(uint8_t opcode) {
+	// Read status register, read JEDEC ID and software die select
+	return opcode == 0x0F || opcode == 0x05 || opcode == 0x9F || opcode == 0xC2;
+}
+
+/**
+ * Called for every byte clocked while this chip's chip select is active.
+ * Returns the byte the chip drives on MISO.
+ */
+static uint8_t sim_exchange(W25N01GV_Sim *sim, uint8_t mosi) {
+	W25N01GV_Sim_Die *die = &sim->die[sim->active_die];
+	uint32_t n = sim->byte_count++;
+	sim->stats.spi_bytes++;
+
+	if (n == 0) {
+		sim->opcode = mosi;
+		if (die_is_busy(die) && !allowed_while_busy(mosi)) {
+			sim->opcode = 0x00;  // Ignored, like the real chip
+			sim->stats.ignored_commands++;
+		}
+		if (sim->opcode == 0x02 || sim->opcode == 0x32)  // Load program data resets the buffer
+			memset(die->buffer, 0xFF, sizeof(die->buffer));
+		if (sim->opcode == 0x0F || sim->opcode == 0x05)
+			sim->stats.status_reads++;
+		return 0xFF;
+	}
+
+	switch (sim->opcode) {
+	case 0x0F:  // Read status register
+	case 0x05:
+		if (n == 1) {
+			sim->args[0] = mosi;
+			return 0xFF;
+		}
+		return read_register(die, sim->args[0]);
+
+	case 0x9F: {  // JEDEC ID
+		static const uint8_t w25n01gv_id[3] = { 0xEF, 0xAA, 0x21 };
+		static const uint8_t w25m02gv_id[3] = { 0xEF, 0xAB, 0x21 };
+		if (n == 1 || n > 4)
+			return 0x00;
+		return sim->num_dies == 2 ? w25m02gv_id[n-2] : w25n01gv_id[n-2];
+	}
+
+	case 0xA5: {  // Read BBM look up table
+		if (n == 1 || n > 81)
+			return 0x00;
+		uint8_t entry = (uint8_t) ((n-2) / 4);
+		uint8_t byte = (uint8_t) ((n-2) % 4);
+		if (entry >= die->lut_count)
+			return 0x00;
+		uint16_t value = byte < 2 ? (uint16_t) (die->lut_lba[entry] | 0x8000) : die->lut_pba[entry];
+		return (byte % 2 == 0) ? (uint8_t) (value >> 8) : (uint8_t) value;
+	}
+
+	case 0xA9:  // Last ECC failure page address
+		if (n == 1 || n > 3)
+			return 0x00;
+		return n == 2 ? (uint8_t) (die->last_ecc_fail_page >> 8) : (uint8_t) die->last_ecc_fail_page;
+
+	case 0x02:  // Load program data
+	case 0x32:  // Quad load program data
+	case 0x84:  // Random load program data
+	case 0x34:  // Quad random load program data
+		if (n <= 2) {
+			sim->args[n-1] = mosi;
+			if (n == 2)
+				sim->column = (uint16_t) (((sim->args[0] << 8) | sim->args[1]) & 0x0FFF);
+			return 0xFF;
+		}
+		if (sim->column < W25N01GV_SIM_PAGE_SIZE)
+			die->buffer[sim->column++] = mosi;
+		return 0xFF;
+
+	case 0x03:  // Read data
+	case 0x0B:  // Fast read
+	case 0x3B:  // Fast read dual output
+	case 0x6B:  // Fast read quad output
+	case 0xBB:  // Fast read dual I/O
+	case 0xEB:  // Fast read quad I/O
+		if (n <= 3) {  // 2 column bytes (dummy in continuous mode) and 1 dummy byte
+			sim->args[n-1] = mosi;
+			if (n == 2)
+				sim->column = (uint16_t) (((sim->args[0] << 8) | sim->args[1]) & 0x0FFF);
+			return 0xFF;
+		}
+		if (die->sr2 & SIM_SR2_BUFFER_READ_MODE) {
+			return sim->column < W25N01GV_SIM_PAGE_SIZE ? die->buffer[sim->column++] : 0xFF;
+		}
+		else {
+			if (die->cont_column >= SIM_MAIN_SIZE) {
+				if (die->cont_page == W25N01GV_SIM_PAGES_PER_DIE - 1)
+					return 0xFF;  // End of the array
+				continuous_read_next_page(sim, die);
+			}
+			return die->buffer[die->cont_column++];
+		}
+
+	default:  // Commands that execute when chip select is released
+		if (n <= 4)
+			sim->args[n-1] = mosi;
+		return 0xFF;
+	}
+}
+
+/**
+ * Called when chip select is released. Most commands only take effect here.
+ */
+static void sim_end_transaction(W25N01GV_Sim *sim) {
+	W25N01GV_Sim_Die *die = &sim->die[sim->active_die];
+	uint16_t page = (uint16_t) ((sim->args[1] << 8) | sim->args[2]);
+
+	if (sim->byte_count == 0)
+		return;
+
+	switch (sim->opcode) {
+	case 0xFF:  // Device reset, only the active die resets and the die selection is kept
+		reset_die(die);
+		start_busy(sim, die, sim->timing.reset_ns);
+		break;
+	case 0x06:
+		die->sr3 |= SIM_SR3_WRITE_ENABLE_LATCH;
+		break;
+	case 0x04:
+		die->sr3 &= ~SIM_SR3_WRITE_ENABLE_LATCH;
+		break;
+	case 0x1F:  // Write status register
+	case 0x01:
+		if (sim->byte_count < 3)
+			break;
+		if ((sim->args[0] & 0xF0) == 0xA0)
+			die->sr1 = sim->args[1];
+		else if ((sim->args[0] & 0xF0) == 0xB0)
+			die->sr2 = (uint8_t) ((die->sr2 & ~SIM_SR2_WRITABLE_BITS) | (sim->args[1] & SIM_SR2_WRITABLE_BITS));
+		break;
+	case 0x13:  // Page data read
+		if (sim->byte_count < 4)
+			break;
+		load_page_into_buffer(sim, die, page);
+		die->cont_page = page;
+		die->cont_column = 0;
+		start_busy(sim, die, sim->timing.page_read_ns);
+		break;
+	case 0x10:  // Program execute
+		if (sim->byte_count < 4 || !(die->sr3 & SIM_SR3_WRITE_ENABLE_LATCH))
+			break;
+		program_execute(sim, die, page);
+		break;
+	case 0xD8:  // Block erase
+		if (sim->byte_count < 4 || !(die->sr3 & SIM_SR3_WRITE_ENABLE_LATCH))
+			break;
+		block_erase(sim, die, page);
+		break;
+	case 0xA1:  // Bad block management swap
+		if (sim->byte_count < 5 || !(die->sr3 & SIM_SR3_WRITE_ENABLE_LATCH))
+			break;
+		if (die->lut_count < 20) {
+			die->lut_lba[die->lut_count] = (uint16_t) ((sim->args[0] << 8) | sim->args[1]);
+			die->lut_pba[die->lut_count] = (uint16_t) ((sim->args[2] << 8) | sim->args[3]);
+			die->lut_count++;
+		}
+		if (die->lut_count == 20)
+			die->sr3 |= SIM_SR3_BBM_LUT_FULL;
+		die->sr3 &= ~SIM_SR3_WRITE_ENABLE_LATCH;
+		start_busy(sim, die, sim->timing.page_program_ns);
+		break;
+	case 0xC2:  // Software die select
+		if (sim->byte_count >= 2 && sim->args[0] < sim->num_dies)
+			sim->active_die = sim->args[0];
+		break;
+	default:
+		break;
+	}
+}
+
+static uint64_t lines_time_ns(uint32_t clock_hz, uint32_t num_bytes, uint8_t lines) {
+	return (uint64_t) num_bytes * 8 * 1000000000ULL / ((uint64_t) clock_hz * (lines ? lines : 1));
+}
+
+static uint64_t transfer_time_ns(SPI_HandleTypeDef *hspi, uint32_t num_bytes) {
+	return lines_time_ns(hspi->clock_hz, num_bytes, hspi->data_lines);
+}
+
+static uint8_t bus_exchange(SPI_HandleTypeDef *hspi, uint8_t mosi) {
+	uint8_t miso = 0xFF;
+	for (uint8_t i = 0; i < hspi->num_sims; i++) {
+		if (hspi->sims[i]->cs_active)
+			miso &= sim_exchange(hspi->sims[i], mosi);
+	}
+	hspi->bytes_transferred++;
+	return miso;
+}
+
+static int bus_dma_busy(SPI_HandleTypeDef *hspi) {
+	return hspi->State != HAL_SPI_STATE_READY && hspi->State != HAL_SPI_STATE_RESET
+			&& sim_now_ns < hspi->dma_done_ns;
+}
+
+static void sim_select(W25N01GV_Sim *sim) {
+	if (sim->cs_active)
+		return;
+	sim->cs_active = 1;
+	sim->byte_count = 0;
+	sim->stats.transactions++;
+	sim_now_ns += sim->timing.cs_overhead_ns;
+}
+
+static void sim_release(W25N01GV_Sim *sim) {
+	if (!sim->cs_active)
+		return;
+	if (sim->bus != NULL && bus_dma_busy(sim->bus))
+		sim->stats.protocol_errors++;  // Transfer would be cut off on hardware
+	sim_end_transaction(sim);
+	sim->cs_active = 0;
+}
+
+
+/* Public simulator functions */
+
+W25N01GV_Sim *w25n01gv_sim_create(const char *image_path, uint8_t num_dies) {
+	if (num_dies < 1 || num_dies > W25N01GV_SIM_MAX_DIES)
+		return NULL;
+
+	W25N01GV_Sim *sim = calloc(1, sizeof(W25N01GV_Sim));
+	if (sim == NULL)
+		return NULL;
+
+	sim->num_dies = num_dies;
+	sim->image_size = (size_t) num_dies * W25N01GV_SIM_PAGES_PER_DIE * W25N01GV_SIM_PAGE_SIZE;
+	sim->fd = -1;
+	int fresh_image = 1;
+
+	if (image_path != NULL) {
+		struct stat st;
+		sim->fd = open(image_path, O_RDWR | O_CREAT, 0644);
+		if (sim->fd < 0 || fstat(sim->fd, &st) != 0) {
+			free(sim);
+			return NULL;
+		}
+		if ((size_t) st.st_size == sim->image_size)
+			fresh_image = 0;
+		else if (ftruncate(sim->fd, (off_t) sim->image_size) != 0) {
+			close(sim->fd);
+			free(sim);
+			return NULL;
+		}
+		sim->image = mmap(NULL, sim->image_size, PROT_READ | PROT_WRITE, MAP_SHARED, sim->fd, 0);
+	}
+	else {
+		sim->image = mmap(NULL, sim->image_size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+
+	if (sim->image == MAP_FAILED) {
+		if (sim->fd >= 0)
+			close(sim->fd);
+		free(sim);
+		return NULL;
+	}
+	if (fresh_image)
+		memset(sim->image, 0xFF, sim->image_size);
+
+	for (uint8_t d = 0; d < num_dies; d++) {
+		W25N01GV_Sim_Die *die = &sim->die[d];
+		die->mem = sim->image + (size_t) d * W25N01GV_SIM_PAGES_PER_DIE * W25N01GV_SIM_PAGE_SIZE;
+		die->corrupt = calloc(W25N01GV_SIM_PAGES_PER_DIE * SIM_SECTORS_PER_PAGE / 8, 1);
+		die->failing_blocks = calloc(W25N01GV_SIM_BLOCKS_PER_DIE / 8, 1);
+		reset_die(die);
+	}
+
+	sim->timing.page_read_ns = 60000;
+	sim->timing.page_program_ns = 250000;
+	sim->timing.block_erase_ns = 2000000;
+	sim->timing.reset_ns = 5000;
+	sim->timing.cs_overhead_ns = 50;
+	sim->tear_after_bytes = UINT32_MAX;
+
+	return sim;
+}
+
+void w25n01gv_sim_destroy(W25N01GV_Sim *sim) {
+	if (sim == NULL)
+		return;
+	if (transport_sim == sim)
+		transport_sim = NULL;
+	for (uint8_t d = 0; d < sim->num_dies; d++) {
+		free(sim->die[d].corrupt);
+		free(sim->die[d].failing_blocks);
+	}
+	if (sim->fd >= 0)
+		msync(sim->image, sim->image_size, MS_SYNC);
+	munmap(sim->image, sim->image_size);
+	if (sim->fd >= 0)
+		close(sim->fd);
+	free(sim);
+}
+
+void w25n01gv_sim_attach(W25N01GV_Sim *sim, SPI_HandleTypeDef *hspi,
+		GPIO_TypeDef *cs_base, uint16_t cs_pin) {
+	if (hspi->num_sims < sizeof(hspi->sims) / sizeof(hspi->sims[0]))
+		hspi->sims[hspi->num_sims++] = sim;
+	if (hspi->clock_hz == 0)
+		hspi->clock_hz = SIM_DEFAULT_SPI_CLOCK_HZ;
+	hspi->State = HAL_SPI_STATE_READY;
+	sim->bus = hspi;
+
+	for (uint8_t pin = 0; pin < 16; pin++) {
+		if (cs_pin & (1 << pin))
+			cs_base->cs_sim[pin] = sim;
+	}
+}
+
+void w25n01gv_sim_attach_transport(W25N01GV_Sim *sim) {
+	transport_sim = sim;
+}
+
+HAL_StatusTypeDef w25n01gv_sim_transport(struct W25N01GV_Flash *flash, uint8_t *header, uint16_t header_size,
+		uint8_t *data, uint16_t data_size, uint8_t data_lines, uint8_t is_read) {
+	W25N01GV_Sim *sim = transport_sim;
+	(void) flash;
+	if (sim == NULL)
+		return HAL_ERROR;
+
+	uint32_t clock_hz = (sim->bus != NULL) ? sim->bus->clock_hz : SIM_DEFAULT_SPI_CLOCK_HZ;
+	sim_select(sim);
+	for (uint16_t i = 0; i < header_size; i++)
+		sim_exchange(sim, header[i]);
+	for (uint16_t i = 0; i < data_size; i++) {
+		if (is_read)
+			data[i] = sim_exchange(sim, 0xFF);
+		else
+			sim_exchange(sim, data[i]);
+	}
+	sim_now_ns += lines_time_ns(clock_hz, header_size, 1) + lines_time_ns(clock_hz, data_size, data_lines);
+	sim_release(sim);
+	return HAL_OK;
+}
+
+void w25n01gv_sim_power_cycle(W25N01GV_Sim *sim) {
+	for (uint8_t d = 0; d < sim->num_dies; d++)
+		reset_die(&sim->die[d]);
+	sim->active_die = 0;
+	sim->cs_active = 0;
+}
+
+void w25n01gv_sim_inject_ecc(W25N01GV_Sim *sim, uint8_t die, uint16_t page, uint8_t ecc_bits) {
+	W25N01GV_Sim_Die *d = &sim->die[die];
+	if (d->num_injected < W25N01GV_SIM_MAX_INJECTED) {
+		d->injected[d->num_injected].page = page;
+		d->injected[d->num_injected].ecc_bits = ecc_bits;
+		d->num_injected++;
+	}
+}
+
+void w25n01gv_sim_mark_bad_block(W25N01GV_Sim *sim, uint8_t die, uint16_t block) {
+	die_page(&sim->die[die], block * W25N01GV_SIM_PAGES_PER_BLOCK)[SIM_MAIN_SIZE] = 0x00;
+	set_bit(sim->die[die].failing_blocks, block);
+}
+
+void w25n01gv_sim_fail_block(W25N01GV_Sim *sim, uint8_t die, uint16_t block) {
+	set_bit(sim->die[die].failing_blocks, block);
+}
+
+void w25n01gv_sim_tear_next_program(W25N01GV_Sim *sim, uint32_t keep_bytes) {
+	sim->tear_after_bytes = keep_bytes;
+}
+
+uint8_t *w25n01gv_sim_page(W25N01GV_Sim *sim, uint8_t die, uint16_t page) {
+	return die_page(&sim->die[die], page);
+}
+
+void w25n01gv_sim_clear_stats(W25N01GV_Sim *sim) {
+	memset(&sim->stats, 0, sizeof(sim->stats));
+}
+
+uint64_t w25n01gv_sim_time_ns(void) {
+	return sim_now_ns;
+}
+
+void w25n01gv_sim_advance(uint64_t ns) {
+	sim_now_ns += ns;
+}
+
+
+/* HAL stand-in functions */
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState) {
+	for (uint8_t pin = 0; pin < 16; pin++) {
+		W25N01GV_Sim *sim = GPIOx->cs_sim[pin];
+		if (!(GPIO_Pin & (1 << pin)) || sim == NULL)
+			continue;
+
+		if (PinState == GPIO_PIN_RESET)
+			sim_select(sim);
+		else
+			sim_release(sim);
+	}
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size, uint32_t Timeout) {
+	(void) Timeout;
+	if (bus_dma_busy(hspi))
+		return HAL_BUSY;
+	for (uint16_t i = 0; i < Size; i++)
+		bus_exchange(hspi, pData[i]);
+	sim_now_ns += transfer_time_ns(hspi, Size);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size, uint32_t Timeout) {
+	(void) Timeout;
+	if (bus_dma_busy(hspi))
+		return HAL_BUSY;
+	for (uint16_t i = 0; i < Size; i++)
+		pData[i] = bus_exchange(hspi, 0xFF);
+	sim_now_ns += transfer_time_ns(hspi, Size);
+	return HAL_OK;
+}
+
+/**
+ * DMA transfers move their data immediately, but the peripheral stays busy
+ * until the virtual clock reaches the time the transfer would have ended.
+ * The CPU is free in the meantime, so the clock isn't advanced here.
+ */
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size) {
+	if (bus_dma_busy(hspi))
+		return HAL_BUSY;
+	for (uint16_t i = 0; i < Size; i++)
+		bus_exchange(hspi, pData[i]);
+	hspi->State = HAL_SPI_STATE_BUSY_TX;
+	hspi->dma_done_ns = sim_now_ns + transfer_time_ns(hspi, Size);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Receive_DMA(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size) {
+	if (bus_dma_busy(hspi))
+		return HAL_BUSY;
+	for (uint16_t i = 0; i < Size; i++)
+		pData[i] = bus_exchange(hspi, 0xFF);
+	hspi->State = HAL_SPI_STATE_BUSY_RX;
+	hspi->dma_done_ns = sim_now_ns + transfer_time_ns(hspi, Size);
+	return HAL_OK;
+}
+
+HAL_SPI_StateTypeDef HAL_SPI_GetState(SPI_HandleTypeDef *hspi) {
+	if (hspi->State != HAL_SPI_STATE_READY && hspi->State != HAL_SPI_STATE_RESET) {
+		sim_now_ns += SIM_DMA_POLL_COST_NS;  // Polling isn't free
+		if (sim_now_ns >= hspi->dma_done_ns)
+			hspi->State = HAL_SPI_STATE_READY;
+	}
+	return hspi->State;
+}
+
+/**
+ * Copies bytes sent over a UART to its tx_log, if it has one.
+ */
+static void log_uart_bytes(UART_HandleTypeDef *huart, const uint8_t *data, uint16_t size) {
+	if (huart->tx_log == NULL)
+		return;
+	for (uint16_t i = 0; i < size && huart->tx_log_used < huart->tx_log_size; i++)
+		huart->tx_log[huart->tx_log_used++] = data[i];
+}
+
+/**
+ * Logs a finished DMA transfer. The buffer is read once the transfer ends,
+ * so a buffer changed while it was being sent shows up in the log.
+ */
+static void finish_uart_dma(UART_HandleTypeDef *huart) {
+	if (huart->dma_size > 0 && sim_now_ns >= huart->dma_done_ns) {
+		log_uart_bytes(huart, huart->dma_data, huart->dma_size);
+		huart->dma_size = 0;
+	}
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size, uint32_t Timeout) {
+	(void) Timeout;
+	uint32_t baud = huart->baud_rate ? huart->baud_rate : 115200;
+	sim_now_ns += (uint64_t) Size * 10 * 1000000000ULL / baud;  // 8N1 framing
+	huart->bytes_transferred += Size;
+	log_uart_bytes(huart, pData, Size);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Receive(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size, uint32_t Timeout) {
+	(void) huart;
+	(void) Timeout;
+	memset(pData, 0, Size);
+	return HAL_TIMEOUT;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size) {
+	uint32_t baud = huart->baud_rate ? huart->baud_rate : 115200;
+	if (sim_now_ns < huart->dma_done_ns)
+		return HAL_BUSY;
+	finish_uart_dma(huart);
+	huart->dma_done_ns = sim_now_ns + (uint64_t) Size * 10 * 1000000000ULL / baud;
+	huart->bytes_transferred += Size;
+	huart->dma_data = pData;
+	huart->dma_size = Size;
+	return HAL_OK;
+}
+
+HAL_UART_StateTypeDef HAL_UART_GetState(UART_HandleTypeDef *huart) {
+	sim_now_ns += SIM_DMA_POLL_COST_NS;  // Polling isn't free
+	if (sim_now_ns < huart->dma_done_ns)
+		return HAL_UART_STATE_BUSY_TX;
+	finish_uart_dma(huart);
+	return HAL_UART_STATE_READY;
+}
+
+uint32_t HAL_GetTick(void) {
+	return (uint32_t) (sim_now_ns / 1000000ULL);
+}
+
+void HAL_Delay(uint32_t Delay) {
+	sim_now_ns += (uint64_t) Delay * 1000000ULL;
+}
+
+DWT_Type *sim_dwt(void) {
+	sim_now_ns += SIM_CYCCNT_READ_COST_NS;  // So loops waiting on the counter make progress
+
+	// Only counts once it's been enabled, like the real one
+	if ((sim_core_debug.DEMCR & CoreDebug_DEMCR_TRCENA_Msk) && (sim_dwt_registers.CTRL & DWT_CTRL_CYCCNTENA_Msk))
+		sim_dwt_registers.CYCCNT = (uint32_t) (sim_now_ns * (SystemCoreClock / 1000000) / 1000);
+	return &sim_dwt_registers;
+}
@@ -0,0 +1,211 @@
+/**
+ * Host-side command-level simulator for the W25N01GV and W25M02GV flash chips.
+ *
+ * The simulator interprets the real SPI opcode stream that the driver sends
+ * through the HAL stand-in (stm32f4xx_hal.h in this directory), so the
+ * unmodified W25N01GV.c / W25M02GV.c can be run and benchmarked on Linux.
+ *
+ * Modeled:
+ * - JEDEC ID, all three status registers, write enable latch, block protect bits
+ * - Page data read, buffer read and continuous read (BUF=0) modes
+ * - Program data load / random load (single and quad), program execute, block erase
+ * - ECC status bits, including uncorrectable errors caused by programming the
+ *   same 512 byte sector twice (the reason for the driver's 512-byte framing)
+ * - BBM look up table (read and swap), factory bad block markers
+ * - Software die select (W25M02GV)
+ * - A transport for init_flash_with_transport(), timed with 1, 2 or 4 data lines
+ * - tRD, tPROG, tBE and tRST busy times, and SPI transfer time at a set clock
+ *
+ * Storage is a memory-mapped image file (or anonymous memory), laid out as
+ * die 0 pages 0-65535 then die 1, each page 2112 bytes (main + spare), so an
+ * image survives across runs for boot-time and power-loss experiments.
+ *
+ * ============================================================================
+ * EXAMPLE CODE
+ * ============================================================================
+ *
+ * SPI_HandleTypeDef hspi = { 0 };
+ * GPIO_TypeDef gpiob = { 0 };
+ * W25N01GV_Sim *sim = w25n01gv_sim_create("flash.img", 1);
+ * w25n01gv_sim_attach(sim, &hspi, &gpiob, GPIO_PIN_5);
+ *
+ * W25N01GV_Flash flash;
+ * init_flash(&flash, &hspi, &gpiob, GPIO_PIN_5);
+ * :
+ * w25n01gv_sim_destroy(sim);
+ *
+ * Nathaniel Kalantar (nkalan@umich.edu)
+ * Michigan Aeronautical Science Association
+ */
+
+#ifndef W25N01GV_SIM_H	// Begin header include protection
+#define W25N01GV_SIM_H
+
+#include "stm32f4xx_hal.h"
+
+#define W25N01GV_SIM_PAGE_SIZE          2112   // 2048 byte main array + 64 byte spare area
+#define W25N01GV_SIM_PAGES_PER_DIE      65536
+#define W25N01GV_SIM_PAGES_PER_BLOCK    64
+#define W25N01GV_SIM_BLOCKS_PER_DIE     1024
+#define W25N01GV_SIM_MAX_DIES           2
+#define W25N01GV_SIM_MAX_INJECTED       64
+
+/**
+ * Chip timing used by the simulator, all in nanoseconds.
+ * Defaults are the typical values on datasheet pg 59.
+ */
+typedef struct {
+	uint32_t page_read_ns;       // tRD with ECC on
+	uint32_t page_program_ns;    // tPP
+	uint32_t block_erase_ns;     // tBE
+	uint32_t reset_ns;           // tRST
+	uint32_t cs_overhead_ns;     // Chip select setup + hold per transaction
+} W25N01GV_Sim_Timing;
+
+/**
+ * Counters the simulator keeps for benchmarks. All of them can be cleared
+ * with w25n01gv_sim_clear_stats().
+ */
+typedef struct {
+	uint64_t spi_bytes;          // Every byte clocked in either direction
+	uint64_t transactions;       // Chip select assertions
+	uint64_t page_reads;         // Page data read (13h) commands
+	uint64_t continuous_pages;   // Pages streamed in continuous read mode
+	uint64_t page_programs;      // Program execute (10h) commands
+	uint64_t block_erases;       // Block erase (D8h) commands
+	uint64_t status_reads;       // Read status register commands
+	uint64_t busy_ns;            // Sum of all chip busy time started
+	uint64_t nop_violations;     // Sectors programmed twice without an erase
+	uint64_t ignored_commands;   // Commands sent while the die was busy
+	uint64_t protocol_errors;    // Bus misuse, e.g. releasing chip select mid-DMA
+} W25N01GV_Sim_Stats;
+
+typedef struct {
+	uint8_t *mem;                                 // Start of this die in the image
+	uint8_t buffer[W25N01GV_SIM_PAGE_SIZE];       // Data buffer
+	uint8_t sr1, sr2, sr3;                        // Protection, config and status registers
+	uint64_t busy_until_ns;
+
+	uint16_t lut_lba[20];                         // BBM look up table
+	uint16_t lut_pba[20];
+	uint8_t lut_count;
+
+	uint16_t cont_page;                           // Continuous read position
+	uint16_t cont_column;
+	uint16_t last_ecc_fail_page;
+
+	uint8_t *corrupt;                             // 1 bit per sector, set on NOP violations
+	uint8_t *failing_blocks;                      // 1 bit per block, program/erase always fails
+	uint32_t erase_count[W25N01GV_SIM_BLOCKS_PER_DIE];
+
+	struct {
+		uint16_t page;
+		uint8_t ecc_bits;                           // 1 = corrected, 2 = uncorrectable
+	} injected[W25N01GV_SIM_MAX_INJECTED];
+	uint8_t num_injected;
+} W25N01GV_Sim_Die;
+
+struct W25N01GV_Flash;
+
+typedef struct W25N01GV_Sim {
+	W25N01GV_Sim_Die die[W25N01GV_SIM_MAX_DIES];
+	uint8_t num_dies;
+	uint8_t active_die;
+
+	uint8_t *image;
+	size_t image_size;
+	int fd;
+
+	// Current SPI transaction
+	uint8_t cs_active;
+	uint8_t opcode;
+	uint32_t byte_count;
+	uint8_t args[4];
+	uint16_t column;
+	uint32_t tear_after_bytes;                    // Power-loss injection, see w25n01gv_sim_tear_next_program()
+
+	SPI_HandleTypeDef *bus;
+	W25N01GV_Sim_Timing timing;
+	W25N01GV_Sim_Stats stats;
+} W25N01GV_Sim;
+
+/**
+ * Creates a simulated chip. If image_path names an existing image of the
+ * right size, its contents are kept, otherwise a new erased image is created.
+ *
+ * @param image_path <const char*>  Backing file, or NULL for anonymous memory
+ * @param num_dies   <uint8_t>      1 for a W25N01GV, 2 for a W25M02GV
+ * @retval The new simulator, or NULL if the image couldn't be mapped
+ */
+W25N01GV_Sim *w25n01gv_sim_create(const char *image_path, uint8_t num_dies);
+
+/**
+ * Flushes the image to disk and frees the simulator.
+ */
+void w25n01gv_sim_destroy(W25N01GV_Sim *sim);
+
+/**
+ * Wires the chip's SPI lines to a bus and its chip select to a GPIO pin.
+ * Sets the bus clock to 20 MHz if it hasn't been set already.
+ */
+void w25n01gv_sim_attach(W25N01GV_Sim *sim, SPI_HandleTypeDef *hspi,
+		GPIO_TypeDef *cs_base, uint16_t cs_pin);
+
+/**
+ * Makes w25n01gv_sim_transport() run its transactions on this chip. It uses
+ * the clock of the bus the chip is attached to, or 20 MHz if it isn't.
+ */
+void w25n01gv_sim_attach_transport(W25N01GV_Sim *sim);
+
+/**
+ * A W25N01GV_Transport for init_flash_with_transport() and
+ * fc_init_flash_with_transport(), like a QUADSPI peripheral: it handles chip
+ * select itself, and the data takes 1/data_lines of the time.
+ */
+HAL_StatusTypeDef w25n01gv_sim_transport(struct W25N01GV_Flash *flash, uint8_t *header, uint16_t header_size,
+		uint8_t *data, uint16_t data_size, uint8_t data_lines, uint8_t is_read);
+
+/**
+ * Returns the registers and buffers of every die to their power-on state,
+ * without touching the memory array. Use it to emulate a brown-out.
+ */
+void w25n01gv_sim_power_cycle(W25N01GV_Sim *sim);
+
+/**
+ * Makes the next page read of the given page report an ECC result.
+ *
+ * @param ecc_bits <uint8_t> 1 for "success with corrections", 2 for "uncorrectable"
+ */
+void w25n01gv_sim_inject_ecc(W25N01GV_Sim *sim, uint8_t die, uint16_t page, uint8_t ecc_bits);
+
+/**
+ * Writes a factory bad block marker into the first spare byte of the block.
+ */
+void w25n01gv_sim_mark_bad_block(W25N01GV_Sim *sim, uint8_t die, uint16_t block);
+
+/**
+ * Makes every later program or erase on the block fail, like a worn out block.
+ */
+void w25n01gv_sim_fail_block(W25N01GV_Sim *sim, uint8_t die, uint16_t block);
+
+/**
+ * Emulates a power loss in the middle of the next program execute:
+ * only the first keep_bytes of the buffer reach the memory array.
+ */
+void w25n01gv_sim_tear_next_program(W25N01GV_Sim *sim, uint32_t keep_bytes);
+
+/**
+ * Raw access to a page of the image (2112 bytes), bypassing the SPI bus.
+ */
+uint8_t *w25n01gv_sim_page(W25N01GV_Sim *sim, uint8_t die, uint16_t page);
+
+void w25n01gv_sim_clear_stats(W25N01GV_Sim *sim);
+
+/**
+ * The virtual clock shared by every simulated chip and peripheral.
+ * w25n01gv_sim_advance() lets a benchmark charge CPU time to it.
+ */
+uint64_t w25n01gv_sim_time_ns(void);
+void w25n01gv_sim_advance(uint64_t ns);
+
+#endif	// end header include protection
@@ -0,0 +1,1677 @@
+/**
+ * Regression tests for the W25N01GV library, run against the host-side
+ * simulator. Each test starts from a fresh, erased chip.
+ *
+ * Build from the W25N01GV directory:
+ * gcc -Isim -Iinc sim/W25N01GV_test.c src/W25N01GV.c src/W25M02GV.c src/W25N01GV_Array.c src/W25N01GV_Download.c sim/W25N01GV_sim.c -o run_tests
+ *
+ * Usage: ./run_tests [name of one test]
+ *
+ * Prints each failed check and exits with 1 if any failed.
+ *
+ * Nathaniel Kalantar (nkalan@umich.edu)
+ * Michigan Aeronautical Science Association
+ */
+
+#include "W25N01GV_sim.h"
+#include "W25N01GV.h"
+#include "W25M02GV.h"
+#include "W25N01GV_Array.h"
+#include "W25N01GV_Download.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_CS_PIN              GPIO_PIN_5
+#define TEST_ERASE_AHEAD_BLOCKS  8  // W25N01GV_ERASE_AHEAD_BLOCKS in W25N01GV.c
+#define TEST_DOWNLOAD_PAGES      300
+#define TEST_DOWNLOAD_MAX_POLLS  30000000  // So a stuck download fails instead of hanging
+
+#define CHECK(condition)         check((condition) != 0, #condition, __LINE__)
+
+static SPI_HandleTypeDef hspi;
+static GPIO_TypeDef gpio;
+static W25N01GV_Sim *sim = NULL;
+
+static uint32_t num_checks = 0;
+static uint32_t num_failed_checks = 0;
+
+
+/* Private functions */
+
+static void check(int passed, const char *condition, int line) {
+	num_checks++;
+	if (!passed) {
+		num_failed_checks++;
+		printf("    line %d: CHECK(%s) failed\n", line, condition);
+	}
+}
+
+/**
+ * Replaces the simulated chip with a fresh, erased one.
+ */
+static void new_chip(uint8_t num_dies) {
+	if (sim != NULL)
+		w25n01gv_sim_destroy(sim);
+
+	memset(&hspi, 0, sizeof(hspi));
+	memset(&gpio, 0, sizeof(gpio));
+	hspi.clock_hz = 20000000;
+
+	sim = w25n01gv_sim_create(NULL, num_dies);
+	if (sim == NULL) {
+		fprintf(stderr, "Couldn't create the simulated chip\n");
+		exit(1);
+	}
+	w25n01gv_sim_attach(sim, &hspi, &gpio, TEST_CS_PIN);
+}
+
+/**
+ * Byte number index of the test data stream. Every byte depends on its
+ * position, so data that's lost, repeated or out of order shows up.
+ */
+static uint8_t pattern_byte(uint32_t index) {
+	return (uint8_t) ((index * 2654435761u) >> 24);
+}
+
+static void fill_pattern(uint8_t *data, uint32_t start_index, uint32_t num_bytes) {
+	for (uint32_t i = 0; i < num_bytes; i++)
+		data[i] = pattern_byte(start_index + i);
+}
+
+/**
+ * Writes num_bytes of the test stream, starting at start_index, in calls of
+ * call_size bytes. In async mode the pipeline is polled after each call.
+ */
+static void write_pattern(W25N01GV_Flash *flash, uint32_t start_index, uint32_t num_bytes, uint16_t call_size) {
+	uint8_t data[W25N01GV_BYTES_PER_PAGE];
+
+	for (uint32_t written = 0; written < num_bytes; written += call_size) {
+		uint16_t size = (num_bytes - written < call_size) ? num_bytes - written : call_size;
+		fill_pattern(data, start_index + written, size);
+		write_to_flash(flash, data, size);
+		if (flash->async_write_enabled)
+			poll_async_flash_write(flash);
+	}
+}
+
+/**
+ * Reads back everything from the start of flash with
+ * read_next_valid_data_from_flash() and checks it's the test stream
+ * from index 0 to num_bytes.
+ */
+static uint8_t pattern_on_flash(W25N01GV_Flash *flash, uint32_t num_bytes) {
+	uint8_t data[W25N01GV_BYTES_PER_PAGE];
+	uint32_t index = 0;
+
+	reset_flash_read_pointer(flash);
+	while (index < num_bytes && flash->next_page_to_read < W25N01GV_NUM_PAGES) {
+		uint16_t size = read_next_valid_data_from_flash(flash, data);
+		for (uint16_t i = 0; i < size; i++, index++) {
+			if (index >= num_bytes || data[i] != pattern_byte(index))
+				return 0;
+		}
+	}
+	return index == num_bytes;
+}
+
+/**
+ * Polls the async pipeline until the sector in flight has been loaded.
+ */
+static W25N01GV_Async_State poll_until_loaded(W25N01GV_Flash *flash) {
+	while (poll_async_flash_write(flash) == ASYNC_WRITE_LOADING);
+	return flash->async_state;
+}
+
+/**
+ * Checks the store holds the last of num_writes values written by
+ * write_kv_pattern(), num_writes being a multiple of 3.
+ */
+static uint8_t kv_holds_values(W25N01GV_KV_Store *store, uint16_t num_writes) {
+	uint8_t value[40], read_value[40];
+
+	for (uint8_t key = 0; key < 3; key++) {
+		fill_pattern(value, num_writes - 3 + key, sizeof(value));
+		if (read_flash_kv(store, key, read_value, sizeof(read_value)) != KV_OK
+				|| memcmp(value, read_value, sizeof(value)) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * Writes num_writes values to keys 0, 1, 2, 0, 1, ...
+ */
+static uint8_t write_kv_pattern(W25N01GV_KV_Store *store, uint16_t num_writes) {
+	uint8_t value[40];
+	uint8_t all_ok = 1;
+
+	for (uint16_t i = 0; i < num_writes; i++) {
+		fill_pattern(value, i, sizeof(value));
+		all_ok &= (write_flash_kv(store, i % 3, value, sizeof(value)) == KV_OK);
+	}
+	return all_ok;
+}
+
+static uint8_t block_bad_in_table(W25N01GV_Flash *flash, uint16_t block) {
+	return (flash->bad_blocks[block / 8] >> (block % 8)) & 1;
+}
+
+static uint32_t test_time = 0;
+
+static uint32_t get_test_time(struct W25N01GV_Flash *flash) {
+	(void) flash;
+	return test_time;
+}
+
+/**
+ * Finds the page seek_flash_to_time() should land on by reading every
+ * page's timestamp: the last stamped page stamped at or before time.
+ */
+static uint32_t last_page_stamped_by(W25N01GV_Flash *flash, uint32_t time) {
+	uint32_t found = W25N01GV_NUM_PAGES;
+	uint32_t page_time;
+
+	for (uint32_t page = 0; page <= flash->current_page; page++) {
+		if (read_flash_page_time(flash, page, &page_time) && page_time <= time)
+			found = page;
+	}
+	return found;
+}
+
+/**
+ * Polls a download until it ends, up to TEST_DOWNLOAD_MAX_POLLS times.
+ *
+ * @retval 1 if it ended
+ */
+static uint8_t run_download(W25N01GV_Download *download) {
+	for (uint32_t polls = 0; polls < TEST_DOWNLOAD_MAX_POLLS; polls++) {
+		if (!poll_flash_download(download))
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * Checks frames sent by a download against the test stream: magic number,
+ * frame number, page address, data and CRC. The download started at
+ * first_page, whose data is the stream from first_index, and every page of
+ * bad_block was skipped.
+ *
+ * @retval The number of frames that are right, stopping at the first wrong one
+ */
+static uint32_t download_frames_ok(uint8_t *frames, uint32_t num_frames, uint32_t first_page,
+		uint32_t first_index, uint16_t bad_block) {
+	uint32_t page = first_page;
+
+	for (uint32_t n = 0; n < num_frames; n++) {
+		uint8_t *frame = frames + n * W25N01GV_DOWNLOAD_FRAME_SIZE;
+		uint8_t *data = frame + W25N01GV_DOWNLOAD_HEADER_SIZE;
+		uint32_t frame_page = ((uint32_t) frame[2] << 24) | ((uint32_t) frame[3] << 16) | (frame[4] << 8) | frame[5];
+		uint16_t crc = update_flash_crc16(0xFFFF, frame, W25N01GV_DOWNLOAD_HEADER_SIZE + W25N01GV_BYTES_PER_PAGE);
+		uint8_t ok = ((frame[0] << 8) | frame[1]) == W25N01GV_DOWNLOAD_MAGIC
+				&& ((frame[6] << 8) | frame[7]) == (uint16_t) n && frame_page == page
+				&& ((data[W25N01GV_BYTES_PER_PAGE] << 8) | data[W25N01GV_BYTES_PER_PAGE + 1]) == crc;
+		for (uint16_t i = 0; i < W25N01GV_BYTES_PER_PAGE; i++)
+			ok &= (data[i] == pattern_byte(first_index + n * W25N01GV_BYTES_PER_PAGE + i));
+		if (!ok)
+			return n;
+
+		page++;
+		if (page / W25N01GV_SIM_PAGES_PER_BLOCK == bad_block)
+			page += W25N01GV_SIM_PAGES_PER_BLOCK;
+	}
+	return num_frames;
+}
+
+/**
+ * Runs a scrub to the end, max_pages per poll.
+ *
+ * @retval The most page loads any poll took
+ */
+static uint64_t run_scrub(W25N01GV_Scrub *scrub, uint16_t max_pages) {
+	uint64_t most_page_reads = 0;
+	uint64_t page_reads = sim->stats.page_reads;
+
+	while (poll_flash_scrub(scrub, max_pages)) {
+		if (sim->stats.page_reads - page_reads > most_page_reads)
+			most_page_reads = sim->stats.page_reads - page_reads;
+		page_reads = sim->stats.page_reads;
+	}
+	return most_page_reads;
+}
+
+/**
+ * Checks pages first_page onwards of a block read back as the test stream
+ * from index.
+ */
+static uint8_t block_holds_pattern(W25N01GV_Flash *flash, uint16_t block, uint16_t first_page, uint32_t index) {
+	uint8_t data[W25N01GV_BYTES_PER_PAGE];
+	uint8_t intact = 1;
+
+	flash->next_page_to_read = block * W25N01GV_SIM_PAGES_PER_BLOCK + first_page;
+	for (uint16_t page = first_page; page < W25N01GV_SIM_PAGES_PER_BLOCK; page++) {
+		read_next_2KB_from_flash(flash, data);
+		for (uint16_t i = 0; i < W25N01GV_BYTES_PER_PAGE; i++)
+			intact &= (data[i] == pattern_byte(index + page * W25N01GV_BYTES_PER_PAGE + i));
+	}
+	return intact;
+}
+
+static uint32_t sectors_programmed = 0;
+
+static void count_programmed_sectors(W25N01GV_Flash *flash, uint8_t write_failure_status) {
+	(void) flash;
+	if (write_failure_status == 0)
+		sectors_programmed++;
+}
+
+static uint32_t yield_calls = 0;
+
+/**
+ * Yield callback that lets 10 us pass, like other work would.
+ */
+static void yield_10us(W25N01GV_Flash *flash) {
+	(void) flash;
+	yield_calls++;
+	w25n01gv_sim_advance(10000);
+}
+
+
+/* Tests */
+
+/**
+ * Async mode programs each sector as soon as it's loaded into the chip's
+ * buffer, so no finished sector waits in the chip for the rest of its page.
+ */
+static void test_async_programs_each_sector(void) {
+	W25N01GV_Flash flash;
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	enable_async_flash_write(&flash, count_programmed_sectors);
+	sectors_programmed = 0;
+	w25n01gv_sim_clear_stats(sim);
+
+	// A full sector is programmed once it's loaded, without waiting for more data
+	write_pattern(&flash, 0, W25N01GV_SECTOR_SIZE, 100);
+	CHECK(poll_until_loaded(&flash) == ASYNC_WRITE_PROGRAMMING);
+	wait_for_async_flash_write(&flash);
+	CHECK(sim->stats.page_programs == 1);
+	CHECK(sectors_programmed == 1);
+
+	// The rest of the page takes one partial program per sector
+	write_pattern(&flash, W25N01GV_SECTOR_SIZE, 3 * W25N01GV_SECTOR_SIZE, 100);
+	wait_for_async_flash_write(&flash);
+	CHECK(sim->stats.page_programs == 4);
+	CHECK(sectors_programmed == 4);
+
+	// The DMA complete interrupt can finish the load instead of a poll
+	uint8_t data[W25N01GV_SECTOR_SIZE];
+	fill_pattern(data, W25N01GV_BYTES_PER_PAGE, W25N01GV_SECTOR_SIZE);
+	write_to_flash(&flash, data, W25N01GV_SECTOR_SIZE);
+	CHECK(flash.async_state == ASYNC_WRITE_LOADING);
+	w25n01gv_sim_advance(1000000);
+	async_flash_write_dma_complete(&flash);
+	CHECK(flash.async_state == ASYNC_WRITE_PROGRAMMING);
+	wait_for_async_flash_write(&flash);
+	CHECK(sim->stats.page_programs == 5);
+
+	// finish_flash_write() programs the partly filled last sector
+	write_pattern(&flash, W25N01GV_BYTES_PER_PAGE + W25N01GV_SECTOR_SIZE, 700, 64);
+	finish_flash_write(&flash);
+	CHECK(flash.async_state == ASYNC_WRITE_IDLE);
+	CHECK(sim->stats.page_programs == 7);
+	CHECK(disable_async_flash_write(&flash) == 0);
+
+	uint32_t total = W25N01GV_BYTES_PER_PAGE + W25N01GV_SECTOR_SIZE + 700;
+	CHECK(pattern_on_flash(&flash, total));
+
+	// After a reset, the rest of the page is written after the last sector
+	w25n01gv_sim_power_cycle(sim);
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	CHECK(flash.current_page == 1);
+	CHECK(flash.next_free_column == 3 * W25N01GV_SECTOR_SIZE);
+	enable_async_flash_write(&flash, NULL);
+	write_pattern(&flash, total, 3 * W25N01GV_SECTOR_SIZE, 512);
+	finish_flash_write(&flash);
+	disable_async_flash_write(&flash);
+
+	CHECK(pattern_on_flash(&flash, total + 3 * W25N01GV_SECTOR_SIZE));
+	CHECK(sim->stats.nop_violations == 0);
+	CHECK(sim->stats.protocol_errors == 0);
+}
+
+/**
+ * A sector that fails to program in async mode is written again in the
+ * next good block.
+ */
+static void test_async_program_failure(void) {
+	W25N01GV_Flash flash;
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	enable_async_flash_write(&flash, NULL);
+
+	write_pattern(&flash, 0, 5 * W25N01GV_BYTES_PER_PAGE, 300);
+	w25n01gv_sim_fail_block(sim, 0, 0);
+	write_pattern(&flash, 5 * W25N01GV_BYTES_PER_PAGE, 3 * W25N01GV_BYTES_PER_PAGE + 100, 300);
+	finish_flash_write(&flash);
+
+	CHECK(disable_async_flash_write(&flash) == 0);
+	CHECK(flash.current_page / W25N01GV_SIM_PAGES_PER_BLOCK == 1);
+	CHECK(pattern_on_flash(&flash, 8 * W25N01GV_BYTES_PER_PAGE + 100));
+	CHECK(sim->stats.nop_violations == 0);
+}
+
+/**
+ * A continuous read streams the log in chunks of any size, starts a new
+ * stream after a bad block, and reports the worst ECC result of all the
+ * pages streamed. Failures in two separate streams count as multiple pages.
+ */
+static void test_continuous_read_ECC_status(void) {
+	static uint8_t data[3000];
+	W25N01GV_Flash flash;
+	uint32_t block_bytes = W25N01GV_SIM_PAGES_PER_BLOCK * W25N01GV_BYTES_PER_PAGE;
+	w25n01gv_sim_mark_bad_block(sim, 0, 1);
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+
+	// The log is in blocks 0 and 2 and the start of block 3
+	uint32_t num_bytes = 2 * block_bytes + 10 * W25N01GV_BYTES_PER_PAGE;
+	write_pattern(&flash, 0, num_bytes, W25N01GV_BYTES_PER_PAGE);
+	finish_flash_write(&flash);
+
+	// One uncorrectable page on each side of the bad block
+	w25n01gv_sim_inject_ecc(sim, 0, 10, 2);
+	w25n01gv_sim_inject_ecc(sim, 0, 2 * W25N01GV_SIM_PAGES_PER_BLOCK + 5, 2);
+
+	reset_flash_read_pointer(&flash);
+	begin_continuous_flash_read(&flash);
+	uint32_t index = 0;
+	uint8_t intact = 1;
+	while (index < num_bytes) {
+		uint32_t size = read_continuous_flash_chunk(&flash, data, sizeof(data));
+		if (size == 0)
+			break;
+		for (uint32_t i = 0; i < size && index + i < num_bytes; i++)
+			intact &= (data[i] == pattern_byte(index + i));
+		index += size;
+	}
+	CHECK(intact && index >= num_bytes);
+
+	// 95 chunks of 3000 bytes end 352 bytes into the 140th page of the log
+	CHECK(flash.next_page_to_read == 3 * W25N01GV_SIM_PAGES_PER_BLOCK + 11);
+	CHECK(end_continuous_flash_read(&flash) == ERROR_MULTIPLE_PAGES);
+	CHECK(flash.last_read_ECC_status == ERROR_MULTIPLE_PAGES);
+	CHECK(flash.last_ECC_failure_page == 2 * W25N01GV_SIM_PAGES_PER_BLOCK + 5);
+
+	// A page that needed corrections, read with DMA chunks
+	w25n01gv_sim_inject_ecc(sim, 0, 3, 1);
+	reset_flash_read_pointer(&flash);
+	begin_continuous_flash_read(&flash);
+	intact = 1;
+	for (uint32_t page = 0; page < 5; page++) {
+		CHECK(start_continuous_flash_chunk_read(&flash, data, W25N01GV_BYTES_PER_PAGE) == W25N01GV_BYTES_PER_PAGE);
+		while (continuous_flash_chunk_read_busy(&flash))
+			w25n01gv_sim_advance(1000);
+		for (uint16_t i = 0; i < W25N01GV_BYTES_PER_PAGE; i++)
+			intact &= (data[i] == pattern_byte(page * W25N01GV_BYTES_PER_PAGE + i));
+	}
+	CHECK(intact);
+	CHECK(end_continuous_flash_read(&flash) == SUCCESS_WITH_CORRECTIONS);
+
+	reset_flash_read_pointer(&flash);
+	begin_continuous_flash_read(&flash);
+	CHECK(read_continuous_flash_chunk(&flash, data, sizeof(data)) == sizeof(data));
+	CHECK(end_continuous_flash_read(&flash) == SUCCESS_NO_CORRECTIONS);
+
+	// Buffer read mode is back for the rest of the library
+	CHECK(pattern_on_flash(&flash, num_bytes));
+	CHECK(sim->stats.protocol_errors == 0);
+}
+
+/**
+ * fc_set_flash_layout() only erases die 1's reserved block when nothing else
+ * is stored there, and fc_finish_flash_write() returns a failure count.
+ */
+static void test_fc_layout_keeps_reserved_pages(void) {
+	W25M02GV_Flash fc_flash;
+	fc_init_flash(&fc_flash, &hspi, &gpio, TEST_CS_PIN);
+	uint16_t reserved_page = 1023 * W25N01GV_SIM_PAGES_PER_BLOCK;
+
+	// The first layout is programmed without an erase
+	CHECK(fc_set_flash_layout(&fc_flash, W25M02GV_LAYOUT_STRIPED) == 0);
+	CHECK(sim->die[1].erase_count[1023] == 0);
+
+	// Replacing it would erase the settings on die 1
+	const char settings[] = "die 1 settings";
+	memcpy(w25n01gv_sim_page(sim, 1, reserved_page), settings, sizeof(settings));
+	CHECK(fc_set_flash_layout(&fc_flash, W25M02GV_LAYOUT_LINEAR) == 1);
+	CHECK(fc_flash.layout == W25M02GV_LAYOUT_STRIPED);
+	CHECK(memcmp(w25n01gv_sim_page(sim, 1, reserved_page), settings, sizeof(settings)) == 0);
+
+	uint8_t data[5000];
+	fill_pattern(data, 0, sizeof(data));
+	CHECK(fc_write_to_flash(&fc_flash, data, sizeof(data)) == 0);
+	CHECK(fc_finish_flash_write(&fc_flash) == 0);
+
+	// Erasing die 1's reserved pages drops the layout, so not under striped data
+	CHECK(fc_erase_reserved_flash_pages(&fc_flash, 1) == 1);
+	fc_erase_flash(&fc_flash);
+	CHECK(fc_erase_reserved_flash_pages(&fc_flash, 1) == 0);
+	CHECK(fc_flash.layout == W25M02GV_LAYOUT_LINEAR);
+	CHECK(fc_set_flash_layout(&fc_flash, W25M02GV_LAYOUT_STRIPED) == 0);
+
+	w25n01gv_sim_power_cycle(sim);
+	fc_init_flash(&fc_flash, &hspi, &gpio, TEST_CS_PIN);
+	CHECK(fc_flash.layout == W25M02GV_LAYOUT_STRIPED);
+}
+
+/**
+ * init_flash() starts searching for the write pointer at the latest
+ * checkpoint. If that one is corrupted it uses the one before it, and with
+ * none at all it searches from the start of flash.
+ */
+static void test_checkpoint_resume(void) {
+	W25N01GV_Flash flash;
+	uint16_t checkpoint_page = (W25N01GV_SIM_BLOCKS_PER_DIE - 2) * W25N01GV_SIM_PAGES_PER_BLOCK;
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+
+	uint32_t num_bytes = 1100 * W25N01GV_BYTES_PER_PAGE + 700;
+	write_pattern(&flash, 0, num_bytes, W25N01GV_BYTES_PER_PAGE);
+	finish_flash_write(&flash);
+	CHECK(flash.last_checkpoint_page == 1024);
+
+	w25n01gv_sim_power_cycle(sim);
+	w25n01gv_sim_clear_stats(sim);
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	uint64_t checkpoint_reads = sim->stats.page_reads;
+	CHECK(flash.last_checkpoint_page == 1024);
+	CHECK(flash.current_page == 1100 && flash.next_free_column == 2 * W25N01GV_SECTOR_SIZE);
+
+	// Checkpoint 1024 is in the second sector of the checkpoint block
+	w25n01gv_sim_page(sim, 0, checkpoint_page)[W25N01GV_SECTOR_SIZE + 5] ^= 0x01;
+	w25n01gv_sim_power_cycle(sim);
+	w25n01gv_sim_clear_stats(sim);
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	uint64_t fallback_reads = sim->stats.page_reads;
+	CHECK(flash.last_checkpoint_page == 512);
+	CHECK(flash.current_page == 1100 && flash.next_free_column == 2 * W25N01GV_SECTOR_SIZE);
+	CHECK(fallback_reads > checkpoint_reads);
+
+	memset(w25n01gv_sim_page(sim, 0, checkpoint_page), 0xFF, 2 * W25N01GV_SECTOR_SIZE);
+	w25n01gv_sim_power_cycle(sim);
+	w25n01gv_sim_clear_stats(sim);
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	CHECK(flash.last_checkpoint_page == 0);
+	CHECK(flash.current_page == 1100 && flash.next_free_column == 2 * W25N01GV_SECTOR_SIZE);
+	CHECK(sim->stats.page_reads > checkpoint_reads);
+
+	// The checkpoints are written again as the log goes on
+	write_pattern(&flash, num_bytes, 500 * W25N01GV_BYTES_PER_PAGE, W25N01GV_BYTES_PER_PAGE);
+	finish_flash_write(&flash);
+	num_bytes += 500 * W25N01GV_BYTES_PER_PAGE;
+	w25n01gv_sim_power_cycle(sim);
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	CHECK(flash.last_checkpoint_page == 1536);
+	CHECK(flash.current_page == 1600 && flash.next_free_column == 2 * W25N01GV_SECTOR_SIZE);
+	CHECK(pattern_on_flash(&flash, num_bytes));
+	CHECK(sim->stats.nop_violations == 0);
+}
+
+/**
+ * Each sector's metadata has its tag, valid bytes, sequence number and a
+ * CRC. After a reset, the write pointer and sequence number are recovered
+ * from the metadata, reading far less than a search of the page data.
+ */
+static void test_sector_metadata(void) {
+	W25N01GV_Flash flash;
+	uint8_t data[W25N01GV_BYTES_PER_PAGE];
+	W25N01GV_Sector_Metadata metadata[4];
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+
+	// 2 pages, then 700 bytes: a full sector and 188 bytes of the next
+	uint32_t num_bytes = 2 * W25N01GV_BYTES_PER_PAGE + 700;
+	write_pattern(&flash, 0, num_bytes, 100);
+	finish_flash_write(&flash);
+
+	CHECK(read_flash_page_metadata(&flash, 2, metadata) == 2);
+	CHECK(metadata[0].tag == W25N01GV_TAG_DATA && metadata[0].valid_bytes == W25N01GV_SECTOR_SIZE);
+	CHECK(metadata[0].sequence == 8 && metadata[1].sequence == 9);
+	CHECK(metadata[1].valid_bytes == 188 && !metadata[1].section_end);
+	CHECK(metadata[2].tag == W25N01GV_TAG_NONE && metadata[3].tag == W25N01GV_TAG_NONE);
+
+	// The CRC covers the sector's data
+	flash.next_page_to_read = 2;
+	read_next_2KB_from_flash(&flash, data);
+	CHECK(check_flash_sector_crc(&metadata[1], data + W25N01GV_SECTOR_SIZE));
+	data[W25N01GV_SECTOR_SIZE + 10] ^= 0x01;
+	CHECK(!check_flash_sector_crc(&metadata[1], data + W25N01GV_SECTOR_SIZE));
+	CHECK(!check_flash_sector_crc(&metadata[2], data + 2 * W25N01GV_SECTOR_SIZE));
+
+	// Records written with another tag are kept apart from the data
+	set_flash_record_tag(&flash, 5);
+	write_pattern(&flash, num_bytes, 100, 100);
+	finish_flash_write(&flash);
+	set_flash_record_tag(&flash, W25N01GV_TAG_DATA);
+	CHECK(read_flash_page_metadata(&flash, 2, metadata) == 3);
+	CHECK(metadata[2].tag == 5 && metadata[2].valid_bytes == 100 && metadata[2].sequence == 10);
+
+	// The write pointer and sequence number pick up where they left off
+	w25n01gv_sim_power_cycle(sim);
+	w25n01gv_sim_clear_stats(sim);
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	uint64_t metadata_init_bytes = sim->stats.spi_bytes;
+	CHECK(flash.current_page == 2 && flash.next_free_column == 3 * W25N01GV_SECTOR_SIZE);
+	CHECK(flash.next_sequence == 11);
+	write_pattern(&flash, num_bytes, 100, 100);
+	finish_flash_write(&flash);
+	CHECK(read_flash_page_metadata(&flash, 2, metadata) == 4 && metadata[3].sequence == 11);
+	CHECK(sim->stats.nop_violations == 0);
+
+	// The same pages written without metadata take a search of the page data
+	new_chip(1);
+	for (uint16_t page = 0; page < 3; page++)
+		memset(w25n01gv_sim_page(sim, 0, page), 0x55, W25N01GV_BYTES_PER_PAGE);
+	w25n01gv_sim_clear_stats(sim);
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	CHECK(flash.current_page == 3 && flash.next_free_column == 0);
+	CHECK(metadata_init_bytes * 10 < sim->stats.spi_bytes);
+}
+
+/**
+ * init_flash() reads the bad block table saved in the checkpoint block
+ * instead of every block's marker, and the table stays right after blocks
+ * are retired and the checkpoint block is erased.
+ */
+static void test_bad_block_table_saved(void) {
+	W25N01GV_Flash flash;
+	w25n01gv_sim_mark_bad_block(sim, 0, 5);
+	w25n01gv_sim_mark_bad_block(sim, 0, 700);
+
+	// The first boot reads every marker and saves them
+	w25n01gv_sim_clear_stats(sim);
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	CHECK(sim->stats.page_reads > 1024);
+	CHECK(flash.num_bad_blocks == 2);
+	uint8_t bad_blocks[sizeof(flash.bad_blocks)];
+	memcpy(bad_blocks, flash.bad_blocks, sizeof(bad_blocks));
+
+	w25n01gv_sim_power_cycle(sim);
+	w25n01gv_sim_clear_stats(sim);
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	CHECK(sim->stats.page_reads < 30);
+	CHECK(memcmp(bad_blocks, flash.bad_blocks, sizeof(bad_blocks)) == 0);
+
+	// A block retired at runtime is found in its record
+	write_pattern(&flash, 0, W25N01GV_BYTES_PER_PAGE, W25N01GV_BYTES_PER_PAGE);
+	w25n01gv_sim_fail_block(sim, 0, 0);
+	write_pattern(&flash, W25N01GV_BYTES_PER_PAGE, W25N01GV_BYTES_PER_PAGE, W25N01GV_BYTES_PER_PAGE);
+	CHECK(flash.retired_blocks == 1);
+
+	w25n01gv_sim_power_cycle(sim);
+	w25n01gv_sim_clear_stats(sim);
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	CHECK(sim->stats.page_reads < 30);
+	CHECK(flash.num_bad_blocks == 3);
+	CHECK(pattern_on_flash(&flash, 2 * W25N01GV_BYTES_PER_PAGE));
+
+	// Erasing the checkpoint block saves the table again
+	quick_erase_flash(&flash);
+	w25n01gv_sim_power_cycle(sim);
+	w25n01gv_sim_clear_stats(sim);
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	CHECK(sim->stats.page_reads < 30);
+	CHECK(flash.num_bad_blocks == 3);
+	CHECK(block_bad_in_table(&flash, 0) && block_bad_in_table(&flash, 5) && block_bad_in_table(&flash, 700));
+
+	// A corrupted table is ignored, and the markers are read again
+	uint8_t *table_page = w25n01gv_sim_page(sim, 0, 1022 * W25N01GV_SIM_PAGES_PER_BLOCK + 63);
+	table_page[2 * W25N01GV_SECTOR_SIZE + 10] ^= 0x01;
+	w25n01gv_sim_power_cycle(sim);
+	w25n01gv_sim_clear_stats(sim);
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	CHECK(sim->stats.page_reads > 1024);
+	CHECK(flash.num_bad_blocks == 3);
+}
+
+/**
+ * quick_erase_flash() only erases the first 2 blocks, and idle polls erase
+ * the rest ahead of the write pointer. The old data after the erased blocks
+ * is never mistaken for the log, even after a reset.
+ */
+static void test_erase_ahead(void) {
+	W25N01GV_Flash flash;
+	uint32_t block_bytes = W25N01GV_SIM_PAGES_PER_BLOCK * W25N01GV_BYTES_PER_PAGE;
+	uint32_t old_index = 12345;
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	write_pattern(&flash, old_index, 20 * block_bytes, W25N01GV_BYTES_PER_PAGE);
+	finish_flash_write(&flash);
+
+	w25n01gv_sim_clear_stats(sim);
+	CHECK(quick_erase_flash(&flash) == 0);
+	CHECK(sim->stats.block_erases == 3);  // The checkpoint block and blocks 0 and 1
+	CHECK(flash.erase_ahead_enabled && flash.current_page == 0);
+	CHECK(get_erased_bytes_remaining(&flash) == 2 * block_bytes);
+	CHECK(get_bytes_remaining(&flash) == get_flash_capacity(&flash));
+
+	// Each idle poll erases one more block, up to TEST_ERASE_AHEAD_BLOCKS after the write pointer's block
+	for (uint8_t i = 0; i < 20; i++) {
+		poll_async_flash_write(&flash);
+		wait_for_async_flash_write(&flash);
+	}
+	CHECK(flash.erase_ahead_block == 1 + TEST_ERASE_AHEAD_BLOCKS);
+	CHECK(get_erased_bytes_remaining(&flash) == (1 + TEST_ERASE_AHEAD_BLOCKS) * block_bytes);
+	CHECK(sim->die[0].erase_count[TEST_ERASE_AHEAD_BLOCKS] == 1);
+	CHECK(sim->die[0].erase_count[TEST_ERASE_AHEAD_BLOCKS + 1] == 0);
+
+	// Without polls, a block that isn't erased yet is erased when the write pointer gets to it
+	uint32_t num_bytes = 12 * block_bytes + 700;
+	write_pattern(&flash, 0, num_bytes, W25N01GV_BYTES_PER_PAGE);
+	finish_flash_write(&flash);
+	CHECK(pattern_on_flash(&flash, num_bytes));
+	CHECK(w25n01gv_sim_page(sim, 0, 14 * W25N01GV_SIM_PAGES_PER_BLOCK)[0] == pattern_byte(old_index + 14 * block_bytes));
+
+	w25n01gv_sim_power_cycle(sim);
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	CHECK(flash.erase_ahead_enabled);
+	CHECK(flash.current_page == 12 * W25N01GV_SIM_PAGES_PER_BLOCK);
+	CHECK(flash.next_free_column == 2 * W25N01GV_SECTOR_SIZE);
+	CHECK(pattern_on_flash(&flash, num_bytes));
+	CHECK(sim->stats.nop_violations == 0);
+}
+
+/**
+ * A key/value compaction writes the values into the other block and commits
+ * to it before the old block is erased, so the values survive a power loss
+ * at any point of it.
+ */
+static void test_kv_compaction_survives_power_loss(void) {
+	W25N01GV_Flash flash;
+	W25N01GV_KV_Store store;
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	init_flash_kv_store(&store, &flash);
+	CHECK(store.block == 1023);
+
+	// Filling the reserved block moves the store to the other block
+	CHECK(write_kv_pattern(&store, 300));
+	CHECK(store.block == 1021);
+	CHECK(store.generation == 1);
+	CHECK(store.num_compactions == 1);
+	CHECK(sim->die[0].erase_count[1021] == 1);
+	CHECK(sim->die[0].erase_count[1023] == 1);
+	CHECK(kv_holds_values(&store, 300));
+
+	w25n01gv_sim_power_cycle(sim);
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	init_flash_kv_store(&store, &flash);
+	CHECK(store.block == 1021);
+	CHECK(kv_holds_values(&store, 300));
+
+	// Power is lost while the new copy is programmed. The old block is still used.
+	w25n01gv_sim_tear_next_program(sim, 100);
+	CHECK(compact_flash_kv_store(&store) == KV_WRITE_FAILED);
+	CHECK(store.block == 1021);
+	CHECK(kv_holds_values(&store, 300));
+
+	w25n01gv_sim_power_cycle(sim);
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	init_flash_kv_store(&store, &flash);
+	CHECK(store.block == 1021);
+	CHECK(store.generation == 1);
+	CHECK(kv_holds_values(&store, 300));
+
+	CHECK(compact_flash_kv_store(&store) == KV_OK);
+	CHECK(store.block == 1023);
+	CHECK(store.generation == 2);
+
+	// The old block can't be erased, like a power loss after the commit. The newer copy wins.
+	w25n01gv_sim_fail_block(sim, 0, 1023);
+	CHECK(compact_flash_kv_store(&store) == KV_OK);
+	w25n01gv_sim_power_cycle(sim);
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	init_flash_kv_store(&store, &flash);
+	CHECK(store.block == 1021);
+	CHECK(store.generation == 3);
+	CHECK(kv_holds_values(&store, 300));
+
+	// erase_flash() leaves both blocks of the store alone
+	uint32_t alt_erases = sim->die[0].erase_count[1021];
+	erase_flash(&flash);
+	CHECK(sim->die[0].erase_count[1021] == alt_erases);
+	init_flash_kv_store(&store, &flash);
+	CHECK(kv_holds_values(&store, 300));
+	CHECK(sim->stats.nop_violations == 0);
+}
+
+/**
+ * Once a key/value store owns the reserved block, the raw reserved page
+ * functions can't write or erase it.
+ */
+static void test_kv_store_guards_reserved_block(void) {
+	W25N01GV_Flash flash;
+	W25N01GV_KV_Store store;
+	uint8_t page[W25N01GV_BYTES_PER_PAGE];
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+
+	// Before the store is set up, the raw functions work
+	memset(page, 0x5A, sizeof(page));
+	CHECK(write_reserved_flash_page(&flash, 10, page, sizeof(page)) == 0);
+	CHECK(erase_reserved_flash_pages(&flash) == 0);
+	CHECK(sim->die[0].erase_count[1023] == 1);
+
+	init_flash_kv_store(&store, &flash);
+	CHECK(write_kv_pattern(&store, 30));
+	w25n01gv_sim_clear_stats(sim);
+
+	CHECK(erase_reserved_flash_pages(&flash) == 1);
+	CHECK(write_reserved_flash_page(&flash, 10, page, sizeof(page)) == 1);
+	CHECK(sim->die[0].erase_count[1023] == 1);
+	CHECK(sim->stats.page_programs == 0);
+	CHECK(kv_holds_values(&store, 30));
+
+	// Reading is still allowed
+	read_reserved_flash_page(&flash, 10, page, sizeof(page));
+	CHECK(page[0] == 0xFF);
+
+	w25n01gv_sim_power_cycle(sim);
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	init_flash_kv_store(&store, &flash);
+	CHECK(kv_holds_values(&store, 30));
+}
+
+/**
+ * A record reserved across the end of a sector is committed into the next
+ * sector, and flash ends up with the same data as with write_to_flash(),
+ * in blocking and async mode.
+ */
+static void test_reserve_commit_crosses_sector(void) {
+	W25N01GV_Flash flash;
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	CHECK(reserve_flash_write(&flash, W25N01GV_MAX_RESERVE_SIZE + 1) == NULL);
+
+	write_pattern(&flash, 0, 500, 500);
+	w25n01gv_sim_clear_stats(sim);
+
+	// Only 40 of the 100 bytes reserved are used, 28 of them in the next sector
+	uint8_t *record = reserve_flash_write(&flash, 100);
+	CHECK(record != NULL);
+	fill_pattern(record, 500, 100);
+	CHECK(commit_flash_write(&flash, 40) == 0);
+	CHECK(sim->stats.page_programs == 1);
+	CHECK(flash.write_buffer_size == 28);
+	uint32_t index = 540;
+
+	enable_async_flash_write(&flash, NULL);
+	for (uint16_t i = 0; i < 40; i++) {
+		uint16_t size = 1 + (i * 53) % W25N01GV_MAX_RESERVE_SIZE;
+		record = reserve_flash_write(&flash, size);
+		fill_pattern(record, index, size);
+		commit_flash_write(&flash, size);
+		poll_async_flash_write(&flash);
+		index += size;
+	}
+	finish_flash_write(&flash);
+	CHECK(disable_async_flash_write(&flash) == 0);
+
+	CHECK(pattern_on_flash(&flash, index));
+	uint8_t sector[W25N01GV_SECTOR_SIZE];
+	fill_pattern(sector, 0, W25N01GV_SECTOR_SIZE);
+	CHECK(memcmp(w25n01gv_sim_page(sim, 0, 0), sector, W25N01GV_SECTOR_SIZE) == 0);
+	CHECK(sim->stats.nop_violations == 0);
+}
+
+/**
+ * A W25M02GV behind a transport selects dies, boots and writes through the
+ * transport only, with page data on 4 lines.
+ */
+static void test_fc_transport(void) {
+	W25M02GV_Flash fc_flash;
+	w25n01gv_sim_attach_transport(sim);
+	fc_init_flash_with_transport(&fc_flash, w25n01gv_sim_transport, 4);
+	CHECK(fc_ping_flash(&fc_flash));
+	CHECK(fc_flash.flash0.SPI_bus == NULL && fc_flash.flash1.SPI_bus == NULL);
+	CHECK(fc_set_flash_layout(&fc_flash, W25M02GV_LAYOUT_STRIPED) == 0);
+
+	// 5 pages alternate dies, the last one partly full
+	uint8_t data[W25N01GV_BYTES_PER_PAGE];
+	uint32_t total = 4 * W25N01GV_BYTES_PER_PAGE + 700;
+	for (uint32_t written = 0; written < total; written += 1000) {
+		uint16_t size = (total - written < 1000) ? total - written : 1000;
+		fill_pattern(data, written, size);
+		CHECK(fc_write_to_flash(&fc_flash, data, size) == 0);
+	}
+	CHECK(fc_finish_flash_write(&fc_flash) == 0);
+	CHECK(w25n01gv_sim_page(sim, 0, 2)[0] == pattern_byte(4 * W25N01GV_BYTES_PER_PAGE));
+	CHECK(w25n01gv_sim_page(sim, 1, 1)[0] == pattern_byte(3 * W25N01GV_BYTES_PER_PAGE));
+	CHECK(hspi.bytes_transferred == 0);
+
+	w25n01gv_sim_power_cycle(sim);
+	fc_init_flash_with_transport(&fc_flash, w25n01gv_sim_transport, 4);
+	CHECK(fc_flash.layout == W25M02GV_LAYOUT_STRIPED);
+	CHECK(fc_flash.current_write_die == 0);
+
+	fc_reset_flash_read_pointer(&fc_flash);
+	uint8_t intact = 1;
+	for (uint32_t page = 0; page < 5; page++) {
+		fc_read_next_2KB_from_flash(&fc_flash, data);
+		uint16_t size = (page < 4) ? W25N01GV_BYTES_PER_PAGE : 700;
+		for (uint16_t i = 0; i < size; i++)
+			intact &= (data[i] == pattern_byte(page * W25N01GV_BYTES_PER_PAGE + i));
+	}
+	CHECK(intact);
+	CHECK(sim->stats.nop_violations == 0);
+	CHECK(sim->stats.protocol_errors == 0);
+}
+
+/**
+ * The simulated time the benchmark reports comes from the SPI clock and the
+ * chip's busy times: a blocking page write costs its page data transfer and
+ * one program, and a continuous read only its transfers.
+ */
+static void test_bench_timing_model(void) {
+	W25N01GV_Flash flash;
+	uint8_t data[W25N01GV_BYTES_PER_PAGE];
+	uint64_t page_transfer_ns = (uint64_t) W25N01GV_BYTES_PER_PAGE * 8 * 1000000000u / hspi.clock_hz;
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+
+	fill_pattern(data, 0, W25N01GV_BYTES_PER_PAGE);
+	w25n01gv_sim_clear_stats(sim);
+	uint64_t start = w25n01gv_sim_time_ns();
+	write_to_flash(&flash, data, W25N01GV_BYTES_PER_PAGE);
+	uint64_t elapsed = w25n01gv_sim_time_ns() - start;
+	uint64_t expected = sim->timing.page_program_ns + page_transfer_ns;
+	CHECK(sim->stats.page_programs == 1);
+	CHECK(elapsed >= expected && elapsed < expected * 11 / 10);
+
+	write_pattern(&flash, W25N01GV_BYTES_PER_PAGE, 63 * W25N01GV_BYTES_PER_PAGE, W25N01GV_BYTES_PER_PAGE);
+	for (uint8_t clock_mhz = 20; clock_mhz <= 40; clock_mhz += 20) {
+		hspi.clock_hz = clock_mhz * 1000000u;
+		reset_flash_read_pointer(&flash);
+		w25n01gv_sim_clear_stats(sim);
+		start = w25n01gv_sim_time_ns();
+		begin_continuous_flash_read(&flash);
+		for (uint8_t page = 0; page < 64; page++)
+			read_continuous_flash_chunk(&flash, data, W25N01GV_BYTES_PER_PAGE);
+		end_continuous_flash_read(&flash);
+		elapsed = w25n01gv_sim_time_ns() - start;
+		expected = 64 * page_transfer_ns * 20 / clock_mhz;
+		CHECK(sim->stats.page_reads == 1 && sim->stats.continuous_pages >= 63);
+		CHECK(elapsed >= expected && elapsed < expected * 21 / 20);
+	}
+	CHECK(pattern_on_flash(&flash, 64 * W25N01GV_BYTES_PER_PAGE));
+}
+
+/**
+ * With statistics on, every page load, program and erase is timed, and ECC
+ * results and failures are counted in total and for each block.
+ * pack_flash_stats() packs them big-endian and saturates the counts.
+ */
+static void test_stats_packing(void) {
+	static W25N01GV_Stats stats;
+	W25N01GV_Flash flash;
+	uint8_t packed[W25N01GV_STATS_PACKED_SIZE];
+	uint8_t data[W25N01GV_BYTES_PER_PAGE];
+	uint32_t block_bytes = W25N01GV_SIM_PAGES_PER_BLOCK * W25N01GV_BYTES_PER_PAGE;
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	CHECK(pack_flash_stats(&flash, packed) == 0);
+
+	enable_flash_stats(&flash, &stats);
+	write_pattern(&flash, 0, 3 * block_bytes, W25N01GV_BYTES_PER_PAGE);
+	w25n01gv_sim_fail_block(sim, 0, 3);
+	write_pattern(&flash, 3 * block_bytes, W25N01GV_BYTES_PER_PAGE, W25N01GV_BYTES_PER_PAGE);
+	finish_flash_write(&flash);
+	CHECK(stats.program_failures >= 1 && stats.block_failures[3] == stats.program_failures);
+	CHECK(stats.program.count >= 3 * W25N01GV_SIM_PAGES_PER_BLOCK);
+
+	w25n01gv_sim_inject_ecc(sim, 0, 5, 1);
+	w25n01gv_sim_inject_ecc(sim, 0, W25N01GV_SIM_PAGES_PER_BLOCK + 6, 1);
+	w25n01gv_sim_inject_ecc(sim, 0, W25N01GV_SIM_PAGES_PER_BLOCK + 7, 1);
+	w25n01gv_sim_inject_ecc(sim, 0, 2 * W25N01GV_SIM_PAGES_PER_BLOCK + 8, 2);
+	reset_flash_read_pointer(&flash);
+	for (uint16_t page = 0; page <= 3 * W25N01GV_SIM_PAGES_PER_BLOCK; page++)
+		read_next_2KB_from_flash(&flash, data);
+	CHECK(stats.ECC_corrections == 3 && stats.block_ECC_corrections[1] == 2);
+	CHECK(stats.ECC_failures == 1 && stats.block_failures[2] == 1);
+	CHECK(stats.page_load.count >= 3 * W25N01GV_SIM_PAGES_PER_BLOCK + 1);
+	CHECK(stats.page_load.min_cycles <= stats.page_load.max_cycles);
+
+	CHECK(pack_flash_stats(&flash, packed) == W25N01GV_STATS_PACKED_SIZE);
+	uint16_t average_load_us = (uint16_t) (packed[0] << 8 | packed[1]);
+	uint16_t average_program_us = (uint16_t) (packed[4] << 8 | packed[5]);
+	CHECK(average_load_us >= sim->timing.page_read_ns / 1000 && average_load_us < 2 * sim->timing.page_read_ns / 1000);
+	CHECK(average_program_us >= sim->timing.page_program_ns / 1000
+			&& average_program_us < 2 * sim->timing.page_program_ns / 1000);
+	CHECK((uint32_t) (packed[12] << 24 | packed[13] << 16 | packed[14] << 8 | packed[15]) == stats.busy_polls);
+	CHECK(packed[16] == 0 && packed[17] == 3);
+	CHECK(packed[18] == 0 && packed[19] == 1);
+	CHECK(packed[20] == 0 && packed[21] == stats.program_failures);
+	CHECK(packed[24] == 0 && packed[25] == 3);  // The block that failed to program
+	CHECK(packed[26] == stats.program_failures);
+
+	stats.ECC_corrections = 70000;
+	pack_flash_stats(&flash, packed);
+	CHECK(packed[16] == 0xFF && packed[17] == 0xFF);
+
+	disable_flash_stats(&flash);
+	CHECK(pack_flash_stats(&flash, packed) == 0);
+	CHECK(stats.ECC_failures == 1);
+}
+
+/**
+ * With a poll interval, the status register is read once per interval and
+ * the yield callback runs in between. A chip still busy after the datasheet
+ * maximum makes the wait time out, and the read is reported as failed.
+ */
+static void test_busy_wait_timeout(void) {
+	W25N01GV_Flash flash;
+	uint8_t data[W25N01GV_BYTES_PER_PAGE];
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+
+	fill_pattern(data, 0, W25N01GV_BYTES_PER_PAGE);
+	w25n01gv_sim_clear_stats(sim);
+	write_to_flash(&flash, data, W25N01GV_BYTES_PER_PAGE);
+	uint64_t back_to_back_polls = sim->stats.status_reads;
+
+	set_flash_busy_wait(&flash, 50, yield_10us);
+	yield_calls = 0;
+	fill_pattern(data, W25N01GV_BYTES_PER_PAGE, W25N01GV_BYTES_PER_PAGE);
+	w25n01gv_sim_clear_stats(sim);
+	write_to_flash(&flash, data, W25N01GV_BYTES_PER_PAGE);
+	CHECK(sim->stats.status_reads * 10 < back_to_back_polls);
+	CHECK(yield_calls >= sim->timing.page_program_ns / 10000);
+	CHECK(flash.last_wait_timed_out == 0 && flash.wait_timeouts == 0);
+
+	// Page loads take up to 60 us
+	sim->timing.page_read_ns = 200000;
+	reset_flash_read_pointer(&flash);
+	read_next_2KB_from_flash(&flash, data);
+	CHECK(flash.last_read_ECC_status == READ_ERROR_NO_ECC_STATUS);
+	CHECK(flash.last_wait_timed_out == 1 && flash.wait_timeouts == 1);
+
+	sim->timing.page_read_ns = 60000;
+	read_next_2KB_from_flash(&flash, data);
+	CHECK(flash.last_read_ECC_status == SUCCESS_NO_CORRECTIONS);
+	CHECK(flash.last_wait_timed_out == 0 && flash.wait_timeouts == 1);
+	CHECK(data[0] == pattern_byte(W25N01GV_BYTES_PER_PAGE));
+	CHECK(sim->stats.protocol_errors == 0);
+}
+
+/**
+ * After a reset, a circular log knows which blocks ahead of the write pointer
+ * are still erased, both on the first lap and once it has wrapped around, so
+ * nothing is erased twice and the oldest page is found with one read.
+ */
+static void test_circular_reboot_keeps_erased_blocks(void) {
+	W25N01GV_Flash flash;
+	uint32_t block_bytes = W25N01GV_SIM_PAGES_PER_BLOCK * W25N01GV_BYTES_PER_PAGE;
+	uint16_t num_data_blocks = W25N01GV_NUM_PAGES / W25N01GV_SIM_PAGES_PER_BLOCK;
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	CHECK(start_circular_flash_log(&flash) == 0);
+
+	// First lap: everything after the write pointer is still erased
+	write_pattern(&flash, 0, 3 * block_bytes + 5 * W25N01GV_BYTES_PER_PAGE, W25N01GV_BYTES_PER_PAGE);
+	uint16_t erase_ahead_block = flash.erase_ahead_block;
+	CHECK(erase_ahead_block == num_data_blocks);
+
+	w25n01gv_sim_power_cycle(sim);
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	CHECK(flash.circular_log_enabled);
+	CHECK(flash.erase_ahead_block == erase_ahead_block);
+
+	w25n01gv_sim_clear_stats(sim);
+	reset_flash_read_pointer(&flash);
+	CHECK(sim->stats.page_reads == 1);
+	CHECK(flash.next_page_to_read == 0);
+	CHECK(pattern_on_flash(&flash, 3 * block_bytes + 5 * W25N01GV_BYTES_PER_PAGE));
+
+	w25n01gv_sim_clear_stats(sim);
+	for (uint8_t i = 0; i < 20; i++) {
+		poll_async_flash_write(&flash);
+		wait_for_async_flash_write(&flash);
+	}
+	CHECK(sim->stats.block_erases == 0);
+
+	// Wrapped around: idle time erases up to W25N01GV_ERASE_AHEAD_BLOCKS blocks of old data
+	uint32_t written = 3 * block_bytes + 5 * W25N01GV_BYTES_PER_PAGE;
+	write_pattern(&flash, written, (uint32_t) num_data_blocks * block_bytes - written + block_bytes,
+			W25N01GV_BYTES_PER_PAGE);
+	CHECK(flash.current_page / W25N01GV_SIM_PAGES_PER_BLOCK == 1);
+	for (uint8_t i = 0; i < 20; i++) {
+		poll_async_flash_write(&flash);
+		wait_for_async_flash_write(&flash);
+	}
+	erase_ahead_block = flash.erase_ahead_block;
+	CHECK(erase_ahead_block == 2 + TEST_ERASE_AHEAD_BLOCKS);
+
+	w25n01gv_sim_power_cycle(sim);
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	CHECK(flash.erase_ahead_block == erase_ahead_block);
+
+	w25n01gv_sim_clear_stats(sim);
+	reset_flash_read_pointer(&flash);
+	CHECK(sim->stats.page_reads == 1);
+	CHECK(flash.next_page_to_read == (uint32_t) erase_ahead_block * W25N01GV_SIM_PAGES_PER_BLOCK);
+
+	w25n01gv_sim_clear_stats(sim);
+	for (uint8_t i = 0; i < 20; i++) {
+		poll_async_flash_write(&flash);
+		wait_for_async_flash_write(&flash);
+	}
+	CHECK(sim->stats.block_erases == 0);
+	CHECK(sim->stats.nop_violations == 0);
+}
+
+/**
+ * seek_flash_to_time() skips pages without a timestamp, here the ones being
+ * written at a reset, instead of counting them as after the time it's
+ * looking for.
+ */
+static void test_seek_skips_unstamped_pages(void) {
+	W25N01GV_Flash flash;
+	uint8_t data[W25N01GV_SECTOR_SIZE];
+	uint32_t index = 0;
+	test_time = 0x10000000;
+
+	// A page being written at a reset is stamped again when writing resumes, and
+	// only the high half of the time in sector 1 is left from before.
+	// 9 sectors per boot, so writing resumes in a different sector of the page each time
+	for (uint8_t boot = 0; boot < 60; boot++) {
+		init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+		set_flash_time_source(&flash, get_test_time);
+		for (uint8_t sector = 0; sector < 9; sector++) {
+			fill_pattern(data, index, sizeof(data));
+			write_to_flash(&flash, data, sizeof(data));
+			index += sizeof(data);
+			test_time += 0x10000;  // Changes the high half
+		}
+		finish_flash_write(&flash);
+		w25n01gv_sim_power_cycle(sim);
+	}
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+
+	uint32_t num_unstamped = 0;
+	uint32_t page_time;
+	for (uint32_t page = 0; page < flash.current_page; page++)
+		num_unstamped += !read_flash_page_time(&flash, page, &page_time);
+	CHECK(num_unstamped >= 20);
+
+	uint8_t all_found = 1;
+	for (uint32_t time = 0x10000000; time < test_time + 0x10000; time += 0x4000) {
+		all_found &= seek_flash_to_time(&flash, time);
+		all_found &= (flash.next_page_to_read == last_page_stamped_by(&flash, time));
+	}
+	CHECK(all_found);
+	CHECK(!seek_flash_to_time(&flash, 0x0FFFFFFF));
+}
+
+/**
+ * add_test_delimiter() marks the end of a test in the metadata of its last
+ * sector, or of an empty sector if the buffer is empty, and padding is left
+ * erased. read_next_valid_data_from_flash() stops at each test end.
+ */
+static void test_delimiter_marks_metadata(void) {
+	W25N01GV_Flash flash;
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+
+	// Ends in the middle of sector 1, so the flag goes on it
+	write_pattern(&flash, 0, 700, 100);
+	add_test_delimiter(&flash);
+	CHECK(flash.current_page == 0 && flash.next_free_column == 2 * W25N01GV_SECTOR_SIZE);
+
+	// Ends on a sector boundary, so the flag goes on an empty sector
+	write_pattern(&flash, 700, 2 * W25N01GV_SECTOR_SIZE, 256);
+	add_test_delimiter(&flash);
+	CHECK(flash.current_page == 1 && flash.next_free_column == W25N01GV_SECTOR_SIZE);
+
+	// The same in async mode
+	enable_async_flash_write(&flash, NULL);
+	write_pattern(&flash, 1724, 300, 100);
+	add_test_delimiter(&flash);
+	CHECK(disable_async_flash_write(&flash) == 0);
+	CHECK(flash.current_page == 1 && flash.next_free_column == 2 * W25N01GV_SECTOR_SIZE);
+
+	uint8_t page[W25N01GV_BYTES_PER_PAGE];
+	reset_flash_read_pointer(&flash);
+	read_next_2KB_from_flash(&flash, page);
+	uint8_t padding_erased = 1;
+	for (uint16_t i = 700; i < W25N01GV_SECTOR_SIZE * 2; i++)
+		padding_erased &= (page[i] == 0xFF);
+	CHECK(padding_erased);
+
+	W25N01GV_Sector_Metadata metadata[4];
+	CHECK(read_flash_page_metadata(&flash, 0, metadata) == 4);
+	CHECK(metadata[1].tag == W25N01GV_TAG_DATA && metadata[1].valid_bytes == 188 && metadata[1].section_end);
+	CHECK(metadata[3].tag == W25N01GV_TAG_DATA && !metadata[3].section_end);
+	CHECK(read_flash_page_metadata(&flash, 1, metadata) == 2);
+	CHECK(metadata[0].tag == W25N01GV_TAG_DELIMITER && metadata[0].valid_bytes == 0 && metadata[0].section_end);
+	CHECK(metadata[1].tag == W25N01GV_TAG_DATA && metadata[1].valid_bytes == 300 && metadata[1].section_end);
+
+	// Each test comes back on its own, even when it ends in the middle of a page
+	uint32_t test_sizes[3] = {700, 2 * W25N01GV_SECTOR_SIZE, 300};
+	uint32_t index = 0;
+	uint8_t intact = 1;
+	reset_flash_read_pointer(&flash);
+	for (uint8_t test = 0; test < 3; test++) {
+		uint32_t test_bytes = 0;
+		do {
+			uint16_t size = read_next_valid_data_from_flash(&flash, page);
+			for (uint16_t i = 0; i < size; i++, index++, test_bytes++)
+				intact &= (page[i] == pattern_byte(index));
+		} while (!flash.test_end_read && flash.next_page_to_read < 2);
+		CHECK(flash.test_end_read);
+		CHECK(test_bytes == test_sizes[test]);
+	}
+	CHECK(intact);
+	CHECK(read_next_valid_data_from_flash(&flash, page) == 0 && !flash.test_end_read);
+}
+
+/**
+ * A page torn by a power loss in the middle of a circular log's second lap
+ * is skipped after the reset instead of being programmed over.
+ */
+static void test_circular_skips_torn_page(void) {
+	W25N01GV_Flash flash;
+	uint32_t block_bytes = W25N01GV_SIM_PAGES_PER_BLOCK * W25N01GV_BYTES_PER_PAGE;
+	uint32_t lap_bytes = (W25N01GV_NUM_PAGES / W25N01GV_SIM_PAGES_PER_BLOCK) * block_bytes;
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	start_circular_flash_log(&flash);
+
+	// Power is lost while sector 1 of a page is programmed, 10 blocks into the second lap
+	uint32_t index = lap_bytes + 10 * block_bytes + W25N01GV_SECTOR_SIZE;
+	write_pattern(&flash, 0, index, W25N01GV_SECTOR_SIZE);
+	uint32_t torn_page = flash.current_page;
+	CHECK(torn_page == 10 * W25N01GV_SIM_PAGES_PER_BLOCK && flash.next_free_column == W25N01GV_SECTOR_SIZE);
+	w25n01gv_sim_tear_next_program(sim, W25N01GV_SECTOR_SIZE + 100);
+	write_pattern(&flash, index, W25N01GV_SECTOR_SIZE, W25N01GV_SECTOR_SIZE);
+
+	w25n01gv_sim_power_cycle(sim);
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	CHECK(flash.torn_page_skipped);
+	CHECK(flash.current_page == torn_page + 1 && flash.next_free_column == 0);
+
+	// Nothing is programmed twice, and the data after the reset reads back
+	w25n01gv_sim_clear_stats(sim);
+	index += W25N01GV_SECTOR_SIZE;
+	write_pattern(&flash, index, W25N01GV_BYTES_PER_PAGE, W25N01GV_SECTOR_SIZE);
+	finish_flash_write(&flash);
+	CHECK(sim->stats.nop_violations == 0);
+
+	uint8_t data[W25N01GV_BYTES_PER_PAGE];
+	flash.next_page_to_read = torn_page;
+	CHECK(read_next_valid_data_from_flash(&flash, data) == W25N01GV_SECTOR_SIZE);
+	CHECK(flash.invalid_sectors_skipped == 1);
+	CHECK(read_next_valid_data_from_flash(&flash, data) == W25N01GV_BYTES_PER_PAGE);
+	uint8_t intact = 1;
+	for (uint16_t i = 0; i < W25N01GV_BYTES_PER_PAGE; i++)
+		intact &= (data[i] == pattern_byte(index + i));
+	CHECK(intact);
+}
+
+/**
+ * After a power loss tears a page on one chip of an array, the chip skips
+ * the page and the others are padded to match, so data written after the
+ * reset reads back in order.
+ */
+static void test_array_realigns_after_torn_page(void) {
+	SPI_HandleTypeDef buses[3];
+	GPIO_TypeDef cs_base;
+	W25N01GV_Sim *sims[3];
+	SPI_HandleTypeDef *SPI_buses[3] = { &buses[0], &buses[1], &buses[2] };
+	GPIO_TypeDef *cs_bases[3] = { &cs_base, &cs_base, &cs_base };
+	uint16_t cs_pins[3] = { GPIO_PIN_0, GPIO_PIN_1, GPIO_PIN_2 };
+	W25N01GV_Array array;
+	uint8_t data[W25N01GV_BYTES_PER_PAGE];
+
+	memset(buses, 0, sizeof(buses));
+	memset(&cs_base, 0, sizeof(cs_base));
+	for (uint8_t i = 0; i < 3; i++) {
+		sims[i] = w25n01gv_sim_create(NULL, 1);
+		w25n01gv_sim_attach(sims[i], &buses[i], &cs_base, cs_pins[i]);
+	}
+	array_init_flash(&array, 3, SPI_buses, cs_bases, cs_pins);
+
+	// Sectors 0-2, then 3-5 with power lost while sector 4 is programmed to chip 1's second sector
+	fill_pattern(data, 0, 3 * W25N01GV_SECTOR_SIZE);
+	array_write_to_flash(&array, data, 3 * W25N01GV_SECTOR_SIZE);
+	array_finish_flash_write(&array);
+	w25n01gv_sim_tear_next_program(sims[1], W25N01GV_SECTOR_SIZE + 100);
+	fill_pattern(data, 3 * W25N01GV_SECTOR_SIZE, 3 * W25N01GV_SECTOR_SIZE);
+	array_write_to_flash(&array, data, 3 * W25N01GV_SECTOR_SIZE);
+	array_finish_flash_write(&array);
+
+	// Chip 1 goes on at its second page, so the stripe goes on at sector 11
+	for (uint8_t i = 0; i < 3; i++)
+		w25n01gv_sim_power_cycle(sims[i]);
+	array_init_flash(&array, 3, SPI_buses, cs_bases, cs_pins);
+	CHECK(array.chips[1].torn_page_skipped);
+	CHECK(array.current_write_chip == 2);
+	for (uint8_t sector = 0; sector < 9; sector++) {
+		fill_pattern(data, (6 + sector) * W25N01GV_SECTOR_SIZE, W25N01GV_SECTOR_SIZE);
+		array_write_to_flash(&array, data, W25N01GV_SECTOR_SIZE);
+	}
+	array_finish_flash_write(&array);
+	CHECK(array_flash_current_page(&array) == 5);
+
+	// The padding is tagged so metadata readers skip it: sectors 6 and 9 on chip 0, 8 on chip 2
+	W25N01GV_Sector_Metadata metadata[4];
+	read_flash_page_metadata(&array.chips[0], 0, metadata);
+	CHECK(metadata[1].tag == W25N01GV_TAG_DATA);
+	CHECK(metadata[2].tag == W25N01GV_TAG_PADDING && metadata[2].valid_bytes == 0);
+	CHECK(metadata[3].tag == W25N01GV_TAG_PADDING && metadata[3].valid_bytes == 0);
+	read_flash_page_metadata(&array.chips[2], 0, metadata);
+	CHECK(metadata[2].tag == W25N01GV_TAG_PADDING && metadata[2].valid_bytes == 0);
+	CHECK(metadata[3].tag == W25N01GV_TAG_DATA);
+	reset_flash_read_pointer(&array.chips[0]);
+	CHECK(read_next_valid_data_from_flash(&array.chips[0], data) == 2 * W25N01GV_SECTOR_SIZE);
+
+	// Sectors 6-10 are padding or unwritten, and the data picks up again at 11
+	uint8_t in_order = 1;
+	array_reset_flash_read_pointer(&array);
+	for (uint32_t page = 0; page <= array_flash_current_page(&array); page++) {
+		array_read_next_2KB_from_flash(&array, data);
+		for (uint8_t s = 0; s < 4; s++) {
+			uint32_t sector = page * 4 + s;
+			uint32_t data_sector = sector;
+			if (sector == 4 || (sector >= 6 && sector < 11))
+				continue;
+			if (sector >= 11)
+				data_sector = sector - 5;
+			if (data_sector >= 15)
+				break;
+			for (uint16_t b = 0; b < W25N01GV_SECTOR_SIZE; b++)
+				in_order &= (data[s * W25N01GV_SECTOR_SIZE + b] == pattern_byte(data_sector * W25N01GV_SECTOR_SIZE + b));
+		}
+	}
+	CHECK(in_order);
+
+	for (uint8_t i = 0; i < 3; i++) {
+		CHECK(sims[i]->stats.nop_violations == 0);
+		w25n01gv_sim_destroy(sims[i]);
+	}
+}
+
+/**
+ * fc_erase_flash() erases both dies at the same time, so it takes about as
+ * long as one die, and fc_scan_bad_blocks() numbers die 1's bad blocks from 1024.
+ */
+static void test_fc_parallel_erase(void) {
+	static uint16_t bad_blocks[2 * W25N01GV_SIM_BLOCKS_PER_DIE];
+	W25M02GV_Flash fc_flash;
+	w25n01gv_sim_mark_bad_block(sim, 0, 7);
+	w25n01gv_sim_mark_bad_block(sim, 1, 5);
+	fc_init_flash(&fc_flash, &hspi, &gpio, TEST_CS_PIN);
+	CHECK(fc_set_flash_layout(&fc_flash, W25M02GV_LAYOUT_STRIPED) == 0);
+
+	uint8_t data[5000];
+	fill_pattern(data, 0, sizeof(data));
+	CHECK(fc_write_to_flash(&fc_flash, data, sizeof(data)) == 0);
+	CHECK(fc_finish_flash_write(&fc_flash) == 0);
+	CHECK(w25n01gv_sim_page(sim, 1, 0)[0] == pattern_byte(W25N01GV_BYTES_PER_PAGE));
+
+	CHECK(fc_scan_bad_blocks(&fc_flash, bad_blocks) == 2);
+	CHECK(bad_blocks[0] == 7 && bad_blocks[1] == W25N01GV_SIM_BLOCKS_PER_DIE + 5);
+
+	w25n01gv_sim_fail_block(sim, 1, 300);
+	w25n01gv_sim_clear_stats(sim);
+	uint64_t start = w25n01gv_sim_time_ns();
+	CHECK(fc_erase_flash(&fc_flash) == 1);
+	uint64_t elapsed = w25n01gv_sim_time_ns() - start;
+	CHECK(elapsed < (uint64_t) W25N01GV_SIM_BLOCKS_PER_DIE * sim->timing.block_erase_ns * 11 / 10);
+	CHECK(sim->stats.block_erases > 2 * (W25N01GV_SIM_BLOCKS_PER_DIE - 4));
+
+	CHECK(w25n01gv_sim_page(sim, 0, 0)[0] == 0xFF && w25n01gv_sim_page(sim, 1, 0)[0] == 0xFF);
+	CHECK(sim->die[0].erase_count[7] == 0 && sim->die[1].erase_count[5] == 0);
+	CHECK(sim->stats.ignored_commands == 0 && sim->stats.protocol_errors == 0);
+}
+
+/**
+ * write_flash_event() puts an event on flash right away in a sector of its
+ * own, without touching the bulk data in the write buffer.
+ */
+static void test_event_records(void) {
+	W25N01GV_Flash flash;
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	w25n01gv_sim_clear_stats(sim);
+
+	uint8_t abort_event[] = "ABORT";
+	uint8_t valve_event[] = "VALVE 3 OPEN";
+
+	// The event is on flash when the call returns, and the 300 bytes before it stay buffered
+	write_pattern(&flash, 0, 300, 100);
+	CHECK(write_flash_event(&flash, abort_event, sizeof(abort_event)) == 0);
+	CHECK(sim->stats.page_programs == 1);
+	CHECK(flash.write_buffer_size == 300);
+	CHECK(flash.next_free_column == W25N01GV_SECTOR_SIZE);
+
+	// In async mode it goes out after the sector in flight
+	enable_async_flash_write(&flash, NULL);
+	write_pattern(&flash, 300, W25N01GV_SECTOR_SIZE, 256);
+	CHECK(flash.async_state != ASYNC_WRITE_IDLE);
+	CHECK(write_flash_event(&flash, valve_event, sizeof(valve_event)) == 0);
+	CHECK(flash.async_state != ASYNC_WRITE_IDLE);
+	wait_for_async_flash_write(&flash);
+	CHECK(sim->stats.page_programs == 3);
+	write_pattern(&flash, 300 + W25N01GV_SECTOR_SIZE, 1000, 100);
+	finish_flash_write(&flash);
+	CHECK(disable_async_flash_write(&flash) == 0);
+
+	W25N01GV_Sector_Metadata metadata[4];
+	CHECK(read_flash_page_metadata(&flash, 0, metadata) == 4);
+	CHECK(metadata[0].tag == W25N01GV_TAG_EVENT && metadata[0].valid_bytes == sizeof(abort_event));
+	CHECK(metadata[1].tag == W25N01GV_TAG_DATA && metadata[1].valid_bytes == W25N01GV_SECTOR_SIZE);
+	CHECK(metadata[2].tag == W25N01GV_TAG_EVENT && metadata[2].valid_bytes == sizeof(valve_event));
+
+	// The rest of an event's sector is left erased
+	uint8_t page[W25N01GV_BYTES_PER_PAGE];
+	reset_flash_read_pointer(&flash);
+	read_next_2KB_from_flash(&flash, page);
+	uint8_t padding_erased = 1;
+	for (uint16_t i = sizeof(abort_event); i < W25N01GV_SECTOR_SIZE; i++)
+		padding_erased &= (page[i] == 0xFF);
+	CHECK(padding_erased);
+
+	// The events and the bulk data read back separately
+	reset_flash_read_pointer(&flash);
+	CHECK(read_next_tagged_data_from_flash(&flash, page, W25N01GV_TAG_EVENT) == sizeof(abort_event) + sizeof(valve_event));
+	CHECK(memcmp(page, abort_event, sizeof(abort_event)) == 0);
+	CHECK(memcmp(page + sizeof(abort_event), valve_event, sizeof(valve_event)) == 0);
+
+	uint32_t index = 0;
+	uint8_t intact = 1;
+	reset_flash_read_pointer(&flash);
+	while (flash.next_page_to_read < 2) {
+		uint16_t size = read_next_tagged_data_from_flash(&flash, page, W25N01GV_TAG_DATA);
+		for (uint16_t i = 0; i < size; i++, index++)
+			intact &= (page[i] == pattern_byte(index));
+	}
+	CHECK(intact);
+	CHECK(index == 1300 + W25N01GV_SECTOR_SIZE);
+	CHECK(sim->stats.nop_violations == 0);
+}
+
+/**
+ * A download sends every page of the log as a frame, skipping a bad block,
+ * and reads the next page while one is sent, so it beats reading and
+ * sending one page at a time.
+ */
+static void test_download_frames(void) {
+	static uint8_t sent[TEST_DOWNLOAD_PAGES * W25N01GV_DOWNLOAD_FRAME_SIZE];
+	static uint8_t frame[W25N01GV_DOWNLOAD_FRAME_SIZE];
+	static W25N01GV_Download download;
+	W25N01GV_Flash flash;
+	UART_HandleTypeDef uart;
+
+	w25n01gv_sim_mark_bad_block(sim, 0, 2);
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	write_pattern(&flash, 0, TEST_DOWNLOAD_PAGES * W25N01GV_BYTES_PER_PAGE, W25N01GV_BYTES_PER_PAGE);
+	finish_flash_write(&flash);
+
+	memset(&uart, 0, sizeof(uart));
+	uart.baud_rate = 10500000;
+	uart.tx_log = sent;
+	uart.tx_log_size = sizeof(sent);
+
+	// Reading a page, then sending it
+	reset_flash_read_pointer(&flash);
+	uint64_t start_ns = w25n01gv_sim_time_ns();
+	for (uint32_t page = 0; page < TEST_DOWNLOAD_PAGES; page++) {
+		read_next_2KB_from_flash(&flash, frame + W25N01GV_DOWNLOAD_HEADER_SIZE);
+		HAL_UART_Transmit(&uart, frame, W25N01GV_DOWNLOAD_FRAME_SIZE, HAL_MAX_DELAY);
+	}
+	uint64_t read_then_send_ns = w25n01gv_sim_time_ns() - start_ns;
+
+	uart.tx_log_used = 0;
+	reset_flash_read_pointer(&flash);
+	start_ns = w25n01gv_sim_time_ns();
+	start_flash_download(&download, &flash, &uart, flash.next_page_to_read, UINT32_MAX, 0);
+	CHECK(run_download(&download));
+	uint64_t download_ns = w25n01gv_sim_time_ns() - start_ns;
+
+	CHECK(download.pages_sent == TEST_DOWNLOAD_PAGES);
+	CHECK(uart.tx_log_used == sizeof(sent));
+	CHECK(download_frames_ok(sent, TEST_DOWNLOAD_PAGES, 0, 0, 2) == TEST_DOWNLOAD_PAGES);
+	CHECK(download.ECC_status == SUCCESS_NO_CORRECTIONS);
+	CHECK(download_ns * 5 < read_then_send_ns * 4);
+	CHECK(!flash.continuous_read_active);
+}
+
+/**
+ * With a flow control window, frames are only sent that far ahead of the
+ * receiver's acknowledgements. A download that's stopped partway resumes
+ * from the page after the last frame received.
+ */
+static void test_download_window_and_resume(void) {
+	static uint8_t sent[(TEST_DOWNLOAD_PAGES + 2) * W25N01GV_DOWNLOAD_FRAME_SIZE];
+	static W25N01GV_Download download;
+	W25N01GV_Flash flash;
+	UART_HandleTypeDef uart;
+
+	w25n01gv_sim_mark_bad_block(sim, 0, 2);
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	write_pattern(&flash, 0, TEST_DOWNLOAD_PAGES * W25N01GV_BYTES_PER_PAGE, W25N01GV_BYTES_PER_PAGE);
+	finish_flash_write(&flash);
+
+	memset(&uart, 0, sizeof(uart));
+	uart.baud_rate = 3000000;
+	uart.tx_log = sent;
+	uart.tx_log_size = sizeof(sent);
+
+	// Only 2 frames go out until the receiver acknowledges them
+	reset_flash_read_pointer(&flash);
+	start_flash_download(&download, &flash, &uart, flash.next_page_to_read, UINT32_MAX, 2);
+	CHECK(!run_download(&download));
+	CHECK(download.pages_sent == 2 && uart.tx_log_used == 2 * W25N01GV_DOWNLOAD_FRAME_SIZE);
+
+	// Then it acknowledges what it has every 50 polls, and the link drops after 100 frames
+	for (uint32_t polls = 1; polls < TEST_DOWNLOAD_MAX_POLLS && poll_flash_download(&download); polls++) {
+		if (polls % 50 == 0)
+			ack_flash_download(&download, uart.tx_log_used / W25N01GV_DOWNLOAD_FRAME_SIZE);
+		if (uart.tx_log_used >= 100 * W25N01GV_DOWNLOAD_FRAME_SIZE)
+			break;
+	}
+	CHECK(stop_flash_download(&download) == SUCCESS_NO_CORRECTIONS);
+	uint32_t first_frames = uart.tx_log_used / W25N01GV_DOWNLOAD_FRAME_SIZE;
+	CHECK(first_frames >= 100 && uart.tx_log_used % W25N01GV_DOWNLOAD_FRAME_SIZE == 0);
+	CHECK(download_frames_ok(sent, first_frames, 0, 0, 2) == first_frames);
+
+	// Page 0 is frame 0, so with block 2 skipped, frame n is page n + 64 from frame 128 on
+	uint32_t next_page = (first_frames >= 2 * W25N01GV_SIM_PAGES_PER_BLOCK)
+			? first_frames + W25N01GV_SIM_PAGES_PER_BLOCK : first_frames;
+	start_flash_download(&download, &flash, &uart, next_page, UINT32_MAX, 0);
+	CHECK(run_download(&download));
+	uint32_t resumed_frames = TEST_DOWNLOAD_PAGES - first_frames;
+	CHECK(uart.tx_log_used == TEST_DOWNLOAD_PAGES * W25N01GV_DOWNLOAD_FRAME_SIZE);
+	CHECK(download_frames_ok(sent + first_frames * W25N01GV_DOWNLOAD_FRAME_SIZE, resumed_frames, next_page,
+			first_frames * W25N01GV_BYTES_PER_PAGE, 2) == resumed_frames);
+}
+
+/**
+ * A scrub loads every page of the log, a few per poll, and counts the
+ * pages that needed corrections or failed, in total and for each block.
+ */
+static void test_scrub_counts_ecc(void) {
+	static W25N01GV_Scrub scrub;
+	W25N01GV_Flash flash;
+	uint32_t block_bytes = W25N01GV_SIM_PAGES_PER_BLOCK * W25N01GV_BYTES_PER_PAGE;
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+
+	write_pattern(&flash, 0, 10 * block_bytes + 1000, W25N01GV_BYTES_PER_PAGE);
+	finish_flash_write(&flash);
+	w25n01gv_sim_inject_ecc(sim, 0, 2 * W25N01GV_SIM_PAGES_PER_BLOCK + 5, 1);
+	w25n01gv_sim_inject_ecc(sim, 0, 4 * W25N01GV_SIM_PAGES_PER_BLOCK + 1, 2);
+
+	w25n01gv_sim_clear_stats(sim);
+	start_flash_scrub(&scrub, &flash, 0);
+	CHECK(run_scrub(&scrub, 4) == 4);
+	CHECK(scrub.pages_checked == 10 * W25N01GV_SIM_PAGES_PER_BLOCK + 1);
+	CHECK(scrub.pages_corrected == 1 && scrub.block_corrections[2] == 1);
+	CHECK(scrub.pages_failed == 1 && scrub.block_failures[4] == 1);
+	CHECK(scrub.blocks_relocated == 0 && sim->die[0].lut_count == 0);
+	CHECK(sim->stats.page_programs == 0 && sim->stats.block_erases == 0);
+}
+
+/**
+ * With relocation on, a full block that needed corrections is copied to a
+ * spare block and swapped for it in the BBM look up table, so it reads back
+ * in place. The spare comes from the end of flash in a linear log, and from
+ * the blocks erased ahead of the write pointer in a circular log. After a
+ * reset it's treated as bad.
+ */
+static void test_scrub_relocates_block(void) {
+	static W25N01GV_Scrub scrub;
+	W25N01GV_Flash flash;
+	uint32_t block_bytes = W25N01GV_SIM_PAGES_PER_BLOCK * W25N01GV_BYTES_PER_PAGE;
+	uint16_t num_data_blocks = W25N01GV_NUM_PAGES / W25N01GV_SIM_PAGES_PER_BLOCK;
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+
+	// Block 10 isn't full, so it stays where it is
+	uint32_t num_bytes = 10 * block_bytes + 1000;
+	write_pattern(&flash, 0, num_bytes, W25N01GV_BYTES_PER_PAGE);
+	finish_flash_write(&flash);
+	w25n01gv_sim_inject_ecc(sim, 0, 2 * W25N01GV_SIM_PAGES_PER_BLOCK + 5, 1);
+	w25n01gv_sim_inject_ecc(sim, 0, 10 * W25N01GV_SIM_PAGES_PER_BLOCK, 1);
+
+	w25n01gv_sim_clear_stats(sim);
+	start_flash_scrub(&scrub, &flash, 1);
+	CHECK(run_scrub(&scrub, 4) <= 4);
+	CHECK(scrub.pages_corrected == 2 && scrub.blocks_relocated == 1 && scrub.relocations_skipped == 0);
+	CHECK(sim->die[0].lut_count == 1);
+	CHECK((sim->die[0].lut_lba[0] & 0x3FF) == 2 && sim->die[0].lut_pba[0] == num_data_blocks - 1);
+	CHECK(memcmp(w25n01gv_sim_page(sim, 0, (num_data_blocks - 1) * W25N01GV_SIM_PAGES_PER_BLOCK + 5),
+			w25n01gv_sim_page(sim, 0, 2 * W25N01GV_SIM_PAGES_PER_BLOCK + 5), W25N01GV_BYTES_PER_PAGE) == 0);
+	CHECK(pattern_on_flash(&flash, num_bytes));
+
+	write_pattern(&flash, num_bytes, W25N01GV_BYTES_PER_PAGE, W25N01GV_SECTOR_SIZE);
+	finish_flash_write(&flash);
+	num_bytes += W25N01GV_BYTES_PER_PAGE;
+
+	w25n01gv_sim_power_cycle(sim);
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	CHECK(block_bad_in_table(&flash, num_data_blocks - 1) && flash.num_bad_blocks == 1);
+	CHECK(pattern_on_flash(&flash, num_bytes));
+	CHECK(sim->stats.nop_violations == 0 && sim->stats.protocol_errors == 0);
+
+	// A circular log one block into its second lap, with blocks 2-9 erased ahead.
+	// The scrub checks blocks 10-1020 and 0.
+	new_chip(1);
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	start_circular_flash_log(&flash);
+	num_bytes = (uint32_t) (num_data_blocks + 1) * block_bytes;
+	write_pattern(&flash, 0, num_bytes, W25N01GV_BYTES_PER_PAGE);
+	for (uint8_t i = 0; i < 20; i++) {
+		poll_async_flash_write(&flash);
+		wait_for_async_flash_write(&flash);
+	}
+	CHECK(flash.erase_ahead_block == 2 + TEST_ERASE_AHEAD_BLOCKS);
+	w25n01gv_sim_inject_ecc(sim, 0, 30 * W25N01GV_SIM_PAGES_PER_BLOCK + 3, 1);
+
+	start_flash_scrub(&scrub, &flash, 1);
+	run_scrub(&scrub, 8);
+	CHECK(scrub.pages_checked == (uint32_t) (num_data_blocks - TEST_ERASE_AHEAD_BLOCKS - 1) * W25N01GV_SIM_PAGES_PER_BLOCK);
+	CHECK(scrub.blocks_relocated == 1 && sim->die[0].lut_count == 1);
+	CHECK((sim->die[0].lut_lba[0] & 0x3FF) == 30 && sim->die[0].lut_pba[0] == 1 + TEST_ERASE_AHEAD_BLOCKS);
+	CHECK(block_holds_pattern(&flash, 30, 0, 30 * block_bytes));
+
+	// The log goes on past the spare block, and the block it replaced is still there
+	w25n01gv_sim_power_cycle(sim);
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+	CHECK(block_bad_in_table(&flash, 1 + TEST_ERASE_AHEAD_BLOCKS));
+	write_pattern(&flash, num_bytes, TEST_ERASE_AHEAD_BLOCKS * block_bytes, W25N01GV_BYTES_PER_PAGE);
+	CHECK(flash.current_page / W25N01GV_SIM_PAGES_PER_BLOCK == 2 + TEST_ERASE_AHEAD_BLOCKS);
+	CHECK(block_holds_pattern(&flash, 8, 0, num_bytes + 7 * block_bytes));
+	CHECK(block_holds_pattern(&flash, 30, 0, 30 * block_bytes));
+	CHECK(sim->stats.nop_violations == 0 && sim->stats.protocol_errors == 0);
+}
+
+/**
+ * Stopping a scrub partway through a relocation erases the spare block
+ * again and gives it back, without touching the look up table.
+ */
+static void test_scrub_stop_mid_relocation(void) {
+	static W25N01GV_Scrub scrub;
+	W25N01GV_Flash flash;
+	uint32_t block_bytes = W25N01GV_SIM_PAGES_PER_BLOCK * W25N01GV_BYTES_PER_PAGE;
+	init_flash(&flash, &hspi, &gpio, TEST_CS_PIN);
+
+	write_pattern(&flash, 0, 5 * block_bytes, W25N01GV_BYTES_PER_PAGE);
+	finish_flash_write(&flash);
+	w25n01gv_sim_inject_ecc(sim, 0, 3 * W25N01GV_SIM_PAGES_PER_BLOCK + 7, 1);
+
+	start_flash_scrub(&scrub, &flash, 1);
+	while (poll_flash_scrub(&scrub, 1)
+			&& (scrub.relocate_dst >= W25N01GV_SIM_BLOCKS_PER_DIE || scrub.relocate_pages_copied < 10));
+	uint16_t spare_block = scrub.relocate_dst;
+	CHECK(spare_block < W25N01GV_SIM_BLOCKS_PER_DIE && block_bad_in_table(&flash, spare_block));
+
+	stop_flash_scrub(&scrub);
+	uint8_t erased = 1;
+	for (uint16_t page = 0; page < 10; page++)
+		for (uint16_t i = 0; i < W25N01GV_SIM_PAGE_SIZE; i++)
+			erased &= (w25n01gv_sim_page(sim, 0, spare_block * W25N01GV_SIM_PAGES_PER_BLOCK + page)[i] == 0xFF);
+	CHECK(erased);
+	CHECK(!block_bad_in_table(&flash, spare_block) && flash.num_bad_blocks == 0);
+	CHECK(sim->die[0].lut_count == 0);
+	CHECK(pattern_on_flash(&flash, 5 * block_bytes));
+}
+
+
+/* Main */
+
+typedef struct {
+	const char *name;
+	void (*run)(void);
+	uint8_t num_dies;
+} Test;
+
+static const Test tests[] = {
+	{ "async_programs_each_sector",          test_async_programs_each_sector,          1 },
+	{ "async_program_failure",               test_async_program_failure,               1 },
+	{ "continuous_read_ECC_status",          test_continuous_read_ECC_status,          1 },
+	{ "fc_layout_keeps_reserved_pages",      test_fc_layout_keeps_reserved_pages,      2 },
+	{ "checkpoint_resume",                   test_checkpoint_resume,                   1 },
+	{ "sector_metadata",                     test_sector_metadata,                     1 },
+	{ "bad_block_table_saved",               test_bad_block_table_saved,               1 },
+	{ "erase_ahead",                         test_erase_ahead,                         1 },
+	{ "kv_compaction_survives_power_loss",   test_kv_compaction_survives_power_loss,   1 },
+	{ "kv_store_guards_reserved_block",      test_kv_store_guards_reserved_block,      1 },
+	{ "reserve_commit_crosses_sector",       test_reserve_commit_crosses_sector,       1 },
+	{ "fc_transport",                        test_fc_transport,                        2 },
+	{ "bench_timing_model",                  test_bench_timing_model,                  1 },
+	{ "stats_packing",                       test_stats_packing,                       1 },
+	{ "busy_wait_timeout",                   test_busy_wait_timeout,                   1 },
+	{ "circular_reboot_keeps_erased_blocks", test_circular_reboot_keeps_erased_blocks, 1 },
+	{ "seek_skips_unstamped_pages",          test_seek_skips_unstamped_pages,          1 },
+	{ "delimiter_marks_metadata",            test_delimiter_marks_metadata,            1 },
+	{ "circular_skips_torn_page",            test_circular_skips_torn_page,            1 },
+	{ "array_realigns_after_torn_page",      test_array_realigns_after_torn_page,      1 },
+	{ "fc_parallel_erase",                   test_fc_parallel_erase,                   2 },
+	{ "event_records",                       test_event_records,                       1 },
+	{ "download_frames",                     test_download_frames,                     1 },
+	{ "download_window_and_resume",          test_download_window_and_resume,          1 },
+	{ "scrub_counts_ecc",                    test_scrub_counts_ecc,                    1 },
+	{ "scrub_relocates_block",               test_scrub_relocates_block,               1 },
+	{ "scrub_stop_mid_relocation",           test_scrub_stop_mid_relocation,           1 },
+};
+
+int main(int argc, char **argv) {
+	uint32_t num_failed_tests = 0;
+	uint32_t num_run = 0;
+
+	for (uint32_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+		if (argc > 1 && strcmp(argv[1], tests[i].name) != 0)
+			continue;
+
+		uint32_t failures_before = num_failed_checks;
+		printf("%s\n", tests[i].name);
+		new_chip(tests[i].num_dies);
+		tests[i].run();
+		num_run++;
+		if (num_failed_checks != failures_before)
+			num_failed_tests++;
+	}
+
+	printf("%u of %u tests passed (%u checks)\n", (unsigned) (num_run - num_failed_tests),
+			(unsigned) num_run, (unsigned) num_checks);
+
+	if (sim != NULL)
+		w25n01gv_sim_destroy(sim);
+	return (num_failed_tests == 0 && num_run > 0) ? 0 : 1;
+}
@@ -0,0 +1,136 @@
+/**
+ * Host-side stand-in for the parts of the STM32F4 HAL used by the
+ * W25N01GV and W25M02GV libraries.
+ *
+ * Put this directory on the include path INSTEAD of the real HAL and the
+ * unmodified driver sources compile and run on Linux. Every SPI byte and
+ * chip select edge is routed to the simulated chip(s) in W25N01GV_sim.c,
+ * and time is a virtual clock advanced by SPI traffic and chip busy time,
+ * so HAL_GetTick() tracks what the hardware would do.
+ *
+ * Nathaniel Kalantar (nkalan@umich.edu)
+ * Michigan Aeronautical Science Association
+ */
+
+#ifndef W25N01GV_SIM_HAL_H	// Begin header include protection
+#define W25N01GV_SIM_HAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define HAL_SPI_MODULE_ENABLED
+#define HAL_UART_MODULE_ENABLED
+
+#define HAL_MAX_DELAY      0xFFFFFFFFU
+
+typedef enum {
+	HAL_OK       = 0x00U,
+	HAL_ERROR    = 0x01U,
+	HAL_BUSY     = 0x02U,
+	HAL_TIMEOUT  = 0x03U
+} HAL_StatusTypeDef;
+
+typedef enum {
+	HAL_SPI_STATE_RESET      = 0x00U,
+	HAL_SPI_STATE_READY      = 0x01U,
+	HAL_SPI_STATE_BUSY       = 0x02U,
+	HAL_SPI_STATE_BUSY_TX    = 0x03U,
+	HAL_SPI_STATE_BUSY_RX    = 0x04U,
+	HAL_SPI_STATE_BUSY_TX_RX = 0x05U,
+	HAL_SPI_STATE_ERROR      = 0x06U
+} HAL_SPI_StateTypeDef;
+
+typedef enum {
+	HAL_UART_STATE_RESET      = 0x00U,
+	HAL_UART_STATE_READY      = 0x20U,
+	HAL_UART_STATE_BUSY       = 0x24U,
+	HAL_UART_STATE_BUSY_TX    = 0x21U,
+	HAL_UART_STATE_BUSY_RX    = 0x22U,
+	HAL_UART_STATE_BUSY_TX_RX = 0x23U
+} HAL_UART_StateTypeDef;
+
+typedef enum {
+	GPIO_PIN_RESET = 0,
+	GPIO_PIN_SET
+} GPIO_PinState;
+
+#define GPIO_PIN_0   ((uint16_t)0x0001)
+#define GPIO_PIN_1   ((uint16_t)0x0002)
+#define GPIO_PIN_2   ((uint16_t)0x0004)
+#define GPIO_PIN_3   ((uint16_t)0x0008)
+#define GPIO_PIN_4   ((uint16_t)0x0010)
+#define GPIO_PIN_5   ((uint16_t)0x0020)
+#define GPIO_PIN_6   ((uint16_t)0x0040)
+#define GPIO_PIN_7   ((uint16_t)0x0080)
+
+struct W25N01GV_Sim;
+
+// A simulated GPIO port. Each pin can be wired to the chip select of one chip.
+typedef struct {
+	struct W25N01GV_Sim *cs_sim[16];
+} GPIO_TypeDef;
+
+// A simulated SPI peripheral. Up to 4 chips can share one bus.
+typedef struct {
+	struct W25N01GV_Sim *sims[4];
+	uint8_t num_sims;
+	uint8_t data_lines;              // 1 for standard SPI, 2 or 4 for dual/quad transfers
+	uint32_t clock_hz;               // SCK frequency used for transfer timing
+	HAL_SPI_StateTypeDef State;
+	uint64_t dma_done_ns;            // Virtual time at which the running DMA transfer ends
+	uint64_t bytes_transferred;      // Total bytes clocked over this bus
+} SPI_HandleTypeDef;
+
+typedef struct {
+	uint32_t baud_rate;
+	uint8_t State;
+	uint64_t dma_done_ns;
+	uint64_t bytes_transferred;
+	uint8_t *dma_data;               // Buffer of the running DMA transfer, read when it ends
+	uint16_t dma_size;
+	uint8_t *tx_log;                 // If set, every byte sent is copied here, up to tx_log_size
+	uint32_t tx_log_size;
+	uint32_t tx_log_used;
+} UART_HandleTypeDef;
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState);
+
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_SPI_Receive_DMA(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size);
+HAL_SPI_StateTypeDef HAL_SPI_GetState(SPI_HandleTypeDef *hspi);
+
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_UART_Receive(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size);
+HAL_UART_StateTypeDef HAL_UART_GetState(UART_HandleTypeDef *huart);
+
+uint32_t HAL_GetTick(void);
+void HAL_Delay(uint32_t Delay);
+
+// Core clock and the DWT cycle counter, which follows the virtual clock
+typedef struct {
+	volatile uint32_t CTRL;
+	volatile uint32_t CYCCNT;
+} DWT_Type;
+
+typedef struct {
+	volatile uint32_t DEMCR;
+} CoreDebug_Type;
+
+#define DWT_CTRL_CYCCNTENA_Msk       (0x1UL)
+#define CoreDebug_DEMCR_TRCENA_Msk   (0x1UL << 24)
+
+extern uint32_t SystemCoreClock;
+extern CoreDebug_Type sim_core_debug;
+DWT_Type *sim_dwt(void);
+
+#define DWT        (sim_dwt())
+#define CoreDebug  (&sim_core_debug)
+
+// Interrupt masking has no meaning on the host
+static inline void __disable_irq(void) {}
+static inline void __enable_irq(void) {}
+
+#endif	// end header include protection
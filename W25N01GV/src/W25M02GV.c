@@ -35,9 +35,24 @@
 // Arbitrary timeout value
 #define W25M02GV_SPI_TIMEOUT                      (uint8_t)  0xFF
 
+// Die 1's blocks are numbered after die 0's by fc_scan_bad_blocks()
+#define W25M02GV_BLOCKS_PER_DIE                   (uint16_t) 1024
+
+// The layout is saved in the last page of die 1's reserved block,
+// as 4 marker bytes followed by the W25M02GV_Layout value
+#define W25M02GV_LAYOUT_PAGE                      (uint8_t)  63
+#define W25M02GV_LAYOUT_MARKER_SIZE               (uint16_t) 5
+#define W25M02GV_LAYOUT_MARKER                    {'L', 'Y', 'O', 'T'}
+
 void select_die(W25M02GV_Flash *fc_flash, uint8_t die_id) {
 	uint8_t tx[2] = { W25M02GV_DIE_SELECT, die_id };
 
+	// The transport gets die 0's struct, the command is for the whole chip
+	if (fc_flash->transport != NULL) {
+		fc_flash->last_HAL_status = fc_flash->transport(&fc_flash->flash0, tx, 2, NULL, 0, 1, 0);
+		return;
+	}
+
 	__disable_irq();
 	HAL_GPIO_WritePin(fc_flash->cs_base, fc_flash->cs_pin, W25M02GV_CS_ACTIVE);  // Select chip
 	// Transmit/receive, and store the status code
@@ -46,14 +61,198 @@ void select_die(W25M02GV_Flash *fc_flash, uint8_t die_id) {
 	__enable_irq();
 }
 
-void fc_init_flash(W25M02GV_Flash *fc_flash, SPI_HandleTypeDef *SPI_bus_in,
-		GPIO_TypeDef *cs_base_in, uint16_t cs_pin_in) {
+/**
+ * Reads the layout saved by fc_set_flash_layout(). Chips that were never
+ * given a layout are linear.
+ *
+ * @param fc_flash   <W25M02GV_Flash*>    Struct used to store flash pins and addresses
+ * @retval The layout of the data on flash
+ */
+static W25M02GV_Layout read_layout(W25M02GV_Flash *fc_flash) {
+	uint8_t marker[4] = W25M02GV_LAYOUT_MARKER;
+	uint8_t buffer[W25M02GV_LAYOUT_MARKER_SIZE];
+
+	select_die(fc_flash, 1);
+	read_reserved_flash_page(&fc_flash->flash1, W25M02GV_LAYOUT_PAGE, buffer, W25M02GV_LAYOUT_MARKER_SIZE);
+
+	for (uint8_t i = 0; i < 4; i++) {
+		if (buffer[i] != marker[i])
+			return W25M02GV_LAYOUT_LINEAR;
+	}
+
+	if (buffer[4] == W25M02GV_LAYOUT_STRIPED)
+		return W25M02GV_LAYOUT_STRIPED;
+	else
+		return W25M02GV_LAYOUT_LINEAR;
+}
+
+/**
+ * Number of logical pages written before the page currently being written,
+ * in the striped layout. A full die leaves its write pointer on its last
+ * page with the column past the end, so that page is counted too.
+ *
+ * @param fc_flash   <W25M02GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static uint32_t stripe_pages_written(W25M02GV_Flash *fc_flash) {
+	uint32_t pages = (uint32_t) fc_flash->flash0.current_page + fc_flash->flash1.current_page;
+
+	if (fc_flash->flash0.next_free_column >= W25N01GV_BYTES_PER_PAGE)
+		pages++;
+	if (fc_flash->flash1.next_free_column >= W25N01GV_BYTES_PER_PAGE)
+		pages++;
+
+	return pages;
+}
+
+/**
+ * Returns the struct for the die that the current logical page is written to.
+ */
+static W25N01GV_Flash *stripe_write_die(W25M02GV_Flash *fc_flash) {
+	return (fc_flash->current_write_die == 0) ? &fc_flash->flash0 : &fc_flash->flash1;
+}
+
+/**
+ * Returns the number of bytes in the stripe buffer that haven't been written yet.
+ */
+static uint16_t stripe_bytes_buffered(W25M02GV_Flash *fc_flash) {
+	uint16_t column = stripe_write_die(fc_flash)->next_free_column;
+
+	if (fc_flash->stripe_buffer_size > column)
+		return fc_flash->stripe_buffer_size - column;
+	else
+		return 0;
+}
+
+/**
+ * Writes the part of the stripe buffer that hasn't been written yet to the
+ * current write die, without waiting for it to program. If that completes
+ * the page, the next page goes to the other die.
+ *
+ * start_flash_page_write() only waits if the die is still programming the
+ * page before this one, which was started two pages ago. The page that was
+ * just started on the other die keeps programming while this one is loaded.
+ *
+ * @param fc_flash   <W25M02GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void write_stripe_buffer(W25M02GV_Flash *fc_flash) {
+	W25N01GV_Flash *die = stripe_write_die(fc_flash);
+
+	select_die(fc_flash, fc_flash->current_write_die);
+	start_flash_page_write(die, fc_flash->stripe_buffer + die->next_free_column,
+			stripe_bytes_buffered(fc_flash));
+
+	if (fc_flash->stripe_buffer_size == W25N01GV_BYTES_PER_PAGE) {
+		fc_flash->stripe_buffer_size = 0;
+		fc_flash->current_write_die = !fc_flash->current_write_die;
+	}
+}
+
+/**
+ * Waits for both dies to finish programming, leaving the write die selected.
+ *
+ * @param fc_flash   <W25M02GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void wait_for_stripe_writes(W25M02GV_Flash *fc_flash) {
 	select_die(fc_flash, 0);
-	init_flash(&fc_flash->flash0, SPI_bus_in, cs_base_in, cs_pin_in);
+	wait_for_async_flash_write(&fc_flash->flash0);
 	select_die(fc_flash, 1);
-	init_flash(&fc_flash->flash1, SPI_bus_in, cs_base_in, cs_pin_in);
+	wait_for_async_flash_write(&fc_flash->flash1);
+	select_die(fc_flash, fc_flash->current_write_die);
+}
+
+/**
+ * Striped layout version of fc_write_to_flash().
+ */
+static uint16_t fc_write_to_flash_striped(W25M02GV_Flash *fc_flash, uint8_t *data, uint32_t num_bytes) {
+	uint16_t failures_before = fc_flash->flash0.async_write_failures + fc_flash->flash1.async_write_failures;
+
+	// If there's not enough space, truncate the data
+	uint32_t bytes_remaining = fc_get_bytes_remaining(fc_flash);
+	if (num_bytes > bytes_remaining)
+		num_bytes = bytes_remaining;
+
+	while (num_bytes > 0) {
+		uint16_t num_bytes_to_copy = W25N01GV_BYTES_PER_PAGE - fc_flash->stripe_buffer_size;
+		if (num_bytes_to_copy > num_bytes)
+			num_bytes_to_copy = num_bytes;
+
+		for (uint16_t i = 0; i < num_bytes_to_copy; ++i) {
+			fc_flash->stripe_buffer[fc_flash->stripe_buffer_size + i] = data[i];
+		}
+		fc_flash->stripe_buffer_size += num_bytes_to_copy;
+		data += num_bytes_to_copy;
+		num_bytes -= num_bytes_to_copy;
+
+		if (fc_flash->stripe_buffer_size == W25N01GV_BYTES_PER_PAGE)
+			write_stripe_buffer(fc_flash);
+	}
+
+	return fc_flash->flash0.async_write_failures + fc_flash->flash1.async_write_failures - failures_before;
+}
 
+/**
+ * Striped layout version of fc_finish_flash_write().
+ */
+static uint16_t fc_finish_flash_write_striped(W25M02GV_Flash *fc_flash) {
+	if (stripe_bytes_buffered(fc_flash) > 0) {
+		// Fill the rest of the sector with 0x00 to keep the 512-byte framing
+		while (fc_flash->stripe_buffer_size % W25N01GV_SECTOR_SIZE != 0)
+			fc_flash->stripe_buffer[fc_flash->stripe_buffer_size++] = 0x00;
+
+		write_stripe_buffer(fc_flash);
+	}
+
+	uint16_t failures_before = fc_flash->flash0.async_write_failures + fc_flash->flash1.async_write_failures;
+	wait_for_stripe_writes(fc_flash);
+
+	return fc_flash->flash0.async_write_failures + fc_flash->flash1.async_write_failures - failures_before;
+}
+
+/**
+ * Checks whether a page of die 1's reserved block is erased, using the
+ * stripe buffer to read it.
+ *
+ * ASSUMPTIONS:
+ * Die 1 is selected and nothing is waiting in the stripe buffer.
+ *
+ * @param fc_flash   <W25M02GV_Flash*>    Struct used to store flash pins and addresses
+ * @param page_num   <uint8_t>            Reserved page to check
+ * @retval 1 if every byte of the page is 0xFF, 0 if anything is written on it
+ */
+static uint8_t reserved_page_is_erased(W25M02GV_Flash *fc_flash, uint8_t page_num) {
+	read_reserved_flash_page(&fc_flash->flash1, page_num, fc_flash->stripe_buffer, W25N01GV_BYTES_PER_PAGE);
+
+	for (uint16_t i = 0; i < W25N01GV_BYTES_PER_PAGE; i++) {
+		if (fc_flash->stripe_buffer[i] != 0xFF)
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * The part of fc_init_flash() after both dies have been set up: reads the
+ * layout and selects the die to write to.
+ *
+ * @param fc_flash   <W25M02GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void start_fc_flash(W25M02GV_Flash *fc_flash) {
 	fc_flash->current_read_die = 0;
+	fc_flash->stripe_buffer_size = 0;
+	fc_flash->layout = read_layout(fc_flash);
+
+	if (fc_flash->layout == W25M02GV_LAYOUT_STRIPED) {
+		// Even logical pages are on die 0 and odd pages on die 1,
+		// so the number of pages written tells which die is next
+		fc_flash->current_write_die = stripe_pages_written(fc_flash) % 2;
+
+		// Pick up a partially written page where it left off
+		W25N01GV_Flash *die = stripe_write_die(fc_flash);
+		if (die->next_free_column < W25N01GV_BYTES_PER_PAGE)
+			fc_flash->stripe_buffer_size = die->next_free_column;
+
+		select_die(fc_flash, fc_flash->current_write_die);
+		return;
+	}
 
 	// write pointers were already found by init_flash
 	// if die0 isn't full, select it.
@@ -68,20 +267,112 @@ void fc_init_flash(W25M02GV_Flash *fc_flash, SPI_HandleTypeDef *SPI_bus_in,
 	}
 }
 
+void fc_init_flash(W25M02GV_Flash *fc_flash, SPI_HandleTypeDef *SPI_bus_in,
+		GPIO_TypeDef *cs_base_in, uint16_t cs_pin_in) {
+	// select_die() uses the bus and pin stored in the struct
+	fc_flash->SPI_bus = SPI_bus_in;
+	fc_flash->cs_base = cs_base_in;
+	fc_flash->cs_pin = cs_pin_in;
+	fc_flash->transport = NULL;
+
+	select_die(fc_flash, 0);
+	init_flash(&fc_flash->flash0, SPI_bus_in, cs_base_in, cs_pin_in);
+	select_die(fc_flash, 1);
+	init_flash(&fc_flash->flash1, SPI_bus_in, cs_base_in, cs_pin_in);
+
+	start_fc_flash(fc_flash);
+}
+
+void fc_init_flash_with_transport(W25M02GV_Flash *fc_flash, W25N01GV_Transport transport, uint8_t data_lines) {
+	fc_flash->SPI_bus = NULL;
+	fc_flash->cs_base = NULL;
+	fc_flash->cs_pin = 0;
+	fc_flash->transport = transport;
+
+	select_die(fc_flash, 0);
+	init_flash_with_transport(&fc_flash->flash0, transport, data_lines);
+	select_die(fc_flash, 1);
+	init_flash_with_transport(&fc_flash->flash1, transport, data_lines);
+
+	start_fc_flash(fc_flash);
+}
+
+uint8_t fc_set_flash_layout(W25M02GV_Flash *fc_flash, W25M02GV_Layout layout) {
+	if (layout == fc_flash->layout)
+		return 0;
+
+	// Data that's already written would be read back in the wrong order
+	if (fc_get_bytes_remaining(fc_flash)
+			!= get_flash_capacity(&fc_flash->flash0) + get_flash_capacity(&fc_flash->flash1))
+		return 1;
+
+	uint8_t marker[W25M02GV_LAYOUT_MARKER_SIZE] = W25M02GV_LAYOUT_MARKER;
+	marker[4] = (uint8_t) layout;
+	uint8_t failure = 0;
+
+	// An erased layout page is just programmed. Replacing a saved layout
+	// erases die 1's reserved block, so only do it if nothing else is stored there.
+	select_die(fc_flash, 1);
+	if (!reserved_page_is_erased(fc_flash, W25M02GV_LAYOUT_PAGE)) {
+		for (uint8_t page = 0; page < W25M02GV_LAYOUT_PAGE; page++) {
+			if (!reserved_page_is_erased(fc_flash, page)) {
+				select_die(fc_flash, fc_flash->current_write_die);
+				return 1;
+			}
+		}
+		failure = erase_reserved_flash_pages(&fc_flash->flash1);
+	}
+	failure |= write_reserved_flash_page(&fc_flash->flash1, W25M02GV_LAYOUT_PAGE,
+			marker, W25M02GV_LAYOUT_MARKER_SIZE);
+
+	// Both layouts start writing on die 0
+	fc_flash->layout = layout;
+	fc_flash->current_write_die = 0;
+	fc_flash->stripe_buffer_size = 0;
+	select_die(fc_flash, 0);
+
+	return failure ? 1 : 0;
+}
+
+uint8_t fc_erase_reserved_flash_pages(W25M02GV_Flash *fc_flash, uint8_t die_id) {
+	// Striped data would be read back in the wrong order once the layout is gone
+	if (die_id == 1 && fc_flash->layout == W25M02GV_LAYOUT_STRIPED && fc_get_bytes_remaining(fc_flash)
+			!= get_flash_capacity(&fc_flash->flash0) + get_flash_capacity(&fc_flash->flash1))
+		return 1;
+
+	select_die(fc_flash, die_id);
+	uint8_t failure = erase_reserved_flash_pages((die_id == 0) ? &fc_flash->flash0 : &fc_flash->flash1);
+
+	// Flash is empty here, and both layouts start writing on die 0
+	if (die_id == 1 && fc_flash->layout == W25M02GV_LAYOUT_STRIPED) {
+		fc_flash->layout = W25M02GV_LAYOUT_LINEAR;
+		fc_flash->current_write_die = 0;
+		fc_flash->stripe_buffer_size = 0;
+	}
+	select_die(fc_flash, fc_flash->current_write_die);
+
+	return failure;
+}
+
 uint8_t fc_ping_flash(W25M02GV_Flash *fc_flash) {
 	uint8_t tx[2] = { W25M02GV_READ_JEDEC_ID, 0 };  // Second byte unused
 	uint8_t rx[3];
 
-	__disable_irq();
-	HAL_GPIO_WritePin(fc_flash->cs_base, fc_flash->cs_pin, W25M02GV_CS_ACTIVE);  // Select chip
-	// Transmit/receive, and store the status code
-	fc_flash->last_HAL_status = HAL_SPI_Transmit(fc_flash->SPI_bus, tx, 2, W25M02GV_SPI_TIMEOUT);
-	fc_flash->last_HAL_status = HAL_SPI_Receive(fc_flash->SPI_bus, rx, 3, W25M02GV_SPI_TIMEOUT);
-	HAL_GPIO_WritePin(fc_flash->cs_base, fc_flash->cs_pin, W25M02GV_CS_INACTIVE);  // Release chip
-	__enable_irq();
+	if (fc_flash->transport != NULL) {
+		fc_flash->last_HAL_status = fc_flash->transport(&fc_flash->flash0, tx, 2, rx, 3, 1, 1);
+	}
+	else {
+		__disable_irq();
+		HAL_GPIO_WritePin(fc_flash->cs_base, fc_flash->cs_pin, W25M02GV_CS_ACTIVE);  // Select chip
+		// Transmit/receive, and store the status code
+		fc_flash->last_HAL_status = HAL_SPI_Transmit(fc_flash->SPI_bus, tx, 2, W25M02GV_SPI_TIMEOUT);
+		fc_flash->last_HAL_status = HAL_SPI_Receive(fc_flash->SPI_bus, rx, 3, W25M02GV_SPI_TIMEOUT);
+		HAL_GPIO_WritePin(fc_flash->cs_base, fc_flash->cs_pin, W25M02GV_CS_INACTIVE);  // Release chip
+		__enable_irq();
+	}
 
 	uint8_t manufacturer_ID = rx[0];
-	uint16_t device_ID = (rx[1] << 8) + rx[0];
+	uint16_t device_ID = (rx[1] << 8) + rx[2];
 
 	if (manufacturer_ID == W25M02GV_MANUFACTURER_ID && device_ID == W25M02GV_DEVICE_ID)
 		return 1;
@@ -103,24 +394,70 @@ uint8_t fc_reset_flash(W25M02GV_Flash *fc_flash) {
 	return success_status;
 }
 
-uint16_t fc_erase_flash(W25M02GV_Flash *fc_flash) {
-	uint16_t erase_failures = 0;
+/**
+ * Runs the block operations started on both dies until they're both done.
+ * Each die is only polled while it's selected, and as soon as it finishes a
+ * block the next one is started, so both dies are busy at the same time.
+ * Leaves die 0 selected.
+ *
+ * @param fc_flash   <W25M02GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void run_block_op_on_both_dies(W25M02GV_Flash *fc_flash) {
+	uint8_t die0_running = 1;
+	uint8_t die1_running = 1;
+
+	while (die0_running || die1_running) {
+		if (die1_running) {
+			select_die(fc_flash, 1);
+			die1_running = poll_flash_block_op(&fc_flash->flash1);
+		}
+		if (die0_running) {
+			select_die(fc_flash, 0);
+			die0_running = poll_flash_block_op(&fc_flash->flash0);
+		}
+	}
+
+	select_die(fc_flash, 0);
+}
 
-	// select die 1 and call erase on it, then
-	// select die 0 and call erase on it.
+uint16_t fc_erase_flash(W25M02GV_Flash *fc_flash) {
+	// Start an erase on each die, then keep both going.
+	// The dies have separate busy states, so their erases overlap.
 	select_die(fc_flash, 1);
-	erase_failures += erase_flash(&fc_flash->flash1);
+	start_flash_erase(&fc_flash->flash1);
 	select_die(fc_flash, 0);
-	erase_failures += erase_flash(&fc_flash->flash0);
+	start_flash_erase(&fc_flash->flash0);
+	run_block_op_on_both_dies(fc_flash);
 
 	// erase_flash() automatically resets the write pointers in flash structs
 	fc_flash->current_write_die = 0;
 	fc_flash->current_read_die = 0;
+	fc_flash->stripe_buffer_size = 0;
+
+	return fc_flash->flash0.block_op_result + fc_flash->flash1.block_op_result;
+}
+
+uint16_t fc_scan_bad_blocks(W25M02GV_Flash *fc_flash, uint16_t *bad_blocks) {
+	// Each die fills its own half of the array, since they find bad blocks at the same time
+	select_die(fc_flash, 0);
+	start_flash_bad_block_scan(&fc_flash->flash0, bad_blocks);
+	select_die(fc_flash, 1);
+	start_flash_bad_block_scan(&fc_flash->flash1, bad_blocks + W25M02GV_BLOCKS_PER_DIE);
+	run_block_op_on_both_dies(fc_flash);
+
+	// Move die 1's bad blocks down after die 0's, numbered after die 0's blocks
+	uint16_t num_die0_bad_blocks = fc_flash->flash0.block_op_result;
+	uint16_t num_die1_bad_blocks = fc_flash->flash1.block_op_result;
+	for (uint16_t i = 0; i < num_die1_bad_blocks; i++)
+		bad_blocks[num_die0_bad_blocks + i] = bad_blocks[W25M02GV_BLOCKS_PER_DIE + i] + W25M02GV_BLOCKS_PER_DIE;
 
-	return erase_failures;
+	return num_die0_bad_blocks + num_die1_bad_blocks;
 }
 
 uint16_t fc_write_to_flash(W25M02GV_Flash *fc_flash, uint8_t *data, uint32_t num_bytes) {
+	if (fc_flash->layout == W25M02GV_LAYOUT_STRIPED)
+		return fc_write_to_flash_striped(fc_flash, data, num_bytes);
+
 	uint16_t write_failures = 0;
 
 	// If die0 is selected
@@ -154,9 +491,14 @@ uint16_t fc_write_to_flash(W25M02GV_Flash *fc_flash, uint8_t *data, uint32_t num
 }
 
 uint16_t fc_finish_flash_write(W25M02GV_Flash *fc_flash) {
+	if (fc_flash->layout == W25M02GV_LAYOUT_STRIPED)
+		return fc_finish_flash_write_striped(fc_flash);
+
+	uint16_t write_failures;
+
 	// do finish_write_flash on current die
 	if (fc_flash->current_write_die == 0) {
-		finish_flash_write(&fc_flash->flash0);
+		write_failures = finish_flash_write(&fc_flash->flash0);
 
 		// if this causes die0 to fill up, switch to die1.
 		if (get_bytes_remaining(&fc_flash->flash0) == 0) {
@@ -165,10 +507,10 @@ uint16_t fc_finish_flash_write(W25M02GV_Flash *fc_flash) {
 		}
 	}
 	else {  // else if (fc_flash->current_write_die == 1)
-		finish_flash_write(&fc_flash->flash1);
+		write_failures = finish_flash_write(&fc_flash->flash1);
 	}
 
-	return fc_flash->flash0.last_write_failure_status | fc_flash->flash1.last_write_failure_status;
+	return write_failures;
 }
 
 void fc_reset_flash_read_pointer(W25M02GV_Flash *fc_flash) {
@@ -176,9 +518,24 @@ void fc_reset_flash_read_pointer(W25M02GV_Flash *fc_flash) {
 	select_die(fc_flash, 0);
 	reset_flash_read_pointer(&fc_flash->flash0);
 	fc_flash->current_read_die = 0;
+
+	// Both dies are read at the same time in the striped layout
+	reset_flash_read_pointer(&fc_flash->flash1);
 }
 
 void fc_read_next_2KB_from_flash(W25M02GV_Flash *fc_flash, uint8_t *buffer) {
+	if (fc_flash->layout == W25M02GV_LAYOUT_STRIPED) {
+		// Reading waits for the die to finish programming if it's still busy
+		select_die(fc_flash, fc_flash->current_read_die);
+		if (fc_flash->current_read_die == 0)
+			read_next_2KB_from_flash(&fc_flash->flash0, buffer);
+		else
+			read_next_2KB_from_flash(&fc_flash->flash1, buffer);
+
+		fc_flash->current_read_die = !fc_flash->current_read_die;
+		return;
+	}
+
 	// call read_next_2kb_from_flash on current die
 	if (fc_flash->current_read_die == 0) {
 		read_next_2KB_from_flash(&fc_flash->flash0, buffer);
@@ -197,6 +554,15 @@ void fc_read_next_2KB_from_flash(W25M02GV_Flash *fc_flash, uint8_t *buffer) {
 }
 
 uint32_t fc_flash_current_page(W25M02GV_Flash *fc_flash) {
+	if (fc_flash->layout == W25M02GV_LAYOUT_STRIPED) {
+		uint32_t pages = stripe_pages_written(fc_flash);
+
+		// Stay on the last page once both dies are full
+		if (pages >= 2 * W25N01GV_NUM_PAGES)
+			pages = 2 * W25N01GV_NUM_PAGES - 1;
+		return pages;
+	}
+
 	if (get_bytes_remaining(&fc_flash->flash0) == 0) {
 		return W25N01GV_NUM_PAGES + fc_flash->flash1.current_page;
 	}
@@ -207,5 +573,11 @@ uint32_t fc_flash_current_page(W25M02GV_Flash *fc_flash) {
 
 uint32_t fc_get_bytes_remaining(W25M02GV_Flash *fc_flash) {
 	// return sum of get_bytes_remaining() for both flash structs.
-	return get_bytes_remaining(&fc_flash->flash0) + get_bytes_remaining(&fc_flash->flash1);
+	uint32_t bytes_remaining = get_bytes_remaining(&fc_flash->flash0) + get_bytes_remaining(&fc_flash->flash1);
+
+	// The stripe buffer hasn't been written to flash yet, but it needs to be counted
+	if (fc_flash->layout == W25M02GV_LAYOUT_STRIPED)
+		bytes_remaining -= stripe_bytes_buffered(fc_flash);
+
+	return bytes_remaining;
 }
@@ -25,6 +25,7 @@
 // Device ID information, used to check if flash is working
 #define	W25N01GV_MANUFACTURER_ID                  (uint8_t)  0xEF
 #define W25N01GV_DEVICE_ID                        (uint16_t) 0xAA21
+#define W25N01GV_W25M02GV_DEVICE_ID               (uint16_t) 0xAB21  // Each die of a W25M02GV reports this instead
 
 // Chip is active low
 #define W25N01GV_CS_ACTIVE                        (uint8_t)  GPIO_PIN_RESET
@@ -36,10 +37,123 @@
 // 1024 blocks with 64 pages each = 65536 pages
 #define W25N01GV_PAGES_PER_BLOCK                  (uint16_t) 64
 #define W25N01GV_NUM_BLOCKS                       (uint16_t) 1024
+#define W25N01GV_SECTORS_PER_PAGE                 (uint16_t) 4
+
+// The last block is reserved for the user (pseudo-eeprom), and the one before
+// it holds write pointer checkpoints. The key/value store compacts into the block
+// before that and back, see compact_flash_kv_store(). Data is written to all
+// blocks before those.
+#define W25N01GV_RESERVED_BLOCK                   (uint16_t) 1023
+#define W25N01GV_CHECKPOINT_BLOCK                 (uint16_t) 1022
+#define W25N01GV_KV_ALT_BLOCK                     (uint16_t) 1021
+#define W25N01GV_NUM_DATA_BLOCKS                  (uint16_t) 1021
+
+// Checkpoint block layout. Every 512 byte sector is a slot holding one record,
+// programmed on its own, and the whole block is only erased by erase_flash(),
+// quick_erase_flash() and start_circular_flash_log():
+//   slots 0-127   write pointer checkpoints ('CP')
+//   slots 128-253 blocks retired at runtime ('RB')
+//   slot 254      bad block table read from the bad block markers ('BT')
+//   slot 255      erase-ahead mode ('EA')
+// Unless noted otherwise, a record is 2 marker bytes, a 2 byte value, and the
+// value with its bits inverted.
+
+// A checkpoint is written every 512 pages, one per slot of the first half of
+// the checkpoint block, which is enough to cover all of flash. The value is the page.
+#define W25N01GV_CHECKPOINT_INTERVAL              (uint16_t) 512
+#define W25N01GV_CHECKPOINT_SLOTS                 (uint16_t) 128
+#define W25N01GV_CHECKPOINT_SIZE                  (uint16_t) 6
+#define W25N01GV_CHECKPOINT_MARKER_0              (uint8_t)  0x43  // 'C'
+#define W25N01GV_CHECKPOINT_MARKER_1              (uint8_t)  0x50  // 'P'
+
+// Blocks retired at runtime, in case a worn out block can't be programmed
+// with its own bad block marker. The value is the block number.
+#define W25N01GV_RETIRED_BLOCK_FIRST_SLOT         (uint16_t) 128
+#define W25N01GV_RETIRED_BLOCK_SLOTS              (uint16_t) 126
+#define W25N01GV_RETIRED_BLOCK_MARKER_0           (uint8_t)  0x52  // 'R'
+#define W25N01GV_RETIRED_BLOCK_MARKER_1           (uint8_t)  0x42  // 'B'
+
+// The blocks with a bad block marker, so init_flash() doesn't have to read all
+// 1024 markers. Record: 2 marker bytes, 1 bit per block like flash->bad_blocks,
+// and a CRC-16/CCITT of all of that.
+#define W25N01GV_BAD_BLOCK_TABLE_SLOT             (uint16_t) 254
+#define W25N01GV_BAD_BLOCK_TABLE_SIZE             (uint16_t) (2 + W25N01GV_NUM_BLOCKS/8 + 2)
+#define W25N01GV_BAD_BLOCK_TABLE_MARKER_0         (uint8_t)  0x42  // 'B'
+#define W25N01GV_BAD_BLOCK_TABLE_MARKER_1         (uint8_t)  0x54  // 'T'
+
+// The last slot of the checkpoint block is written by quick_erase_flash() and
+// start_circular_flash_log(), so erase-ahead mode is still on after a reset.
+// The value says whether the log wraps around. erase_flash() erases it.
+#define W25N01GV_ERASE_AHEAD_SLOT                 (uint16_t) 255
+#define W25N01GV_ERASE_AHEAD_MARKER_0             (uint8_t)  0x45  // 'E'
+#define W25N01GV_ERASE_AHEAD_MARKER_1             (uint8_t)  0x41  // 'A'
+#define W25N01GV_ERASE_AHEAD_LINEAR               (uint16_t) 0
+#define W25N01GV_ERASE_AHEAD_CIRCULAR             (uint16_t) 1
+
+// In erase-ahead mode, idle time is used to keep up to this many blocks (1 MB)
+// erased ahead of the write pointer's block
+#define W25N01GV_ERASE_AHEAD_BLOCKS               (uint16_t) 8
+
+// Sector metadata in the spare area. Each sector has 16 spare bytes starting at
+// column 2048 + 16*sector. Bytes 0-1 are the bad block marker and bytes 8-15 are
+// the ECC, so the metadata goes in bytes 2-7 (datasheet pg 11).
+// Metadata: 2 byte CRC, then the tag (4 bits) and valid byte count (12 bits),
+// then the sequence number. Only bytes 4-7 are protected by ECC, so the CRC goes first.
+// The valid byte count only needs 10 bits, the top bit of the 12 marks the end of a test.
+#define W25N01GV_SPARE_AREA_COLUMN                (uint16_t) 2048
+#define W25N01GV_SPARE_BYTES_PER_SECTOR           (uint16_t) 16
+#define W25N01GV_SPARE_AREA_SIZE                  (uint16_t) 64
+#define W25N01GV_METADATA_OFFSET                  (uint16_t) 2
+#define W25N01GV_METADATA_VALID_BYTES_MASK        (uint16_t) 0x03FF
+#define W25N01GV_METADATA_SECTION_END             (uint16_t) 0x0800
+
+// Page timestamps, see seek_flash_to_time(). Bytes 0-1 are only the bad block
+// marker in sector 0, so in sectors 1-3 they hold the high half of the time,
+// the low half and a CRC-16 of both. They aren't covered by ECC.
+#define W25N01GV_PAGE_TIME_OFFSET                 (uint16_t) 0
+#define W25N01GV_PAGE_TIME_HIGH_SECTOR            (uint16_t) 1
+#define W25N01GV_PAGE_TIME_LOW_SECTOR             (uint16_t) 2
+#define W25N01GV_PAGE_TIME_CHECK_SECTOR           (uint16_t) 3
+
+// Bad blocks are marked with a non-0xFF first spare byte in their first page.
+// That byte is never written by this firmware otherwise, so the marker stays
+// readable after the block has been written to (datasheet pg 11).
+#define W25N01GV_BAD_BLOCK_MARKER                 (uint8_t)  0x00
+
+// BBM look up table entries, datasheet pg 32
+#define W25N01GV_BBM_LUT_ENTRIES                  (uint8_t)  20
+#define W25N01GV_BBM_LUT_ENABLE                   (uint16_t) 0x8000
+#define W25N01GV_BBM_LUT_BLOCK_MASK               (uint16_t) 0x03FF
+
+// Key/value store records: marker, key, value size, the value, then a CRC-16/CCITT
+// of all of that. Page 0 of the store's block holds the values packed by the last
+// compaction, and updates are appended one per sector after it.
+#define W25N01GV_KV_RECORD_MARKER                 (uint8_t)  0x4B  // 'K'
+#define W25N01GV_KV_HEADER_SIZE                   (uint16_t) 4
+#define W25N01GV_KV_RECORD_OVERHEAD               (uint16_t) 6
+#define W25N01GV_KV_FIRST_APPEND_SECTOR           (uint16_t) 5
+
+// A compaction is committed by a record in the sector after page 0, with a key
+// no value can have and the 2 byte generation of the compaction as its value.
+// Stores from before there was a commit record have an update there instead.
+#define W25N01GV_KV_COMMIT_SECTOR                 (uint16_t) 4
+#define W25N01GV_KV_COMMIT_KEY                    (uint8_t)  0xFF
+#define W25N01GV_KV_COMMIT_RECORD_SIZE            (uint16_t) 8
+#define W25N01GV_KV_NUM_SECTORS                   (uint16_t) 256
+
+// Operations timed for the statistics, see enable_flash_stats()
+#define W25N01GV_OP_NONE                          (uint8_t)  0
+#define W25N01GV_OP_LOAD                          (uint8_t)  1
+#define W25N01GV_OP_PROGRAM                       (uint8_t)  2
+#define W25N01GV_OP_ERASE                         (uint8_t)  3
+#define W25N01GV_STAT_COUNTER_MAX                 (uint8_t)  255
 
 // Used for find_file_ptr()
 #define W25N01GV_ERASED_BYTE                               (uint8_t) 0xFF
 
+// Used by read_next_sectors() to keep sectors with any tag
+#define W25N01GV_ANY_TAG                                   (uint8_t) 0xFF
+
 /* Commands */
 // Summary of commands and usage on datasheet pg 23-25
 #define W25N01GV_DEVICE_RESET                     (uint8_t) 0xFF
@@ -49,11 +163,18 @@
 #define W25N01GV_WRITE_ENABLE                     (uint8_t) 0x06
 #define W25N01GV_WRITE_DISABLE                    (uint8_t) 0x04
 #define W25N01GV_READ_BBM_LOOK_UP_TABLE           (uint8_t) 0xA5
+#define W25N01GV_BBM_SWAP_BLOCKS                  (uint8_t) 0xA1
 #define W25N01GV_ERASE_BLOCK                      (uint8_t) 0xD8
 #define W25N01GV_LOAD_PROGRAM_DATA                (uint8_t) 0x02
+#define W25N01GV_RANDOM_LOAD_PROGRAM_DATA         (uint8_t) 0x84
 #define W25N01GV_PROGRAM_EXECUTE                  (uint8_t) 0x10
 #define W25N01GV_PAGE_DATA_READ                   (uint8_t) 0x13
 #define W25N01GV_READ_DATA                        (uint8_t) 0x03
+#define W25N01GV_QUAD_LOAD_PROGRAM_DATA           (uint8_t) 0x32
+#define W25N01GV_QUAD_RANDOM_LOAD_PROGRAM_DATA    (uint8_t) 0x34
+#define W25N01GV_FAST_READ_DUAL_OUTPUT            (uint8_t) 0x3B
+#define W25N01GV_FAST_READ_QUAD_OUTPUT            (uint8_t) 0x6B
+#define W25N01GV_LAST_ECC_FAILURE_PAGE_ADDRESS    (uint8_t) 0xA9
 
 /* Status Register addressses */
 #define W25N01GV_SR1_PROTECTION_REG_ADR           (uint8_t) 0xA0  // Listed as 0xAx in the datasheet
@@ -91,9 +212,9 @@
 // Used for firmware timeouts
 #define W25N01GV_RESET_MAX_TIME_US                    500  // datasheet pg 26
 #define W25N01GV_WRITE_STATUS_REGISTER_TIME_NS         50
-#define W25N01GV_BLOCK_ERASE_MAX_TIME_MS                4
-#define W25N01GV_READ_PAGE_DATA_ECC_ON_MAX_TIME_US     25
-#define W25N01GV_READ_PAGE_DATA_ECC_OFF_MAX_TIME_US    60
+#define W25N01GV_BLOCK_ERASE_MAX_TIME_MS               10
+#define W25N01GV_READ_PAGE_DATA_ECC_ON_MAX_TIME_US     60
+#define W25N01GV_READ_PAGE_DATA_ECC_OFF_MAX_TIME_US    25
 #define W25N01GV_PAGE_PROGRAM_MAX_TIME_US             700
 
 
@@ -120,6 +241,42 @@
  */
 #define W25N01GV_PACK_2_BYTES_TO_UINT16(bytes)		(uint16_t) ((((uint16_t) *(bytes)) << 8) + *((bytes)+1))
 
+// CRC-16/CCITT lookup table (polynomial 0x1021), used for the sector metadata
+static const uint16_t W25N01GV_CRC16_TABLE[256] = {
+		0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+		0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+		0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+		0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+		0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+		0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+		0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+		0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+		0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+		0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+		0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+		0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+		0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+		0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+		0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+		0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+		0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+		0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+		0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+		0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+		0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+		0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+		0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+		0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+		0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+		0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+		0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+		0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+		0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+		0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+		0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+		0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0
+};
+
 /**
  * Transmit 1 or more bytes to the device via SPI. This function exists to
  * shorten the number of commands required to write something over SPI
@@ -131,6 +288,11 @@
  */
 static void spi_transmit(W25N01GV_Flash *flash, uint8_t *tx, uint16_t size) {
 
+	if (flash->transport != NULL) {
+		flash->last_HAL_status = flash->transport(flash, tx, size, NULL, 0, 1, 0);
+		return;
+	}
+
 	__disable_irq();
 	HAL_GPIO_WritePin(flash->cs_base, flash->cs_pin, W25N01GV_CS_ACTIVE);  // Select chip
 	// Transmit data and store the status code
@@ -155,6 +317,11 @@ static void spi_transmit(W25N01GV_Flash *flash, uint8_t *tx, uint16_t size) {
 static void spi_transmit_receive(W25N01GV_Flash *flash, uint8_t *tx,
 		uint16_t tx_size,	uint8_t *rx, uint16_t rx_size) {
 
+	if (flash->transport != NULL) {
+		flash->last_HAL_status = flash->transport(flash, tx, tx_size, rx, rx_size, 1, 1);
+		return;
+	}
+
 	__disable_irq();
 	HAL_GPIO_WritePin(flash->cs_base, flash->cs_pin, W25N01GV_CS_ACTIVE);  // Select chip
 	// Transmit/receive, and store the status code
@@ -166,6 +333,44 @@ static void spi_transmit_receive(W25N01GV_Flash *flash, uint8_t *tx,
 
 }
 
+/**
+ * Transmit a command header followed by a block of data in the same
+ * transaction. With a transport (see init_flash_with_transport()), the data
+ * is sent on data_lines lines, otherwise everything is sent over standard SPI.
+ *
+ * @param flash       <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param header      <uint8_t*>           Command and address bytes, always sent on 1 line
+ * @param header_size <uint16_t>           Number of bytes in header
+ * @param data        <uint8_t*>           Data buffer to transmit
+ * @param num_bytes   <uint16_t>           Number of bytes in data
+ * @param data_lines  <uint8_t>            Number of lines to send data on: 1, 2 or 4
+ */
+static void spi_transmit_data(W25N01GV_Flash *flash, uint8_t *header, uint16_t header_size,
+		uint8_t *data, uint16_t num_bytes, uint8_t data_lines) {
+
+	if (flash->transport != NULL) {
+		flash->last_HAL_status = flash->transport(flash, header, header_size, data, num_bytes, data_lines, 0);
+		return;
+	}
+
+	__disable_irq();
+	HAL_GPIO_WritePin(flash->cs_base, flash->cs_pin, W25N01GV_CS_ACTIVE);  // Select chip
+	flash->last_HAL_status = HAL_SPI_Transmit(flash->SPI_bus, header, header_size, W25N01GV_SPI_TIMEOUT);
+	flash->last_HAL_status = HAL_SPI_Transmit(flash->SPI_bus, data, num_bytes, W25N01GV_SPI_TIMEOUT);
+	HAL_GPIO_WritePin(flash->cs_base, flash->cs_pin, W25N01GV_CS_INACTIVE);  // Release chip
+	__enable_irq();
+}
+
+/**
+ * The chip has a quad program data load, but no dual one.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @retval The number of lines to load program data on
+ */
+static uint8_t program_data_lines(W25N01GV_Flash *flash) {
+	return (flash->data_lines == 4) ? 4 : 1;
+}
+
 /**
  * The Read Status Register instruction may be used at any time, even while
  * a Program or Erase cycle is in progress.
@@ -190,6 +395,84 @@ static uint8_t read_status_register(W25N01GV_Flash *flash, uint8_t register_adr)
 	return *rx;
 }
 
+/**
+ * Turns on the DWT cycle counter, the time base for busy waits and the
+ * latency statistics.
+ */
+static void enable_cycle_counter(void) {
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+/**
+ * Converts a time to CPU cycles at the current core clock.
+ *
+ * @param ns         <uint32_t>           Time in nanoseconds
+ * @retval The number of cycles
+ */
+static uint32_t ns_to_cycles(uint32_t ns) {
+	return (uint32_t) (((uint64_t) ns * (SystemCoreClock / 1000000)) / 1000);
+}
+
+/**
+ * Remembers the page of an operation that's about to be sent, and if
+ * statistics are enabled, starts timing it. The timer is stopped by the
+ * first flash_is_busy() that finds the chip ready.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param op         <uint8_t>            W25N01GV_OP_LOAD, W25N01GV_OP_PROGRAM or W25N01GV_OP_ERASE
+ * @param page_adr   <uint16_t>           Page the operation is on
+ */
+static void start_op_timer(W25N01GV_Flash *flash, uint8_t op, uint16_t page_adr) {
+	flash->last_op_page = page_adr;
+	flash->last_wait_timed_out = 0;
+	if (flash->stats == NULL)
+		return;
+
+	flash->timed_op = op;
+	flash->timed_op_start = DWT->CYCCNT;
+}
+
+/**
+ * Adds the time since start_op_timer() to the statistics of the operation
+ * being timed, if there is one.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void stop_op_timer(W25N01GV_Flash *flash) {
+	W25N01GV_Latency *latency;
+	uint32_t cycles = DWT->CYCCNT - flash->timed_op_start;  // Unsigned math handles the counter wrapping
+
+	if (flash->timed_op == W25N01GV_OP_LOAD)
+		latency = &flash->stats->page_load;
+	else if (flash->timed_op == W25N01GV_OP_PROGRAM)
+		latency = &flash->stats->program;
+	else if (flash->timed_op == W25N01GV_OP_ERASE)
+		latency = &flash->stats->erase;
+	else
+		return;
+
+	latency->count++;
+	latency->total_cycles += cycles;
+	if (cycles < latency->min_cycles)
+		latency->min_cycles = cycles;
+	if (cycles > latency->max_cycles)
+		latency->max_cycles = cycles;
+
+	flash->timed_op = W25N01GV_OP_NONE;
+}
+
+/**
+ * Adds 1 to a block's counter in the statistics, stopping at 255.
+ *
+ * @param counters   <uint8_t*>           Array of 1024 counters
+ * @param block      <uint16_t>           Block to count, ignored if it's 1024 or more
+ */
+static void count_block_event(uint8_t *counters, uint16_t block) {
+	if (block < W25N01GV_NUM_BLOCKS && counters[block] < W25N01GV_STAT_COUNTER_MAX)
+		counters[block]++;
+}
+
 /**
  * Checks to see if flash is busy. While it's busy, all commands will be
  * ignored except for Read Status Register and Read JEDEC ID.
@@ -208,29 +491,90 @@ static uint8_t read_status_register(W25N01GV_Flash *flash, uint8_t register_adr)
  */
 static uint8_t flash_is_busy(W25N01GV_Flash *flash) {
 	uint8_t status_register = read_status_register(flash, W25N01GV_SR3_STATUS_REG_ADR);
-	return status_register & W25N01GV_SR3_OPERATION_IN_PROGRESS;
+	uint8_t busy = status_register & W25N01GV_SR3_OPERATION_IN_PROGRESS;
+
+	if (flash->stats != NULL) {
+		flash->stats->busy_polls++;
+		if (!busy)
+			stop_op_timer(flash);
+	}
+
+	return busy;
+}
+
+/**
+ * Waits out the poll interval between two status register reads, calling
+ * the yield callback so other work can run in the meantime. Without a poll
+ * interval, the callback is called once.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void wait_poll_interval(W25N01GV_Flash *flash) {
+	uint32_t start = DWT->CYCCNT;
+	uint32_t interval = ns_to_cycles(flash->poll_interval_us * 1000);
+
+	do {
+		if (flash->yield_callback != NULL)
+			flash->yield_callback(flash);
+	} while (DWT->CYCCNT - start < interval);
 }
 
 /**
  * Pings flash with the flash_is_busy() function to check if it's
  * currently busy with an operation. It stays in this function waiting
  * for the operation to finish when flash_is_busy() returns 0 or until
- * it reaches the timeout.
+ * the timeout passes, measured with the DWT cycle counter. Between polls
+ * it waits flash->poll_interval_us and calls flash->yield_callback,
+ * see set_flash_busy_wait().
  *
- * Note: this function should assume a 180 MHz maximum clock frequency, which
- * corresponds to a minimum 5.5555 ns period.
- *
- * TODO (low priority): Change function to accurately count the times using timers,
- * right now it's a duct tape solution
+ * If the chip is still busy at the timeout, flash->last_wait_timed_out is set
+ * and flash->wait_timeouts goes up. The program/erase failure status and the
+ * ECC status report the operation as failed.
  *
  * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
  * @param timeout    <uint32_t>           Maximum time to wait in nanoseconds.
+ * @retval 1 if the operation finished, 0 if it timed out
  */
-static void wait_for_operation(W25N01GV_Flash *flash, uint32_t timeout) {
-	uint32_t count = 0;
-	while (flash_is_busy(flash) && count < 6*timeout) {
+static uint8_t wait_for_operation(W25N01GV_Flash *flash, uint32_t timeout) {
+	uint32_t start = DWT->CYCCNT;
+	uint32_t timeout_cycles = ns_to_cycles(timeout);
+	uint32_t count = 1;
+	uint8_t timeout_passed = 0;
+
+	flash->last_wait_timed_out = 0;
+	while (flash_is_busy(flash)) {
+		// Poll once more after the timeout in case the wait was cut short by an interrupt
+		if (timeout_passed) {
+			flash->last_wait_timed_out = 1;
+			flash->wait_timeouts++;
+			break;
+		}
+		if (DWT->CYCCNT - start >= timeout_cycles)
+			timeout_passed = 1;
+		else
+			wait_poll_interval(flash);
 		++count;
 	}
+
+	if (flash->stats != NULL && count > flash->stats->max_polls_per_wait)
+		flash->stats->max_polls_per_wait = count;
+
+	return !flash->last_wait_timed_out;
+}
+
+/**
+ * After a wait timed out, gives the chip up to the longest any operation can
+ * take (a block erase) to finish, since it ignores commands until then.
+ * flash->wait_timeouts isn't counted again if this times out too, and
+ * flash->last_wait_timed_out stays set for the wait that timed out.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void wait_out_stuck_operation(W25N01GV_Flash *flash) {
+	uint32_t wait_timeouts = flash->wait_timeouts;
+	wait_for_operation(flash, W25N01GV_BLOCK_ERASE_MAX_TIME_MS * 1000000);
+	flash->wait_timeouts = wait_timeouts;
+	flash->last_wait_timed_out = 1;
 }
 
 /**
@@ -292,28 +636,43 @@ static void read_BBM_look_up_table(W25N01GV_Flash *flash, uint16_t *logical_bloc
 
 	spi_transmit_receive(flash, tx, 2, rx, 80);
 
-	// Format the received bytes into the user-supplied arrays
+	// Format the received bytes into the user-supplied arrays.
+	// Each entry is 4 bytes: the LBA followed by the PBA.
 	for (int i = 0; i < 20; i++) {
-		logical_block_addresses[i] = W25N01GV_PACK_2_BYTES_TO_UINT16(rx+(2*i));
-		physical_block_addresses[i] = W25N01GV_PACK_2_BYTES_TO_UINT16(rx+(2*i)+1);
+		logical_block_addresses[i] = W25N01GV_PACK_2_BYTES_TO_UINT16(rx+(4*i));
+		physical_block_addresses[i] = W25N01GV_PACK_2_BYTES_TO_UINT16(rx+(4*i)+2);
 	}
 }
 
 /**
- * Loads a page specified by the user into the device's buffer.
- * Load process takes 25 microseconds if ECC is disabled, and 60 microseconds if enabled.
- * The device will be in a BUSY state and ignore most commands until loading finishes.
+ * Sends the page data read command without waiting for the page to load.
+ * The chip stays busy for up to 60 microseconds afterwards.
  *
  * datasheet pg 38
  *
  * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
  * @param page_num   <uint16_t>           Page number of data to load to the device's buffer
  */
-static void load_page(W25N01GV_Flash *flash, uint16_t page_num) {
+static void start_page_load(W25N01GV_Flash *flash, uint16_t page_num) {
 	uint8_t page_num_8bit_array[2] = W25N01GV_UNPACK_UINT16_TO_2_BYTES(page_num);
 	uint8_t tx[4] = {W25N01GV_PAGE_DATA_READ, 0, page_num_8bit_array[0], page_num_8bit_array[1]};  // 2nd byte is unused
 
+	start_op_timer(flash, W25N01GV_OP_LOAD, page_num);
 	spi_transmit(flash, tx, 4);
+}
+
+/**
+ * Loads a page specified by the user into the device's buffer.
+ * Load process takes 25 microseconds if ECC is disabled, and 60 microseconds if enabled.
+ * The device will be in a BUSY state and ignore most commands until loading finishes.
+ *
+ * datasheet pg 38
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param page_num   <uint16_t>           Page number of data to load to the device's buffer
+ */
+static void load_page(W25N01GV_Flash *flash, uint16_t page_num) {
+	start_page_load(flash, page_num);
 
 	// TODO currently assumes ECC is always on, but needs to be more flexible
   wait_for_operation(flash, W25N01GV_READ_PAGE_DATA_ECC_ON_MAX_TIME_US * 1000);  // Wait for the page to load
@@ -409,6 +768,32 @@ static void disable_write(W25N01GV_Flash *flash) {
 	spi_transmit(flash, tx, 1);
 }
 
+/**
+ * Adds an entry to the bad block management look up table, so every access
+ * to the logical block goes to the physical block from then on. The table is
+ * non-volatile and has room for 20 entries, see BBM_look_up_table_is_full().
+ *
+ * datasheet pg 32
+ *
+ * ASSUMPTIONS:
+ * Flash is unlocked.
+ *
+ * @param flash          <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param logical_block  <uint16_t>           Block to replace
+ * @param physical_block <uint16_t>           Block to use in its place
+ */
+static void swap_BBM_blocks(W25N01GV_Flash *flash, uint16_t logical_block, uint16_t physical_block) {
+	uint8_t logical_block_8bit_array[2] = W25N01GV_UNPACK_UINT16_TO_2_BYTES(logical_block);
+	uint8_t physical_block_8bit_array[2] = W25N01GV_UNPACK_UINT16_TO_2_BYTES(physical_block);
+	uint8_t tx[5] = {W25N01GV_BBM_SWAP_BLOCKS, logical_block_8bit_array[0], logical_block_8bit_array[1],
+			physical_block_8bit_array[0], physical_block_8bit_array[1]};
+
+	enable_write(flash);
+	spi_transmit(flash, tx, 5);
+
+	wait_for_operation(flash, W25N01GV_PAGE_PROGRAM_MAX_TIME_US * 1000);
+}
+
 /**
  * Writes data to the device's buffer in preparation for writing
  * it to memory. It writes the data at the specified column (byte), and writes
@@ -425,7 +810,9 @@ static void write_page_to_buffer(W25N01GV_Flash *flash, uint8_t *data,
 		uint16_t num_bytes, uint16_t column_adr) {
 
 	uint8_t column_adr_8bit_array[2] = W25N01GV_UNPACK_UINT16_TO_2_BYTES(column_adr);
-	uint8_t tx1[3] = {W25N01GV_LOAD_PROGRAM_DATA, column_adr_8bit_array[0], column_adr_8bit_array[1]};
+	uint8_t data_lines = program_data_lines(flash);
+	uint8_t tx[3] = {(data_lines == 4) ? W25N01GV_QUAD_LOAD_PROGRAM_DATA : W25N01GV_LOAD_PROGRAM_DATA,
+			column_adr_8bit_array[0], column_adr_8bit_array[1]};
 
 	// Ignore all data that would be written to column 2048 and after.
 	// You don't want to overwrite the extra memory at the end of the page.
@@ -433,13 +820,29 @@ static void write_page_to_buffer(W25N01GV_Flash *flash, uint8_t *data,
 	if (num_bytes > W25N01GV_BYTES_PER_PAGE)
 		num_bytes = W25N01GV_BYTES_PER_PAGE;
 
-	// Not using spi_transmit() because I didn't want to mess with combining the tx arrays
-	__disable_irq();
-	HAL_GPIO_WritePin(flash->cs_base, flash->cs_pin, W25N01GV_CS_ACTIVE);
-	flash->last_HAL_status = HAL_SPI_Transmit(flash->SPI_bus, tx1, 3, W25N01GV_SPI_TIMEOUT);
-	flash->last_HAL_status = HAL_SPI_Transmit(flash->SPI_bus, data, num_bytes, W25N01GV_SPI_TIMEOUT);
-	HAL_GPIO_WritePin(flash->cs_base, flash->cs_pin, W25N01GV_CS_INACTIVE);
-	__enable_irq();
+	spi_transmit_data(flash, tx, 3, data, num_bytes, data_lines);
+}
+
+/**
+ * Same as write_page_to_buffer(), but uses the random load command, which
+ * doesn't reset the rest of the buffer to 0xFF. Can also load into the spare area.
+ *
+ * datasheet pg 36
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param data       <uint8_t*>           Data array containing data to load
+ * @param num_bytes  <uint16_t>           Number of bytes to load
+ * @param column_adr <uint16_t>           Byte in buffer to start loading at, up to 2111
+ */
+static void random_load_page_buffer(W25N01GV_Flash *flash, uint8_t *data,
+		uint16_t num_bytes, uint16_t column_adr) {
+
+	uint8_t column_adr_8bit_array[2] = W25N01GV_UNPACK_UINT16_TO_2_BYTES(column_adr);
+	uint8_t data_lines = program_data_lines(flash);
+	uint8_t tx[3] = {(data_lines == 4) ? W25N01GV_QUAD_RANDOM_LOAD_PROGRAM_DATA : W25N01GV_RANDOM_LOAD_PROGRAM_DATA,
+			column_adr_8bit_array[0], column_adr_8bit_array[1]};
+
+	spi_transmit_data(flash, tx, 3, data, num_bytes, data_lines);
 }
 
 /**
@@ -458,6 +861,7 @@ static void program_buffer_to_memory(W25N01GV_Flash *flash, uint16_t page_adr) {
 	uint8_t page_adr_8bit_array[2] = W25N01GV_UNPACK_UINT16_TO_2_BYTES(page_adr);
 	uint8_t tx[4] = {W25N01GV_PROGRAM_EXECUTE, 0, page_adr_8bit_array[0], page_adr_8bit_array[1]};  // 2nd byte unused
 
+	start_op_timer(flash, W25N01GV_OP_PROGRAM, page_adr);
 	spi_transmit(flash, tx, 4);
 	wait_for_operation(flash, W25N01GV_PAGE_PROGRAM_MAX_TIME_US * 1000);	 // Wait for the data to be written to memory
 }
@@ -479,7 +883,12 @@ static void program_buffer_to_memory(W25N01GV_Flash *flash, uint16_t page_adr) {
  */
 static uint8_t get_write_failure_status(W25N01GV_Flash *flash) {
 	// If it can't read from flash, it will automatically return a write failure
-	if (ping_flash(flash)) {
+	// A program that didn't finish in time failed too
+	if (flash->last_wait_timed_out) {
+		flash->last_write_failure_status = W25N01GV_SR3_PROGRAM_FAILURE;
+		wait_out_stuck_operation(flash);
+	}
+	else if (ping_flash(flash)) {
 		uint8_t status_register = read_status_register(flash, W25N01GV_SR3_STATUS_REG_ADR);
 		flash->last_write_failure_status = status_register & W25N01GV_SR3_PROGRAM_FAILURE;
 	}
@@ -487,6 +896,11 @@ static uint8_t get_write_failure_status(W25N01GV_Flash *flash) {
 		flash->last_write_failure_status = W25N01GV_SR3_PROGRAM_FAILURE;
 	}
 
+	if (flash->stats != NULL && flash->last_write_failure_status) {
+		flash->stats->program_failures++;
+		count_block_event(flash->stats->block_failures, flash->last_op_page / W25N01GV_PAGES_PER_BLOCK);
+	}
+
 	return flash->last_write_failure_status;
 }
 
@@ -507,7 +921,12 @@ static uint8_t get_write_failure_status(W25N01GV_Flash *flash) {
  */
 static uint8_t get_erase_failure_status(W25N01GV_Flash *flash) {
 	// If it can't read from flash, it will automatically return an erase failure
-	if (ping_flash(flash)) {
+	// An erase that didn't finish in time failed too
+	if (flash->last_wait_timed_out) {
+		flash->last_erase_failure_status = W25N01GV_SR3_ERASE_FAILURE;
+		wait_out_stuck_operation(flash);
+	}
+	else if (ping_flash(flash)) {
 		uint8_t status_register = read_status_register(flash, W25N01GV_SR3_STATUS_REG_ADR);
 		flash->last_erase_failure_status = status_register & W25N01GV_SR3_ERASE_FAILURE;
 	}
@@ -515,10 +934,33 @@ static uint8_t get_erase_failure_status(W25N01GV_Flash *flash) {
 		flash->last_erase_failure_status = W25N01GV_SR3_ERASE_FAILURE;
 	}
 
+	if (flash->stats != NULL && flash->last_erase_failure_status) {
+		flash->stats->erase_failures++;
+		count_block_event(flash->stats->block_failures, flash->last_op_page / W25N01GV_PAGES_PER_BLOCK);
+	}
+
 	return flash->last_erase_failure_status;
 
 }
 
+/**
+ * Sends the block erase command without waiting for the erase to finish.
+ * The chip stays busy for 2-10 milliseconds afterwards (datasheet pg 59).
+ *
+ * datasheet pg 34
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param page_adr   <uint16_t>           Address of the page whose block should be erased
+ */
+static void start_block_erase(W25N01GV_Flash *flash, uint16_t page_adr) {
+	enable_write(flash);	// Set WEL bit high, it will automatically be set back to 0 after the command executes
+
+	uint8_t page_adr_8bit_array[2] = W25N01GV_UNPACK_UINT16_TO_2_BYTES(page_adr);
+	uint8_t tx[4] = {W25N01GV_ERASE_BLOCK, 0, page_adr_8bit_array[0], page_adr_8bit_array[1]};	// 2nd byte unused
+	start_op_timer(flash, W25N01GV_OP_ERASE, page_adr);
+	spi_transmit(flash, tx, 4);
+}
+
 /**
  * Erases all data in the block containing the specified page address.
  * Each block has 64 pages, for a total of 128KB. Data is erased by setting
@@ -543,11 +985,7 @@ static uint8_t get_erase_failure_status(W25N01GV_Flash *flash) {
  * @param page_adr   <uint16_t>           Address of the page whose block should be erased
  */
 static void erase_block(W25N01GV_Flash *flash, uint16_t page_adr) {
-	enable_write(flash);	// Set WEL bit high, it will automatically be set back to 0 after the command executes
-
-	uint8_t page_adr_8bit_array[2] = W25N01GV_UNPACK_UINT16_TO_2_BYTES(page_adr);
-	uint8_t tx[4] = {W25N01GV_ERASE_BLOCK, 0, page_adr_8bit_array[0], page_adr_8bit_array[1]};	// 2nd byte unused
-	spi_transmit(flash, tx, 4);
+	start_block_erase(flash, page_adr);
 
 	disable_write(flash);	// Disable WEL just in case the erase block command doens't execute
 
@@ -556,6 +994,27 @@ static void erase_block(W25N01GV_Flash *flash, uint16_t page_adr) {
 	get_erase_failure_status(flash);
 }
 
+/**
+ * Adds the result of the last read to the ECC statistics, if they're enabled.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param block      <uint16_t>           Block that was read, W25N01GV_NUM_BLOCKS if unknown
+ */
+static void count_ECC_status(W25N01GV_Flash *flash, uint16_t block) {
+	if (flash->stats == NULL)
+		return;
+
+	if (flash->last_read_ECC_status == SUCCESS_WITH_CORRECTIONS) {
+		flash->stats->ECC_corrections++;
+		count_block_event(flash->stats->block_ECC_corrections, block);
+	}
+	else if (flash->last_read_ECC_status == ERROR_ONE_PAGE
+			|| flash->last_read_ECC_status == ERROR_MULTIPLE_PAGES) {
+		flash->stats->ECC_failures++;
+		count_block_event(flash->stats->block_failures, block);
+	}
+}
+
 /**
  * Reads the status of the error corrections done on the last read command.
  * This function should be used after read operations to verify data integrity.
@@ -570,8 +1029,13 @@ static void erase_block(W25N01GV_Flash *flash, uint16_t page_adr) {
  */
 static void get_ECC_status(W25N01GV_Flash *flash) {
 
+	// If the page didn't finish loading in time, there's no status to read
+	if (flash->last_wait_timed_out) {
+		flash->last_read_ECC_status = READ_ERROR_NO_ECC_STATUS;
+		wait_out_stuck_operation(flash);
+	}
 	// If it can read from flash properly, check the ECC bits as normal
-	if (ping_flash(flash)) {
+	else if (ping_flash(flash)) {
 		uint8_t status_register, ECC1, ECC0;
 
 		status_register = read_status_register(flash, W25N01GV_SR3_STATUS_REG_ADR);
@@ -592,6 +1056,11 @@ static void get_ECC_status(W25N01GV_Flash *flash) {
 	else {  // Otherwise record the read error
 		flash->last_read_ECC_status = READ_ERROR_NO_ECC_STATUS;
 	}
+
+	// A continuous read over SPI doesn't know which page the result is for,
+	// add_stream_ECC_status() counts it instead
+	if (!flash->continuous_read_active || flash->transport != NULL)
+		count_ECC_status(flash, flash->last_op_page / W25N01GV_PAGES_PER_BLOCK);
 }
 
 /**
@@ -617,6 +1086,13 @@ static void read_flash_buffer(W25N01GV_Flash *flash, uint8_t *buffer,
 	uint8_t column_adr_8bit_array[2] = W25N01GV_UNPACK_UINT16_TO_2_BYTES(column_adr);
 	uint8_t tx[4] = {W25N01GV_READ_DATA, column_adr_8bit_array[0], column_adr_8bit_array[1], 0};  // last byte is unused
 
+	// The fast read commands have the same header, the last byte is a dummy byte either way
+	if (flash->transport != NULL && flash->data_lines > 1) {
+		tx[0] = (flash->data_lines == 4) ? W25N01GV_FAST_READ_QUAD_OUTPUT : W25N01GV_FAST_READ_DUAL_OUTPUT;
+		flash->last_HAL_status = flash->transport(flash, tx, 4, buffer, num_bytes, flash->data_lines, 1);
+		return;
+	}
+
 	spi_transmit_receive(flash, tx, 4, buffer, num_bytes);
 }
 
@@ -650,9 +1126,165 @@ static void read_bytes_from_page(W25N01GV_Flash *flash, uint8_t *buffer, uint16_
 	get_ECC_status(flash);
 }
 
+/**
+ * Updates a CRC-16/CCITT with num_bytes of data.
+ *
+ * @param crc        <uint16_t>           CRC so far, start with 0xFFFF
+ * @param data       <uint8_t*>           Data to add to the CRC
+ * @param num_bytes  <uint16_t>           Number of bytes in data
+ * @retval The updated CRC
+ */
+static uint16_t update_crc16(uint16_t crc, const uint8_t *data, uint16_t num_bytes) {
+	for (uint16_t i = 0; i < num_bytes; i++)
+		crc = (uint16_t) (crc << 8) ^ W25N01GV_CRC16_TABLE[(uint8_t) (crc >> 8) ^ data[i]];
+	return crc;
+}
+
+/**
+ * Calculates the CRC stored in a sector's metadata. It covers all 512 bytes
+ * of the sector as they will be on flash (bytes that aren't written stay 0xFF),
+ * followed by the 4 metadata bytes after the CRC.
+ *
+ * @param data       <uint8_t*>           Data written to the sector
+ * @param num_bytes  <uint16_t>           Number of bytes written, up to W25N01GV_SECTOR_SIZE
+ * @param fields     <uint8_t*>           The 4 metadata bytes after the CRC
+ * @retval The CRC
+ */
+static uint16_t sector_crc(const uint8_t *data, uint16_t num_bytes, const uint8_t *fields) {
+	uint8_t erased_byte[1] = { W25N01GV_ERASED_BYTE };
+
+	uint16_t crc = update_crc16(0xFFFF, data, num_bytes);
+	for (uint16_t b = num_bytes; b < W25N01GV_SECTOR_SIZE; b++)
+		crc = update_crc16(crc, erased_byte, 1);
+
+	return update_crc16(crc, fields, W25N01GV_SECTOR_METADATA_SIZE - 2);
+}
+
+/**
+ * Returns the time to stamp pages with, see set_flash_time_source().
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @retval The current time
+ */
+static uint32_t get_flash_time(W25N01GV_Flash *flash) {
+	if (flash->time_source != NULL)
+		return flash->time_source(flash);
+	return HAL_GetTick();
+}
+
+/**
+ * Fills in the spare area record for each sector covered by a write of
+ * num_bytes starting at a sector boundary: the metadata, using
+ * flash->record_tag and the next sequence numbers, and the page's timestamp.
+ * The write starts at the write pointer, and the page is stamped when its
+ * first sector is written.
+ *
+ * @param flash           <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param data            <uint8_t*>           Data to be written
+ * @param num_bytes       <uint16_t>           Number of bytes to be written, up to W25N01GV_BYTES_PER_PAGE
+ * @param num_valid_bytes <uint16_t>           Number of bytes in data that aren't padding
+ * @param metadata        <uint8_t[][]>        One spare area record for each sector, starting with the first one written
+ */
+static void make_page_metadata(W25N01GV_Flash *flash, uint8_t *data, uint16_t num_bytes,
+		uint16_t num_valid_bytes, uint8_t metadata[][W25N01GV_SECTOR_SPARE_RECORD_SIZE]) {
+
+	if (flash->next_free_column == 0 || flash->page_time_page != flash->current_page) {
+		flash->page_time = get_flash_time(flash);
+		flash->page_time_page = flash->current_page;
+	}
+	uint8_t time_8bit_array[4] = {(uint8_t) (flash->page_time >> 24), (uint8_t) (flash->page_time >> 16),
+			(uint8_t) (flash->page_time >> 8), (uint8_t) flash->page_time};
+	uint8_t time_check_8bit_array[2] = W25N01GV_UNPACK_UINT16_TO_2_BYTES(update_crc16(0xFFFF, time_8bit_array, 4));
+
+	for (uint16_t start = 0; start < num_bytes; start += W25N01GV_SECTOR_SIZE) {
+		uint8_t *spare_record = metadata[start / W25N01GV_SECTOR_SIZE];
+		uint8_t *sector_metadata = spare_record + W25N01GV_METADATA_OFFSET;
+
+		uint8_t *time_part = NULL;
+		switch ((flash->next_free_column + start) / W25N01GV_SECTOR_SIZE) {
+		case W25N01GV_PAGE_TIME_HIGH_SECTOR:  time_part = time_8bit_array;     break;
+		case W25N01GV_PAGE_TIME_LOW_SECTOR:   time_part = time_8bit_array + 2; break;
+		case W25N01GV_PAGE_TIME_CHECK_SECTOR: time_part = time_check_8bit_array; break;
+		}
+		spare_record[W25N01GV_PAGE_TIME_OFFSET] = (time_part != NULL) ? time_part[0] : W25N01GV_ERASED_BYTE;
+		spare_record[W25N01GV_PAGE_TIME_OFFSET+1] = (time_part != NULL) ? time_part[1] : W25N01GV_ERASED_BYTE;
+
+		uint16_t sector_bytes = num_bytes - start;
+		if (sector_bytes > W25N01GV_SECTOR_SIZE)
+			sector_bytes = W25N01GV_SECTOR_SIZE;
+
+		uint16_t valid_bytes = 0;
+		if (num_valid_bytes > start)
+			valid_bytes = num_valid_bytes - start;
+		if (valid_bytes > sector_bytes)
+			valid_bytes = sector_bytes;
+
+		uint16_t tag_and_size = ((uint16_t) flash->record_tag << 12) | valid_bytes;
+		if (flash->section_end_pending)
+			tag_and_size |= W25N01GV_METADATA_SECTION_END;
+		uint8_t tag_and_size_8bit_array[2] = W25N01GV_UNPACK_UINT16_TO_2_BYTES(tag_and_size);
+		uint8_t sequence_8bit_array[2] = W25N01GV_UNPACK_UINT16_TO_2_BYTES(flash->next_sequence);
+		flash->next_sequence++;
+
+		sector_metadata[2] = tag_and_size_8bit_array[0];
+		sector_metadata[3] = tag_and_size_8bit_array[1];
+		sector_metadata[4] = sequence_8bit_array[0];
+		sector_metadata[5] = sequence_8bit_array[1];
+
+		uint16_t crc = sector_crc(data + start, sector_bytes, sector_metadata+2);
+		uint8_t crc_8bit_array[2] = W25N01GV_UNPACK_UINT16_TO_2_BYTES(crc);
+		sector_metadata[0] = crc_8bit_array[0];
+		sector_metadata[1] = crc_8bit_array[1];
+	}
+}
+
+/**
+ * Loads sector metadata into the spare area of the device's buffer, after the
+ * sector data has been loaded with write_page_to_buffer(). Uses the random
+ * load command so the data already in the buffer isn't reset. Sector 0 skips
+ * the bytes in front of the metadata, since they hold the bad block marker.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param metadata   <uint8_t[][]>        Metadata from make_page_metadata()
+ * @param num_bytes  <uint16_t>           Number of bytes of sector data that were loaded
+ * @param column_adr <uint16_t>           Column the sector data was loaded at, a multiple of W25N01GV_SECTOR_SIZE
+ */
+static void load_page_metadata(W25N01GV_Flash *flash, uint8_t metadata[][W25N01GV_SECTOR_SPARE_RECORD_SIZE],
+		uint16_t num_bytes, uint16_t column_adr) {
+
+	for (uint16_t start = 0; start < num_bytes; start += W25N01GV_SECTOR_SIZE) {
+		uint16_t sector = (column_adr + start) / W25N01GV_SECTOR_SIZE;
+		uint16_t spare_column = W25N01GV_SPARE_AREA_COLUMN + sector * W25N01GV_SPARE_BYTES_PER_SECTOR;
+		uint8_t *spare_record = metadata[start / W25N01GV_SECTOR_SIZE];
+
+		if (sector == 0)
+			random_load_page_buffer(flash, spare_record + W25N01GV_METADATA_OFFSET,
+					W25N01GV_SECTOR_METADATA_SIZE, spare_column + W25N01GV_METADATA_OFFSET);
+		else
+			random_load_page_buffer(flash, spare_record, W25N01GV_SECTOR_SPARE_RECORD_SIZE, spare_column);
+	}
+}
+
+/**
+ * Converts the metadata bytes of one sector into a struct.
+ *
+ * @param spare      <uint8_t*>                   The sector's 16 spare area bytes
+ * @param metadata   <W25N01GV_Sector_Metadata*>  Struct to fill in
+ */
+static void parse_sector_metadata(uint8_t *spare, W25N01GV_Sector_Metadata *metadata) {
+	uint16_t tag_and_size = W25N01GV_PACK_2_BYTES_TO_UINT16(spare + W25N01GV_METADATA_OFFSET + 2);
+
+	metadata->crc = W25N01GV_PACK_2_BYTES_TO_UINT16(spare + W25N01GV_METADATA_OFFSET);
+	metadata->tag = tag_and_size >> 12;
+	metadata->valid_bytes = tag_and_size & W25N01GV_METADATA_VALID_BYTES_MASK;
+	metadata->section_end = (tag_and_size & W25N01GV_METADATA_SECTION_END) != 0;
+	metadata->sequence = W25N01GV_PACK_2_BYTES_TO_UINT16(spare + W25N01GV_METADATA_OFFSET + 4);
+}
+
 /**
  * Writes the contents of data into flash at the specified page and column.
  * It writes to the device's buffer, then programs the buffer data into flash memory.
+ * If metadata is given, it's programmed into the spare area with the data.
  *
  * It then reads the write failure status bit and stores it to the W25N01GV_Flash struct.
  *
@@ -668,13 +1300,16 @@ static void read_bytes_from_page(W25N01GV_Flash *flash, uint8_t *buffer, uint16_
  * @param num_bytes  <uint16_t>           Number of bytes to write to flash
  * @param page_adr   <uint16_t>           Page to write data to
  * @param column_adr <uint16_t>           Column of page to start writing data at
+ * @param metadata   <uint8_t[][]>        Metadata from make_page_metadata(), or NULL to not write any
  */
 static void write_bytes_to_page(W25N01GV_Flash *flash, uint8_t *data, uint16_t num_bytes,
-		uint16_t page_adr, uint16_t column_adr) {
+		uint16_t page_adr, uint16_t column_adr, uint8_t metadata[][W25N01GV_SECTOR_SPARE_RECORD_SIZE]) {
 
 	enable_write(flash);
 
 	write_page_to_buffer(flash, data, num_bytes, column_adr);
+	if (metadata != NULL)
+		load_page_metadata(flash, metadata, num_bytes, column_adr);
 	program_buffer_to_memory(flash, page_adr);
 
 	// This will happen automatically if program_buffer_to_memory() succeeds, but just in case it fails ;)
@@ -684,519 +1319,3535 @@ static void write_bytes_to_page(W25N01GV_Flash *flash, uint8_t *data, uint16_t n
 }
 
 /**
- * Set the ECC-E bit in the configuration register (SR2) to 1, enabling the
- * onboard error correction algorithms. If ECC-E is already 1, does nothing.
- *
- * datasheet pg 18
+ * Reads the record in a slot of the checkpoint block. Each 512 byte sector is
+ * a slot, so every record is programmed in its own sector.
  *
  * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param slot       <uint16_t>           Slot to read, 0 to W25N01GV_PAGES_PER_BLOCK*W25N01GV_SECTORS_PER_PAGE-1
+ * @param marker_0   <uint8_t>            Expected first marker byte
+ * @param marker_1   <uint8_t>            Expected second marker byte
+ * @param value      <uint16_t*>          Set to the value in the record if it's valid
+ * @retval 1 if the slot holds a valid record, 0 if it's erased or corrupted
  */
-static void enable_ECC(W25N01GV_Flash *flash) {
-	uint8_t config_reg_read = read_status_register(flash, W25N01GV_SR2_CONFIG_REG_ADR);
-	uint8_t ECC_enabled_register = config_reg_read | W25N01GV_SR2_ECC_ENABLE;	 // OR: turn bit on
+static uint8_t read_slot_record(W25N01GV_Flash *flash, uint16_t slot, uint8_t marker_0, uint8_t marker_1,
+		uint16_t *value) {
+	uint8_t record[W25N01GV_CHECKPOINT_SIZE];
 
-	if (ECC_enabled_register != config_reg_read)
-		write_status_register(flash, W25N01GV_SR2_CONFIG_REG_ADR, ECC_enabled_register);
+	read_bytes_from_page(flash, record, W25N01GV_CHECKPOINT_SIZE,
+			W25N01GV_CHECKPOINT_BLOCK * W25N01GV_PAGES_PER_BLOCK + slot / W25N01GV_SECTORS_PER_PAGE,
+			(slot % W25N01GV_SECTORS_PER_PAGE) * W25N01GV_SECTOR_SIZE);
+
+	uint16_t record_value = W25N01GV_PACK_2_BYTES_TO_UINT16(record+2);
+	uint16_t inverted_value = W25N01GV_PACK_2_BYTES_TO_UINT16(record+4);
+
+	if (record[0] != marker_0 || record[1] != marker_1 || (record_value ^ inverted_value) != 0xFFFF)
+		return 0;
+
+	*value = record_value;
+	return 1;
 }
 
 /**
- * Set the ECC-E bit in the configuration register (SR2) to 0, disabling the
- * onboard error correction algorithms. If ECC-E is already 0, does nothing.
- * Don't actually use this, but I included it because why not.
+ * Writes a record to an erased slot of the checkpoint block.
  *
- * datasheet pg 18
+ * ASSUMPTIONS:
+ * Flash is unlocked.
  *
  * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param slot       <uint16_t>           Slot to write, 0 to W25N01GV_PAGES_PER_BLOCK*W25N01GV_SECTORS_PER_PAGE-1
+ * @param marker_0   <uint8_t>            First marker byte
+ * @param marker_1   <uint8_t>            Second marker byte
+ * @param value      <uint16_t>           Value to save
  */
-static void disable_ECC(W25N01GV_Flash *flash) {
-	uint8_t config_reg_read = read_status_register(flash, W25N01GV_SR2_CONFIG_REG_ADR);
-	uint8_t ECC_disabled_register = config_reg_read & ~W25N01GV_SR2_ECC_ENABLE;	 // Remove bit
-
-	if (ECC_disabled_register != config_reg_read)
-		write_status_register(flash, W25N01GV_SR2_CONFIG_REG_ADR, ECC_disabled_register);
+static void write_slot_record(W25N01GV_Flash *flash, uint16_t slot, uint8_t marker_0, uint8_t marker_1,
+		uint16_t value) {
+	uint8_t value_8bit_array[2] = W25N01GV_UNPACK_UINT16_TO_2_BYTES(value);
+	uint8_t inverted_value_8bit_array[2] = W25N01GV_UNPACK_UINT16_TO_2_BYTES((uint16_t) ~value);
+	uint8_t record[W25N01GV_CHECKPOINT_SIZE] = {marker_0, marker_1,
+			value_8bit_array[0], value_8bit_array[1], inverted_value_8bit_array[0], inverted_value_8bit_array[1]};
+
+	write_bytes_to_page(flash, record, W25N01GV_CHECKPOINT_SIZE,
+			W25N01GV_CHECKPOINT_BLOCK * W25N01GV_PAGES_PER_BLOCK + slot / W25N01GV_SECTORS_PER_PAGE,
+			(slot % W25N01GV_SECTORS_PER_PAGE) * W25N01GV_SECTOR_SIZE, NULL);
 }
 
 /**
- * Sets the device to buffer read mode, which limits the user to reading
- * up to one page at a time before loading a new page. It sets the BUF bit
- * in the configuration register to 1 if BUF=0, and does nothing if BUF=1.
- * This is the mode that MASA firmware will be using for TSM.
- *
- * datasheet pg 18
+ * Counts the written slots in a range of the checkpoint block. Slots are
+ * always written in order, so this is a binary search for the first erased
+ * one, reading 1 byte from each slot it checks.
  *
  * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param first_slot <uint16_t>           First slot of the range
+ * @param num_slots  <uint16_t>           Number of slots in the range
+ * @retval Number of slots written, starting from first_slot
  */
-static void enable_buffer_mode(W25N01GV_Flash *flash) {
-	uint8_t config_reg_read = read_status_register(flash, W25N01GV_SR2_CONFIG_REG_ADR);
-	uint8_t buffer_enabled_register = config_reg_read | W25N01GV_SR2_BUFFER_READ_MODE;	// OR: turn bit on
-	if (buffer_enabled_register != config_reg_read)
-		write_status_register(flash, W25N01GV_SR2_CONFIG_REG_ADR, buffer_enabled_register);
+static uint16_t count_written_slots(W25N01GV_Flash *flash, uint16_t first_slot, uint16_t num_slots) {
+	uint8_t record[1];
+	uint32_t min = 0;  // exclusive, last slot known to be written
+	uint32_t max = num_slots;  // exclusive
+
+	read_bytes_from_page(flash, record, 1,
+			W25N01GV_CHECKPOINT_BLOCK * W25N01GV_PAGES_PER_BLOCK + first_slot / W25N01GV_SECTORS_PER_PAGE,
+			(first_slot % W25N01GV_SECTORS_PER_PAGE) * W25N01GV_SECTOR_SIZE);
+	if (record[0] == W25N01GV_ERASED_BYTE)
+		return 0;
+
+	while (max - min > 1) {
+		uint16_t slot = first_slot + min + (max-min) / 2;
+		read_bytes_from_page(flash, record, 1,
+				W25N01GV_CHECKPOINT_BLOCK * W25N01GV_PAGES_PER_BLOCK + slot / W25N01GV_SECTORS_PER_PAGE,
+				(slot % W25N01GV_SECTORS_PER_PAGE) * W25N01GV_SECTOR_SIZE);
+
+		if (record[0] == W25N01GV_ERASED_BYTE)
+			max = slot - first_slot;
+		else
+			min = slot - first_slot;
+	}
+
+	return min + 1;
 }
 
 /**
- * Performs a binary search on flash memory to find the first available
- * address to write to. Modifies flash->current_page and flash->next_free_column.
+ * Checks the RAM bad block table.
  *
- * This function is critical to prevent data corruption, which occurs when this firmware
- * tries to write over previously-written addresses.
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param block      <uint16_t>           Block to check, 0 to W25N01GV_NUM_BLOCKS-1
+ * @retval 1 if the block is bad or retired, 0 if it can be used
+ */
+static uint8_t block_is_bad(W25N01GV_Flash *flash, uint16_t block) {
+	return (flash->bad_blocks[block / 8] >> (block % 8)) & 1;
+}
+
+/**
+ * Finds the first page at or after page_adr that isn't in a bad block.
  *
- * Key assumptions made by this function that are maintained by write_to_flash():
- * All non-empty pages come before all empty pages in memory. This in turn assumes
- * that the user is not constantly writing '0xFF', which is the empty/erased byte.
- * If there is entire page consisting of '0xFF', and there are later pages that
- * contain user-written data, then this function might fail.
- * TODO: write a note in write_to_flash() not to do this
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param page_adr   <uint32_t>           Page to start at
+ * @retval The page, or W25N01GV_NUM_PAGES if there are only bad blocks left
+ */
+static uint32_t next_good_page(W25N01GV_Flash *flash, uint32_t page_adr) {
+	while (page_adr < W25N01GV_NUM_PAGES && block_is_bad(flash, page_adr / W25N01GV_PAGES_PER_BLOCK))
+		page_adr = (page_adr / W25N01GV_PAGES_PER_BLOCK + 1) * W25N01GV_PAGES_PER_BLOCK;
+	return page_adr;
+}
+
+/**
+ * Finds the first block in the data area at or after the given one that isn't bad.
  *
- * Another way to think of this function is that there should always be a contiguous chunk
- * of 0xFF bytes at the end of flash, and this function finds the first byte in that chunk.
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param block      <uint16_t>           Block to start at
+ * @retval The block, or W25N01GV_NUM_DATA_BLOCKS if there are only bad blocks left
+ */
+static uint16_t next_good_block(W25N01GV_Flash *flash, uint16_t block) {
+	while (block < W25N01GV_NUM_DATA_BLOCKS && block_is_bad(flash, block))
+		block++;
+	return block;
+}
+
+/**
+ * Finds the first page at or after page_adr that isn't in a bad block, going
+ * back to the start of flash past the last good block in a circular log.
  *
- * Expected results:
- * flash->current_page will be any uint16_t,and flash->next_free_column will be
- * 0, 512, 1024, or 1536 (except when flash->current_page == 65536, in which case
- * flash->next_free_column can also be 2048).
- * See various comments about flash->write_buffer for explanation.
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param page_adr   <uint32_t>           Page to start at
+ * @retval The page, or W25N01GV_NUM_PAGES if there are only bad blocks left
+ */
+static uint32_t next_good_log_page(W25N01GV_Flash *flash, uint32_t page_adr) {
+	page_adr = next_good_page(flash, page_adr);
+	if (page_adr >= W25N01GV_NUM_PAGES && flash->circular_log_enabled)
+		page_adr = next_good_page(flash, 0);
+	return page_adr;
+}
+
+/**
+ * Erase-ahead mode: the block erase-ahead has to stop before. In a circular
+ * log, block numbers from W25N01GV_NUM_DATA_BLOCKS on are the blocks of the
+ * next time around flash, up to the write pointer's block.
  *
  * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @retval The block, where blocks in the next lap count from W25N01GV_NUM_DATA_BLOCKS
  */
-static void find_write_ptr(W25N01GV_Flash *flash) {
-	uint8_t read_buffer[2048];
+static uint16_t erase_ahead_end(W25N01GV_Flash *flash) {
+	if (flash->circular_log_enabled)
+		return flash->current_page / W25N01GV_PAGES_PER_BLOCK + W25N01GV_NUM_DATA_BLOCKS;
+	return W25N01GV_NUM_DATA_BLOCKS;
+}
 
-	// First check page 0 for if flash has already been erased.
-	// Checking this case first because it's probably pretty common.
-	read_bytes_from_page(flash, read_buffer, 2048, 0, 0);
-	uint8_t first_page_empty = 1;
-	for (uint16_t b = 0; b < 2048; b++) {
-		if (read_buffer[b] != 0xFF) {
-			first_page_empty = 0;
-		}
+/**
+ * Erase-ahead mode: finds the first good block at or after the given one,
+ * counting into the next lap of a circular log like erase_ahead_end().
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param block      <uint16_t>           Block to start at
+ * @retval The block, or erase_ahead_end() if there are only bad blocks left
+ */
+static uint16_t next_good_block_ahead(W25N01GV_Flash *flash, uint16_t block) {
+	uint16_t end = erase_ahead_end(flash);
+	while (block < end && block_is_bad(flash, block % W25N01GV_NUM_DATA_BLOCKS))
+		block++;
+	return (block < end) ? block : end;
+}
+
+/**
+ * Counts the bad blocks in the data area after the write pointer's block,
+ * which get_bytes_remaining() can't write to. Only needs to be redone when
+ * the write pointer skips over a bad block or a block is marked bad.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void count_bad_blocks_ahead(W25N01GV_Flash *flash) {
+	flash->bad_blocks_ahead = 0;
+	for (uint16_t block = flash->current_page / W25N01GV_PAGES_PER_BLOCK + 1; block < W25N01GV_NUM_DATA_BLOCKS; block++) {
+		if (block_is_bad(flash, block))
+			flash->bad_blocks_ahead++;
 	}
-	if (first_page_empty) {
-		flash->current_page = 0;
+}
+
+/**
+ * Circular log: moves the write pointer from the end of the data area back
+ * to the first good block. The erase-ahead block moves back a lap with it.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void wrap_write_ptr(W25N01GV_Flash *flash) {
+	uint32_t page_adr = next_good_page(flash, 0);
+	if (page_adr >= W25N01GV_NUM_PAGES) {  // Only bad blocks, same as a full chip
+		flash->current_page = W25N01GV_NUM_PAGES-1;
+		flash->next_free_column = W25N01GV_BYTES_PER_PAGE;
+	}
+	else {
+		flash->current_page = page_adr;
 		flash->next_free_column = 0;
-		return;
 	}
 
-	// Binary search on all of flash to find the last page written to.
-
-	// min and max declared as 32bit because W25N01GV_NUM_PAGES > largest uint16_t
-	uint32_t min = 0;  // inclusive
-	uint32_t max = W25N01GV_NUM_PAGES;  // exclusive
-	uint16_t cur_search_page;
+	if (flash->erase_ahead_block >= W25N01GV_NUM_DATA_BLOCKS)
+		flash->erase_ahead_block -= W25N01GV_NUM_DATA_BLOCKS;
+	else
+		flash->erase_ahead_block = 0;
 
-	while (max - min > 1) {  // Keep looping until you narrow range down a single page
-		cur_search_page = min + (max-min) / 2;
+	count_bad_blocks_ahead(flash);
+}
 
-		// Read cur_search_page and check if it's empty
-		read_bytes_from_page(flash, read_buffer, 2048, cur_search_page, 0);
-		uint8_t cur_page_empty = 1;
-		for (uint16_t b = 0; b < 2048; b++) {
-			if (read_buffer[b] != 0xFF) {
-				cur_page_empty = 0;
-				break;
-			}
-		}
+/**
+ * If the write pointer is in a bad block, moves it to the start of the next
+ * good block. If there isn't one, flash is full, or a circular log wraps around.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void skip_bad_blocks(W25N01GV_Flash *flash) {
+	if (!block_is_bad(flash, flash->current_page / W25N01GV_PAGES_PER_BLOCK))
+		return;
 
-		if (cur_page_empty)  // Found an empty page - move to the left sector
-			max = cur_search_page;
-		else  // Found a non-empty page - move to the right sector
-			min = cur_search_page;  // Don't completely exclude it from range
+	uint32_t page_adr = next_good_page(flash, flash->current_page);
+	if (page_adr >= W25N01GV_NUM_PAGES && flash->circular_log_enabled) {
+		wrap_write_ptr(flash);
+		return;
+	}
+	if (page_adr >= W25N01GV_NUM_PAGES) {  // Same as a full chip, makes get_bytes_remaining() return 0
+		flash->current_page = W25N01GV_NUM_PAGES-1;
+		flash->next_free_column = W25N01GV_BYTES_PER_PAGE;
+	}
+	else {
+		flash->current_page = page_adr;
+		flash->next_free_column = 0;
 	}
-	// Breaks out of the loop when range is narrowed down to [min, min+1),
-	flash->current_page = min;
 
-	// After finding flash->current_page, do a linear search on that page
-	// to find flash->next_free_address
-	read_bytes_from_page(flash, read_buffer, 2048, flash->current_page, 0);
+	count_bad_blocks_ahead(flash);
+}
 
-	// Edge case: if the page found by the binary search is completely full
-	// (last byte is non-0xFF) then the write pointer should actually be the
-	// first byte of the next page (breaking out of the while loop guaranteed
-	// that page min+1 is empty).	If that is the last page in flash, handle
-	// accordingly to make get_bytes_remaining() return 0.
+/**
+ * Saves a retired block to the next free retired block slot of the checkpoint
+ * block. If they're all used, the block's own bad block marker is the only record.
+ *
+ * ASSUMPTIONS:
+ * Flash is unlocked.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param block      <uint16_t>           Block that was retired
+ */
+static void record_retired_block(W25N01GV_Flash *flash, uint16_t block) {
+	if (flash->num_retired_block_records >= W25N01GV_RETIRED_BLOCK_SLOTS)
+		return;
 
-	if (read_buffer[2047] != 0xFF) {  // aforementioned edge case
-		if (flash->current_page == W25N01GV_NUM_PAGES-1) {  // no room left in flash
-			flash->next_free_column = 2048;
-		}
-		else {  // go to start of next page
-			flash->current_page++;
-			flash->next_free_column = 0;
-		}
+	write_slot_record(flash, W25N01GV_RETIRED_BLOCK_FIRST_SLOT + flash->num_retired_block_records,
+			W25N01GV_RETIRED_BLOCK_MARKER_0, W25N01GV_RETIRED_BLOCK_MARKER_1, block);
+	flash->num_retired_block_records++;  // The slot is used even if the write failed
+}
 
-		return;
-	}
-	else {  // normal linear search
-		// Start at the end and search backwards for the first non-empty byte
-		uint8_t page_empty = 1;
-		for (int16_t b = 2047; b >= 0; b--) {
-			if (read_buffer[b] != 0xFF) {
-				flash->next_free_column = b+1;
-				page_empty = 0;
-				break;
-			}
-		}
+/**
+ * Retires a block: marks it in the RAM table, writes the bad block marker and
+ * records it in the checkpoint block so it's still known to be bad after a
+ * reset. The record covers blocks too worn out to take the marker.
+ *
+ * ASSUMPTIONS:
+ * Flash is unlocked.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param block      <uint16_t>           Block to retire
+ */
+static void mark_bad_block(W25N01GV_Flash *flash, uint16_t block) {
+	uint8_t marker[1] = { W25N01GV_BAD_BLOCK_MARKER };
+	uint8_t write_failure_status = flash->last_write_failure_status;
 
-		// Debug code
-		// TODO: delete in final release
-		/*
-		if (page_empty) {
-			asm("nop");  // if you get here, I fucked up
-		}
-		*/
-	}
+	if (block_is_bad(flash, block))
+		return;
 
-	// flash->next_free_column should only ever be at the beginning of one of the sectors on a page.
-	// If the user's last byte(s) written are 0xFF, then the previous loop will treat it as empty memory.
-	// This if block maintains the 512 byte framing.
-	// At this point in the code, flash->current_page is not empty and flash is not completely full.
-	if (flash->next_free_column <= 512)
-		flash->next_free_column = 512;
-	else if (flash->next_free_column <= 1024)
-		flash->next_free_column = 1024;
-	else if (flash->next_free_column <= 1536)
-		flash->next_free_column = 1536;
-	else if (flash->next_free_column < 2048) {  // Increment to next page
-		flash->next_free_column = 0;
-		flash->current_page++;
-	}
-}
+	flash->bad_blocks[block / 8] |= 1 << (block % 8);
+	if (block < W25N01GV_NUM_DATA_BLOCKS)
+		flash->num_bad_blocks++;
+	flash->retired_blocks++;
 
+	write_bytes_to_page(flash, marker, 1, block * W25N01GV_PAGES_PER_BLOCK, W25N01GV_SPARE_AREA_COLUMN, NULL);
+	record_retired_block(flash, block);
+	flash->last_write_failure_status = write_failure_status;  // Keep the status of the write that failed
 
-/* Public function definitions */
+	count_bad_blocks_ahead(flash);
+}
 
-void init_flash(W25N01GV_Flash *flash, SPI_HandleTypeDef *SPI_bus_in,
-		GPIO_TypeDef *cs_base_in,	uint16_t cs_pin_in) {
-	flash->SPI_bus = SPI_bus_in;
-	flash->cs_base = cs_base_in;
-	flash->cs_pin = cs_pin_in;
-	flash->next_page_to_read = 0;
+/**
+ * Reads the table of blocks with a bad block marker from the checkpoint block.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param bad_blocks <uint8_t*>           Set to the table, 1 bit per block, if it's valid
+ * @retval 1 if the table was read, 0 if it's erased or corrupted
+ */
+static uint8_t read_bad_block_table_record(W25N01GV_Flash *flash, uint8_t *bad_blocks) {
+	uint8_t record[W25N01GV_BAD_BLOCK_TABLE_SIZE];
 
-	flash->last_HAL_status = HAL_OK;
-	flash->last_read_ECC_status = SUCCESS_NO_CORRECTIONS;
-	flash->last_write_failure_status = 0;
-	flash->last_erase_failure_status = 0;
+	read_bytes_from_page(flash, record, W25N01GV_BAD_BLOCK_TABLE_SIZE,
+			W25N01GV_CHECKPOINT_BLOCK * W25N01GV_PAGES_PER_BLOCK + W25N01GV_BAD_BLOCK_TABLE_SLOT / W25N01GV_SECTORS_PER_PAGE,
+			(W25N01GV_BAD_BLOCK_TABLE_SLOT % W25N01GV_SECTORS_PER_PAGE) * W25N01GV_SECTOR_SIZE);
 
-	reset_flash(flash);
+	uint16_t crc = W25N01GV_PACK_2_BYTES_TO_UINT16(record + W25N01GV_BAD_BLOCK_TABLE_SIZE - 2);
+	if (record[0] != W25N01GV_BAD_BLOCK_TABLE_MARKER_0 || record[1] != W25N01GV_BAD_BLOCK_TABLE_MARKER_1
+			|| crc != update_crc16(0xFFFF, record, W25N01GV_BAD_BLOCK_TABLE_SIZE - 2))
+		return 0;
 
-	enable_ECC(flash);  // Should be enabled by default, but enable ECC just in case
-	enable_buffer_mode(flash);  // -IG models start with buffer mode by default, -IT models don't
-	// As of the time of writing this, MASA uses the -IG model.
+	for (uint16_t i = 0; i < W25N01GV_NUM_BLOCKS / 8; i++)
+		bad_blocks[i] = record[2 + i];
+	return 1;
+}
 
-	find_write_ptr(flash);
+/**
+ * Writes the table of blocks with a bad block marker to its erased slot of
+ * the checkpoint block.
+ *
+ * ASSUMPTIONS:
+ * Flash is unlocked.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param bad_blocks <uint8_t*>           Blocks with a marker, 1 bit per block
+ */
+static void write_bad_block_table_record(W25N01GV_Flash *flash, uint8_t *bad_blocks) {
+	uint8_t record[W25N01GV_BAD_BLOCK_TABLE_SIZE];
+
+	record[0] = W25N01GV_BAD_BLOCK_TABLE_MARKER_0;
+	record[1] = W25N01GV_BAD_BLOCK_TABLE_MARKER_1;
+	for (uint16_t i = 0; i < W25N01GV_NUM_BLOCKS / 8; i++)
+		record[2 + i] = bad_blocks[i];
+
+	uint16_t crc = update_crc16(0xFFFF, record, W25N01GV_BAD_BLOCK_TABLE_SIZE - 2);
+	uint8_t crc_8bit_array[2] = W25N01GV_UNPACK_UINT16_TO_2_BYTES(crc);
+	record[W25N01GV_BAD_BLOCK_TABLE_SIZE - 2] = crc_8bit_array[0];
+	record[W25N01GV_BAD_BLOCK_TABLE_SIZE - 1] = crc_8bit_array[1];
+
+	write_bytes_to_page(flash, record, W25N01GV_BAD_BLOCK_TABLE_SIZE,
+			W25N01GV_CHECKPOINT_BLOCK * W25N01GV_PAGES_PER_BLOCK + W25N01GV_BAD_BLOCK_TABLE_SLOT / W25N01GV_SECTORS_PER_PAGE,
+			(W25N01GV_BAD_BLOCK_TABLE_SLOT % W25N01GV_SECTORS_PER_PAGE) * W25N01GV_SECTOR_SIZE, NULL);
 }
 
-uint8_t ping_flash(W25N01GV_Flash *flash) {
+/**
+ * Builds the RAM bad block table. The blocks with a bad block marker come
+ * from the table saved in the checkpoint block, which is 1 page read. Only
+ * if it isn't there is the marker of every block read, which only transfers
+ * 1 byte per block but takes ~70 ms in total because each block needs a page
+ * data read, and the table is saved for the next time. Blocks in the retired
+ * block records are added, and so are blocks used as replacements in the BBM
+ * look up table, because using them directly would overwrite the data of the
+ * block they replace.
+ *
+ * Every block retired at runtime is in the retired block records until they
+ * run out. After that, a new marker might not be in the saved table, so the
+ * markers are read every time until the checkpoint block is erased.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void build_bad_block_table(W25N01GV_Flash *flash) {
+	uint8_t marker[1];
+	uint16_t retired_block;
+	uint16_t logical_block_addresses[W25N01GV_BBM_LUT_ENTRIES];
+	uint16_t physical_block_addresses[W25N01GV_BBM_LUT_ENTRIES];
+
+	for (uint16_t i = 0; i < sizeof(flash->bad_blocks); i++)
+		flash->bad_blocks[i] = 0;
+	flash->num_bad_blocks = 0;
+	flash->retired_blocks = 0;
+
+	flash->num_retired_block_records = count_written_slots(flash, W25N01GV_RETIRED_BLOCK_FIRST_SLOT,
+			W25N01GV_RETIRED_BLOCK_SLOTS);
+
+	if (flash->num_retired_block_records >= W25N01GV_RETIRED_BLOCK_SLOTS
+			|| !read_bad_block_table_record(flash, flash->bad_blocks)) {
+		for (uint16_t block = 0; block < W25N01GV_NUM_BLOCKS; block++) {
+			read_bytes_from_page(flash, marker, 1, block * W25N01GV_PAGES_PER_BLOCK, W25N01GV_SPARE_AREA_COLUMN);
+			if (marker[0] != W25N01GV_ERASED_BYTE)
+				flash->bad_blocks[block / 8] |= 1 << (block % 8);
+		}
 
-	uint8_t tx[2] = {W25N01GV_READ_JEDEC_ID, 0};	// Second byte is unused
-	uint8_t rx[3];
+		// A slot can only be programmed once, so a table that didn't pass its CRC stays
+		if (count_written_slots(flash, W25N01GV_BAD_BLOCK_TABLE_SLOT, 1) == 0) {
+			unlock_flash(flash);
+			write_bad_block_table_record(flash, flash->bad_blocks);
+			lock_flash(flash);
+		}
+	}
 
-	spi_transmit_receive(flash, tx, 2, rx, 3);
-	uint8_t manufacturer_ID = rx[0];
-	uint16_t device_ID = W25N01GV_PACK_2_BYTES_TO_UINT16(rx+1);
+	for (uint16_t i = 0; i < flash->num_retired_block_records; i++) {
+		if (read_slot_record(flash, W25N01GV_RETIRED_BLOCK_FIRST_SLOT + i, W25N01GV_RETIRED_BLOCK_MARKER_0,
+				W25N01GV_RETIRED_BLOCK_MARKER_1, &retired_block) && retired_block < W25N01GV_NUM_DATA_BLOCKS)
+			flash->bad_blocks[retired_block / 8] |= 1 << (retired_block % 8);
+	}
 
-	if (manufacturer_ID == W25N01GV_MANUFACTURER_ID && device_ID == W25N01GV_DEVICE_ID)
-		return 1;
-	else
-		return 0;
+	read_BBM_look_up_table(flash, logical_block_addresses, physical_block_addresses);
+	for (uint8_t i = 0; i < W25N01GV_BBM_LUT_ENTRIES; i++) {
+		if (logical_block_addresses[i] & W25N01GV_BBM_LUT_ENABLE) {
+			uint16_t block = physical_block_addresses[i] & W25N01GV_BBM_LUT_BLOCK_MASK;
+			flash->bad_blocks[block / 8] |= 1 << (block % 8);
+		}
+	}
+
+	for (uint16_t block = 0; block < W25N01GV_NUM_DATA_BLOCKS; block++) {
+		if (block_is_bad(flash, block))
+			flash->num_bad_blocks++;
+	}
 }
 
-uint8_t reset_flash(W25N01GV_Flash *flash) {
-	// The reset command will corrupt data if given while another
-	// operation is taking place, so just return in that case
-	if (flash_is_busy(flash))  // TODO: replace with wait_for_operation? idk honestly
-		return 0;
+/**
+ * Erase-ahead mode: erases every block that isn't erased yet, up to and
+ * including last_block, waiting for each one. A block that fails to erase
+ * is retired. Does nothing when erase-ahead mode is off, because then all
+ * of the blocks after the write pointer were erased by erase_flash().
+ *
+ * ASSUMPTIONS:
+ * Flash is unlocked and not busy.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param last_block <uint16_t>           Last block that has to be erased, counting into the next lap like erase_ahead_end()
+ */
+static void erase_ahead_through(W25N01GV_Flash *flash, uint16_t last_block) {
+	if (!flash->erase_ahead_enabled)
+		return;
 
-	// Otherwise send the reset command
-	uint8_t tx[1] = { W25N01GV_DEVICE_RESET };
-	spi_transmit(flash, tx, 1);
+	uint16_t end = erase_ahead_end(flash);
+	while (flash->erase_ahead_block <= last_block && flash->erase_ahead_block < end) {
+		uint16_t block = flash->erase_ahead_block % W25N01GV_NUM_DATA_BLOCKS;
+		if (!block_is_bad(flash, block)) {
+			erase_block(flash, block * W25N01GV_PAGES_PER_BLOCK);
+			if (flash->last_erase_failure_status)
+				mark_bad_block(flash, block);
+		}
+		flash->erase_ahead_block++;
+	}
+}
 
-	// Wait for it to reset
-	wait_for_operation(flash, W25N01GV_RESET_MAX_TIME_US * 1000);
+/**
+ * Erase-ahead mode: makes sure the write pointer's block and the good block
+ * after it are erased before anything is written, erasing them now if idle
+ * time didn't. Keeping the next block erased too means the page after the
+ * last one written is always erased, which find_write_ptr() relies on.
+ *
+ * ASSUMPTIONS:
+ * Flash is unlocked and not busy.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void erase_ahead_of_write_ptr(W25N01GV_Flash *flash) {
+	uint16_t block, next_block;
 
-	return 1;
+	if (!flash->erase_ahead_enabled)
+		return;
+
+	// A block that fails to erase is retired, which can move the write pointer
+	do {
+		skip_bad_blocks(flash);
+		block = flash->current_page / W25N01GV_PAGES_PER_BLOCK;
+		next_block = next_good_block_ahead(flash, block+1);
+		erase_ahead_through(flash, (next_block < erase_ahead_end(flash)) ? next_block : block);
+	} while (block_is_bad(flash, block) || (next_block < erase_ahead_end(flash)
+			&& block_is_bad(flash, next_block % W25N01GV_NUM_DATA_BLOCKS)));
 }
 
 /**
- * Old write function that writes everything immediately.
- * The reason why this is separate from write_flash() is because I wrote
- * this function before I learned about the 512-byte framing requirement,
- * so write_to_flash() handles the framing and uses this function to do
- * the actual writing.
+ * Counts the good blocks after the write pointer's block that are already
+ * erased in erase-ahead mode.
  *
- * Read the application note linked in the README to read about the
- * 512-byte framing requirement and why violating it will corrupt data.
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @retval Number of erased blocks ahead of the write pointer's block
+ */
+static uint16_t count_erased_blocks_ahead(W25N01GV_Flash *flash) {
+	uint16_t num_blocks = 0;
+	for (uint16_t block = flash->current_page / W25N01GV_PAGES_PER_BLOCK + 1; block < flash->erase_ahead_block; block++) {
+		if (!block_is_bad(flash, block % W25N01GV_NUM_DATA_BLOCKS))
+			num_blocks++;
+	}
+	return num_blocks;
+}
+
+/**
+ * After the checkpoint block was erased, records again any bad block that
+ * doesn't have a bad block marker, since the retired block records were erased
+ * with it, and saves the table of the ones that do.
  *
  * ASSUMPTIONS:
- * flash->next_free_column is a multiple of W25N01GV_SECTOR_SIZE between [0, 2047].
- * data can fit in flash's remaining space.
- * flash->write_buffer is not full == flash->write_buffer_size < W25N01GV_SECTOR_SIZE.
- * Flash is unlocked.
+ * Flash is unlocked and not busy.
  *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
  */
-static uint16_t write_to_flash_contiguous(W25N01GV_Flash *flash, uint8_t *data, uint32_t num_bytes) {
+static void rerecord_retired_blocks(W25N01GV_Flash *flash) {
+	uint8_t marker[1];
+	uint8_t marked_blocks[W25N01GV_NUM_BLOCKS / 8] = {0};
+
+	flash->num_retired_block_records = 0;
+	for (uint16_t block = 0; block < W25N01GV_NUM_BLOCKS; block++) {
+		if (!block_is_bad(flash, block))
+			continue;
+
+		read_bytes_from_page(flash, marker, 1, block * W25N01GV_PAGES_PER_BLOCK, W25N01GV_SPARE_AREA_COLUMN);
+		if (marker[0] != W25N01GV_ERASED_BYTE)
+			marked_blocks[block / 8] |= 1 << (block % 8);
+		else if (block < W25N01GV_NUM_DATA_BLOCKS)
+			record_retired_block(flash, block);
+	}
+
+	write_bad_block_table_record(flash, marked_blocks);
+}
+
+/**
+ * Erases the checkpoint block, then records the retired blocks again.
+ *
+ * ASSUMPTIONS:
+ * Flash is unlocked and not busy.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @retval 0 if the erase succeeded, 1 if it failed
+ */
+static uint8_t erase_checkpoint_block(W25N01GV_Flash *flash) {
+	erase_block(flash, W25N01GV_CHECKPOINT_BLOCK * W25N01GV_PAGES_PER_BLOCK);
+	uint8_t erase_failure_status = flash->last_erase_failure_status;
+
+	rerecord_retired_blocks(flash);
+
+	return erase_failure_status;
+}
+
+/**
+ * Copies a page to another page inside the chip: the source page is loaded
+ * into the device's buffer and programmed straight to the destination, so
+ * none of the data goes over SPI. The spare area (and the sector metadata)
+ * is copied with it. Sectors from num_bytes on are erased in the buffer
+ * first, for when the rest of the source page can't be trusted.
+ *
+ * ASSUMPTIONS:
+ * Flash is unlocked.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param src_page   <uint16_t>           Page to copy
+ * @param dst_page   <uint16_t>           Empty page to copy it to
+ * @param num_bytes  <uint16_t>           Bytes at the start of the page to keep, a multiple of W25N01GV_SECTOR_SIZE
+ * @retval 0 if the copy was programmed successfully, nonzero if it failed
+ */
+static uint8_t copy_page(W25N01GV_Flash *flash, uint16_t src_page, uint16_t dst_page, uint16_t num_bytes) {
+	uint8_t erased[W25N01GV_SECTOR_SIZE];
+	for (uint16_t i = 0; i < W25N01GV_SECTOR_SIZE; i++)
+		erased[i] = W25N01GV_ERASED_BYTE;
+
+	load_page(flash, src_page);
+	enable_write(flash);
+
+	// Overwrite the sectors that aren't kept, and their spare bytes, with 0xFF
+	if (num_bytes < W25N01GV_BYTES_PER_PAGE) {
+		for (uint16_t column = num_bytes; column < W25N01GV_BYTES_PER_PAGE; column += W25N01GV_SECTOR_SIZE)
+			random_load_page_buffer(flash, erased, W25N01GV_SECTOR_SIZE, column);
+
+		uint16_t spare_column = W25N01GV_SPARE_AREA_COLUMN
+				+ (num_bytes / W25N01GV_SECTOR_SIZE) * W25N01GV_SPARE_BYTES_PER_SECTOR;
+		random_load_page_buffer(flash, erased, W25N01GV_BYTES_PER_PAGE + W25N01GV_SPARE_AREA_SIZE - spare_column,
+				spare_column);
+	}
+
+	program_buffer_to_memory(flash, dst_page);
+	disable_write(flash);
+
+	return get_write_failure_status(flash);
+}
+
+/**
+ * Called after programming at the write pointer fails. Retires the write
+ * pointer's block, copies everything written to it so far to the next good
+ * block, and moves the write pointer to the same place in that block, so the
+ * failed data can be written again. Repeats if a copy fails too.
+ *
+ * ASSUMPTIONS:
+ * The write pointer is where the failed data was supposed to go.
+ * Flash is unlocked.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @retval 1 if the write pointer was moved, 0 if flash ran out of good blocks
+ */
+static uint8_t relocate_write_block(W25N01GV_Flash *flash) {
+	uint16_t src_block_page = flash->current_page - flash->current_page % W25N01GV_PAGES_PER_BLOCK;
+	uint16_t pages_to_copy = flash->current_page % W25N01GV_PAGES_PER_BLOCK;
+	uint16_t column = flash->next_free_column;
+
+	uint16_t failed_block = flash->current_page / W25N01GV_PAGES_PER_BLOCK;
+	uint16_t lap_offset = 0;  // W25N01GV_NUM_DATA_BLOCKS once a circular log wraps around
+	mark_bad_block(flash, failed_block);
+
+	while (1) {
+		uint32_t dst_block_page = next_good_page(flash, (failed_block+1) * W25N01GV_PAGES_PER_BLOCK);
+
+		// A circular log continues in the first good block, but only goes around once
+		if (dst_block_page >= W25N01GV_NUM_PAGES && flash->circular_log_enabled && lap_offset == 0) {
+			lap_offset = W25N01GV_NUM_DATA_BLOCKS;
+			dst_block_page = next_good_page(flash, 0);
+		}
+		if (dst_block_page >= W25N01GV_NUM_PAGES) {
+			flash->current_page = W25N01GV_NUM_PAGES-1;
+			flash->next_free_column = W25N01GV_BYTES_PER_PAGE;
+			count_bad_blocks_ahead(flash);
+			return 0;
+		}
+
+		// In erase-ahead mode the block may not be erased yet
+		erase_ahead_through(flash, dst_block_page / W25N01GV_PAGES_PER_BLOCK + lap_offset);
+		if (block_is_bad(flash, dst_block_page / W25N01GV_PAGES_PER_BLOCK))
+			continue;
+
+		uint8_t copy_failed = 0;
+		for (uint16_t page = 0; page < pages_to_copy && !copy_failed; page++)
+			copy_failed = copy_page(flash, src_block_page + page, dst_block_page + page, W25N01GV_BYTES_PER_PAGE);
+		if (column > 0 && !copy_failed)
+			copy_failed = copy_page(flash, src_block_page + pages_to_copy, dst_block_page + pages_to_copy, column);
+
+		failed_block = dst_block_page / W25N01GV_PAGES_PER_BLOCK;
+		if (copy_failed) {
+			mark_bad_block(flash, failed_block);
+			continue;
+		}
+
+		flash->current_page = dst_block_page + pages_to_copy;
+		flash->next_free_column = column;
+		if (lap_offset > 0)
+			flash->erase_ahead_block = (flash->erase_ahead_block >= lap_offset) ? flash->erase_ahead_block - lap_offset : 0;
+		count_bad_blocks_ahead(flash);
+		return 1;
+	}
+}
+
+/**
+ * Moves the write pointer forward after num_bytes have been written at
+ * flash->current_page and flash->next_free_column. num_bytes can't go past
+ * the end of the current page. Bad blocks are skipped.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param num_bytes  <uint16_t>           Number of bytes written on the current page
+ */
+static void advance_write_ptr(W25N01GV_Flash *flash, uint16_t num_bytes) {
+	// If there's room left over at the end of the page,
+	// increment the column counter and leave the page counter the same
+	if (flash->next_free_column + num_bytes < W25N01GV_BYTES_PER_PAGE)
+		flash->next_free_column += num_bytes;
+
+	// A circular log goes back to the start of flash
+	else if (flash->current_page == W25N01GV_NUM_PAGES-1 && flash->circular_log_enabled)
+		wrap_write_ptr(flash);
+
+	// If it fills the current page and runs out of pages, set the column counter over
+	// the limit so it can't write again (will make get_bytes_remaining() return 0)
+	else if (flash->current_page == W25N01GV_NUM_PAGES-1)
+		flash->next_free_column = W25N01GV_BYTES_PER_PAGE;
+
+	// Otherwise if there's more pages left, bring the address counter to the next page
+	// and reset the column counter
+	else {
+		flash->next_free_column = 0;
+		flash->current_page++;
+
+		if (flash->current_page % W25N01GV_PAGES_PER_BLOCK == 0)
+			skip_bad_blocks(flash);
+	}
+}
+
+/**
+ * Reads the checkpoint in the given slot of the checkpoint block.
+ *
+ * @param flash           <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param slot            <uint16_t>           Slot to read, 0 to W25N01GV_CHECKPOINT_SLOTS-1
+ * @param checkpoint_page <uint16_t*>          Set to the saved write pointer page if the record is valid
+ * @retval 1 if the slot holds a valid record, 0 if it's erased or corrupted
+ */
+static uint8_t read_checkpoint(W25N01GV_Flash *flash, uint16_t slot, uint16_t *checkpoint_page) {
+	uint16_t page;
+
+	if (!read_slot_record(flash, slot, W25N01GV_CHECKPOINT_MARKER_0, W25N01GV_CHECKPOINT_MARKER_1, &page)
+			|| page >= W25N01GV_NUM_PAGES)
+		return 0;
+
+	*checkpoint_page = page;
+	return 1;
+}
+
+/**
+ * Saves the write pointer to the checkpoint block once it has moved past
+ * the next multiple of W25N01GV_CHECKPOINT_INTERVAL pages. Checkpoint N is
+ * always stored in slot N-1, and any that were skipped are filled in, so the
+ * written slots are contiguous and can be binary searched at boot.
+ *
+ * Must be called before anything is written at the write pointer, so a
+ * checkpoint never points past data that's already on flash.
+ *
+ * ASSUMPTIONS:
+ * Flash is unlocked and not busy.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void update_checkpoint(W25N01GV_Flash *flash) {
+	// A circular log's write pointer is found without checkpoints
+	if (flash->circular_log_enabled)
+		return;
+
+	while ((uint32_t) flash->last_checkpoint_page + W25N01GV_CHECKPOINT_INTERVAL <= flash->current_page) {
+		uint16_t checkpoint_page = flash->last_checkpoint_page + W25N01GV_CHECKPOINT_INTERVAL;
+		uint16_t slot = checkpoint_page / W25N01GV_CHECKPOINT_INTERVAL - 1;
+
+		write_slot_record(flash, slot, W25N01GV_CHECKPOINT_MARKER_0, W25N01GV_CHECKPOINT_MARKER_1, checkpoint_page);
+
+		// If the write failed, boot falls back to an earlier checkpoint and a longer search
+		flash->last_checkpoint_page = checkpoint_page;
+	}
+}
+
+/**
+ * Second stage of an asynchronous write: releases chip select after the DMA
+ * transfer, loads the sector metadata and issues program execute, without
+ * waiting for it to finish.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void finish_async_load(W25N01GV_Flash *flash) {
+	// Change state first so the interrupt and the main loop can't both get here
+	flash->async_state = ASYNC_WRITE_PROGRAMMING;
+
+	if (flash->transport == NULL)
+		HAL_GPIO_WritePin(flash->cs_base, flash->cs_pin, W25N01GV_CS_INACTIVE);
+
+	load_page_metadata(flash, flash->async_metadata, flash->async_num_bytes, flash->async_column);
+
+	uint8_t page_adr_8bit_array[2] = W25N01GV_UNPACK_UINT16_TO_2_BYTES(flash->async_page);
+	uint8_t tx[4] = {W25N01GV_PROGRAM_EXECUTE, 0, page_adr_8bit_array[0], page_adr_8bit_array[1]};  // 2nd byte unused
+	start_op_timer(flash, W25N01GV_OP_PROGRAM, flash->async_page);
+	spi_transmit(flash, tx, 4);
+}
+
+/**
+ * Starts an asynchronous write of one sector buffer at the write pointer.
+ * Sends the Load Program Data header, then hands the data to the SPI DMA
+ * and returns with chip select still active. The write pointer is advanced
+ * right away so get_bytes_remaining() stays correct. With a transport, the
+ * data is loaded with a blocking transfer and program execute is issued too.
+ *
+ * ASSUMPTIONS:
+ * The pipeline is idle (async_state == ASYNC_WRITE_IDLE).
+ * flash->next_free_column is a multiple of W25N01GV_SECTOR_SIZE and data fits on the page.
+ * Flash is unlocked.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param data            <uint8_t*>           Sector buffer, must stay untouched until the write finishes
+ * @param num_bytes       <uint16_t>           Number of bytes to write, up to W25N01GV_SECTOR_SIZE
+ * @param num_valid_bytes <uint16_t>           Number of bytes in data that aren't padding
+ */
+static void start_async_write(W25N01GV_Flash *flash, uint8_t *data, uint16_t num_bytes,
+		uint16_t num_valid_bytes) {
+	erase_ahead_of_write_ptr(flash);
+	update_checkpoint(flash);
+
+	// Calculated here so the interrupt only has to send it
+	make_page_metadata(flash, data, num_bytes, num_valid_bytes, flash->async_metadata);
+
+	flash->async_data = data;
+	flash->async_num_bytes = num_bytes;
+	flash->async_page = flash->current_page;
+	flash->async_column = flash->next_free_column;
+	advance_write_ptr(flash, num_bytes);
+
+	enable_write(flash);
+
+	// A transport has no DMA hook, so the load blocks, but programming still
+	// overlaps with filling the next sector
+	if (flash->transport != NULL) {
+		write_page_to_buffer(flash, data, num_bytes, flash->async_column);
+		flash->async_state = ASYNC_WRITE_LOADING;
+		finish_async_load(flash);
+		return;
+	}
+
+	uint8_t column_adr_8bit_array[2] = W25N01GV_UNPACK_UINT16_TO_2_BYTES(flash->async_column);
+	uint8_t tx[3] = {W25N01GV_LOAD_PROGRAM_DATA, column_adr_8bit_array[0], column_adr_8bit_array[1]};
+
+	// Interrupts are only disabled for the header. The DMA transfer needs them.
+	__disable_irq();
+	HAL_GPIO_WritePin(flash->cs_base, flash->cs_pin, W25N01GV_CS_ACTIVE);
+	flash->last_HAL_status = HAL_SPI_Transmit(flash->SPI_bus, tx, 3, W25N01GV_SPI_TIMEOUT);
+	__enable_irq();
+
+	flash->async_state = ASYNC_WRITE_LOADING;
+	flash->last_HAL_status = HAL_SPI_Transmit_DMA(flash->SPI_bus, data, num_bytes);
+
+	// Fall back to a blocking transfer if the DMA couldn't start.
+	// The next poll will see the bus is ready and move on.
+	if (flash->last_HAL_status != HAL_OK)
+		flash->last_HAL_status = HAL_SPI_Transmit(flash->SPI_bus, data, num_bytes, W25N01GV_SPI_TIMEOUT);
+}
+
+/**
+ * Last stage of an asynchronous write, once the chip is no longer busy:
+ * records the write failure status and calls the completion callback.
+ * A failed write is moved to the next good block like in write_to_flash().
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void finish_async_program(W25N01GV_Flash *flash) {
+	// This will happen automatically if programming succeeds, but just in case it fails
+	disable_write(flash);
+
+	// If it failed, retire the block and write the data again (blocking) in the next good one
+	if (get_write_failure_status(flash)) {
+		// The data given to start_flash_page_write() may have been reused already,
+		// but it's still in the device's buffer, which a failed program doesn't change
+		uint8_t data[W25N01GV_BYTES_PER_PAGE];
+		read_flash_buffer(flash, data, flash->async_num_bytes, flash->async_column);
+
+		flash->current_page = flash->async_page;
+		flash->next_free_column = flash->async_column;
+
+		while (flash->last_write_failure_status && relocate_write_block(flash)) {
+			write_bytes_to_page(flash, data, flash->async_num_bytes,
+					flash->current_page, flash->next_free_column, flash->async_metadata);
+		}
+		advance_write_ptr(flash, flash->async_num_bytes);
+
+		if (flash->last_write_failure_status)  // Out of good blocks
+			flash->async_write_failures++;
+	}
+
+	// A page write started outside of async mode unlocked flash for itself
+	if (!flash->async_write_enabled)
+		lock_flash(flash);
+
+	flash->async_state = ASYNC_WRITE_IDLE;
+
+	if (flash->async_callback != NULL)
+		flash->async_callback(flash, flash->last_write_failure_status);
+}
+
+/**
+ * Erase-ahead mode: starts erasing the next block that isn't erased yet,
+ * without waiting. The async pipeline is used to track it, so nothing else
+ * touches the chip until finish_erase_ahead() is called.
+ *
+ * ASSUMPTIONS:
+ * The pipeline is idle (async_state == ASYNC_WRITE_IDLE).
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void start_erase_ahead(W25N01GV_Flash *flash) {
+	flash->erase_ahead_block = next_good_block_ahead(flash, flash->erase_ahead_block);
+	if (flash->erase_ahead_block >= erase_ahead_end(flash))
+		return;
+
+	// Locked again by finish_erase_ahead()
+	if (!flash->async_write_enabled)
+		unlock_flash(flash);
+
+	start_block_erase(flash, (flash->erase_ahead_block % W25N01GV_NUM_DATA_BLOCKS) * W25N01GV_PAGES_PER_BLOCK);
+	flash->async_state = ASYNC_WRITE_ERASING;
+}
+
+/**
+ * Erase-ahead mode: once the chip is no longer busy, checks the result of
+ * the erase started by start_erase_ahead(). A block that failed is retired.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void finish_erase_ahead(W25N01GV_Flash *flash) {
+	// This will happen automatically if the erase succeeds, but just in case it fails
+	disable_write(flash);
+
+	if (get_erase_failure_status(flash))
+		mark_bad_block(flash, flash->erase_ahead_block % W25N01GV_NUM_DATA_BLOCKS);
+	flash->erase_ahead_block++;
+
+	if (!flash->async_write_enabled)
+		lock_flash(flash);
+
+	flash->async_state = ASYNC_WRITE_IDLE;
+}
+
+/**
+ * Moves the async pipeline forward without starting anything new. Used by
+ * poll_async_flash_write() and wait_for_async_flash_write().
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @retval The state of the pipeline
+ */
+static W25N01GV_Async_State update_async_state(W25N01GV_Flash *flash) {
+	if (flash->async_state == ASYNC_WRITE_ERASING && !flash_is_busy(flash))
+		finish_erase_ahead(flash);
+
+	if (flash->async_state == ASYNC_WRITE_LOADING) {
+		HAL_SPI_StateTypeDef spi_state = HAL_SPI_GetState(flash->SPI_bus);
+		if (spi_state == HAL_SPI_STATE_BUSY_TX || spi_state == HAL_SPI_STATE_BUSY)
+			return ASYNC_WRITE_LOADING;
+
+		// The interrupt could have finished the load since the first check
+		__disable_irq();
+		if (flash->async_state == ASYNC_WRITE_LOADING)
+			finish_async_load(flash);
+		__enable_irq();
+	}
+
+	if (flash->async_state == ASYNC_WRITE_PROGRAMMING && !flash_is_busy(flash))
+		finish_async_program(flash);
+
+	return flash->async_state;
+}
+
+/**
+ * Set the ECC-E bit in the configuration register (SR2) to 1, enabling the
+ * onboard error correction algorithms. If ECC-E is already 1, does nothing.
+ *
+ * datasheet pg 18
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void enable_ECC(W25N01GV_Flash *flash) {
+	uint8_t config_reg_read = read_status_register(flash, W25N01GV_SR2_CONFIG_REG_ADR);
+	uint8_t ECC_enabled_register = config_reg_read | W25N01GV_SR2_ECC_ENABLE;	 // OR: turn bit on
+
+	if (ECC_enabled_register != config_reg_read)
+		write_status_register(flash, W25N01GV_SR2_CONFIG_REG_ADR, ECC_enabled_register);
+}
+
+/**
+ * Set the ECC-E bit in the configuration register (SR2) to 0, disabling the
+ * onboard error correction algorithms. If ECC-E is already 0, does nothing.
+ * Don't actually use this, but I included it because why not.
+ *
+ * datasheet pg 18
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void disable_ECC(W25N01GV_Flash *flash) {
+	uint8_t config_reg_read = read_status_register(flash, W25N01GV_SR2_CONFIG_REG_ADR);
+	uint8_t ECC_disabled_register = config_reg_read & ~W25N01GV_SR2_ECC_ENABLE;	 // Remove bit
+
+	if (ECC_disabled_register != config_reg_read)
+		write_status_register(flash, W25N01GV_SR2_CONFIG_REG_ADR, ECC_disabled_register);
+}
+
+/**
+ * Sets the device to buffer read mode, which limits the user to reading
+ * up to one page at a time before loading a new page. It sets the BUF bit
+ * in the configuration register to 1 if BUF=0, and does nothing if BUF=1.
+ * This is the mode that MASA firmware will be using for TSM.
+ *
+ * datasheet pg 18
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void enable_buffer_mode(W25N01GV_Flash *flash) {
+	uint8_t config_reg_read = read_status_register(flash, W25N01GV_SR2_CONFIG_REG_ADR);
+	uint8_t buffer_enabled_register = config_reg_read | W25N01GV_SR2_BUFFER_READ_MODE;	// OR: turn bit on
+	if (buffer_enabled_register != config_reg_read)
+		write_status_register(flash, W25N01GV_SR2_CONFIG_REG_ADR, buffer_enabled_register);
+}
+
+/**
+ * Sets the device to continuous read mode, where a read keeps streaming
+ * consecutive pages until chip select goes high. It sets the BUF bit
+ * in the configuration register to 0 if BUF=1, and does nothing if BUF=0.
+ *
+ * datasheet pg 18
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void disable_buffer_mode(W25N01GV_Flash *flash) {
+	uint8_t config_reg_read = read_status_register(flash, W25N01GV_SR2_CONFIG_REG_ADR);
+	uint8_t buffer_disabled_register = config_reg_read & ~W25N01GV_SR2_BUFFER_READ_MODE;	// Remove bit
+	if (buffer_disabled_register != config_reg_read)
+		write_status_register(flash, W25N01GV_SR2_CONFIG_REG_ADR, buffer_disabled_register);
+}
+
+/**
+ * Reads the address of the last page that failed ECC during a continuous
+ * read, and stores it in flash->last_ECC_failure_page.
+ *
+ * datasheet pg 41
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void read_last_ECC_failure_page(W25N01GV_Flash *flash) {
+	uint8_t tx[2] = {W25N01GV_LAST_ECC_FAILURE_PAGE_ADDRESS, 0};  // 2nd byte is unused
+	uint8_t rx[2];
+
+	spi_transmit_receive(flash, tx, 2, rx, 2);
+	flash->last_ECC_failure_page = W25N01GV_PACK_2_BYTES_TO_UINT16(rx);
+}
+
+/**
+ * Checks if a page is completely erased (every byte is 0xFF).
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param page_adr   <uint16_t>           Page to check
+ * @param buffer     <uint8_t*>           Buffer of 2048 bytes to read the page into
+ * @retval 1 if the page is empty, 0 if it isn't
+ */
+static uint8_t page_is_empty(W25N01GV_Flash *flash, uint16_t page_adr, uint8_t *buffer) {
+	read_bytes_from_page(flash, buffer, W25N01GV_BYTES_PER_PAGE, page_adr, 0);
+	for (uint16_t b = 0; b < W25N01GV_BYTES_PER_PAGE; b++) {
+		if (buffer[b] != W25N01GV_ERASED_BYTE)
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * Checks if the first sector of a page has metadata, by reading the one spare
+ * area byte that holds its tag. Every page written by write_to_flash() starts
+ * with a sector that has metadata.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param page_adr   <uint16_t>           Page to check
+ * @retval 1 if the page has metadata, 0 if it doesn't
+ */
+static uint8_t page_has_metadata(W25N01GV_Flash *flash, uint16_t page_adr) {
+	uint8_t tag_byte[1];
+	read_bytes_from_page(flash, tag_byte, 1, page_adr, W25N01GV_SPARE_AREA_COLUMN + W25N01GV_METADATA_OFFSET + 2);
+	return (tag_byte[0] >> 4) != W25N01GV_TAG_NONE;
+}
+
+/**
+ * Checks if a page has been written to, using page_has_metadata() if flash
+ * has metadata and page_is_empty() if it doesn't.
+ *
+ * Pages in bad blocks are skipped, so they count as written if the next good
+ * page is. That keeps the written pages in front of the empty ones for
+ * search_write_ptr() even when a bad block has been left erased.
+ *
+ * @param flash        <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param page_adr     <uint16_t>           Page to check
+ * @param use_metadata <uint8_t>            1 if the data on flash has metadata
+ * @param buffer       <uint8_t*>           Buffer of 2048 bytes to read the page into
+ * @retval 1 if the page has been written to, 0 if it's empty
+ */
+static uint8_t page_is_written(W25N01GV_Flash *flash, uint16_t page_adr, uint8_t use_metadata,
+		uint8_t *buffer) {
+	uint32_t good_page_adr = next_good_page(flash, page_adr);
+	if (good_page_adr >= W25N01GV_NUM_PAGES)
+		return 0;
+	page_adr = good_page_adr;
+
+	if (use_metadata)
+		return page_has_metadata(flash, page_adr);
+	else
+		return !page_is_empty(flash, page_adr, buffer);
+}
+
+/**
+ * Performs a binary search on the pages from min to max to find the first available
+ * address to write to. Modifies flash->current_page, flash->next_free_column
+ * and flash->next_sequence.
+ *
+ * This function is critical to prevent data corruption, which occurs when this firmware
+ * tries to write over previously-written addresses.
+ *
+ * Key assumptions made by this function that are maintained by write_to_flash():
+ * All non-empty pages come before all empty pages in memory. This in turn assumes
+ * that the user is not constantly writing '0xFF', which is the empty/erased byte.
+ * If there is entire page consisting of '0xFF', and there are later pages that
+ * contain user-written data, then this function might fail.
+ * TODO: write a note in write_to_flash() not to do this
+ *
+ * Another way to think of this function is that there should always be a contiguous chunk
+ * of 0xFF bytes at the end of flash, and this function finds the first byte in that chunk.
+ *
+ * Expected results:
+ * flash->current_page will be any uint16_t,and flash->next_free_column will be
+ * 0, 512, 1024, or 1536 (except when flash->current_page == 65536, in which case
+ * flash->next_free_column can also be 2048).
+ * See various comments about flash->write_buffer for explanation.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param min        <uint32_t>           First page to search. All pages before it are written.
+ * @param max          <uint32_t>           Page after the last page to search, must be empty or W25N01GV_NUM_PAGES
+ * @param use_metadata <uint8_t>            1 to search using the sector metadata instead of reading whole pages
+ */
+static void search_write_ptr(W25N01GV_Flash *flash, uint32_t min, uint32_t max, uint8_t use_metadata) {
+	uint8_t read_buffer[2048];
+
+	flash->next_sequence = 0;
+
+	// First check the first page for if flash has already been erased.
+	// Checking this case first because it's probably pretty common.
+	if (!page_is_written(flash, min, use_metadata, read_buffer)) {
+		flash->current_page = min;
+		flash->next_free_column = 0;
+		return;
+	}
+
+	// Binary search on the range to find the last page written to.
+	// min (inclusive) and max (exclusive) are 32bit because W25N01GV_NUM_PAGES > largest uint16_t
+	uint16_t cur_search_page;
+
+	while (max - min > 1) {  // Keep looping until you narrow range down a single page
+		cur_search_page = min + (max-min) / 2;
+
+		if (!page_is_written(flash, cur_search_page, use_metadata, read_buffer))  // Found an empty page - move to the left sector
+			max = cur_search_page;
+		else  // Found a non-empty page - move to the right sector
+			min = cur_search_page;  // Don't completely exclude it from range
+	}
+	// Breaks out of the loop when range is narrowed down to [min, min+1),
+	flash->current_page = min;
+
+	// With metadata, the sectors written on the page are known exactly,
+	// even if the user's data ends in 0xFF
+	if (use_metadata) {
+		W25N01GV_Sector_Metadata metadata[W25N01GV_SECTORS_PER_PAGE];
+		uint8_t num_sectors = read_flash_page_metadata(flash, flash->current_page, metadata);
+
+		flash->next_sequence = metadata[num_sectors-1].sequence + 1;
+
+		if (num_sectors < W25N01GV_SECTORS_PER_PAGE)
+			flash->next_free_column = num_sectors * W25N01GV_SECTOR_SIZE;
+		else if (flash->current_page == W25N01GV_NUM_PAGES-1)  // no room left in flash
+			flash->next_free_column = W25N01GV_BYTES_PER_PAGE;
+		else {  // go to start of next page
+			flash->current_page++;
+			flash->next_free_column = 0;
+		}
+
+		return;
+	}
+
+	// After finding flash->current_page, do a linear search on that page
+	// to find flash->next_free_address
+	read_bytes_from_page(flash, read_buffer, 2048, flash->current_page, 0);
+
+	// Edge case: if the page found by the binary search is completely full
+	// (last byte is non-0xFF) then the write pointer should actually be the
+	// first byte of the next page (breaking out of the while loop guaranteed
+	// that page min+1 is empty).	If that is the last page in flash, handle
+	// accordingly to make get_bytes_remaining() return 0.
+
+	if (read_buffer[2047] != 0xFF) {  // aforementioned edge case
+		if (flash->current_page == W25N01GV_NUM_PAGES-1) {  // no room left in flash
+			flash->next_free_column = 2048;
+		}
+		else {  // go to start of next page
+			flash->current_page++;
+			flash->next_free_column = 0;
+		}
+
+		return;
+	}
+	else {  // normal linear search
+		// Start at the end and search backwards for the first non-empty byte
+		uint8_t page_empty = 1;
+		for (int16_t b = 2047; b >= 0; b--) {
+			if (read_buffer[b] != 0xFF) {
+				flash->next_free_column = b+1;
+				page_empty = 0;
+				break;
+			}
+		}
+
+		// Debug code
+		// TODO: delete in final release
+		/*
+		if (page_empty) {
+			asm("nop");  // if you get here, I fucked up
+		}
+		*/
+	}
+
+	// flash->next_free_column should only ever be at the beginning of one of the sectors on a page.
+	// If the user's last byte(s) written are 0xFF, then the previous loop will treat it as empty memory.
+	// This if block maintains the 512 byte framing.
+	// At this point in the code, flash->current_page is not empty and flash is not completely full.
+	if (flash->next_free_column <= 512)
+		flash->next_free_column = 512;
+	else if (flash->next_free_column <= 1024)
+		flash->next_free_column = 1024;
+	else if (flash->next_free_column <= 1536)
+		flash->next_free_column = 1536;
+	else if (flash->next_free_column < 2048) {  // Increment to next page
+		flash->next_free_column = 0;
+		flash->current_page++;
+	}
+}
+
+/**
+ * Circular log: finds the write pointer. Every block with data has metadata
+ * on its first page, and erase-ahead mode keeps the good block after the
+ * write pointer's block erased, so the write pointer's block is the only one
+ * with data that's followed by an erased one. The good blocks are checked in
+ * order until it's found, then the write pointer is binary searched in it
+ * and the sequence numbers continue from its last sector.
+ *
+ * Checks 1 byte per block, ~60 us each, so it takes up to ~70 ms.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void find_circular_write_ptr(W25N01GV_Flash *flash) {
+	uint16_t first_block = next_good_block(flash, 0);
+	flash->last_checkpoint_page = 0;
+	flash->next_sequence = 0;
+
+	if (first_block >= W25N01GV_NUM_DATA_BLOCKS) {  // Only bad blocks, same as a full chip
+		flash->current_page = W25N01GV_NUM_PAGES-1;
+		flash->next_free_column = W25N01GV_BYTES_PER_PAGE;
+		count_bad_blocks_ahead(flash);
+		return;
+	}
+
+	// The last good block comes before the first one around the ring
+	uint16_t prev_block = first_block;
+	for (uint16_t block = first_block; block < W25N01GV_NUM_DATA_BLOCKS; block = next_good_block(flash, block+1))
+		prev_block = block;
+	uint8_t prev_written = page_has_metadata(flash, prev_block * W25N01GV_PAGES_PER_BLOCK);
+
+	uint16_t block = first_block;
+	while (block < W25N01GV_NUM_DATA_BLOCKS) {
+		uint8_t written = page_has_metadata(flash, block * W25N01GV_PAGES_PER_BLOCK);
+		if (prev_written && !written)
+			break;
+		prev_written = written;
+		prev_block = block;
+		block = next_good_block(flash, block+1);
+	}
+
+	// Nothing is written yet
+	if (block >= W25N01GV_NUM_DATA_BLOCKS) {
+		flash->current_page = first_block * W25N01GV_PAGES_PER_BLOCK;
+		flash->next_free_column = 0;
+		count_bad_blocks_ahead(flash);
+		return;
+	}
+
+	search_write_ptr(flash, (uint32_t) prev_block * W25N01GV_PAGES_PER_BLOCK,
+			((uint32_t) prev_block+1) * W25N01GV_PAGES_PER_BLOCK, 1);
+
+	// A full last page of flash leaves the write pointer past the end
+	if (flash->next_free_column >= W25N01GV_BYTES_PER_PAGE)
+		wrap_write_ptr(flash);
+	else
+		skip_bad_blocks(flash);
+	count_bad_blocks_ahead(flash);
+}
+
+/**
+ * Circular log: finds the end of the blocks erased ahead of the write
+ * pointer after a reset. Erase-ahead mode keeps at most
+ * W25N01GV_ERASE_AHEAD_BLOCKS good blocks erased past the write pointer's
+ * block, so once the log has wrapped around, the oldest data is in one of the
+ * next few good blocks. If none of them has data, the log is still on its
+ * first lap and everything up to the first block of the next lap is still
+ * erased from start_circular_flash_log().
+ *
+ * Checks 1 byte per block, for up to W25N01GV_ERASE_AHEAD_BLOCKS+1 blocks.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @retval The first block that isn't erased, counting into the next lap like erase_ahead_end()
+ */
+static uint16_t find_circular_erase_ahead_block(W25N01GV_Flash *flash) {
+	uint16_t end = erase_ahead_end(flash);
+	uint16_t block = flash->current_page / W25N01GV_PAGES_PER_BLOCK;
+
+	for (uint16_t n = 0; n <= W25N01GV_ERASE_AHEAD_BLOCKS; n++) {
+		block = next_good_block_ahead(flash, block+1);
+		if (block >= end)
+			return end;
+		if (page_has_metadata(flash, (block % W25N01GV_NUM_DATA_BLOCKS) * W25N01GV_PAGES_PER_BLOCK))
+			return block;
+	}
+
+	// First lap: the gap goes on to the first good block
+	block = next_good_block(flash, 0) + W25N01GV_NUM_DATA_BLOCKS;
+	return (block < end) ? block : end;
+}
+
+/**
+ * Circular log: finds the first page of the oldest data, in the first block
+ * with data after the ones erased ahead of the write pointer.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @retval The page
+ */
+static uint32_t find_oldest_log_page(W25N01GV_Flash *flash) {
+	uint16_t write_block = flash->current_page / W25N01GV_PAGES_PER_BLOCK;
+
+	for (uint16_t block = flash->erase_ahead_block; block < write_block + W25N01GV_NUM_DATA_BLOCKS; block++) {
+		uint16_t ring_block = block % W25N01GV_NUM_DATA_BLOCKS;
+		if (!block_is_bad(flash, ring_block) && page_has_metadata(flash, ring_block * W25N01GV_PAGES_PER_BLOCK))
+			return (uint32_t) ring_block * W25N01GV_PAGES_PER_BLOCK;
+	}
+
+	// All of the data is in the write pointer's block
+	return (uint32_t) write_block * W25N01GV_PAGES_PER_BLOCK;
+}
+
+/**
+ * Finds the nth good block of the log, counting from first_block and going
+ * around the end of flash in a circular log.
+ *
+ * @param flash       <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param first_block <uint16_t>           Good block the log starts in
+ * @param n           <uint16_t>           Number of good blocks to skip
+ * @retval The block
+ */
+static uint16_t nth_good_log_block(W25N01GV_Flash *flash, uint16_t first_block, uint16_t n) {
+	uint32_t block = first_block;
+	while (block_is_bad(flash, block % W25N01GV_NUM_DATA_BLOCKS) || n-- > 0)
+		block++;
+	return block % W25N01GV_NUM_DATA_BLOCKS;
+}
+
+/**
+ * Counts the good blocks of the log from first_block through the write
+ * pointer's block.
+ *
+ * @param flash       <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param first_block <uint16_t>           Good block the log starts in
+ * @retval Number of good blocks, at least 1
+ */
+static uint16_t count_good_log_blocks(W25N01GV_Flash *flash, uint16_t first_block) {
+	uint16_t write_block = flash->current_page / W25N01GV_PAGES_PER_BLOCK;
+	uint16_t num_blocks = 0;
+
+	for (uint16_t block = first_block; block < first_block + W25N01GV_NUM_DATA_BLOCKS; block++) {
+		if (!block_is_bad(flash, block % W25N01GV_NUM_DATA_BLOCKS))
+			num_blocks++;
+		if (block % W25N01GV_NUM_DATA_BLOCKS == write_block)
+			break;
+	}
+	return num_blocks;
+}
+
+/**
+ * Finds the first page from page_adr up to end_page with a valid timestamp.
+ * Pages with fewer than 4 sectors written don't have one, e.g. the last page
+ * before finish_flash_write() or add_test_delimiter(), and the page the write
+ * pointer was in at a reset, which was stamped again when writing resumed.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param page_adr   <uint16_t>           First page to check
+ * @param end_page   <uint16_t>           Page after the last one to check
+ * @param page_time  <uint32_t*>          Set to the timestamp of the page found
+ * @retval The page, or end_page if none of them has a timestamp
+ */
+static uint16_t next_stamped_page(W25N01GV_Flash *flash, uint16_t page_adr, uint16_t end_page, uint32_t *page_time) {
+	while (page_adr < end_page && !read_flash_page_time(flash, page_adr, page_time))
+		page_adr++;
+	return page_adr;
+}
+
+/**
+ * Finds the page after the last one in a block of the log that can have
+ * data: the block's last page, or the write pointer's page in its block.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param block      <uint16_t>           Block of the log
+ * @retval The page
+ */
+static uint16_t log_block_end_page(W25N01GV_Flash *flash, uint16_t block) {
+	if (block == flash->current_page / W25N01GV_PAGES_PER_BLOCK)
+		return flash->current_page + 1;
+	return (block+1) * W25N01GV_PAGES_PER_BLOCK;
+}
+
+/**
+ * Checks that the rest of the page at the write pointer is erased, and moves
+ * the write pointer to the next page if it isn't. Power loss during a program
+ * can leave bits programmed in the data area without the metadata that marks
+ * the sector as written, so the write pointer search sees it as empty. The
+ * next write would then program over those bits and be corrupted. A program
+ * only affects one page, so the next page is always clean.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void skip_torn_page(W25N01GV_Flash *flash) {
+	uint8_t read_buffer[W25N01GV_BYTES_PER_PAGE + W25N01GV_SPARE_AREA_SIZE];
+	uint16_t column = flash->next_free_column;
+
+	flash->torn_page_skipped = 0;
+	if (column >= W25N01GV_BYTES_PER_PAGE)  // Flash is full
+		return;
+
+	read_bytes_from_page(flash, read_buffer, sizeof(read_buffer), flash->current_page, 0);
+
+	uint8_t torn = 0;
+	for (uint16_t b = column; b < W25N01GV_BYTES_PER_PAGE; b++)
+		torn |= read_buffer[b] != W25N01GV_ERASED_BYTE;
+	for (uint16_t b = W25N01GV_SPARE_AREA_COLUMN + (column / W25N01GV_SECTOR_SIZE) * W25N01GV_SPARE_BYTES_PER_SECTOR;
+			b < sizeof(read_buffer); b++)
+		torn |= read_buffer[b] != W25N01GV_ERASED_BYTE;
+
+	if (torn) {
+		advance_write_ptr(flash, W25N01GV_BYTES_PER_PAGE - column);
+		flash->torn_page_skipped = 1;
+	}
+}
+
+/**
+ * Finds the first available address to write to. Modifies flash->current_page,
+ * flash->next_free_column and flash->last_checkpoint_page.
+ *
+ * Starts from the latest checkpoint: the written checkpoint slots are found
+ * with a binary search (reading 1 byte from each slot it checks). If flash
+ * has sector metadata, the blocks after the checkpoint are checked one at a
+ * time until one with an empty last page is found, and the write pointer is
+ * binary searched in that block. Usually that's only a few blocks, since a
+ * checkpoint is written every W25N01GV_CHECKPOINT_INTERVAL pages. It doesn't
+ * depend on the rest of flash being erased, so old data past the erased
+ * blocks in erase-ahead mode is never mistaken for new data. Flash without
+ * metadata (written by older firmware) is binary searched from the checkpoint
+ * to the end. Bad blocks are skipped.
+ *
+ * ASSUMPTIONS:
+ * The bad block table has been built.
+ * The good block after the write pointer's block is erased (maintained by
+ * erase_ahead_of_write_ptr() in erase-ahead mode).
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void find_write_ptr(W25N01GV_Flash *flash) {
+	uint8_t read_buffer[2048];
+	uint16_t checkpoint_page = 0;
+
+	if (flash->circular_log_enabled) {
+		find_circular_write_ptr(flash);
+		skip_torn_page(flash);
+		count_bad_blocks_ahead(flash);
+		return;
+	}
+
+	// If power was lost while writing the latest checkpoint, use the one before it
+	for (int32_t slot = (int32_t) count_written_slots(flash, 0, W25N01GV_CHECKPOINT_SLOTS) - 1; slot >= 0; slot--) {
+		if (read_checkpoint(flash, slot, &checkpoint_page))
+			break;
+	}
+	flash->last_checkpoint_page = checkpoint_page;
+
+	// Flash written by this firmware has metadata on every page, which is much
+	// faster to check. Otherwise whole pages have to be read.
+	uint8_t use_metadata = 0;
+	if (next_good_page(flash, checkpoint_page) < W25N01GV_NUM_PAGES)
+		use_metadata = page_has_metadata(flash, next_good_page(flash, checkpoint_page));
+
+	if (!use_metadata) {
+		search_write_ptr(flash, checkpoint_page, W25N01GV_NUM_PAGES, 0);
+	}
+	else {
+		// Written blocks have their last page written, so the write pointer is in the first one that doesn't
+		uint16_t block = next_good_block(flash, checkpoint_page / W25N01GV_PAGES_PER_BLOCK);
+		while (block < W25N01GV_NUM_DATA_BLOCKS
+				&& page_is_written(flash, (block+1) * W25N01GV_PAGES_PER_BLOCK - 1, 1, read_buffer))
+			block = next_good_block(flash, block+1);
+
+		if (block >= W25N01GV_NUM_DATA_BLOCKS)  // Flash is full
+			block = W25N01GV_NUM_DATA_BLOCKS-1;
+
+		uint32_t min = (uint32_t) block * W25N01GV_PAGES_PER_BLOCK;
+		if (min < checkpoint_page)
+			min = checkpoint_page;
+		search_write_ptr(flash, min, ((uint32_t) block+1) * W25N01GV_PAGES_PER_BLOCK, 1);
+	}
+
+	// The write pointer can end up at the start of a bad block
+	skip_bad_blocks(flash);
+	skip_torn_page(flash);
+	count_bad_blocks_ahead(flash);
+}
+
+/**
+ * Loads flash->next_page_to_read and starts streaming from it in continuous
+ * read mode, leaving chip select active.
+ *
+ * ASSUMPTIONS:
+ * Buffer mode is disabled (BUF=0).
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void start_continuous_read(W25N01GV_Flash *flash) {
+	load_page(flash, flash->next_page_to_read);
+
+	// In continuous mode the column address is ignored, the 3 bytes after the command are dummy bytes
+	uint8_t tx[4] = {W25N01GV_READ_DATA, 0, 0, 0};
+
+	__disable_irq();
+	HAL_GPIO_WritePin(flash->cs_base, flash->cs_pin, W25N01GV_CS_ACTIVE);  // Stays selected until the stream ends
+	flash->last_HAL_status = HAL_SPI_Transmit(flash->SPI_bus, tx, 4, W25N01GV_SPI_TIMEOUT);
+	__enable_irq();
+}
+
+/**
+ * Adds the ECC result of the pages read since the last check to
+ * flash->continuous_read_ECC_status.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void add_stream_ECC_status(W25N01GV_Flash *flash) {
+	// In continuous mode, the ECC bits accumulate over every page streamed
+	get_ECC_status(flash);
+	uint16_t block = W25N01GV_NUM_BLOCKS;  // Unknown for corrections in a stream
+	if (flash->last_read_ECC_status == ERROR_ONE_PAGE
+			|| flash->last_read_ECC_status == ERROR_MULTIPLE_PAGES) {
+		read_last_ECC_failure_page(flash);
+		block = flash->last_ECC_failure_page / W25N01GV_PAGES_PER_BLOCK;
+	}
+	if (flash->transport == NULL)  // Otherwise get_ECC_status() counted the page already
+		count_ECC_status(flash, block);
+
+	// Keep the worst result if a stream is restarted after a bad block.
+	// Errors in two separate streams count as multiple pages.
+	if ((flash->continuous_read_ECC_status == ERROR_ONE_PAGE || flash->continuous_read_ECC_status == ERROR_MULTIPLE_PAGES)
+			&& (flash->last_read_ECC_status == ERROR_ONE_PAGE || flash->last_read_ECC_status == ERROR_MULTIPLE_PAGES))
+		flash->continuous_read_ECC_status = ERROR_MULTIPLE_PAGES;
+	else if (flash->last_read_ECC_status > flash->continuous_read_ECC_status)
+		flash->continuous_read_ECC_status = flash->last_read_ECC_status;
+}
+
+/**
+ * Releases chip select to stop a continuous read, and adds the ECC result of
+ * the pages streamed to flash->continuous_read_ECC_status.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void stop_continuous_read(W25N01GV_Flash *flash) {
+	HAL_GPIO_WritePin(flash->cs_base, flash->cs_pin, W25N01GV_CS_INACTIVE);
+
+	// The chip finishes loading the page it was working on before it's ready
+	wait_for_operation(flash, W25N01GV_READ_PAGE_DATA_ECC_ON_MAX_TIME_US * 1000);
+
+	add_stream_ECC_status(flash);
+}
+
+/**
+ * Waits for a chunk started by start_continuous_flash_chunk_read() to finish.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void wait_for_continuous_read_dma(W25N01GV_Flash *flash) {
+	while (continuous_flash_chunk_read_busy(flash));
+}
+
+/**
+ * Gets the stream ready to read from flash->next_page_to_read at the start
+ * of a page. The chip would stream the bad block too, so a new stream is
+ * started after it. A circular log starts a new stream at the start of flash
+ * after the last block.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @retval 1 if there's a page to read, 0 at the end of flash
+ */
+static uint8_t skip_bad_blocks_in_stream(W25N01GV_Flash *flash) {
+	if (flash->continuous_read_column == 0
+			&& next_good_log_page(flash, flash->next_page_to_read) != flash->next_page_to_read) {
+		if (flash->transport == NULL)
+			stop_continuous_read(flash);
+		flash->next_page_to_read = next_good_log_page(flash, flash->next_page_to_read);
+		if (flash->next_page_to_read >= W25N01GV_NUM_PAGES)
+			return 0;
+		if (flash->transport == NULL)
+			start_continuous_read(flash);
+	}
+	return 1;
+}
+
+/**
+ * Keeps the page counter in sync with the stream after num_bytes were read.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param num_bytes  <uint16_t>           Number of bytes read from the stream
+ */
+static void advance_continuous_read(W25N01GV_Flash *flash, uint16_t num_bytes) {
+	flash->continuous_read_column += num_bytes;
+	if (flash->continuous_read_column == W25N01GV_BYTES_PER_PAGE) {
+		flash->continuous_read_column = 0;
+		flash->next_page_to_read++;
+	}
+}
+
+
+/* Public function definitions */
+
+/**
+ * Adds the key/value records in data to the store's index. Parsing stops at
+ * the first byte that isn't a record marker (erased space). Records with a
+ * bad CRC, e.g. from a write that was interrupted, are skipped.
+ *
+ * @param store      <W25N01GV_KV_Store*> Store to update the index of
+ * @param page       <uint8_t>            Page of the store's block data was read from
+ * @param column     <uint16_t>           Column data was read from
+ * @param data       <uint8_t*>           Records read from flash
+ * @param num_bytes  <uint16_t>           Number of bytes in data
+ */
+static void index_kv_records(W25N01GV_KV_Store *store, uint8_t page, uint16_t column,
+		uint8_t *data, uint16_t num_bytes) {
+	uint16_t offset = 0;
+
+	while (offset + W25N01GV_KV_RECORD_OVERHEAD <= num_bytes && data[offset] == W25N01GV_KV_RECORD_MARKER) {
+		uint8_t key = data[offset+1];
+		uint16_t size = W25N01GV_PACK_2_BYTES_TO_UINT16(data+offset+2);
+		if (size > W25N01GV_KV_MAX_VALUE_SIZE || offset + W25N01GV_KV_RECORD_OVERHEAD + size > num_bytes)
+			break;  // Not a complete record
+
+		uint16_t crc = W25N01GV_PACK_2_BYTES_TO_UINT16(data+offset+W25N01GV_KV_HEADER_SIZE+size);
+		if (key < W25N01GV_KV_MAX_KEYS && crc == update_crc16(0xFFFF, data+offset, W25N01GV_KV_HEADER_SIZE+size)) {
+			W25N01GV_KV_Entry *entry = &store->index[key];
+			if (entry->present)
+				store->live_bytes -= W25N01GV_KV_RECORD_OVERHEAD + entry->size;
+
+			// A record without a value deletes the key
+			entry->present = (size > 0);
+			entry->page = page;
+			entry->column = column + offset;
+			entry->size = size;
+			if (entry->present)
+				store->live_bytes += W25N01GV_KV_RECORD_OVERHEAD + size;
+		}
+
+		offset += W25N01GV_KV_RECORD_OVERHEAD + size;
+	}
+}
+
+/**
+ * Empties the key/value store's RAM index.
+ *
+ * @param store      <W25N01GV_KV_Store*> Store to clear the index of
+ */
+static void clear_kv_index(W25N01GV_KV_Store *store) {
+	for (uint8_t key = 0; key < W25N01GV_KV_MAX_KEYS; key++)
+		store->index[key].present = 0;
+	store->live_bytes = 0;
+}
+
+/**
+ * Programs a record into the next free sector of the key/value store and
+ * adds it to the index. The sector is used up even if programming fails.
+ *
+ * @param store      <W25N01GV_KV_Store*> Store to append to
+ * @param record     <uint8_t*>           Record to write
+ * @param num_bytes  <uint16_t>           Size of the record, up to W25N01GV_SECTOR_SIZE
+ * @retval 0 if the record was written successfully, 1 if it failed
+ */
+static uint8_t append_kv_record(W25N01GV_KV_Store *store, uint8_t *record, uint16_t num_bytes) {
+	W25N01GV_Flash *flash = store->flash;
+	uint8_t page = store->next_free_sector / W25N01GV_SECTORS_PER_PAGE;
+	uint16_t column = (store->next_free_sector % W25N01GV_SECTORS_PER_PAGE) * W25N01GV_SECTOR_SIZE;
+
+	wait_for_async_flash_write(flash);  // Don't interrupt an asynchronous write or erase
+	unlock_flash(flash);
+	write_bytes_to_page(flash, record, num_bytes, store->block * W25N01GV_PAGES_PER_BLOCK + page,
+			column, NULL);
+	if (!flash->async_write_enabled)
+		lock_flash(flash);
+
+	store->next_free_sector++;
+	if (flash->last_write_failure_status)
+		return 1;
+
+	index_kv_records(store, page, column, record, num_bytes);
+	return 0;
+}
+
+/**
+ * Reads the commit record of the last compaction into a key/value block.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param block      <uint16_t>           W25N01GV_RESERVED_BLOCK or W25N01GV_KV_ALT_BLOCK
+ * @param generation <uint16_t*>          Set to the generation of the compaction
+ * @retval 1 if the block has a valid commit record, 0 otherwise
+ */
+static uint8_t read_kv_commit_record(W25N01GV_Flash *flash, uint16_t block, uint16_t *generation) {
+	uint8_t record[W25N01GV_KV_COMMIT_RECORD_SIZE];
+
+	if (block_is_bad(flash, block))
+		return 0;
+
+	read_bytes_from_page(flash, record, W25N01GV_KV_COMMIT_RECORD_SIZE,
+			block * W25N01GV_PAGES_PER_BLOCK + W25N01GV_KV_COMMIT_SECTOR / W25N01GV_SECTORS_PER_PAGE,
+			(W25N01GV_KV_COMMIT_SECTOR % W25N01GV_SECTORS_PER_PAGE) * W25N01GV_SECTOR_SIZE);
+
+	if (record[0] != W25N01GV_KV_RECORD_MARKER || record[1] != W25N01GV_KV_COMMIT_KEY
+			|| W25N01GV_PACK_2_BYTES_TO_UINT16(record+2) != 2
+			|| W25N01GV_PACK_2_BYTES_TO_UINT16(record+6) != update_crc16(0xFFFF, record, W25N01GV_KV_HEADER_SIZE+2))
+		return 0;
+
+	*generation = W25N01GV_PACK_2_BYTES_TO_UINT16(record+W25N01GV_KV_HEADER_SIZE);
+	return 1;
+}
+
+/**
+ * Appends a record setting a key's value, or deleting it if size is 0.
+ * Compacts the store first if it's full, and tries the next sector once
+ * if programming fails.
+ *
+ * @param store      <W25N01GV_KV_Store*> Store to write to
+ * @param key        <uint8_t>            Key, 0 to W25N01GV_KV_MAX_KEYS-1
+ * @param value      <uint8_t*>           Value to save
+ * @param size       <uint16_t>           Size of the value, up to W25N01GV_KV_MAX_VALUE_SIZE
+ * @retval KV_OK, or the reason the record wasn't written
+ */
+static W25N01GV_KV_Status write_kv_record(W25N01GV_KV_Store *store, uint8_t key, uint8_t *value, uint16_t size) {
+	uint8_t record[W25N01GV_KV_RECORD_OVERHEAD + W25N01GV_KV_MAX_VALUE_SIZE];
+	W25N01GV_KV_Entry *entry = &store->index[key];
+
+	// Everything has to fit in page 0 after a compaction
+	uint32_t live_bytes = store->live_bytes;
+	if (entry->present)
+		live_bytes -= W25N01GV_KV_RECORD_OVERHEAD + entry->size;
+	if (size > 0)
+		live_bytes += W25N01GV_KV_RECORD_OVERHEAD + size;
+	if (live_bytes > W25N01GV_BYTES_PER_PAGE)
+		return KV_FULL;
+
+	uint8_t size_8bit_array[2] = W25N01GV_UNPACK_UINT16_TO_2_BYTES(size);
+	record[0] = W25N01GV_KV_RECORD_MARKER;
+	record[1] = key;
+	record[2] = size_8bit_array[0];
+	record[3] = size_8bit_array[1];
+	for (uint16_t i = 0; i < size; i++)
+		record[W25N01GV_KV_HEADER_SIZE + i] = value[i];
+
+	uint16_t crc = update_crc16(0xFFFF, record, W25N01GV_KV_HEADER_SIZE + size);
+	uint8_t crc_8bit_array[2] = W25N01GV_UNPACK_UINT16_TO_2_BYTES(crc);
+	record[W25N01GV_KV_HEADER_SIZE + size] = crc_8bit_array[0];
+	record[W25N01GV_KV_HEADER_SIZE + size + 1] = crc_8bit_array[1];
+
+	for (uint8_t attempt = 0; attempt < 2; attempt++) {
+		if (store->next_free_sector >= W25N01GV_KV_NUM_SECTORS && compact_flash_kv_store(store) != KV_OK)
+			return KV_WRITE_FAILED;
+
+		if (!append_kv_record(store, record, W25N01GV_KV_RECORD_OVERHEAD + size))
+			return KV_OK;
+	}
+
+	return KV_WRITE_FAILED;
+}
+
+/**
+ * The part of init_flash() after the bus has been chosen: sets parameters to
+ * an initial state, sets up the chip, and finds the write pointer.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void start_flash(W25N01GV_Flash *flash) {
+	flash->next_page_to_read = 0;
+	flash->next_sector_to_read = 0;
+	flash->test_end_read = 0;
+	flash->invalid_sectors_skipped = 0;
+	flash->torn_page_skipped = 0;
+
+	flash->write_buffer = flash->sector_buffers[0];
+	flash->write_buffer_size = 0;
+	flash->reserved_bytes = 0;
+	flash->record_tag = W25N01GV_TAG_DATA;
+	flash->section_end_pending = 0;
+	flash->time_source = NULL;
+	flash->page_time = 0;
+	flash->page_time_page = W25N01GV_NUM_PAGES;  // No page stamped yet
+
+	flash->async_write_enabled = 0;
+	flash->async_state = ASYNC_WRITE_IDLE;
+	flash->async_write_failures = 0;
+	flash->async_callback = NULL;
+
+	flash->continuous_read_active = 0;
+	flash->continuous_read_column = 0;
+	flash->continuous_read_dma_active = 0;
+	flash->last_ECC_failure_page = 0;
+
+	flash->last_HAL_status = HAL_OK;
+	flash->last_read_ECC_status = SUCCESS_NO_CORRECTIONS;
+	flash->last_write_failure_status = 0;
+	flash->last_erase_failure_status = 0;
+
+	flash->stats = NULL;
+	flash->timed_op = W25N01GV_OP_NONE;
+	flash->last_op_page = 0;
+
+	// Busy waits are timed with the cycle counter
+	enable_cycle_counter();
+	flash->poll_interval_us = 0;
+	flash->yield_callback = NULL;
+	flash->last_wait_timed_out = 0;
+	flash->wait_timeouts = 0;
+
+	reset_flash(flash);
+
+	enable_ECC(flash);  // Should be enabled by default, but enable ECC just in case
+	enable_buffer_mode(flash);  // -IG models start with buffer mode by default, -IT models don't
+	// As of the time of writing this, MASA uses the -IG model.
+
+	build_bad_block_table(flash);
+
+	// Erase-ahead mode and circular logs stay on until the next erase_flash()
+	uint16_t erase_ahead_mode = W25N01GV_ERASE_AHEAD_LINEAR;
+	flash->erase_ahead_enabled = read_slot_record(flash, W25N01GV_ERASE_AHEAD_SLOT,
+			W25N01GV_ERASE_AHEAD_MARKER_0, W25N01GV_ERASE_AHEAD_MARKER_1, &erase_ahead_mode);
+	flash->circular_log_enabled = flash->erase_ahead_enabled && erase_ahead_mode == W25N01GV_ERASE_AHEAD_CIRCULAR;
+	flash->erase_ahead_block = W25N01GV_NUM_DATA_BLOCKS;
+	flash->kv_store_active = 0;
+
+	flash->block_op = BLOCK_OP_NONE;
+	flash->block_op_result = 0;
+
+	find_write_ptr(flash);
+
+	if (flash->circular_log_enabled) {
+		flash->erase_ahead_block = find_circular_erase_ahead_block(flash);
+	}
+	else if (flash->erase_ahead_enabled) {
+		// Only the write pointer's block and the one after it are known to be erased.
+		// The one after it isn't if nothing has been written to the block yet.
+		uint16_t block = flash->current_page / W25N01GV_PAGES_PER_BLOCK;
+		uint16_t next_block = next_good_block_ahead(flash, block+1);
+		if (flash->current_page % W25N01GV_PAGES_PER_BLOCK == 0 && flash->next_free_column == 0)
+			next_block = erase_ahead_end(flash);
+		flash->erase_ahead_block = ((next_block < erase_ahead_end(flash)) ? next_block : block) + 1;
+	}
+}
+
+void init_flash(W25N01GV_Flash *flash, SPI_HandleTypeDef *SPI_bus_in,
+		GPIO_TypeDef *cs_base_in,	uint16_t cs_pin_in) {
+	flash->SPI_bus = SPI_bus_in;
+	flash->cs_base = cs_base_in;
+	flash->cs_pin = cs_pin_in;
+	flash->transport = NULL;
+	flash->data_lines = 1;
+
+	start_flash(flash);
+}
+
+void init_flash_with_transport(W25N01GV_Flash *flash, W25N01GV_Transport transport, uint8_t data_lines) {
+	flash->SPI_bus = NULL;
+	flash->cs_base = NULL;
+	flash->cs_pin = 0;
+	flash->transport = transport;
+	flash->data_lines = (data_lines == 2 || data_lines == 4) ? data_lines : 1;
+
+	start_flash(flash);
+}
+
+void set_flash_busy_wait(W25N01GV_Flash *flash, uint32_t poll_interval_us, W25N01GV_Yield_Callback yield_callback) {
+	flash->poll_interval_us = poll_interval_us;
+	flash->yield_callback = yield_callback;
+}
+
+uint8_t ping_flash(W25N01GV_Flash *flash) {
+
+	uint8_t tx[2] = {W25N01GV_READ_JEDEC_ID, 0};	// Second byte is unused
+	uint8_t rx[3];
+
+	spi_transmit_receive(flash, tx, 2, rx, 3);
+	uint8_t manufacturer_ID = rx[0];
+	uint16_t device_ID = W25N01GV_PACK_2_BYTES_TO_UINT16(rx+1);
+
+	if (manufacturer_ID == W25N01GV_MANUFACTURER_ID
+			&& (device_ID == W25N01GV_DEVICE_ID || device_ID == W25N01GV_W25M02GV_DEVICE_ID))
+		return 1;
+	else
+		return 0;
+}
+
+uint8_t reset_flash(W25N01GV_Flash *flash) {
+	// The reset command will corrupt data if given while another
+	// operation is taking place, so just return in that case
+	if (flash_is_busy(flash))  // TODO: replace with wait_for_operation? idk honestly
+		return 0;
+
+	// Otherwise send the reset command
+	uint8_t tx[1] = { W25N01GV_DEVICE_RESET };
+	spi_transmit(flash, tx, 1);
+
+	// Wait for it to reset
+	wait_for_operation(flash, W25N01GV_RESET_MAX_TIME_US * 1000);
+
+	return 1;
+}
+
+/**
+ * Old write function that writes everything immediately.
+ * The reason why this is separate from write_flash() is because I wrote
+ * this function before I learned about the 512-byte framing requirement,
+ * so write_to_flash() handles the framing and uses this function to do
+ * the actual writing.
+ *
+ * Read the application note linked in the README to read about the
+ * 512-byte framing requirement and why violating it will corrupt data.
+ *
+ * ASSUMPTIONS:
+ * flash->next_free_column is a multiple of W25N01GV_SECTOR_SIZE between [0, 2047].
+ * data can fit in flash's remaining space.
+ * flash->write_buffer is not full == flash->write_buffer_size < W25N01GV_SECTOR_SIZE.
+ * Flash is unlocked.
+ *
+ * num_valid_bytes is the number of bytes at the start of data that aren't
+ * padding, and is recorded in the sector metadata.
+ */
+static uint16_t write_to_flash_contiguous(W25N01GV_Flash *flash, uint8_t *data, uint32_t num_bytes,
+		uint32_t num_valid_bytes) {
+
+	// Debug code
+	// TODO: delete in final release
+	/*
+	if (!(flash->next_free_column == 0 || flash->next_free_column == 512
+			|| flash->next_free_column == 1024 || flash->next_free_column == 1536
+			|| flash->next_free_column == 2048)) {
+		asm("nop");
+	}
+	*/
+
+	// Debug code
+	// TODO: delete in final release
+	/*
+	if (num_bytes % 512 != 0) {
+		asm("nop");
+	}
+	*/
+
+	uint32_t write_counter = 0;  // Track how many bytes have been written so far
+	uint16_t write_failures = 0;  // Track write errors
+	uint8_t metadata[W25N01GV_SECTORS_PER_PAGE][W25N01GV_SECTOR_SPARE_RECORD_SIZE];
+
+	while (write_counter < num_bytes) {
+
+		erase_ahead_of_write_ptr(flash);
+		update_checkpoint(flash);
+
+		// If there's not enough space on the page, only write as much as will fit
+		uint16_t num_bytes_to_write_on_page = num_bytes - write_counter;
+		if (num_bytes_to_write_on_page > W25N01GV_BYTES_PER_PAGE - flash->next_free_column)
+			num_bytes_to_write_on_page = W25N01GV_BYTES_PER_PAGE - flash->next_free_column;
+
+		uint32_t num_valid_bytes_on_page = 0;
+		if (num_valid_bytes > write_counter)
+			num_valid_bytes_on_page = num_valid_bytes - write_counter;
+		if (num_valid_bytes_on_page > num_bytes_to_write_on_page)
+			num_valid_bytes_on_page = num_bytes_to_write_on_page;
+		make_page_metadata(flash, data + write_counter, num_bytes_to_write_on_page,
+				num_valid_bytes_on_page, metadata);
+
+		// Write the array (or a part of it if it's too long for one page) to flash
+		write_bytes_to_page(flash, data + write_counter, num_bytes_to_write_on_page,
+				flash->current_page, flash->next_free_column, metadata);
+
+		// If the page wasn't written correctly, retire the block and write it again in the next good one
+		if (flash->last_write_failure_status) {
+			if (relocate_write_block(flash))
+				continue;
+
+			write_failures++;  // Out of good blocks
+			break;
+		}
+
+		write_counter += num_bytes_to_write_on_page;
+		advance_write_ptr(flash, num_bytes_to_write_on_page);
+	}
+
+	// Debug code
+	// TODO: delete in final release
+	/*
+	if (!(flash->next_free_column == 0 || flash->next_free_column == 512
+			|| flash->next_free_column == 1024 || flash->next_free_column == 1536
+			|| flash->next_free_column == 2048)) {
+		asm("nop");
+	}
+	*/
+
+	return write_failures;
+}
+
+/**
+ * Writes the full sector at the start of the write buffer to flash, in async
+ * mode if it's on. Anything in the buffer past the sector (the end of a
+ * reserved record, see reserve_flash_write()) is moved to the start of the
+ * next write buffer.
+ *
+ * ASSUMPTIONS:
+ * flash->write_buffer_size is at least W25N01GV_SECTOR_SIZE.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @retval The number of writes that failed and couldn't be moved to a good block
+ */
+static uint16_t write_full_sector(W25N01GV_Flash *flash) {
+	uint8_t *sector = flash->write_buffer;
+	uint16_t num_spilled_bytes = flash->write_buffer_size - W25N01GV_SECTOR_SIZE;
+	uint16_t write_failures = 0;
+
+	if (flash->async_write_enabled) {
+		uint16_t failures_before = flash->async_write_failures;
+
+		// The other buffer is still in flight until the pipeline is idle
+		wait_for_async_flash_write(flash);
+		start_async_write(flash, sector, W25N01GV_SECTOR_SIZE, W25N01GV_SECTOR_SIZE);
+
+		// Swap buffers and keep filling
+		flash->write_buffer = (sector == flash->sector_buffers[0]) ?
+				flash->sector_buffers[1] : flash->sector_buffers[0];
+		write_failures = flash->async_write_failures - failures_before;
+	}
+	else {
+		wait_for_async_flash_write(flash);  // In case start_flash_page_write() is still programming
+		unlock_flash(flash);
+		write_failures = write_to_flash_contiguous(flash, sector, W25N01GV_SECTOR_SIZE, W25N01GV_SECTOR_SIZE);
+		lock_flash(flash);
+	}
+
+	// The DMA only reads the first W25N01GV_SECTOR_SIZE bytes, so the rest can be copied while it runs
+	for (uint16_t i = 0; i < num_spilled_bytes; i++)
+		flash->write_buffer[i] = sector[W25N01GV_SECTOR_SIZE + i];
+	flash->write_buffer_size = num_spilled_bytes;
+
+	return write_failures;
+}
+
+/**
+ * Async mode version of write_to_flash(). Everything goes through the two
+ * sector buffers, because the caller's data can't be handed to the DMA
+ * directly (it may be reused as soon as this function returns).
+ *
+ * ASSUMPTIONS:
+ * num_bytes has already been truncated to the space remaining.
+ *
+ * @retval The number of sector writes that failed while this function was running
+ */
+static uint16_t write_to_flash_async(W25N01GV_Flash *flash, uint8_t *data, uint32_t num_bytes) {
+	uint16_t failures_before = flash->async_write_failures;
+
+	while (num_bytes > 0) {
+		uint16_t num_bytes_to_copy = W25N01GV_SECTOR_SIZE - flash->write_buffer_size;
+		if (num_bytes_to_copy > num_bytes)
+			num_bytes_to_copy = num_bytes;
+
+		for (uint16_t i = 0; i < num_bytes_to_copy; ++i) {
+			flash->write_buffer[flash->write_buffer_size + i] = data[i];
+		}
+		flash->write_buffer_size += num_bytes_to_copy;
+		data += num_bytes_to_copy;
+		num_bytes -= num_bytes_to_copy;
+
+		if (flash->write_buffer_size == W25N01GV_SECTOR_SIZE)
+			write_full_sector(flash);  // Failures are counted in flash->async_write_failures
+	}
+
+	return flash->async_write_failures - failures_before;
+}
+
+uint16_t write_to_flash(W25N01GV_Flash *flash, uint8_t *data, uint32_t num_bytes) {
+
+	// If there's not enough space, truncate the data
+	uint32_t bytes_remaining = get_bytes_remaining(flash);
+	if (num_bytes > bytes_remaining)
+		num_bytes = bytes_remaining;
+
+	if (flash->async_write_enabled)
+		return write_to_flash_async(flash, data, num_bytes);
+
+	uint16_t write_failures = 0;  // Track write failures
+
+	// Copy the front end into the write_buffer
+	uint8_t buffer_full = 0;  // Used to decide whether or not to write buffer contents to flash
+
+	// If write_buffer is not empty and data fills it completely
+	if (flash->write_buffer_size > 0 && flash->write_buffer_size + num_bytes >= W25N01GV_SECTOR_SIZE) {
+		// Copy data into write_buffer until it's full,
+		uint16_t num_bytes_to_copy = W25N01GV_SECTOR_SIZE - flash->write_buffer_size;
+		for (uint16_t i = 0; i < num_bytes_to_copy; ++i) {
+			flash->write_buffer[flash->write_buffer_size + i] = data[i];
+		}
+		flash->write_buffer_size = W25N01GV_SECTOR_SIZE;
+		buffer_full = 1;
+
+		// Adjust data and num_bytes to reflect the front end being chopped off
+		data += num_bytes_to_copy;
+		num_bytes -= num_bytes_to_copy;
+	}
+	// If data doesn't fill write_buffer completely
+	else if (flash->write_buffer_size + num_bytes < W25N01GV_SECTOR_SIZE) {
+		// Copy all data into write_buffer and return
+		for (uint16_t i = 0; i < num_bytes; ++i) {
+			flash->write_buffer[flash->write_buffer_size + i] = data[i];
+		}
+		flash->write_buffer_size += num_bytes;
+
+		return 0;
+	}
+
+	// In the case where write_buffer is empty and data would fill it completely,
+	// write_buffer isn't used and the write is handled separately.
+
+	// At this point, data and num_bytes should be adjusted so it starts at a multiple address.
+	// Use integer division to find out where the last unit is.
+	// If there are less than W25N01GV_SECTOR_SIZE, then end_size == num_bytes and end_arr == data,
+	// so anything in data that doesn't get written in this function will get stored in write_buffer
+	uint32_t new_data_size = (num_bytes / W25N01GV_SECTOR_SIZE) * W25N01GV_SECTOR_SIZE;
+	uint16_t end_size = num_bytes % W25N01GV_SECTOR_SIZE;
+	uint8_t* end_arr = data + new_data_size;
+
+	wait_for_async_flash_write(flash);  // In case start_flash_page_write() is still programming
+	unlock_flash(flash);
+
+	// If the buffer got filled, write the buffer to flash using write_to_flash_contiguous()
+	if (buffer_full) {
+		write_failures += write_to_flash_contiguous(flash, flash->write_buffer, W25N01GV_SECTOR_SIZE,
+				W25N01GV_SECTOR_SIZE);
+		flash->write_buffer_size = 0;
+	}
+
+	// Write the processed array into flash using write_to_flash_contiguous()
+	if (new_data_size > 0) {
+		write_failures += write_to_flash_contiguous(flash, data, new_data_size, new_data_size);
+	}
+
+	lock_flash(flash);
+
+	// Copy the remaining data, if any, into write_buffer
+	for (uint16_t i = 0; i < end_size; ++i) {
+		flash->write_buffer[i] = end_arr[i];
+	}
+	flash->write_buffer_size = end_size;
+
+	return write_failures;
+
+}
+
+uint8_t *reserve_flash_write(W25N01GV_Flash *flash, uint16_t num_bytes) {
+	if (num_bytes == 0 || num_bytes > W25N01GV_MAX_RESERVE_SIZE || num_bytes > get_bytes_remaining(flash))
+		return NULL;
+
+	// write_buffer_size is always less than a sector here, so the
+	// reserved space fits in the room after the sector buffer
+	flash->reserved_bytes = num_bytes;
+	return flash->write_buffer + flash->write_buffer_size;
+}
+
+uint16_t commit_flash_write(W25N01GV_Flash *flash, uint16_t num_bytes) {
+	if (num_bytes > flash->reserved_bytes)
+		num_bytes = flash->reserved_bytes;
+	flash->reserved_bytes = 0;
+
+	flash->write_buffer_size += num_bytes;
+	if (flash->write_buffer_size < W25N01GV_SECTOR_SIZE)
+		return 0;
+
+	return write_full_sector(flash);
+}
+
+/**
+ * Writes whatever is contained in the write buffer to flash as one sector,
+ * see finish_flash_write(). If the buffer is empty, the sector is empty and
+ * only carries its metadata. If section_end is set, the sector's metadata
+ * marks the end of a test.
+ *
+ * @param flash       <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param section_end <uint8_t>            1 to mark the end of a test, see add_test_delimiter()
+ * @retval The number of writes that failed and couldn't be moved to a good block
+ */
+static uint16_t flush_write_buffer(W25N01GV_Flash *flash, uint8_t section_end) {
+	// The rest of the sector can't be programmed later, so leave it erased.
+	// The metadata says how many bytes are valid.
+	uint16_t num_valid_bytes = flash->write_buffer_size;
+	while (flash->write_buffer_size < W25N01GV_SECTOR_SIZE)
+		flash->write_buffer[flash->write_buffer_size++] = W25N01GV_ERASED_BYTE;
+
+	// If there's not enough space, truncate the data.
+	// This should never happen, but just in case.
+	uint32_t bytes_remaining = get_bytes_remaining(flash);
+	if (flash->write_buffer_size > bytes_remaining)
+		flash->write_buffer_size = bytes_remaining;
+
+	// In async mode, flash is already unlocked. Send the last sector
+	// and wait for everything to be written.
+	if (flash->async_write_enabled) {
+		uint16_t failures_before = flash->async_write_failures;
+		wait_for_async_flash_write(flash);
+		flash->section_end_pending = section_end;  // Only this sector's metadata is made from here
+		if (flash->write_buffer_size > 0)
+			start_async_write(flash, flash->write_buffer, flash->write_buffer_size, num_valid_bytes);
+		flash->section_end_pending = 0;
+		flash->write_buffer_size = 0;
+		wait_for_async_flash_write(flash);
+		return flash->async_write_failures - failures_before;
+	}
+
+	wait_for_async_flash_write(flash);  // In case start_flash_page_write() is still programming
+	unlock_flash(flash);
+
+	flash->section_end_pending = section_end;
+	uint16_t write_failures = write_to_flash_contiguous(flash, flash->write_buffer,
+			flash->write_buffer_size, num_valid_bytes);
+	flash->section_end_pending = 0;
+	flash->write_buffer_size = 0;
+
+	lock_flash(flash);
+
+	return write_failures;
+}
+
+uint16_t finish_flash_write(W25N01GV_Flash *flash) {
+	// Ignore this function if there's nothing in the write buffer
+	if (flash->write_buffer_size == 0) {
+		return 0;
+	}
+
+	return flush_write_buffer(flash, 0);
+}
+
+uint16_t write_flash_event(W25N01GV_Flash *flash, uint8_t *data, uint16_t num_bytes) {
+	if (num_bytes > W25N01GV_SECTOR_SIZE)
+		num_bytes = W25N01GV_SECTOR_SIZE;
+
+	// Leave room for the sector the write buffer will take
+	uint32_t space_needed = (flash->write_buffer_size > 0) ? 2 * W25N01GV_SECTOR_SIZE : W25N01GV_SECTOR_SIZE;
+	if (get_bytes_remaining(flash) + (uint32_t) flash->write_buffer_size < space_needed)
+		return 0;
+
+	// The event buffer may still be in flight from the last event
+	wait_for_async_flash_write(flash);
+
+	for (uint16_t i = 0; i < W25N01GV_SECTOR_SIZE; i++)
+		flash->event_buffer[i] = (i < num_bytes) ? data[i] : W25N01GV_ERASED_BYTE;  // Padded like finish_flash_write()
+
+	// Only this sector's metadata is made with the event tag
+	uint8_t record_tag = flash->record_tag;
+	flash->record_tag = W25N01GV_TAG_EVENT;
+
+	uint16_t write_failures;
+	if (flash->async_write_enabled) {
+		uint16_t failures_before = flash->async_write_failures;
+		start_async_write(flash, flash->event_buffer, W25N01GV_SECTOR_SIZE, num_bytes);
+		write_failures = flash->async_write_failures - failures_before;
+	}
+	else {
+		unlock_flash(flash);
+		write_failures = write_to_flash_contiguous(flash, flash->event_buffer, W25N01GV_SECTOR_SIZE, num_bytes);
+		lock_flash(flash);
+	}
+
+	flash->record_tag = record_tag;
+
+	return write_failures;
+}
+
+void reset_flash_read_pointer(W25N01GV_Flash *flash) {
+	if (flash->circular_log_enabled) {
+		wait_for_async_flash_write(flash);  // Don't interrupt an asynchronous write
+		flash->next_page_to_read = find_oldest_log_page(flash);
+		flash->next_sector_to_read = 0;
+		return;
+	}
+
+	flash->next_page_to_read = 0;
+	flash->next_sector_to_read = 0;
+}
+
+void read_next_2KB_from_flash(W25N01GV_Flash *flash, uint8_t *buffer) {
+	wait_for_async_flash_write(flash);  // Don't interrupt an asynchronous write
+
+	// Bad blocks never hold data, skip them
+	flash->next_page_to_read = next_good_log_page(flash, flash->next_page_to_read);
+	flash->next_sector_to_read = 0;
+
+	// Past the last good block, read back the same thing as an empty page
+	if (flash->next_page_to_read >= W25N01GV_NUM_PAGES) {
+		for (uint16_t b = 0; b < W25N01GV_BYTES_PER_PAGE; b++)
+			buffer[b] = W25N01GV_ERASED_BYTE;
+		flash->next_page_to_read++;
+		return;
+	}
+
+	// read_bytes_from_page() already got the ECC status
+	read_bytes_from_page(flash, buffer,	W25N01GV_BYTES_PER_PAGE, flash->next_page_to_read, 0);
+	flash->next_page_to_read++;  // Increment the page read counter
+}
+
+/**
+ * Reads the next page and moves the valid bytes of each good sector with
+ * the given tag to the start of buffer, starting at
+ * flash->next_sector_to_read and stopping after the last sector of a test.
+ * See read_next_valid_data_from_flash().
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param buffer     <uint8_t*>           Buffer to hold up to 2048 bytes of data
+ * @param tag        <uint8_t>            Tag of the sectors to keep, or W25N01GV_ANY_TAG
+ * @retval The number of bytes put in buffer, 0 to 2048
+ */
+static uint16_t read_next_sectors(W25N01GV_Flash *flash, uint8_t *buffer, uint8_t tag) {
+	uint8_t spare[W25N01GV_SPARE_AREA_SIZE];
+	W25N01GV_Sector_Metadata metadata;
+	uint16_t num_bytes = 0;
+
+	wait_for_async_flash_write(flash);  // Don't interrupt an asynchronous write
+
+	flash->test_end_read = 0;
+	flash->next_page_to_read = next_good_log_page(flash, flash->next_page_to_read);
+	if (flash->next_page_to_read >= W25N01GV_NUM_PAGES) {
+		flash->next_page_to_read++;
+		flash->next_sector_to_read = 0;
+		return 0;
+	}
+
+	// Both parts come from the same page load
+	load_page(flash, flash->next_page_to_read);
+	read_flash_buffer(flash, buffer, W25N01GV_BYTES_PER_PAGE, 0);
+	read_flash_buffer(flash, spare, W25N01GV_SPARE_AREA_SIZE, W25N01GV_SPARE_AREA_COLUMN);
+	get_ECC_status(flash);
+
+	// Move the valid bytes of each good sector down, over the padding and bad sectors
+	uint8_t sector = flash->next_sector_to_read;
+	while (sector < W25N01GV_SECTORS_PER_PAGE && !flash->test_end_read) {
+		uint8_t *sector_data = buffer + sector * W25N01GV_SECTOR_SIZE;
+
+		parse_sector_metadata(spare + sector * W25N01GV_SPARE_BYTES_PER_SECTOR, &metadata);
+		sector++;
+
+		if (metadata.tag == W25N01GV_TAG_NONE) {  // Not written, unless it was torn before the metadata
+			for (uint16_t b = 0; b < W25N01GV_SECTOR_SIZE; b++) {
+				if (sector_data[b] != W25N01GV_ERASED_BYTE) {
+					flash->invalid_sectors_skipped++;
+					break;
+				}
+			}
+			continue;
+		}
+		if (metadata.valid_bytes > W25N01GV_SECTOR_SIZE || !check_flash_sector_crc(&metadata, sector_data)) {
+			flash->invalid_sectors_skipped++;
+			continue;
+		}
+
+		// The next call starts with the next test
+		flash->test_end_read = metadata.section_end;
+
+		if (tag != W25N01GV_ANY_TAG && metadata.tag != tag)
+			continue;
+
+		for (uint16_t b = 0; b < metadata.valid_bytes; b++)  // Never moves data up, so it can't overwrite itself
+			buffer[num_bytes++] = sector_data[b];
+	}
+
+	if (sector < W25N01GV_SECTORS_PER_PAGE)
+		flash->next_sector_to_read = sector;
+	else {
+		flash->next_sector_to_read = 0;
+		flash->next_page_to_read++;
+	}
+
+	return num_bytes;
+}
+
+uint16_t read_next_valid_data_from_flash(W25N01GV_Flash *flash, uint8_t *buffer) {
+	return read_next_sectors(flash, buffer, W25N01GV_ANY_TAG);
+}
+
+uint16_t read_next_tagged_data_from_flash(W25N01GV_Flash *flash, uint8_t *buffer, uint8_t tag) {
+	return read_next_sectors(flash, buffer, tag);
+}
+
+void begin_continuous_flash_read(W25N01GV_Flash *flash) {
+	if (flash->continuous_read_active)
+		return;
+
+	wait_for_async_flash_write(flash);  // Don't interrupt an asynchronous write
+
+	flash->next_page_to_read = next_good_log_page(flash, flash->next_page_to_read);
+	flash->next_sector_to_read = 0;
+	if (flash->next_page_to_read >= W25N01GV_NUM_PAGES)
+		return;
+
+	// A transport can't hold chip select between chunks, so with one the
+	// stream is read a page at a time in buffer mode instead
+	if (flash->transport == NULL) {
+		disable_buffer_mode(flash);
+		start_continuous_read(flash);
+	}
+
+	flash->continuous_read_active = 1;
+	flash->continuous_read_column = 0;
+	flash->continuous_read_ECC_status = SUCCESS_NO_CORRECTIONS;
+}
+
+uint32_t read_continuous_flash_chunk(W25N01GV_Flash *flash, uint8_t *buffer, uint32_t num_bytes) {
+	if (!flash->continuous_read_active)
+		return 0;
+
+	// Receive at most a page at a time so the SPI timeout and the time
+	// spent with interrupts disabled don't depend on the chunk size.
+	// The stream stops before the checkpoint and reserved blocks.
+	wait_for_continuous_read_dma(flash);
+
+	uint32_t bytes_read = 0;
+	while (bytes_read < num_bytes && (flash->next_page_to_read < W25N01GV_NUM_PAGES || flash->circular_log_enabled)) {
+		if (!skip_bad_blocks_in_stream(flash))
+			break;
+
+		uint16_t transfer_size = W25N01GV_BYTES_PER_PAGE - flash->continuous_read_column;
+		if (transfer_size > num_bytes - bytes_read)
+			transfer_size = num_bytes - bytes_read;
+
+		if (flash->transport != NULL) {
+			if (flash->continuous_read_column == 0) {
+				load_page(flash, flash->next_page_to_read);
+				add_stream_ECC_status(flash);
+			}
+			read_flash_buffer(flash, buffer + bytes_read, transfer_size, flash->continuous_read_column);
+		}
+		else {
+			__disable_irq();
+			flash->last_HAL_status = HAL_SPI_Receive(flash->SPI_bus, buffer + bytes_read,
+					transfer_size, W25N01GV_SPI_TIMEOUT);
+			__enable_irq();
+		}
+
+		bytes_read += transfer_size;
+		advance_continuous_read(flash, transfer_size);
+	}
+
+	return bytes_read;
+}
+
+uint32_t start_continuous_flash_chunk_read(W25N01GV_Flash *flash, uint8_t *buffer, uint32_t num_bytes) {
+	if (!flash->continuous_read_active)
+		return 0;
+
+	wait_for_continuous_read_dma(flash);
+
+	if (flash->next_page_to_read >= W25N01GV_NUM_PAGES && !flash->circular_log_enabled)
+		return 0;
+	if (!skip_bad_blocks_in_stream(flash))
+		return 0;
+
+	// One transfer can't cross into the next page, in case that's a bad block
+	uint16_t transfer_size = W25N01GV_BYTES_PER_PAGE - flash->continuous_read_column;
+	if (transfer_size > num_bytes)
+		transfer_size = num_bytes;
+
+	// A transport reads the page in buffer mode, which finishes before this returns
+	if (flash->transport != NULL)
+		return read_continuous_flash_chunk(flash, buffer, transfer_size);
+
+	flash->last_HAL_status = HAL_SPI_Receive_DMA(flash->SPI_bus, buffer, transfer_size);
+
+	// Fall back to a blocking transfer if the DMA couldn't start
+	if (flash->last_HAL_status == HAL_OK)
+		flash->continuous_read_dma_active = 1;
+	else
+		flash->last_HAL_status = HAL_SPI_Receive(flash->SPI_bus, buffer, transfer_size, W25N01GV_SPI_TIMEOUT);
+
+	// The data isn't all here yet, but the stream has moved on
+	advance_continuous_read(flash, transfer_size);
+	return transfer_size;
+}
+
+uint8_t continuous_flash_chunk_read_busy(W25N01GV_Flash *flash) {
+	if (!flash->continuous_read_dma_active)
+		return 0;
+
+	HAL_SPI_StateTypeDef spi_state = HAL_SPI_GetState(flash->SPI_bus);
+	if (spi_state == HAL_SPI_STATE_BUSY_RX || spi_state == HAL_SPI_STATE_BUSY)
+		return 1;
+
+	flash->continuous_read_dma_active = 0;
+	return 0;
+}
+
+W25N01GV_ECC_Status end_continuous_flash_read(W25N01GV_Flash *flash) {
+	if (!flash->continuous_read_active)
+		return flash->last_read_ECC_status;
+
+	wait_for_continuous_read_dma(flash);
+
+	if (flash->transport == NULL) {
+		stop_continuous_read(flash);
+
+		// Go back to the mode the rest of the library expects
+		enable_buffer_mode(flash);
+	}
+	flash->continuous_read_active = 0;
+	flash->last_read_ECC_status = flash->continuous_read_ECC_status;
+
+	// A partially read page will be read again from the start by read_next_2KB_from_flash()
+	flash->continuous_read_column = 0;
+
+	return flash->last_read_ECC_status;
+}
+
+/**
+ * Sends the command for flash->block_op_block, skipping blocks that the
+ * operation doesn't touch. Once there are no blocks left, the operation is
+ * wrapped up and flash->block_op goes back to BLOCK_OP_NONE.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void start_next_block_op(W25N01GV_Flash *flash) {
+	if (flash->block_op == BLOCK_OP_ERASE) {
+		// Erasing a bad block would erase its bad block marker
+		while (flash->block_op_block < W25N01GV_NUM_DATA_BLOCKS && block_is_bad(flash, flash->block_op_block))
+			flash->block_op_block++;
+
+		// The key/value store's second block is kept like the reserved block
+		if (flash->block_op_block == W25N01GV_KV_ALT_BLOCK)
+			flash->block_op_block++;
+
+		// Ignore the last block, which is reserved for pseudo-eeprom functionality
+		if (flash->block_op_block >= W25N01GV_RESERVED_BLOCK) {
+			flash->block_op = BLOCK_OP_NONE;
+			if (!flash->async_write_enabled)
+				lock_flash(flash);
+
+			// Everything is erased, and so is the erase-ahead mode record
+			flash->erase_ahead_enabled = 0;
+			flash->circular_log_enabled = 0;
+			flash->erase_ahead_block = W25N01GV_NUM_DATA_BLOCKS;
+
+			// Reset the address pointer after erasing
+			find_write_ptr(flash);  // Don't manually set addr pointers to ensure it actually erases
+			flash->write_buffer_size = 0;
+			return;
+		}
+
+		start_block_erase(flash, flash->block_op_block * W25N01GV_PAGES_PER_BLOCK);  // Address of first page in each block
+	}
+	else {
+		if (flash->block_op_block >= W25N01GV_NUM_BLOCKS) {
+			flash->block_op = BLOCK_OP_NONE;
+			return;
+		}
+
+		start_page_load(flash, flash->block_op_block * W25N01GV_PAGES_PER_BLOCK);  // page 0, 64, 128, ...
+	}
+
+	flash->block_op_start = DWT->CYCCNT;
+}
+
+/**
+ * Checks the result for flash->block_op_block once the chip is done with it.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ */
+static void finish_block_op(W25N01GV_Flash *flash) {
+	uint16_t block = flash->block_op_block;
+
+	if (flash->block_op == BLOCK_OP_ERASE) {
+		disable_write(flash);  // This will happen automatically if the erase succeeds, but just in case it fails
+
+		// Check if the erase failed, and stop using the block if it did
+		if (get_erase_failure_status(flash)) {
+			flash->block_op_result++;
+			if (block < W25N01GV_NUM_DATA_BLOCKS)
+				mark_bad_block(flash, block);
+		}
+
+		if (block == W25N01GV_CHECKPOINT_BLOCK)
+			rerecord_retired_blocks(flash);
+		return;
+	}
+
+	uint8_t read_byte[1];
+
+	if (flash->last_wait_timed_out)
+		wait_out_stuck_operation(flash);
+	read_flash_buffer(flash, read_byte, 1, W25N01GV_SPARE_AREA_COLUMN);
+	get_ECC_status(flash);
+
+	if (*read_byte != 0xFF) {  // Look for non-0xFF bad block markers
+		flash->block_op_bad_blocks[flash->block_op_result] = block;
+		flash->block_op_result++;
+	}
+}
+
+void start_flash_erase(W25N01GV_Flash *flash) {
+	wait_for_async_flash_write(flash);  // Don't interrupt an asynchronous write
+	unlock_flash(flash);
+
+	// Every block is erased one by one, including the checkpoints
+	flash->block_op = BLOCK_OP_ERASE;
+	flash->block_op_block = 0;
+	flash->block_op_result = 0;
+	start_next_block_op(flash);
+}
+
+void start_flash_bad_block_scan(W25N01GV_Flash *flash, uint16_t *bad_blocks) {
+	wait_for_async_flash_write(flash);  // Don't interrupt an asynchronous write
+
+	flash->block_op = BLOCK_OP_BAD_BLOCK_SCAN;
+	flash->block_op_block = 0;
+	flash->block_op_result = 0;
+	flash->block_op_bad_blocks = bad_blocks;
+	start_next_block_op(flash);
+}
+
+uint8_t poll_flash_block_op(W25N01GV_Flash *flash) {
+	if (flash->block_op == BLOCK_OP_NONE)
+		return 0;
+
+	flash->last_wait_timed_out = 0;
+	if (flash_is_busy(flash)) {
+		uint32_t max_time_ns = (flash->block_op == BLOCK_OP_ERASE) ?
+				W25N01GV_BLOCK_ERASE_MAX_TIME_MS * 1000000 : W25N01GV_READ_PAGE_DATA_ECC_ON_MAX_TIME_US * 1000;
+		if (DWT->CYCCNT - flash->block_op_start < ns_to_cycles(max_time_ns))
+			return 1;
+
+		// Taking longer than the datasheet allows, same as a wait that timed out
+		flash->last_wait_timed_out = 1;
+		flash->wait_timeouts++;
+	}
+
+	finish_block_op(flash);
+	flash->block_op_block++;
+	start_next_block_op(flash);
+
+	return flash->block_op != BLOCK_OP_NONE;
+}
+
+uint16_t erase_flash(W25N01GV_Flash *flash) {
+	start_flash_erase(flash);
+	while (poll_flash_block_op(flash))
+		wait_poll_interval(flash);
+
+	return flash->block_op_result;
+}
+
+uint16_t quick_erase_flash(W25N01GV_Flash *flash) {
+	uint16_t retired_blocks_before = flash->retired_blocks;
+
+	wait_for_async_flash_write(flash);  // Don't interrupt an asynchronous write
+	unlock_flash(flash);
+
+	uint16_t erase_failures = erase_checkpoint_block(flash);
+	write_slot_record(flash, W25N01GV_ERASE_AHEAD_SLOT, W25N01GV_ERASE_AHEAD_MARKER_0,
+			W25N01GV_ERASE_AHEAD_MARKER_1, W25N01GV_ERASE_AHEAD_LINEAR);
+
+	// Start over at the first block, which is erased right away along with the one after it
+	flash->erase_ahead_enabled = 1;
+	flash->circular_log_enabled = 0;
+	flash->erase_ahead_block = 0;
+	flash->current_page = 0;
+	flash->next_free_column = 0;
+	erase_ahead_of_write_ptr(flash);
+
+	if (!flash->async_write_enabled)
+		lock_flash(flash);
+
+	find_write_ptr(flash);  // Don't manually set addr pointers to ensure it actually erases
+	flash->write_buffer_size = 0;
+
+	return erase_failures + (flash->retired_blocks - retired_blocks_before);
+}
+
+uint16_t start_circular_flash_log(W25N01GV_Flash *flash) {
+	uint16_t erase_failures = erase_flash(flash);
+
+	unlock_flash(flash);
+	write_slot_record(flash, W25N01GV_ERASE_AHEAD_SLOT, W25N01GV_ERASE_AHEAD_MARKER_0,
+			W25N01GV_ERASE_AHEAD_MARKER_1, W25N01GV_ERASE_AHEAD_CIRCULAR);
+	if (!flash->async_write_enabled)
+		lock_flash(flash);
+
+	// Everything up to the first block of the next lap is erased
+	flash->erase_ahead_enabled = 1;
+	flash->circular_log_enabled = 1;
+	flash->erase_ahead_block = flash->current_page / W25N01GV_PAGES_PER_BLOCK + W25N01GV_NUM_DATA_BLOCKS;
+
+	return erase_failures;
+}
+
+uint8_t end_of_flash_log(W25N01GV_Flash *flash) {
+	if (flash->continuous_read_column != 0)
+		return 0;
+
+	// First page after the last one with data
+	uint32_t end_page = flash->current_page + ((flash->next_free_column > 0) ? 1 : 0);
+
+	if (flash->circular_log_enabled)
+		return next_good_log_page(flash, flash->next_page_to_read) == next_good_log_page(flash, end_page);
+	return next_good_page(flash, flash->next_page_to_read) >= next_good_page(flash, end_page);
+}
+
+uint32_t get_erased_bytes_remaining(W25N01GV_Flash *flash) {
+	if (!flash->erase_ahead_enabled)
+		return get_bytes_remaining(flash);
+
+	// Rest of the write pointer's block, plus the erased blocks after it
+	uint32_t block_end_page = (flash->current_page / W25N01GV_PAGES_PER_BLOCK + 1) * W25N01GV_PAGES_PER_BLOCK;
+	uint32_t erased_bytes = (block_end_page - flash->current_page) * W25N01GV_BYTES_PER_PAGE - flash->next_free_column
+			+ (uint32_t) count_erased_blocks_ahead(flash) * W25N01GV_PAGES_PER_BLOCK * W25N01GV_BYTES_PER_PAGE;
+
+	// write_buffer is counted as written, like in get_bytes_remaining()
+	if (erased_bytes < flash->write_buffer_size)
+		return 0;
+	return erased_bytes - flash->write_buffer_size;
+}
+
+uint32_t get_bytes_remaining(W25N01GV_Flash *flash) {
+	// A circular log never runs out of space
+	if (flash->circular_log_enabled)
+		return get_flash_capacity(flash) - flash->write_buffer_size;
+
+	return ((W25N01GV_NUM_PAGES - (uint32_t) flash->bad_blocks_ahead * W25N01GV_PAGES_PER_BLOCK) * W25N01GV_BYTES_PER_PAGE)
+			- (flash->current_page * W25N01GV_BYTES_PER_PAGE + flash->next_free_column)
+			- flash->write_buffer_size;
+
+	// write_buffer hasn't been written to flash yet, but its size needs to be counted
+	// to get an accurate count for the user.
+}
+
+uint32_t get_flash_capacity(W25N01GV_Flash *flash) {
+	return (W25N01GV_NUM_PAGES - (uint32_t) flash->num_bad_blocks * W25N01GV_PAGES_PER_BLOCK) * W25N01GV_BYTES_PER_PAGE;
+}
+
+uint8_t write_reserved_flash_page(W25N01GV_Flash *flash, uint8_t page_num, uint8_t* data, uint16_t data_sz) {
+	// The key/value store owns the block
+	if (flash->kv_store_active)
+		return 1;
+
+	wait_for_async_flash_write(flash);  // Don't interrupt an asynchronous write or erase
+
+	// Write to the nth page of the last block of flash
+	unlock_flash(flash);
+	write_bytes_to_page(flash, data, data_sz,
+			W25N01GV_RESERVED_BLOCK * W25N01GV_PAGES_PER_BLOCK + page_num, 0, NULL);
+	lock_flash(flash);
+
+	return flash->last_write_failure_status;
+}
+
+void read_reserved_flash_page(W25N01GV_Flash *flash, uint8_t page_num, uint8_t* buffer, uint16_t buffer_sz) {
+	wait_for_async_flash_write(flash);  // Don't interrupt an asynchronous write or erase
+
+	// Grab the nth page of the last block of flash
+	read_bytes_from_page(flash, buffer, buffer_sz,
+			W25N01GV_RESERVED_BLOCK * W25N01GV_PAGES_PER_BLOCK + page_num, 0);
+}
+
+uint8_t erase_reserved_flash_pages(W25N01GV_Flash *flash) {
+	// The key/value store owns the block
+	if (flash->kv_store_active)
+		return 1;
+
+	wait_for_async_flash_write(flash);  // Don't interrupt an asynchronous write or erase
+
+	// Erase the last block only
+	unlock_flash(flash);
+	erase_block(flash, W25N01GV_RESERVED_BLOCK * W25N01GV_PAGES_PER_BLOCK);
+	lock_flash(flash);
+	return flash->last_erase_failure_status;
+}
+
+void init_flash_kv_store(W25N01GV_KV_Store *store, W25N01GV_Flash *flash) {
+	uint8_t page_data[W25N01GV_BYTES_PER_PAGE];
+
+	store->flash = flash;
+	store->num_compactions = 0;
+	clear_kv_index(store);
+	flash->kv_store_active = 1;
+
+	wait_for_async_flash_write(flash);  // Don't interrupt an asynchronous write or erase
+
+	// The store is in the block with the newest committed compaction. A store
+	// that was never compacted, or is from before commit records, is in the reserved block.
+	uint16_t reserved_generation, alt_generation;
+	uint8_t reserved_committed = read_kv_commit_record(flash, W25N01GV_RESERVED_BLOCK, &reserved_generation);
+	uint8_t alt_committed = read_kv_commit_record(flash, W25N01GV_KV_ALT_BLOCK, &alt_generation);
+
+	store->block = W25N01GV_RESERVED_BLOCK;
+	store->generation = reserved_committed ? reserved_generation : 0;
+	if (alt_committed && (!reserved_committed || (int16_t) (alt_generation - reserved_generation) > 0)) {
+		store->block = W25N01GV_KV_ALT_BLOCK;
+		store->generation = alt_generation;
+	}
+
+	// Page 0 has the values from the last compaction, packed back to back
+	read_bytes_from_page(flash, page_data, W25N01GV_BYTES_PER_PAGE, store->block * W25N01GV_PAGES_PER_BLOCK, 0);
+	index_kv_records(store, 0, 0, page_data, W25N01GV_BYTES_PER_PAGE);
+
+	// Then the updates after it, one record per sector, until the first erased sector.
+	// The commit record is skipped like any other key that's out of range.
+	store->next_free_sector = W25N01GV_KV_NUM_SECTORS;
+	for (uint16_t sector = W25N01GV_KV_COMMIT_SECTOR; sector < W25N01GV_KV_NUM_SECTORS; sector++) {
+		uint8_t page = sector / W25N01GV_SECTORS_PER_PAGE;
+		uint8_t *sector_data = page_data + (sector % W25N01GV_SECTORS_PER_PAGE) * W25N01GV_SECTOR_SIZE;
+		if (sector % W25N01GV_SECTORS_PER_PAGE == 0)
+			read_bytes_from_page(flash, page_data, W25N01GV_BYTES_PER_PAGE,
+					store->block * W25N01GV_PAGES_PER_BLOCK + page, 0);
+
+		// A sector is only reused if all of it is erased
+		uint8_t sector_empty = 1;
+		for (uint16_t b = 0; b < W25N01GV_SECTOR_SIZE && sector_empty; b++)
+			sector_empty = (sector_data[b] == W25N01GV_ERASED_BYTE);
+
+		if (sector_empty) {
+			store->next_free_sector = sector;
+			break;
+		}
+
+		index_kv_records(store, page, (sector % W25N01GV_SECTORS_PER_PAGE) * W25N01GV_SECTOR_SIZE,
+				sector_data, W25N01GV_SECTOR_SIZE);
+	}
+}
+
+W25N01GV_KV_Status write_flash_kv(W25N01GV_KV_Store *store, uint8_t key, uint8_t *value, uint16_t size) {
+	if (key >= W25N01GV_KV_MAX_KEYS || size == 0 || size > W25N01GV_KV_MAX_VALUE_SIZE)
+		return KV_INVALID;
+
+	return write_kv_record(store, key, value, size);
+}
+
+W25N01GV_KV_Status read_flash_kv(W25N01GV_KV_Store *store, uint8_t key, uint8_t *buffer, uint16_t buffer_sz) {
+	uint8_t record[W25N01GV_KV_RECORD_OVERHEAD + W25N01GV_KV_MAX_VALUE_SIZE];
+
+	if (key >= W25N01GV_KV_MAX_KEYS || !store->index[key].present)
+		return KV_NOT_FOUND;
+
+	W25N01GV_KV_Entry *entry = &store->index[key];
+	if (buffer_sz < entry->size)
+		return KV_INVALID;
+
+	wait_for_async_flash_write(store->flash);  // Don't interrupt an asynchronous write or erase
+	read_bytes_from_page(store->flash, record, W25N01GV_KV_RECORD_OVERHEAD + entry->size,
+			store->block * W25N01GV_PAGES_PER_BLOCK + entry->page, entry->column);
+
+	uint16_t crc = W25N01GV_PACK_2_BYTES_TO_UINT16(record+W25N01GV_KV_HEADER_SIZE+entry->size);
+	if (record[1] != key || crc != update_crc16(0xFFFF, record, W25N01GV_KV_HEADER_SIZE + entry->size))
+		return KV_CORRUPTED;
+
+	for (uint16_t i = 0; i < entry->size; i++)
+		buffer[i] = record[W25N01GV_KV_HEADER_SIZE + i];
+
+	return KV_OK;
+}
+
+uint16_t get_flash_kv_size(W25N01GV_KV_Store *store, uint8_t key) {
+	if (key >= W25N01GV_KV_MAX_KEYS || !store->index[key].present)
+		return 0;
+	return store->index[key].size;
+}
+
+W25N01GV_KV_Status delete_flash_kv(W25N01GV_KV_Store *store, uint8_t key) {
+	if (key >= W25N01GV_KV_MAX_KEYS || !store->index[key].present)
+		return KV_NOT_FOUND;
+
+	return write_kv_record(store, key, NULL, 0);
+}
+
+W25N01GV_KV_Status compact_flash_kv_store(W25N01GV_KV_Store *store) {
+	W25N01GV_Flash *flash = store->flash;
+	uint8_t page_data[W25N01GV_BYTES_PER_PAGE];
+	uint8_t check_data[W25N01GV_SECTOR_SIZE];
+	uint8_t commit[W25N01GV_KV_COMMIT_RECORD_SIZE];
+	uint16_t num_bytes = 0;
+
+	wait_for_async_flash_write(flash);  // Don't interrupt an asynchronous write or erase
+
+	// Gather the current values. They always fit in one page.
+	for (uint8_t key = 0; key < W25N01GV_KV_MAX_KEYS; key++) {
+		W25N01GV_KV_Entry *entry = &store->index[key];
+		if (!entry->present)
+			continue;
+
+		uint8_t *record = page_data + num_bytes;
+		read_bytes_from_page(flash, record, W25N01GV_KV_RECORD_OVERHEAD + entry->size,
+				store->block * W25N01GV_PAGES_PER_BLOCK + entry->page, entry->column);
+
+		uint16_t crc = W25N01GV_PACK_2_BYTES_TO_UINT16(record+W25N01GV_KV_HEADER_SIZE+entry->size);
+		if (crc == update_crc16(0xFFFF, record, W25N01GV_KV_HEADER_SIZE + entry->size))
+			num_bytes += W25N01GV_KV_RECORD_OVERHEAD + entry->size;
+	}
+	for (uint16_t b = num_bytes; b < W25N01GV_BYTES_PER_PAGE; b++)
+		page_data[b] = W25N01GV_ERASED_BYTE;
+
+	// The values go to the other block, so the current one still has all of them
+	// until the new copy is committed. If the other block is bad, there's no choice
+	// but to rewrite the current one.
+	uint16_t new_block = (store->block == W25N01GV_RESERVED_BLOCK) ? W25N01GV_KV_ALT_BLOCK : W25N01GV_RESERVED_BLOCK;
+	if (block_is_bad(flash, new_block))
+		new_block = store->block;
+	uint32_t new_page = (uint32_t) new_block * W25N01GV_PAGES_PER_BLOCK;
+
+	unlock_flash(flash);
+	erase_block(flash, new_page);
+	uint8_t failed = flash->last_erase_failure_status;
+
+	// Page 0 is written even if it's empty, so a sector of it is never programmed twice
+	if (!failed) {
+		write_bytes_to_page(flash, page_data, W25N01GV_BYTES_PER_PAGE, new_page, 0, NULL);
+		failed = flash->last_write_failure_status;
+	}
+
+	// Only commit to values that read back the same
+	for (uint16_t column = 0; column < W25N01GV_BYTES_PER_PAGE && !failed; column += W25N01GV_SECTOR_SIZE) {
+		read_bytes_from_page(flash, check_data, W25N01GV_SECTOR_SIZE, new_page, column);
+		for (uint16_t b = 0; b < W25N01GV_SECTOR_SIZE && !failed; b++)
+			failed = (check_data[b] != page_data[column + b]);
+	}
+
+	uint16_t generation = store->generation + 1;
+	if (!failed) {
+		uint8_t generation_8bit_array[2] = W25N01GV_UNPACK_UINT16_TO_2_BYTES(generation);
+		commit[0] = W25N01GV_KV_RECORD_MARKER;
+		commit[1] = W25N01GV_KV_COMMIT_KEY;
+		commit[2] = 0;
+		commit[3] = 2;
+		commit[4] = generation_8bit_array[0];
+		commit[5] = generation_8bit_array[1];
+
+		uint16_t crc = update_crc16(0xFFFF, commit, W25N01GV_KV_HEADER_SIZE+2);
+		uint8_t crc_8bit_array[2] = W25N01GV_UNPACK_UINT16_TO_2_BYTES(crc);
+		commit[6] = crc_8bit_array[0];
+		commit[7] = crc_8bit_array[1];
+
+		write_bytes_to_page(flash, commit, W25N01GV_KV_COMMIT_RECORD_SIZE,
+				new_page + W25N01GV_KV_COMMIT_SECTOR / W25N01GV_SECTORS_PER_PAGE,
+				(W25N01GV_KV_COMMIT_SECTOR % W25N01GV_SECTORS_PER_PAGE) * W25N01GV_SECTOR_SIZE, NULL);
+		failed = flash->last_write_failure_status;
+	}
+
+	// init_flash_kv_store() picks the newer block until the old one is erased.
+	// If the erase fails, the next compaction tries again.
+	if (!failed && new_block != store->block)
+		erase_block(flash, (uint32_t) store->block * W25N01GV_PAGES_PER_BLOCK);
+	if (!flash->async_write_enabled)
+		lock_flash(flash);
+
+	// The current block wasn't touched, so its index still holds
+	if (failed && new_block != store->block)
+		return KV_WRITE_FAILED;
+
+	store->block = new_block;
+	store->generation = generation;
+	clear_kv_index(store);
+	index_kv_records(store, 0, 0, page_data, W25N01GV_BYTES_PER_PAGE);
+	store->next_free_sector = W25N01GV_KV_FIRST_APPEND_SECTOR;
+	store->num_compactions++;
+
+	return failed ? KV_WRITE_FAILED : KV_OK;
+}
+
+uint16_t scan_bad_blocks(W25N01GV_Flash *flash, uint16_t *bad_blocks) {
+	start_flash_bad_block_scan(flash, bad_blocks);
+	while (poll_flash_block_op(flash))
+		wait_poll_interval(flash);
+
+	return flash->block_op_result;
+}
+
+void enable_async_flash_write(W25N01GV_Flash *flash, W25N01GV_Write_Callback callback) {
+	flash->async_callback = callback;
+
+	if (flash->async_write_enabled)
+		return;
+
+	// write_to_flash() normally unlocks and locks flash around every call.
+	// In async mode it stays unlocked so nothing has to wait for the pipeline.
+	unlock_flash(flash);
+	flash->async_state = ASYNC_WRITE_IDLE;
+	flash->async_write_enabled = 1;
+}
+
+uint16_t disable_async_flash_write(W25N01GV_Flash *flash) {
+	if (!flash->async_write_enabled)
+		return flash->async_write_failures;
+
+	wait_for_async_flash_write(flash);
+	flash->async_write_enabled = 0;
+	lock_flash(flash);
+
+	return flash->async_write_failures;
+}
+
+W25N01GV_Async_State poll_async_flash_write(W25N01GV_Flash *flash) {
+	update_async_state(flash);
+
+	// Use the idle time to erase ahead of the write pointer, one block per poll
+	if (flash->async_state == ASYNC_WRITE_IDLE && flash->erase_ahead_enabled
+			&& count_erased_blocks_ahead(flash) < W25N01GV_ERASE_AHEAD_BLOCKS)
+		start_erase_ahead(flash);
+
+	return flash->async_state;
+}
+
+void async_flash_write_dma_complete(W25N01GV_Flash *flash) {
+	if (flash->async_state == ASYNC_WRITE_LOADING)
+		finish_async_load(flash);
+}
 
-	// Debug code
-	// TODO: delete in final release
-	/*
-	if (!(flash->next_free_column == 0 || flash->next_free_column == 512
-			|| flash->next_free_column == 1024 || flash->next_free_column == 1536
-			|| flash->next_free_column == 2048)) {
-		asm("nop");
+void wait_for_async_flash_write(W25N01GV_Flash *flash) {
+	if (flash->async_state == ASYNC_WRITE_IDLE)
+		return;
+
+	if (flash->async_state == ASYNC_WRITE_ERASING) {
+		wait_for_operation(flash, W25N01GV_BLOCK_ERASE_MAX_TIME_MS * 1000000);
+		finish_erase_ahead(flash);
+		return;
 	}
-	*/
 
-	// Debug code
-	// TODO: delete in final release
-	/*
-	if (num_bytes % 512 != 0) {
-		asm("nop");
+	while (update_async_state(flash) == ASYNC_WRITE_LOADING);
+
+	if (flash->async_state == ASYNC_WRITE_PROGRAMMING) {
+		wait_for_operation(flash, W25N01GV_PAGE_PROGRAM_MAX_TIME_US * 1000);
+		finish_async_program(flash);
 	}
-	*/
+}
 
-	uint32_t write_counter = 0;  // Track how many bytes have been written so far
-	uint16_t write_failures = 0;  // Track write errors
+uint16_t start_flash_page_write(W25N01GV_Flash *flash, uint8_t *data, uint16_t num_bytes) {
+	// Only one program can be in flight at a time
+	wait_for_async_flash_write(flash);
 
-	while (write_counter < num_bytes) {
+	// Don't write past the end of the current page
+	if (flash->next_free_column >= W25N01GV_BYTES_PER_PAGE)
+		return 0;
+	if (num_bytes > W25N01GV_BYTES_PER_PAGE - flash->next_free_column)
+		num_bytes = W25N01GV_BYTES_PER_PAGE - flash->next_free_column;
+	if (num_bytes == 0)
+		return 0;
 
-		// If there's not enough space on the page, only write as much as will fit
-		uint16_t num_bytes_to_write_on_page = num_bytes - write_counter;
-		if (num_bytes_to_write_on_page > W25N01GV_BYTES_PER_PAGE - flash->next_free_column)
-			num_bytes_to_write_on_page = W25N01GV_BYTES_PER_PAGE - flash->next_free_column;
+	// Locked again by finish_async_program() once programming is done
+	if (!flash->async_write_enabled)
+		unlock_flash(flash);
 
-		// Write the array (or a part of it if it's too long for one page) to flash
-		write_bytes_to_page(flash, data + write_counter, num_bytes_to_write_on_page,
-				flash->current_page, flash->next_free_column);
+	erase_ahead_of_write_ptr(flash);
+	update_checkpoint(flash);
+	make_page_metadata(flash, data, num_bytes, num_bytes, flash->async_metadata);
 
-		// Check if the page was written to correctly
-		if (flash->last_write_failure_status)
-			write_failures++;
+	flash->async_data = data;
+	flash->async_num_bytes = num_bytes;
+	flash->async_page = flash->current_page;
+	flash->async_column = flash->next_free_column;
+	advance_write_ptr(flash, num_bytes);
 
-		write_counter += num_bytes_to_write_on_page;
+	enable_write(flash);
+	write_page_to_buffer(flash, data, num_bytes, flash->async_column);
 
-		// If there's room left over at the end of the page,
-		// increment the column counter and leave the page counter the same
-		if (flash->next_free_column + num_bytes_to_write_on_page < W25N01GV_BYTES_PER_PAGE)
-			flash->next_free_column += num_bytes_to_write_on_page;
+	// Same as the end of an async DMA load: program execute without waiting.
+	// The page is tracked as an async write from here on.
+	finish_async_load(flash);
 
-		// If it fills the current page and runs out of pages, set the column counter over
-		// the limit so it can't write again (will make get_bytes_remaining() return 0)
-		else if (flash->current_page == W25N01GV_NUM_PAGES-1)
-			flash->next_free_column = W25N01GV_BYTES_PER_PAGE;
+	return num_bytes;
+}
 
-		// Otherwise if there's more pages left, bring the address counter to the next page
-		// and reset the column counter
-		else {
-			flash->next_free_column = 0;
-			flash->current_page++;  // This function can assume it won't run out of pages
-		}
-	}
+void set_flash_record_tag(W25N01GV_Flash *flash, uint8_t tag) {
+	if (tag < W25N01GV_TAG_NONE)
+		flash->record_tag = tag;
+}
 
-	// Debug code
-	// TODO: delete in final release
-	/*
-	if (!(flash->next_free_column == 0 || flash->next_free_column == 512
-			|| flash->next_free_column == 1024 || flash->next_free_column == 1536
-			|| flash->next_free_column == 2048)) {
-		asm("nop");
+uint8_t read_flash_page_metadata(W25N01GV_Flash *flash, uint16_t page_adr, W25N01GV_Sector_Metadata *metadata) {
+	uint8_t spare[W25N01GV_SECTORS_PER_PAGE * W25N01GV_SPARE_BYTES_PER_SECTOR];
+	uint8_t num_sectors = 0;
+
+	wait_for_async_flash_write(flash);  // Don't interrupt an asynchronous write
+
+	read_bytes_from_page(flash, spare, sizeof(spare), page_adr, W25N01GV_SPARE_AREA_COLUMN);
+
+	for (uint8_t sector = 0; sector < W25N01GV_SECTORS_PER_PAGE; sector++) {
+		parse_sector_metadata(spare + sector * W25N01GV_SPARE_BYTES_PER_SECTOR, metadata + sector);
+		if (metadata[sector].tag != W25N01GV_TAG_NONE)
+			num_sectors++;
 	}
-	*/
 
-	return write_failures;
+	return num_sectors;
 }
 
-uint16_t write_to_flash(W25N01GV_Flash *flash, uint8_t *data, uint32_t num_bytes) {
+uint8_t check_flash_sector_crc(W25N01GV_Sector_Metadata *metadata, uint8_t *data) {
+	if (metadata->tag == W25N01GV_TAG_NONE)
+		return 0;
 
-	// If there's not enough space, truncate the data
-	uint32_t bytes_remaining = get_bytes_remaining(flash);
-	if (num_bytes > bytes_remaining)
-		num_bytes = bytes_remaining;
+	uint16_t tag_and_size = ((uint16_t) metadata->tag << 12) | metadata->valid_bytes;
+	if (metadata->section_end)
+		tag_and_size |= W25N01GV_METADATA_SECTION_END;
+	uint8_t tag_and_size_8bit_array[2] = W25N01GV_UNPACK_UINT16_TO_2_BYTES(tag_and_size);
+	uint8_t sequence_8bit_array[2] = W25N01GV_UNPACK_UINT16_TO_2_BYTES(metadata->sequence);
+	uint8_t fields[4] = {tag_and_size_8bit_array[0], tag_and_size_8bit_array[1],
+			sequence_8bit_array[0], sequence_8bit_array[1]};
 
-	uint16_t write_failures = 0;  // Track write failures
+	return sector_crc(data, W25N01GV_SECTOR_SIZE, fields) == metadata->crc;
+}
 
-	// Copy the front end into the write_buffer
-	uint8_t buffer_full = 0;  // Used to decide whether or not to write buffer contents to flash
+uint16_t update_flash_crc16(uint16_t crc, const uint8_t *data, uint16_t num_bytes) {
+	return update_crc16(crc, data, num_bytes);
+}
 
-	// If write_buffer is not empty and data fills it completely
-	if (flash->write_buffer_size > 0 && flash->write_buffer_size + num_bytes >= W25N01GV_SECTOR_SIZE) {
-		// Copy data into write_buffer until it's full,
-		uint16_t num_bytes_to_copy = W25N01GV_SECTOR_SIZE - flash->write_buffer_size;
-		for (uint16_t i = 0; i < num_bytes_to_copy; ++i) {
-			flash->write_buffer[flash->write_buffer_size + i] = data[i];
-		}
-		flash->write_buffer_size = W25N01GV_SECTOR_SIZE;
-		buffer_full = 1;
+void set_flash_time_source(W25N01GV_Flash *flash, W25N01GV_Time_Callback time_source) {
+	flash->time_source = time_source;
+}
 
-		// Adjust data and num_bytes to reflect the front end being chopped off
-		data += num_bytes_to_copy;
-		num_bytes -= num_bytes_to_copy;
-	}
-	// If data doesn't fill write_buffer completely
-	else if (flash->write_buffer_size + num_bytes < W25N01GV_SECTOR_SIZE) {
-		// Copy all data into write_buffer and return
-		for (uint16_t i = 0; i < num_bytes; ++i) {
-			flash->write_buffer[flash->write_buffer_size + i] = data[i];
-		}
-		flash->write_buffer_size += num_bytes;
+uint8_t read_flash_page_time(W25N01GV_Flash *flash, uint16_t page_adr, uint32_t *time) {
+	uint8_t spare[W25N01GV_SPARE_AREA_SIZE];
 
-		return 0;
-	}
+	wait_for_async_flash_write(flash);  // Don't interrupt an asynchronous write
 
-	// In the case where write_buffer is empty and data would fill it completely,
-	// write_buffer isn't used and the write is handled separately.
+	read_bytes_from_page(flash, spare, sizeof(spare), page_adr, W25N01GV_SPARE_AREA_COLUMN);
 
-	// At this point, data and num_bytes should be adjusted so it starts at a multiple address.
-	// Use integer division to find out where the last unit is.
-	// If there are less than W25N01GV_SECTOR_SIZE, then end_size == num_bytes and end_arr == data,
-	// so anything in data that doesn't get written in this function will get stored in write_buffer
-	uint32_t new_data_size = (num_bytes / W25N01GV_SECTOR_SIZE) * W25N01GV_SECTOR_SIZE;
-	uint16_t end_size = num_bytes % W25N01GV_SECTOR_SIZE;
-	uint8_t* end_arr = data + new_data_size;
+	uint8_t *high = spare + W25N01GV_PAGE_TIME_HIGH_SECTOR * W25N01GV_SPARE_BYTES_PER_SECTOR + W25N01GV_PAGE_TIME_OFFSET;
+	uint8_t *low = spare + W25N01GV_PAGE_TIME_LOW_SECTOR * W25N01GV_SPARE_BYTES_PER_SECTOR + W25N01GV_PAGE_TIME_OFFSET;
+	uint8_t *check = spare + W25N01GV_PAGE_TIME_CHECK_SECTOR * W25N01GV_SPARE_BYTES_PER_SECTOR + W25N01GV_PAGE_TIME_OFFSET;
+	uint8_t time_8bit_array[4] = {high[0], high[1], low[0], low[1]};
 
-	unlock_flash(flash);
+	*time = ((uint32_t) W25N01GV_PACK_2_BYTES_TO_UINT16(high) << 16) | W25N01GV_PACK_2_BYTES_TO_UINT16(low);
+	return update_crc16(0xFFFF, time_8bit_array, 4) == W25N01GV_PACK_2_BYTES_TO_UINT16(check);
+}
 
-	// If the buffer got filled, write the buffer to flash using write_to_flash_contiguous()
-	if (buffer_full) {
-		write_failures += write_to_flash_contiguous(flash, flash->write_buffer, W25N01GV_SECTOR_SIZE);
-		flash->write_buffer_size = 0;
-	}
+uint8_t seek_flash_to_time(W25N01GV_Flash *flash, uint32_t time) {
+	uint32_t oldest_time, page_time;
 
-	// Write the processed array into flash using write_to_flash_contiguous()
-	if (new_data_size > 0) {
-		write_failures += write_to_flash_contiguous(flash, data, new_data_size);
-	}
+	reset_flash_read_pointer(flash);
 
-	lock_flash(flash);
+	// The oldest timestamp is the first one in the oldest block
+	uint32_t first_page = next_good_log_page(flash, flash->next_page_to_read);
+	if (first_page >= W25N01GV_NUM_PAGES)
+		return 0;
+	uint16_t first_block = first_page / W25N01GV_PAGES_PER_BLOCK;
+	uint16_t block_end_page = log_block_end_page(flash, first_block);
+	if (next_stamped_page(flash, first_page, block_end_page, &oldest_time) >= block_end_page
+			|| time - oldest_time >= 0x80000000)  // Before the oldest page
+		return 0;
 
-	// Copy the remaining data, if any, into write_buffer
-	for (uint16_t i = 0; i < end_size; ++i) {
-		flash->write_buffer[i] = end_arr[i];
+	// Times are compared relative to the oldest page, so the clock can wrap around
+	// once. Pages without a timestamp are skipped: each check uses the first
+	// stamped one at or after the middle of the range, or shrinks the range if
+	// there isn't one in it.
+
+	// Find the last block whose first stamped page is stamped by then...
+	uint16_t low = 0;
+	uint16_t high = count_good_log_blocks(flash, first_block) - 1;
+	while (low < high) {
+		uint16_t mid = (low + high + 1) / 2;
+		uint16_t n = mid;
+		for (; n <= high; n++) {
+			uint16_t block = nth_good_log_block(flash, first_block, n);
+			block_end_page = log_block_end_page(flash, block);
+			if (next_stamped_page(flash, block * W25N01GV_PAGES_PER_BLOCK, block_end_page, &page_time) < block_end_page)
+				break;
+		}
+		if (n <= high && page_time - oldest_time <= time - oldest_time)
+			low = n;
+		else
+			high = mid - 1;
 	}
-	flash->write_buffer_size = end_size;
+	uint16_t block = nth_good_log_block(flash, first_block, low);
+
+	// ...then the last stamped page in it that's stamped by then
+	uint16_t first_block_page = block * W25N01GV_PAGES_PER_BLOCK;
+	block_end_page = log_block_end_page(flash, block);
+	low = next_stamped_page(flash, first_block_page, block_end_page, &page_time) - first_block_page;
+	high = block_end_page - first_block_page - 1;
+	while (low < high) {
+		uint16_t mid = (low + high + 1) / 2;
+		uint16_t page_adr = next_stamped_page(flash, first_block_page + mid, first_block_page + high + 1, &page_time);
+		if (page_adr <= first_block_page + high && page_time - oldest_time <= time - oldest_time)
+			low = page_adr - first_block_page;
+		else
+			high = mid - 1;
+	}
+
+	flash->next_page_to_read = first_block_page + low;
+	flash->next_sector_to_read = 0;
+	return 1;
+}
+
+void add_test_delimiter(W25N01GV_Flash *flash) {
+	uint8_t record_tag = flash->record_tag;
+
+	// The last sector of the test is already on flash, so mark the end with an empty one
+	if (flash->write_buffer_size == 0)
+		set_flash_record_tag(flash, W25N01GV_TAG_DELIMITER);
+
+	flush_write_buffer(flash, 1);
+	set_flash_record_tag(flash, record_tag);
+}
+
+uint16_t write_flash_padding(W25N01GV_Flash *flash) {
+	uint16_t write_failures = finish_flash_write(flash);
+
+	// Only this sector's metadata is made with the padding tag
+	uint8_t record_tag = flash->record_tag;
+	flash->record_tag = W25N01GV_TAG_PADDING;
+	write_failures += flush_write_buffer(flash, 0);
+	flash->record_tag = record_tag;
 
 	return write_failures;
+}
 
+/**
+ * Packs a statistic into 2 big-endian bytes, reporting anything too big as 65535.
+ *
+ * @param buffer     <uint8_t*>           Where to pack the value
+ * @param value      <uint32_t>           Value to pack
+ * @retval The byte after the packed value
+ */
+static uint8_t *pack_stat_uint16(uint8_t *buffer, uint32_t value) {
+	uint16_t packed = (value > UINT16_MAX) ? UINT16_MAX : (uint16_t) value;
+	buffer[0] = packed >> 8;
+	buffer[1] = packed & 0xFF;
+	return buffer + 2;
 }
 
-uint16_t finish_flash_write(W25N01GV_Flash *flash) {
-	// Ignore this function if there's nothing in the write buffer
-	if (flash->write_buffer_size == 0) {
+void enable_flash_stats(W25N01GV_Flash *flash, W25N01GV_Stats *stats) {
+	uint8_t *stats_bytes = (uint8_t *) stats;
+	for (uint32_t i = 0; i < sizeof(W25N01GV_Stats); i++)
+		stats_bytes[i] = 0;
+	stats->page_load.min_cycles = UINT32_MAX;
+	stats->program.min_cycles = UINT32_MAX;
+	stats->erase.min_cycles = UINT32_MAX;
+
+	enable_cycle_counter();  // init_flash() turned it on, but something else may have turned it off
+	flash->timed_op = W25N01GV_OP_NONE;
+	flash->stats = stats;
+}
+
+void disable_flash_stats(W25N01GV_Flash *flash) {
+	flash->stats = NULL;
+	flash->timed_op = W25N01GV_OP_NONE;
+}
+
+uint16_t pack_flash_stats(W25N01GV_Flash *flash, uint8_t *buffer) {
+	W25N01GV_Stats *stats = flash->stats;
+	if (stats == NULL)
 		return 0;
+
+	uint32_t cycles_per_us = SystemCoreClock / 1000000;
+	W25N01GV_Latency *latencies[3] = { &stats->page_load, &stats->program, &stats->erase };
+	uint8_t *next = buffer;
+
+	for (uint8_t i = 0; i < 3; i++) {
+		uint64_t average = latencies[i]->count ? latencies[i]->total_cycles / latencies[i]->count : 0;
+		next = pack_stat_uint16(next, (uint32_t) (average / cycles_per_us));
+		next = pack_stat_uint16(next, latencies[i]->max_cycles / cycles_per_us);
 	}
 
-	// Fill the rest of write_buffer with 0x00 to prevent
-	// any future accidental calls to write_to_flash() don't
-	// mess up the 512-byte framing
-	while (flash->write_buffer_size < W25N01GV_SECTOR_SIZE)
-		flash->write_buffer[flash->write_buffer_size++] = 0x00;
+	*next++ = (stats->busy_polls >> 24) & 0xFF;
+	*next++ = (stats->busy_polls >> 16) & 0xFF;
+	*next++ = (stats->busy_polls >> 8) & 0xFF;
+	*next++ = stats->busy_polls & 0xFF;
+
+	next = pack_stat_uint16(next, stats->ECC_corrections);
+	next = pack_stat_uint16(next, stats->ECC_failures);
+	next = pack_stat_uint16(next, stats->program_failures);
+	next = pack_stat_uint16(next, stats->erase_failures);
+
+	// Blocks that failed are worse than blocks that needed corrections
+	uint16_t worst_block = 0;
+	for (uint16_t block = 1; block < W25N01GV_NUM_BLOCKS; block++) {
+		if (stats->block_failures[block] > stats->block_failures[worst_block]
+				|| (stats->block_failures[block] == stats->block_failures[worst_block]
+						&& stats->block_ECC_corrections[block] > stats->block_ECC_corrections[worst_block]))
+			worst_block = block;
+	}
+	next = pack_stat_uint16(next, worst_block);
+	*next++ = stats->block_failures[worst_block];
 
-	// If there's not enough space, truncate the data.
-	// This should never happen, but just in case.
-	uint32_t bytes_remaining = get_bytes_remaining(flash);
-	if (flash->write_buffer_size > bytes_remaining)
-		flash->write_buffer_size = bytes_remaining;
+	return W25N01GV_STATS_PACKED_SIZE;
+}
 
-	unlock_flash(flash);
+/**
+ * Checks if a block is one of the log's blocks before the write pointer's
+ * block. Those are fully written, and stay the same until erase-ahead mode
+ * gets to them in a circular log.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param block      <uint16_t>           Block to check
+ * @retval 1 if the block is full, 0 if not
+ */
+static uint8_t block_is_full(W25N01GV_Flash *flash, uint16_t block) {
+	uint16_t write_block = flash->current_page / W25N01GV_PAGES_PER_BLOCK;
+
+	if (flash->circular_log_enabled) {
+		// The log starts at the first block that isn't erased ahead of the write pointer
+		uint16_t first_block = flash->erase_ahead_block % W25N01GV_NUM_DATA_BLOCKS;
+		return (block + W25N01GV_NUM_DATA_BLOCKS - first_block) % W25N01GV_NUM_DATA_BLOCKS
+				< (write_block + W25N01GV_NUM_DATA_BLOCKS - first_block) % W25N01GV_NUM_DATA_BLOCKS;
+	}
+	return block < write_block;
+}
 
-	uint16_t write_failures = write_to_flash_contiguous(flash, flash->write_buffer,
-			flash->write_buffer_size);
-	flash->write_buffer_size = 0;
+/**
+ * Checks if a block is already replaced in the BBM look up table.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param block      <uint16_t>           Block to look for
+ * @retval 1 if the table has an entry for it, 0 if not
+ */
+static uint8_t block_is_remapped(W25N01GV_Flash *flash, uint16_t block) {
+	uint16_t logical_block_addresses[W25N01GV_BBM_LUT_ENTRIES];
+	uint16_t physical_block_addresses[W25N01GV_BBM_LUT_ENTRIES];
+
+	read_BBM_look_up_table(flash, logical_block_addresses, physical_block_addresses);
+	for (uint8_t i = 0; i < W25N01GV_BBM_LUT_ENTRIES; i++) {
+		if ((logical_block_addresses[i] & W25N01GV_BBM_LUT_ENABLE)
+				&& (logical_block_addresses[i] & W25N01GV_BBM_LUT_BLOCK_MASK) == block)
+			return 1;
+	}
+	return 0;
+}
 
-	lock_flash(flash);
+/**
+ * Finds a block the scrub can copy a block to. The good block after the
+ * write pointer's block has to stay erased (see find_write_ptr()), so it's
+ * never used. A linear log takes the last good block of flash. A circular
+ * log only has the blocks erased ahead of the write pointer to spare, and
+ * takes the last one, so the block after it still has data and a partial
+ * copy can't look like the write pointer to find_circular_write_ptr().
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @retval The block, or W25N01GV_NUM_BLOCKS if there isn't one
+ */
+static uint16_t find_scrub_spare_block(W25N01GV_Flash *flash) {
+	uint16_t write_block = flash->current_page / W25N01GV_PAGES_PER_BLOCK;
+	uint16_t keep_block, block;
 
-	return write_failures;
+	if (flash->circular_log_enabled) {
+		keep_block = next_good_block_ahead(flash, write_block+1);
+		block = flash->erase_ahead_block;
+	}
+	else {
+		keep_block = next_good_block(flash, write_block+1);
+		block = W25N01GV_NUM_DATA_BLOCKS;
+	}
+
+	while (block > keep_block+1) {
+		block--;
+		if (!block_is_bad(flash, block % W25N01GV_NUM_DATA_BLOCKS))
+			return block % W25N01GV_NUM_DATA_BLOCKS;
+	}
+	return W25N01GV_NUM_BLOCKS;
 }
 
-void reset_flash_read_pointer(W25N01GV_Flash *flash) {
-	flash->next_page_to_read = 0;
+/**
+ * Marks or unmarks a spare block as bad in the RAM table only, so the write
+ * pointer and erase-ahead mode leave it alone while the scrub copies to it.
+ * Once it's in the BBM look up table, build_bad_block_table() finds it there.
+ *
+ * @param flash      <W25N01GV_Flash*>    Struct used to store flash pins and addresses
+ * @param block      <uint16_t>           Spare block
+ * @param in_use     <uint8_t>            1 to take the block, 0 to give it back
+ */
+static void set_scrub_spare_block(W25N01GV_Flash *flash, uint16_t block, uint8_t in_use) {
+	if (in_use) {
+		flash->bad_blocks[block / 8] |= 1 << (block % 8);
+		flash->num_bad_blocks++;
+	}
+	else {
+		flash->bad_blocks[block / 8] &= ~(1 << (block % 8));
+		flash->num_bad_blocks--;
+	}
+	count_bad_blocks_ahead(flash);
 }
 
-void read_next_2KB_from_flash(W25N01GV_Flash *flash, uint8_t *buffer) {
-	read_bytes_from_page(flash, buffer,	W25N01GV_BYTES_PER_PAGE, flash->next_page_to_read, 0);
-	flash->next_page_to_read++;  // Increment the page read counter
+/**
+ * Drops the relocation in progress. A spare block that was already erased
+ * is erased again and given back, or retired if that fails.
+ *
+ * ASSUMPTIONS:
+ * Flash is unlocked and not busy.
+ *
+ * @param scrub      <W25N01GV_Scrub*>    Struct used to store the scrub state and results
+ */
+static void drop_scrub_relocation(W25N01GV_Scrub *scrub) {
+	W25N01GV_Flash *flash = scrub->flash;
+	uint16_t block = scrub->relocate_dst;
 
-	get_ECC_status(flash);
+	if (block < W25N01GV_NUM_BLOCKS) {
+		erase_block(flash, block * W25N01GV_PAGES_PER_BLOCK);
+		set_scrub_spare_block(flash, block, 0);
+		if (flash->last_erase_failure_status)
+			mark_bad_block(flash, block);
+	}
+
+	scrub->relocate_src = W25N01GV_NUM_BLOCKS;
+	scrub->relocate_dst = W25N01GV_NUM_BLOCKS;
 }
 
-uint16_t erase_flash(W25N01GV_Flash *flash) {
-	uint16_t erase_failures = 0;
+/**
+ * Does the next step of moving scrub->relocate_src: erasing a spare block,
+ * copying one page to it, or putting it in the BBM look up table in place of
+ * the block once every page is copied. A spare block that fails to erase or
+ * program is retired, and the next step starts over with another one.
+ *
+ * ASSUMPTIONS:
+ * Flash is unlocked and not busy.
+ *
+ * @param scrub      <W25N01GV_Scrub*>    Struct used to store the scrub state and results
+ */
+static void relocate_scrub_block(W25N01GV_Scrub *scrub) {
+	W25N01GV_Flash *flash = scrub->flash;
+	uint16_t src_block = scrub->relocate_src;
+	uint16_t dst_block = scrub->relocate_dst;
+
+	// In a circular log, erase-ahead mode can get to the block in the meantime
+	if (!block_is_full(flash, src_block)) {
+		drop_scrub_relocation(scrub);
+		return;
+	}
 
-	unlock_flash(flash);
+	if (dst_block >= W25N01GV_NUM_BLOCKS) {
+		dst_block = find_scrub_spare_block(flash);
+		if (dst_block >= W25N01GV_NUM_BLOCKS || BBM_look_up_table_is_full(flash) || block_is_remapped(flash, src_block)) {
+			scrub->relocations_skipped++;
+			scrub->relocate_src = W25N01GV_NUM_BLOCKS;
+			return;
+		}
 
-	// Loop through every block to erase them one by one
-	// Ignore the last block, which is reserved for pseudo-eeprom functionality
-	for (uint16_t block_count = 0; block_count < W25N01GV_NUM_BLOCKS-1; block_count++) {
-		erase_block(flash, block_count * W25N01GV_PAGES_PER_BLOCK);  // Address of first page in each block
+		set_scrub_spare_block(flash, dst_block, 1);
+		erase_block(flash, dst_block * W25N01GV_PAGES_PER_BLOCK);
+		if (flash->last_erase_failure_status) {
+			set_scrub_spare_block(flash, dst_block, 0);
+			mark_bad_block(flash, dst_block);
+			return;
+		}
 
-		// Check if the erase failed
-		if (flash->last_erase_failure_status)
-			erase_failures++;
+		scrub->relocate_dst = dst_block;
+		scrub->relocate_pages_copied = 0;
+		return;
 	}
 
-	lock_flash(flash);
+	if (scrub->relocate_pages_copied < W25N01GV_PAGES_PER_BLOCK) {
+		uint16_t page = scrub->relocate_pages_copied;
+		if (copy_page(flash, src_block * W25N01GV_PAGES_PER_BLOCK + page, dst_block * W25N01GV_PAGES_PER_BLOCK + page,
+				W25N01GV_BYTES_PER_PAGE)) {
+			set_scrub_spare_block(flash, dst_block, 0);
+			mark_bad_block(flash, dst_block);
+			scrub->relocate_dst = W25N01GV_NUM_BLOCKS;
+			return;
+		}
 
-	// Reset the address pointer after erasing
-	find_write_ptr(flash);  // Don't manually set addr pointers to ensure it actually erases
-	flash->write_buffer_size = 0;
+		scrub->relocate_pages_copied++;
+		return;
+	}
 
-	return erase_failures;
+	// The spare block stays bad in the RAM table, the look up table covers it after a reset
+	swap_BBM_blocks(flash, src_block, dst_block);
+	scrub->blocks_relocated++;
+	scrub->relocate_src = W25N01GV_NUM_BLOCKS;
+	scrub->relocate_dst = W25N01GV_NUM_BLOCKS;
 }
 
-uint32_t get_bytes_remaining(W25N01GV_Flash *flash) {
-	return ((W25N01GV_NUM_BLOCKS-1) * W25N01GV_PAGES_PER_BLOCK * W25N01GV_BYTES_PER_PAGE)
-			- (flash->current_page * W25N01GV_BYTES_PER_PAGE + flash->next_free_column)
-			- flash->write_buffer_size;
+/**
+ * Loads scrub->next_page and counts its ECC status, then moves on to the
+ * next page of the log. The scrub ends at the write pointer.
+ *
+ * @param scrub      <W25N01GV_Scrub*>    Struct used to store the scrub state and results
+ */
+static void scrub_next_page(W25N01GV_Scrub *scrub) {
+	W25N01GV_Flash *flash = scrub->flash;
+	uint32_t end_page = flash->current_page + ((flash->next_free_column > 0) ? 1 : 0);
 
-	// write_buffer hasn't been written to flash yet, but its size needs to be counted
-	// to get an accurate count for the user.
-}
+	if ((flash->circular_log_enabled && scrub->next_page == next_good_log_page(flash, end_page))
+			|| (!flash->circular_log_enabled && scrub->next_page >= next_good_page(flash, end_page))) {
+		scrub->active = 0;
+		return;
+	}
 
-uint8_t write_reserved_flash_page(W25N01GV_Flash *flash, uint8_t page_num, uint8_t* data, uint16_t data_sz) {
-	// Write to the nth page of the last block of flash
-	unlock_flash(flash);
-	write_bytes_to_page(flash, data, data_sz,
-			(W25N01GV_NUM_BLOCKS-1) * W25N01GV_PAGES_PER_BLOCK + page_num, 0);
-	lock_flash(flash);
+	uint16_t page_adr = scrub->next_page;
+	uint16_t block = page_adr / W25N01GV_PAGES_PER_BLOCK;
+	load_page(flash, page_adr);
+	get_ECC_status(flash);
 
-	return flash->last_write_failure_status;
-}
+	scrub->pages_checked++;
+	if (flash->last_read_ECC_status == SUCCESS_WITH_CORRECTIONS) {
+		scrub->pages_corrected++;
+		count_block_event(scrub->block_corrections, block);
+	}
+	else if (flash->last_read_ECC_status != SUCCESS_NO_CORRECTIONS) {
+		scrub->pages_failed++;
+		count_block_event(scrub->block_failures, block);
+	}
 
-void read_reserved_flash_page(W25N01GV_Flash *flash, uint8_t page_num, uint8_t* buffer, uint16_t buffer_sz) {
-	// Grab the nth page of the last block of flash
-	read_bytes_from_page(flash, buffer, buffer_sz,
-			(W25N01GV_NUM_BLOCKS-1) * W25N01GV_PAGES_PER_BLOCK + page_num, 0);
+	scrub->next_page = next_good_log_page(flash, (uint32_t) page_adr + 1);
+
+	// Once the whole block is checked, move it if it needed corrections
+	if (scrub->relocate && page_adr % W25N01GV_PAGES_PER_BLOCK == W25N01GV_PAGES_PER_BLOCK-1
+			&& scrub->block_corrections[block] > 0 && block_is_full(flash, block))
+		scrub->relocate_src = block;
 }
 
-uint8_t erase_reserved_flash_pages(W25N01GV_Flash *flash) {
-	// Erase the last block only
-	unlock_flash(flash);
-	erase_block(flash, W25N01GV_PAGES_PER_BLOCK * (W25N01GV_NUM_BLOCKS - 1));
-	lock_flash(flash);
-	return flash->last_erase_failure_status;
+void start_flash_scrub(W25N01GV_Scrub *scrub, W25N01GV_Flash *flash, uint8_t relocate) {
+	scrub->flash = flash;
+	scrub->relocate = relocate;
+
+	scrub->pages_checked = 0;
+	scrub->pages_corrected = 0;
+	scrub->pages_failed = 0;
+	scrub->blocks_relocated = 0;
+	scrub->relocations_skipped = 0;
+	for (uint16_t i = 0; i < W25N01GV_NUM_BLOCKS; i++) {
+		scrub->block_corrections[i] = 0;
+		scrub->block_failures[i] = 0;
+	}
+	scrub->relocate_src = W25N01GV_NUM_BLOCKS;
+	scrub->relocate_dst = W25N01GV_NUM_BLOCKS;
+
+	// A circular log starts at the first block that isn't erased ahead of the write pointer
+	if (flash->circular_log_enabled)
+		scrub->next_page = next_good_log_page(flash,
+				(uint32_t) (flash->erase_ahead_block % W25N01GV_NUM_DATA_BLOCKS) * W25N01GV_PAGES_PER_BLOCK);
+	else
+		scrub->next_page = next_good_page(flash, 0);
+	scrub->active = 1;
 }
 
-uint16_t scan_bad_blocks(W25N01GV_Flash *flash, uint16_t *bad_blocks) {
+uint8_t poll_flash_scrub(W25N01GV_Scrub *scrub, uint16_t max_pages) {
+	W25N01GV_Flash *flash = scrub->flash;
 
-	uint8_t read_byte[1];
-	uint16_t num_bad_blocks = 0;
+	if (!scrub->active)
+		return 0;
+
+	// Only use the chip when nothing else is
+	if (flash->async_state != ASYNC_WRITE_IDLE || flash->block_op != BLOCK_OP_NONE || flash->continuous_read_active)
+		return 1;
 
-	for (uint16_t block_adr = 0; block_adr < W25N01GV_NUM_BLOCKS; block_adr++) {  // block 0, 1, ..., 1022, 1023
-		read_bytes_from_page(flash, read_byte, 1, block_adr*W25N01GV_PAGES_PER_BLOCK, 0);  // page 0, 64, 128, ...
+	uint8_t unlock = scrub->relocate && !flash->async_write_enabled;
+	if (unlock)
+		unlock_flash(flash);
 
-		if (*read_byte != 0xFF) {  // Look for non-0xFF bytes
-			bad_blocks[num_bad_blocks] = block_adr;
-			num_bad_blocks++;
-		}
+	for (uint16_t i = 0; i < max_pages && scrub->active; i++) {
+		if (scrub->relocate_src < W25N01GV_NUM_BLOCKS)
+			relocate_scrub_block(scrub);
+		else
+			scrub_next_page(scrub);
 	}
 
-	return num_bad_blocks;
+	if (unlock)
+		lock_flash(flash);
+
+	return scrub->active;
 }
 
-void add_test_delimiter(W25N01GV_Flash *flash) {
-	// This is kind of dumb but it works
-	uint8_t delimiter_arr[W25N01GV_BYTES_PER_PAGE] = { 0 };
+void stop_flash_scrub(W25N01GV_Scrub *scrub) {
+	W25N01GV_Flash *flash = scrub->flash;
 
-	// Fill an entire page worth of bytes with 0's
-	write_to_flash(flash, delimiter_arr, W25N01GV_BYTES_PER_PAGE);
+	if (!scrub->active)
+		return;
+
+	wait_for_async_flash_write(flash);  // Don't interrupt an asynchronous write
+
+	if (scrub->relocate_src < W25N01GV_NUM_BLOCKS) {
+		unlock_flash(flash);
+		drop_scrub_relocation(scrub);
+		if (!flash->async_write_enabled)
+			lock_flash(flash);
+	}
+	scrub->active = 0;
 }
 
 #endif	// End SPI include protection
@@ -0,0 +1,267 @@
+/**
+ * Implementation of striping data across several W25N01GV Flash Memory chips
+ * Datasheet: https://www.winbond.com/resource-files/w25n01gv%20revl%20050918%20unsecured.pdf
+ *
+ * NOTE: This is a wrapper around the W25N01GV functions. Sector n of the
+ * data is sector n / num_chips of chip n % num_chips.
+ *
+ * Nathaniel Kalantar (nkalan@umich.edu)
+ * Michigan Aeronautical Science Association
+ */
+
+#include "../inc/W25N01GV_Array.h"
+
+// What unwritten flash reads back as
+#define W25N01GV_ARRAY_ERASED_BYTE                (uint8_t) 0xFF
+
+#define W25N01GV_ARRAY_SECTORS_PER_PAGE           (uint8_t) (W25N01GV_BYTES_PER_PAGE / W25N01GV_SECTOR_SIZE)
+
+/**
+ * Returns the number of sector slots used on a chip, counting a partly
+ * filled write buffer as a whole sector.
+ */
+static uint32_t chip_sectors_written(W25N01GV_Flash *chip) {
+	uint32_t bytes_used = get_flash_capacity(chip) - get_bytes_remaining(chip);
+	return (bytes_used + W25N01GV_SECTOR_SIZE - 1) / W25N01GV_SECTOR_SIZE;
+}
+
+/**
+ * Returns the number of sectors written to the array. Chips are written in
+ * turn, so every chip has the same count, or one more for the chips before
+ * the current write chip.
+ */
+static uint32_t array_sectors_written(W25N01GV_Array *array) {
+	uint32_t sectors = 0;
+
+	for (uint8_t i = 0; i < array->num_chips; i++)
+		sectors += chip_sectors_written(&array->chips[i]);
+
+	return sectors;
+}
+
+/**
+ * Pads the chips with empty sectors so that sector n of the data is on
+ * chip n % num_chips again, and returns the number of sectors written to
+ * the array, including the padding.
+ *
+ * A reset can leave a chip ahead of the stripe: it skipped a torn page (see
+ * init_flash()), or its sector got to flash while the one before it on
+ * another chip didn't. The stripe goes on from the first position where
+ * every chip's sectors are behind it, and the chips that are short of it
+ * catch up. Reading goes through each chip's sectors in turn, so without
+ * the padding everything written afterwards would come back out of order.
+ * The padding sectors are tagged W25N01GV_TAG_PADDING with no valid bytes
+ * (see write_flash_padding()), so metadata readers don't take them for data.
+ *
+ * @param array      <W25N01GV_Array*>     Struct used to store the chips
+ * @retval Number of sectors written to the array
+ */
+static uint32_t align_array_chips(W25N01GV_Array *array) {
+	uint32_t sectors = 0;
+
+	// Chip i's last sector is sector (its sectors - 1) * num_chips + i of the data
+	for (uint8_t i = 0; i < array->num_chips; i++) {
+		uint32_t chip_sectors = chip_sectors_written(&array->chips[i]);
+		if (chip_sectors > 0 && (chip_sectors - 1) * array->num_chips + i + 1 > sectors)
+			sectors = (chip_sectors - 1) * array->num_chips + i + 1;
+	}
+
+	for (uint8_t i = 0; i < array->num_chips; i++) {
+		W25N01GV_Flash *chip = &array->chips[i];
+		uint32_t stripe_sectors = (sectors + array->num_chips - 1 - i) / array->num_chips;
+		while (chip_sectors_written(chip) < stripe_sectors && get_bytes_remaining(chip) > 0)
+			write_flash_padding(chip);
+	}
+
+	return sectors;
+}
+
+/**
+ * Ends the continuous read on every chip, so their buses can be used again.
+ *
+ * @param array      <W25N01GV_Array*>     Struct used to store the chips
+ */
+static void end_array_read(W25N01GV_Array *array) {
+	if (!array->read_active)
+		return;
+
+	for (uint8_t i = 0; i < array->num_chips; i++)
+		end_continuous_flash_read(&array->chips[i]);
+	array->read_active = 0;
+}
+
+void array_init_flash(W25N01GV_Array *array, uint8_t num_chips, SPI_HandleTypeDef **SPI_buses,
+		GPIO_TypeDef **cs_bases, uint16_t *cs_pins) {
+	if (num_chips > W25N01GV_ARRAY_MAX_CHIPS)
+		num_chips = W25N01GV_ARRAY_MAX_CHIPS;
+	if (num_chips == 0)
+		num_chips = 1;
+
+	array->num_chips = num_chips;
+	array->current_read_chip = 0;
+	array->read_active = 0;
+
+	for (uint8_t i = 0; i < num_chips; i++) {
+		init_flash(&array->chips[i], SPI_buses[i], cs_bases[i], cs_pins[i]);
+		enable_async_flash_write(&array->chips[i], NULL);
+	}
+
+	// Sector n is on chip n % num_chips, so the number of sectors written tells which chip is next
+	array->current_write_chip = align_array_chips(array) % num_chips;
+}
+
+uint8_t array_ping_flash(W25N01GV_Array *array) {
+	uint8_t all_alive = 1;
+
+	end_array_read(array);
+	for (uint8_t i = 0; i < array->num_chips; i++) {
+		wait_for_async_flash_write(&array->chips[i]);  // Don't interrupt an asynchronous write
+		if (!ping_flash(&array->chips[i]))
+			all_alive = 0;
+	}
+
+	return all_alive;
+}
+
+uint16_t array_erase_flash(W25N01GV_Array *array) {
+	uint16_t erase_failures = 0;
+
+	end_array_read(array);
+
+	// Each chip erases a block while the others are polled, see start_flash_erase()
+	uint8_t chips_erasing = 1;
+	for (uint8_t i = 0; i < array->num_chips; i++)
+		start_flash_erase(&array->chips[i]);
+	while (chips_erasing) {
+		chips_erasing = 0;
+		for (uint8_t i = 0; i < array->num_chips; i++)
+			chips_erasing |= poll_flash_block_op(&array->chips[i]);
+	}
+
+	for (uint8_t i = 0; i < array->num_chips; i++)
+		erase_failures += array->chips[i].block_op_result;
+
+	array->current_write_chip = 0;
+	array->current_read_chip = 0;
+
+	return erase_failures;
+}
+
+uint16_t array_write_to_flash(W25N01GV_Array *array, uint8_t *data, uint32_t num_bytes) {
+	uint16_t write_failures = 0;
+
+	end_array_read(array);
+
+	// If there's not enough space, truncate the data
+	uint32_t bytes_remaining = array_get_bytes_remaining(array);
+	if (num_bytes > bytes_remaining)
+		num_bytes = bytes_remaining;
+
+	while (num_bytes > 0) {
+		W25N01GV_Flash *chip = &array->chips[array->current_write_chip];
+
+		// Fill the chip's write buffer up to the end of the sector
+		uint16_t num_bytes_to_write = W25N01GV_SECTOR_SIZE - chip->write_buffer_size;
+		if (num_bytes_to_write > num_bytes)
+			num_bytes_to_write = num_bytes;
+
+		write_failures += write_to_flash(chip, data, num_bytes_to_write);
+		data += num_bytes_to_write;
+		num_bytes -= num_bytes_to_write;
+
+		// The full sector went out over DMA, so the next one goes to the next chip
+		if (chip->write_buffer_size == 0)
+			array->current_write_chip = (array->current_write_chip + 1) % array->num_chips;
+	}
+
+	return write_failures;
+}
+
+void array_poll_flash_write(W25N01GV_Array *array) {
+	if (array->read_active)
+		return;
+
+	for (uint8_t i = 0; i < array->num_chips; i++)
+		poll_async_flash_write(&array->chips[i]);
+}
+
+void array_flash_dma_complete(W25N01GV_Array *array, SPI_HandleTypeDef *hspi) {
+	for (uint8_t i = 0; i < array->num_chips; i++) {
+		if (array->chips[i].SPI_bus == hspi)
+			async_flash_write_dma_complete(&array->chips[i]);
+	}
+}
+
+uint16_t array_finish_flash_write(W25N01GV_Array *array) {
+	uint16_t write_failures = 0;
+
+	end_array_read(array);
+
+	// Only the current chip can have a partly filled sector, which is padded out
+	W25N01GV_Flash *chip = &array->chips[array->current_write_chip];
+	if (chip->write_buffer_size > 0) {
+		write_failures += finish_flash_write(chip);
+		array->current_write_chip = (array->current_write_chip + 1) % array->num_chips;
+	}
+
+	for (uint8_t i = 0; i < array->num_chips; i++)
+		wait_for_async_flash_write(&array->chips[i]);
+
+	return write_failures;
+}
+
+void array_reset_flash_read_pointer(W25N01GV_Array *array) {
+	end_array_read(array);
+
+	for (uint8_t i = 0; i < array->num_chips; i++)
+		reset_flash_read_pointer(&array->chips[i]);
+	array->current_read_chip = 0;
+}
+
+void array_read_next_2KB_from_flash(W25N01GV_Array *array, uint8_t *buffer) {
+	// Start streaming every chip. begin_continuous_flash_read() waits for writes in flight.
+	if (!array->read_active) {
+		for (uint8_t i = 0; i < array->num_chips; i++)
+			begin_continuous_flash_read(&array->chips[i]);
+		array->read_active = 1;
+	}
+
+	for (uint8_t sector = 0; sector < W25N01GV_ARRAY_SECTORS_PER_PAGE; sector++) {
+		uint8_t *sector_data = buffer + sector * W25N01GV_SECTOR_SIZE;
+
+		uint32_t bytes_read = read_continuous_flash_chunk(&array->chips[array->current_read_chip],
+				sector_data, W25N01GV_SECTOR_SIZE);
+
+		// Past the end of the chip, read back the same thing as an empty sector
+		for (uint16_t b = bytes_read; b < W25N01GV_SECTOR_SIZE; b++)
+			sector_data[b] = W25N01GV_ARRAY_ERASED_BYTE;
+
+		array->current_read_chip = (array->current_read_chip + 1) % array->num_chips;
+	}
+}
+
+uint32_t array_flash_current_page(W25N01GV_Array *array) {
+	return array_sectors_written(array) / W25N01GV_ARRAY_SECTORS_PER_PAGE;
+}
+
+uint32_t array_get_bytes_remaining(W25N01GV_Array *array) {
+	// Writing stops at the first chip that's full when its turn comes around.
+	// Going through the chips in write order, the i'th one can take sectors
+	// up to sector (its free sectors * num_chips + i) counted from here.
+	uint32_t sectors_remaining = UINT32_MAX;
+	uint16_t bytes_buffered = array->chips[array->current_write_chip].write_buffer_size;
+
+	for (uint8_t i = 0; i < array->num_chips; i++) {
+		W25N01GV_Flash *chip = &array->chips[(array->current_write_chip + i) % array->num_chips];
+
+		// The partly filled sector on the current chip still counts as free
+		uint32_t free_sectors = (get_bytes_remaining(chip) + chip->write_buffer_size) / W25N01GV_SECTOR_SIZE;
+		uint32_t sectors = free_sectors * array->num_chips + i;
+		if (sectors < sectors_remaining)
+			sectors_remaining = sectors;
+	}
+
+	if (sectors_remaining == 0)
+		return 0;
+	return sectors_remaining * W25N01GV_SECTOR_SIZE - bytes_buffered;
+}
@@ -0,0 +1,168 @@
+/**
+ * Implementation of downloading a W25N01GV flash log over UART
+ * Datasheet: https://www.winbond.com/resource-files/w25n01gv%20revl%20050918%20unsecured.pdf
+ *
+ * NOTE: Pages are read into one frame buffer over SPI DMA while the other
+ * frame is sent over UART DMA, see W25N01GV_Download.h for the frame format.
+ *
+ * Nathaniel Kalantar (nkalan@umich.edu)
+ * Michigan Aeronautical Science Association
+ */
+
+#include "../inc/W25N01GV_Download.h"
+
+/**
+ * Checks if the UART is still sending a frame. Receiving doesn't count,
+ * so the UART can also be listening for commands over DMA.
+ *
+ * @param uart       <UART_HandleTypeDef*> UART the frames are sent over
+ * @retval 1 if a transmission is running, 0 if not
+ */
+static uint8_t uart_is_sending(UART_HandleTypeDef *uart) {
+	HAL_UART_StateTypeDef uart_state = HAL_UART_GetState(uart);
+	return uart_state == HAL_UART_STATE_BUSY_TX || uart_state == HAL_UART_STATE_BUSY_TX_RX;
+}
+
+/**
+ * Fills in the header and CRC of a frame once its page has been read.
+ *
+ * @param download   <W25N01GV_Download*>  Struct used to store the download state
+ * @param frame      <uint8_t>             Index of the frame
+ * @param frame_num  <uint32_t>            Number of the frame in the download
+ */
+static void finish_frame(W25N01GV_Download *download, uint8_t frame, uint32_t frame_num) {
+	uint8_t *buffer = download->frames[frame];
+	uint32_t page_adr = download->frame_page[frame];
+
+	buffer[0] = (uint8_t) (W25N01GV_DOWNLOAD_MAGIC >> 8);
+	buffer[1] = (uint8_t) (W25N01GV_DOWNLOAD_MAGIC & 0xFF);
+	buffer[2] = (uint8_t) (page_adr >> 24);
+	buffer[3] = (uint8_t) (page_adr >> 16);
+	buffer[4] = (uint8_t) (page_adr >> 8);
+	buffer[5] = (uint8_t) (page_adr & 0xFF);
+	buffer[6] = (uint8_t) (frame_num >> 8);
+	buffer[7] = (uint8_t) (frame_num & 0xFF);
+
+	uint16_t crc_pos = W25N01GV_DOWNLOAD_HEADER_SIZE + W25N01GV_BYTES_PER_PAGE;
+	uint16_t crc = update_flash_crc16(0xFFFF, buffer, crc_pos);
+	buffer[crc_pos] = (uint8_t) (crc >> 8);
+	buffer[crc_pos + 1] = (uint8_t) (crc & 0xFF);
+
+	download->frame_state[frame] = DOWNLOAD_FRAME_READY;
+}
+
+/**
+ * Starts reading the next page into the read frame over SPI DMA. At the end
+ * of the log, the download is cut short to the pages already read.
+ *
+ * @param download   <W25N01GV_Download*>  Struct used to store the download state
+ */
+static void start_page_read(W25N01GV_Download *download) {
+	if (end_of_flash_log(download->flash)) {
+		download->num_pages = download->pages_read;
+		return;
+	}
+
+	uint8_t frame = download->read_frame;
+	uint32_t bytes_read = start_continuous_flash_chunk_read(download->flash,
+			download->frames[frame] + W25N01GV_DOWNLOAD_HEADER_SIZE, W25N01GV_BYTES_PER_PAGE);
+
+	// The stream starts at the beginning of a page, so a chunk is always a whole page
+	if (bytes_read < W25N01GV_BYTES_PER_PAGE) {
+		download->num_pages = download->pages_read;
+		return;
+	}
+
+	// The stream has already moved on to the next page
+	download->frame_page[frame] = download->flash->next_page_to_read - 1;
+	download->frame_state[frame] = DOWNLOAD_FRAME_READING;
+	download->read_frame ^= 1;
+	download->pages_read++;
+}
+
+void start_flash_download(W25N01GV_Download *download, W25N01GV_Flash *flash, UART_HandleTypeDef *uart,
+		uint32_t start_page, uint32_t num_pages, uint32_t window) {
+	// A frame from an earlier download could still be going out
+	while (uart_is_sending(uart));
+
+	download->flash = flash;
+	download->uart = uart;
+	download->frame_state[0] = DOWNLOAD_FRAME_EMPTY;
+	download->frame_state[1] = DOWNLOAD_FRAME_EMPTY;
+	download->read_frame = 0;
+	download->send_frame = 0;
+
+	download->num_pages = num_pages;
+	download->pages_read = 0;
+	download->pages_sent = 0;
+	download->pages_acked = 0;
+	download->window = window;
+	download->ECC_status = SUCCESS_NO_CORRECTIONS;
+
+	end_continuous_flash_read(flash);  // In case a read was left running
+	flash->next_page_to_read = start_page;
+	begin_continuous_flash_read(flash);
+	download->active = 1;
+}
+
+uint8_t poll_flash_download(W25N01GV_Download *download) {
+	if (!download->active)
+		return 0;
+
+	// The page read over SPI is in, so it can be sent
+	uint8_t reading_frame = download->read_frame ^ 1;
+	if (download->frame_state[reading_frame] == DOWNLOAD_FRAME_READING
+			&& !continuous_flash_chunk_read_busy(download->flash))
+		finish_frame(download, reading_frame, download->pages_read - 1);
+
+	// The frame went out over UART, so its buffer can take another page
+	uint8_t send_frame = download->send_frame;
+	if (download->frame_state[send_frame] == DOWNLOAD_FRAME_SENDING && !uart_is_sending(download->uart)) {
+		download->frame_state[send_frame] = DOWNLOAD_FRAME_EMPTY;
+		download->send_frame ^= 1;
+		send_frame = download->send_frame;
+	}
+
+	// Send the next frame if the receiver has room for it
+	if (download->frame_state[send_frame] == DOWNLOAD_FRAME_READY
+			&& (download->window == 0 || download->pages_sent < download->pages_acked + download->window)) {
+		if (HAL_UART_Transmit_DMA(download->uart, download->frames[send_frame], W25N01GV_DOWNLOAD_FRAME_SIZE) == HAL_OK) {
+			download->frame_state[send_frame] = DOWNLOAD_FRAME_SENDING;
+			download->pages_sent++;
+		}
+	}
+
+	// Read the page after it in the meantime. The last read has to be
+	// finished above first, so frame numbers follow pages_read.
+	if (download->frame_state[download->read_frame] == DOWNLOAD_FRAME_EMPTY
+			&& download->frame_state[reading_frame] != DOWNLOAD_FRAME_READING
+			&& download->pages_read < download->num_pages)
+		start_page_read(download);
+
+	if (download->pages_sent == download->num_pages
+			&& download->frame_state[download->send_frame ^ 1] != DOWNLOAD_FRAME_SENDING
+			&& download->frame_state[download->send_frame] != DOWNLOAD_FRAME_SENDING) {
+		download->ECC_status = end_continuous_flash_read(download->flash);
+		download->active = 0;
+	}
+
+	return download->active;
+}
+
+void ack_flash_download(W25N01GV_Download *download, uint32_t num_frames) {
+	if (num_frames > download->pages_acked && num_frames <= download->pages_sent)
+		download->pages_acked = num_frames;
+}
+
+W25N01GV_ECC_Status stop_flash_download(W25N01GV_Download *download) {
+	if (!download->active)
+		return download->ECC_status;
+
+	while (uart_is_sending(download->uart));
+
+	// Waits for a page read in progress
+	download->ECC_status = end_continuous_flash_read(download->flash);
+	download->active = 0;
+
+	return download->ECC_status;
+}